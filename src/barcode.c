@@ -0,0 +1,1110 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "barcode.h"
+#include "log.h"
+
+/* The space each kind of barcode needs around it to scan. */
+#define CODE128_QUIET_ZONE (10)
+#define QR_QUIET_ZONE (4)
+#define DATAMATRIX_QUIET_ZONE (1)
+
+#define CODE128_CODE_C (99)
+#define CODE128_CODE_B (100)
+#define CODE128_START_B (104)
+#define CODE128_START_C (105)
+#define CODE128_SYMBOL_WIDTH (11)
+
+/* The stop symbol has one bar more than the others. */
+#define CODE128_STOP_PATTERN (0x18EB)
+#define CODE128_STOP_WIDTH (13)
+
+/* Longer than this, and a Code128 is too long to scan anyway. */
+#define MAX_CODE128_SYMBOLS (128)
+
+#define QR_MAX_VERSION (40)
+#define QR_MAX_SIZE (177)
+#define QR_MAX_CODEWORDS (3706)
+#define QR_MAX_BLOCKS (49)
+#define QR_POLYNOMIAL (0x11D)
+
+#define DATAMATRIX_MAX_CODEWORDS (1800)
+#define DATAMATRIX_POLYNOMIAL (0x12D)
+
+/* Neither kind of code has more error correction than this in a block. */
+#define MAX_ECC_LENGTH (68)
+
+/* No printer is wider than this many dots. */
+#define MAX_BARCODE_DOTS (32768)
+
+/* The bars and spaces of each Code128 symbol, eleven modules from the most
+ * significant bit down. */
+static const WORD code128_patterns[106] = {
+    0x6CC, 0x66C, 0x666, 0x498, 0x48C, 0x44C, 0x4C8, 0x4C4, 0x464, 0x648,
+    0x644, 0x624, 0x59C, 0x4DC, 0x4CE, 0x5CC, 0x4EC, 0x4E6, 0x672, 0x65C,
+    0x64E, 0x6E4, 0x674, 0x76E, 0x74C, 0x72C, 0x726, 0x764, 0x734, 0x732,
+    0x6D8, 0x6C6, 0x636, 0x518, 0x458, 0x446, 0x588, 0x468, 0x462, 0x688,
+    0x628, 0x622, 0x5B8, 0x58E, 0x46E, 0x5D8, 0x5C6, 0x476, 0x776, 0x68E,
+    0x62E, 0x6E8, 0x6E2, 0x6EE, 0x758, 0x746, 0x716, 0x768, 0x762, 0x71A,
+    0x77A, 0x642, 0x78A, 0x530, 0x50C, 0x4B0, 0x486, 0x42C, 0x426, 0x590,
+    0x584, 0x4D0, 0x4C2, 0x434, 0x432, 0x612, 0x650, 0x7BA, 0x614, 0x47A,
+    0x53C, 0x4BC, 0x49E, 0x5E4, 0x4F4, 0x4F2, 0x7A4, 0x794, 0x792, 0x6DE,
+    0x6F6, 0x7B6, 0x578, 0x51E, 0x45E, 0x5E8, 0x5E2, 0x7A8, 0x7A2, 0x5DE,
+    0x5EE, 0x75E, 0x7AE, 0x684, 0x690, 0x69C};
+
+/* For each QR version at level M, how many error correction codewords each
+ * block has, and how many blocks there are. */
+static const BYTE qr_ecc_lengths[QR_MAX_VERSION + 1] = {
+    0, 10, 16, 26, 18, 24, 16, 18, 22, 22, 26, 30, 22, 22, 24, 24, 28, 28, 26, 26,
+    26, 26, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28, 28};
+
+static const BYTE qr_block_counts[QR_MAX_VERSION + 1] = {
+    0, 1, 1, 1, 2, 2, 4, 4, 4, 5, 5, 5, 8, 9, 9, 10, 10, 11, 13, 14,
+    16, 17, 17, 18, 20, 21, 23, 25, 26, 28, 29, 31, 33, 35, 37, 38, 40, 43, 45, 47, 49};
+
+/* The square ECC 200 symbols, smallest first. Bigger symbols are split
+ * into regions, and interleave their error correction. */
+struct datamatrix_size
+{
+    int size;
+    int region;
+    int regions;
+    int blocks;
+    int data;
+    int ecc;
+};
+
+static const struct datamatrix_size datamatrix_sizes[] = {
+    {10, 8, 1, 1, 3, 5},
+    {12, 10, 1, 1, 5, 7},
+    {14, 12, 1, 1, 8, 10},
+    {16, 14, 1, 1, 12, 12},
+    {18, 16, 1, 1, 18, 14},
+    {20, 18, 1, 1, 22, 18},
+    {22, 20, 1, 1, 30, 20},
+    {24, 22, 1, 1, 36, 24},
+    {26, 24, 1, 1, 44, 28},
+    {32, 14, 2, 1, 62, 36},
+    {36, 16, 2, 1, 86, 42},
+    {40, 18, 2, 1, 114, 48},
+    {44, 20, 2, 1, 144, 56},
+    {48, 22, 2, 1, 174, 68},
+    {52, 24, 2, 2, 204, 84},
+    {64, 14, 4, 2, 280, 112},
+    {72, 16, 4, 4, 368, 144},
+    {80, 18, 4, 4, 456, 192},
+    {88, 20, 4, 4, 576, 224},
+    {96, 22, 4, 4, 696, 272},
+    {104, 24, 4, 6, 816, 336},
+    {120, 18, 6, 6, 1050, 408},
+    {132, 20, 6, 8, 1304, 496},
+};
+
+#define DATAMATRIX_SIZE_COUNT (sizeof(datamatrix_sizes) / sizeof(datamatrix_sizes[0]))
+
+/* A QR code while it's being built, with which modules are taken by the
+ * fixed patterns and mustn't be masked. */
+struct qr_matrix
+{
+    int size;
+    BYTE modules[QR_MAX_SIZE * QR_MAX_SIZE];
+    BYTE reserved[QR_MAX_SIZE * QR_MAX_SIZE];
+};
+
+BOOL parse_barcode_type(const char *name, enum barcode_type *type)
+{
+    if (_stricmp(name, "code128") == 0)
+        *type = BARCODE_CODE128;
+    else if (_stricmp(name, "qr") == 0)
+        *type = BARCODE_QR;
+    else if (_stricmp(name, "datamatrix") == 0)
+        *type = BARCODE_DATAMATRIX;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+static struct barcode *new_barcode(enum barcode_type type, int width, int height)
+{
+    struct barcode *barcode;
+
+    barcode = (struct barcode *)calloc(1, sizeof(struct barcode) + (size_t)width * height);
+    if (barcode == NULL)
+    {
+        ERR("Failed to allocate memory for barcode.\n");
+        return NULL;
+    }
+
+    barcode->type = type;
+    barcode->width = width;
+    barcode->height = height;
+    barcode->linear = height == 1;
+
+    return barcode;
+}
+
+/**
+ * @brief Multiply two elements of GF(256), as defined by `polynomial`.
+ */
+static BYTE gf_multiply(BYTE x, BYTE y, int polynomial)
+{
+    int z = 0;
+
+    for (int i = 7; i >= 0; i--)
+    {
+        z = (z << 1) ^ ((z >> 7) * polynomial);
+        z ^= ((y >> i) & 1) * x;
+    }
+
+    return (BYTE)z;
+}
+
+/**
+ * @brief Work out the Reed-Solomon error correction for a block of
+ * codewords.
+ *
+ * QR and Data Matrix codes do the same sums over different fields, with
+ * generators whose roots start at different powers.
+ *
+ * @param stride How far apart the codewords are, in both `data` and `ecc`,
+ * for symbols that interleave their blocks in place.
+ */
+static void reed_solomon(
+    const BYTE *data,
+    int count,
+    BYTE *ecc,
+    int length,
+    int stride,
+    int polynomial,
+    BYTE first_root)
+{
+    BYTE generator[MAX_ECC_LENGTH] = {0};
+    BYTE remainder[MAX_ECC_LENGTH] = {0};
+    BYTE root = first_root;
+
+    generator[length - 1] = 1;
+    for (int i = 0; i < length; i++)
+    {
+        for (int j = 0; j < length; j++)
+        {
+            generator[j] = gf_multiply(generator[j], root, polynomial);
+            if (j + 1 < length)
+                generator[j] ^= generator[j + 1];
+        }
+
+        root = gf_multiply(root, 0x02, polynomial);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        BYTE factor = data[i * stride] ^ remainder[0];
+
+        memmove(remainder, remainder + 1, length - 1);
+        remainder[length - 1] = 0;
+
+        for (int j = 0; j < length; j++)
+            remainder[j] ^= gf_multiply(generator[j], factor, polynomial);
+    }
+
+    for (int i = 0; i < length; i++)
+        ecc[i * stride] = remainder[i];
+}
+
+static int count_digits(const char *text)
+{
+    int count = 0;
+
+    while (text[count] >= '0' && text[count] <= '9')
+        count++;
+
+    return count;
+}
+
+/**
+ * @brief Encode text as a Code128, in set B, switching to set C for runs
+ * of digits long enough to pay for the switch.
+ */
+static struct barcode *encode_code128(const char *text)
+{
+    int symbols[MAX_CODE128_SYMBOLS + 3];
+    int count = 0;
+    int length = (int)strlen(text);
+    int run = count_digits(text);
+    int checksum;
+    BOOL set_c;
+    struct barcode *barcode;
+    BYTE *module;
+
+    for (const char *p = text; *p != '\0'; p++)
+    {
+        if (*p < ' ' || *p > '~')
+        {
+            ERR("A Code128 can only hold printable ASCII: %s\n", text);
+            return NULL;
+        }
+    }
+
+    set_c = run >= 4 || (run == length && run >= 2 && run % 2 == 0);
+    symbols[count++] = set_c ? CODE128_START_C : CODE128_START_B;
+
+    for (int i = 0; i < length;)
+    {
+        if (count >= MAX_CODE128_SYMBOLS)
+        {
+            ERR("Too much text for a Code128: %d characters.\n", length);
+            return NULL;
+        }
+
+        run = count_digits(text + i);
+
+        if (set_c)
+        {
+            if (run >= 2)
+            {
+                symbols[count++] = (text[i] - '0') * 10 + text[i + 1] - '0';
+                i += 2;
+            }
+            else
+            {
+                symbols[count++] = CODE128_CODE_B;
+                set_c = FALSE;
+            }
+
+            continue;
+        }
+
+        /* An odd run leaves its first digit in set B. */
+        if (run >= 6 || (run >= 4 && i + run == length))
+        {
+            if (run % 2 == 1)
+            {
+                symbols[count++] = text[i] - ' ';
+                i++;
+            }
+
+            symbols[count++] = CODE128_CODE_C;
+            set_c = TRUE;
+            continue;
+        }
+
+        symbols[count++] = text[i] - ' ';
+        i++;
+    }
+
+    checksum = symbols[0];
+    for (int i = 1; i < count; i++)
+        checksum += i * symbols[i];
+
+    symbols[count++] = checksum % 103;
+
+    barcode = new_barcode(
+        BARCODE_CODE128,
+        2 * CODE128_QUIET_ZONE + count * CODE128_SYMBOL_WIDTH + CODE128_STOP_WIDTH,
+        1);
+    if (barcode == NULL)
+        return NULL;
+
+    module = barcode->modules + CODE128_QUIET_ZONE;
+    for (int i = 0; i < count; i++)
+    {
+        for (int bit = CODE128_SYMBOL_WIDTH - 1; bit >= 0; bit--)
+            *module++ = (code128_patterns[symbols[i]] >> bit) & 1;
+    }
+
+    for (int bit = CODE128_STOP_WIDTH - 1; bit >= 0; bit--)
+        *module++ = (CODE128_STOP_PATTERN >> bit) & 1;
+
+    DBG("Code128 of %d symbols: %s\n", count, text);
+
+    return barcode;
+}
+
+/**
+ * @brief Count the modules of a QR version that hold codewords, rather than
+ * fixed patterns.
+ */
+static int get_qr_data_modules(int version)
+{
+    int modules = (16 * version + 128) * version + 64;
+
+    if (version >= 2)
+    {
+        int alignments = version / 7 + 2;
+
+        modules -= (25 * alignments - 10) * alignments - 55;
+        if (version >= 7)
+            modules -= 36;
+    }
+
+    return modules;
+}
+
+/**
+ * @brief Get the rows and columns a QR version's alignment patterns are
+ * centred on.
+ *
+ * @return How many there are.
+ */
+static int get_qr_alignment_positions(int version, int *positions)
+{
+    int count, step, size = version * 4 + 17;
+
+    if (version == 1)
+        return 0;
+
+    count = version / 7 + 2;
+    step = version == 32 ? 26 : (version * 4 + count * 2 + 1) / (count * 2 - 2) * 2;
+
+    positions[0] = 6;
+    for (int i = count - 1, position = size - 7; i >= 1; i--, position -= step)
+        positions[i] = position;
+
+    return count;
+}
+
+static void set_qr_module(struct qr_matrix *qr, int x, int y, BOOL dark)
+{
+    qr->modules[y * qr->size + x] = dark ? 1 : 0;
+    qr->reserved[y * qr->size + x] = 1;
+}
+
+static void draw_qr_finder(struct qr_matrix *qr, int x, int y)
+{
+    for (int dy = -4; dy <= 4; dy++)
+    {
+        for (int dx = -4; dx <= 4; dx++)
+        {
+            int distance = max(abs(dx), abs(dy));
+
+            if (x + dx >= 0 && x + dx < qr->size && y + dy >= 0 && y + dy < qr->size)
+                set_qr_module(qr, x + dx, y + dy, distance != 2 && distance != 4);
+        }
+    }
+}
+
+static void draw_qr_alignment(struct qr_matrix *qr, int x, int y)
+{
+    for (int dy = -2; dy <= 2; dy++)
+    {
+        for (int dx = -2; dx <= 2; dx++)
+            set_qr_module(qr, x + dx, y + dy, max(abs(dx), abs(dy)) != 1);
+    }
+}
+
+/**
+ * @brief Draw both copies of the error correction level and mask.
+ */
+static void draw_qr_format(struct qr_matrix *qr, int mask)
+{
+    /* Level M is 0, so only the mask shows. */
+    int data = mask;
+    int remainder = data;
+    int bits;
+
+    for (int i = 0; i < 10; i++)
+        remainder = (remainder << 1) ^ ((remainder >> 9) * 0x537);
+
+    bits = ((data << 10) | remainder) ^ 0x5412;
+
+    for (int i = 0; i <= 5; i++)
+        set_qr_module(qr, 8, i, (bits >> i) & 1);
+
+    set_qr_module(qr, 8, 7, (bits >> 6) & 1);
+    set_qr_module(qr, 8, 8, (bits >> 7) & 1);
+    set_qr_module(qr, 7, 8, (bits >> 8) & 1);
+
+    for (int i = 9; i < 15; i++)
+        set_qr_module(qr, 14 - i, 8, (bits >> i) & 1);
+
+    for (int i = 0; i < 8; i++)
+        set_qr_module(qr, qr->size - 1 - i, 8, (bits >> i) & 1);
+
+    for (int i = 8; i < 15; i++)
+        set_qr_module(qr, 8, qr->size - 15 + i, (bits >> i) & 1);
+
+    /* Always dark. */
+    set_qr_module(qr, 8, qr->size - 8, TRUE);
+}
+
+/**
+ * @brief Draw the timing, finder, alignment and version patterns, and save
+ * room for the format.
+ */
+static void draw_qr_patterns(struct qr_matrix *qr, int version)
+{
+    int positions[7];
+    int count;
+
+    for (int i = 0; i < qr->size; i++)
+    {
+        set_qr_module(qr, 6, i, i % 2 == 0);
+        set_qr_module(qr, i, 6, i % 2 == 0);
+    }
+
+    draw_qr_finder(qr, 3, 3);
+    draw_qr_finder(qr, qr->size - 4, 3);
+    draw_qr_finder(qr, 3, qr->size - 4);
+
+    /* Except where they'd land on the finders. */
+    count = get_qr_alignment_positions(version, positions);
+    for (int i = 0; i < count; i++)
+    {
+        for (int j = 0; j < count; j++)
+        {
+            if ((i == 0 && j == 0) || (i == 0 && j == count - 1) || (i == count - 1 && j == 0))
+                continue;
+
+            draw_qr_alignment(qr, positions[i], positions[j]);
+        }
+    }
+
+    draw_qr_format(qr, 0);
+
+    if (version >= 7)
+    {
+        int remainder = version;
+        long bits;
+
+        for (int i = 0; i < 12; i++)
+            remainder = (remainder << 1) ^ ((remainder >> 11) * 0x1F25);
+
+        bits = ((long)version << 12) | remainder;
+
+        for (int i = 0; i < 18; i++)
+        {
+            BOOL dark = (bits >> i) & 1;
+            int a = qr->size - 11 + i % 3, b = i / 3;
+
+            set_qr_module(qr, a, b, dark);
+            set_qr_module(qr, b, a, dark);
+        }
+    }
+}
+
+/**
+ * @brief Lay the codewords out in the zigzag, two columns at a time from
+ * the bottom right, around whatever's reserved.
+ */
+static void draw_qr_codewords(struct qr_matrix *qr, const BYTE *codewords, int count)
+{
+    int bit = 0;
+
+    for (int right = qr->size - 1; right >= 1; right -= 2)
+    {
+        /* The vertical timing pattern takes a whole column. */
+        if (right == 6)
+            right = 5;
+
+        for (int vertical = 0; vertical < qr->size; vertical++)
+        {
+            for (int j = 0; j < 2; j++)
+            {
+                int x = right - j;
+                BOOL upward = ((right + 1) & 2) == 0;
+                int y = upward ? qr->size - 1 - vertical : vertical;
+
+                if (qr->reserved[y * qr->size + x] || bit >= count * 8)
+                    continue;
+
+                qr->modules[y * qr->size + x] = (codewords[bit >> 3] >> (7 - (bit & 7))) & 1;
+                bit++;
+            }
+        }
+    }
+}
+
+static BOOL get_qr_mask(int mask, int x, int y)
+{
+    switch (mask)
+    {
+    case 0:
+        return (x + y) % 2 == 0;
+    case 1:
+        return y % 2 == 0;
+    case 2:
+        return x % 3 == 0;
+    case 3:
+        return (x + y) % 3 == 0;
+    case 4:
+        return (x / 3 + y / 2) % 2 == 0;
+    case 5:
+        return x * y % 2 + x * y % 3 == 0;
+    case 6:
+        return (x * y % 2 + x * y % 3) % 2 == 0;
+    default:
+        return ((x + y) % 2 + x * y % 3) % 2 == 0;
+    }
+}
+
+/**
+ * @brief Flip the modules a mask covers. Doing it twice undoes it.
+ */
+static void apply_qr_mask(struct qr_matrix *qr, int mask)
+{
+    for (int y = 0; y < qr->size; y++)
+    {
+        for (int x = 0; x < qr->size; x++)
+        {
+            if (!qr->reserved[y * qr->size + x] && get_qr_mask(mask, x, y))
+                qr->modules[y * qr->size + x] ^= 1;
+        }
+    }
+}
+
+/**
+ * @brief Score how hard a QR code would be to scan, from long runs, solid
+ * blocks, things that look like finders, and too much of either colour.
+ *
+ * @return The penalty; lower is better.
+ */
+static long get_qr_penalty(const struct qr_matrix *qr)
+{
+    static const BYTE finder_like[11] = {1, 0, 1, 1, 1, 0, 1, 0, 0, 0, 0};
+    int size = qr->size;
+    long penalty = 0;
+    long dark = 0, total = (long)size * size;
+
+    /* Rows, then columns. */
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (int a = 0; a < size; a++)
+        {
+            int run = 0;
+            BYTE colour = 2;
+
+            for (int b = 0; b < size; b++)
+            {
+                BYTE module = pass == 0 ? qr->modules[a * size + b] : qr->modules[b * size + a];
+
+                if (module != colour)
+                {
+                    colour = module;
+                    run = 1;
+                }
+                else if (++run == 5)
+                    penalty += 3;
+                else if (run > 5)
+                    penalty++;
+            }
+
+            for (int b = 0; b + 11 <= size; b++)
+            {
+                BOOL forward = TRUE, backward = TRUE;
+
+                for (int k = 0; k < 11; k++)
+                {
+                    BYTE module = pass == 0 ? qr->modules[a * size + b + k] : qr->modules[(b + k) * size + a];
+
+                    forward = forward && module == finder_like[k];
+                    backward = backward && module == finder_like[10 - k];
+                }
+
+                if (forward)
+                    penalty += 40;
+                if (backward)
+                    penalty += 40;
+            }
+        }
+    }
+
+    for (int y = 0; y + 1 < size; y++)
+    {
+        for (int x = 0; x + 1 < size; x++)
+        {
+            BYTE module = qr->modules[y * size + x];
+
+            if (module == qr->modules[y * size + x + 1] &&
+                module == qr->modules[(y + 1) * size + x] &&
+                module == qr->modules[(y + 1) * size + x + 1])
+                penalty += 3;
+        }
+    }
+
+    for (long i = 0; i < total; i++)
+        dark += qr->modules[i];
+
+    penalty += ((labs(dark * 20 - total * 10) + total - 1) / total - 1) * 10;
+
+    return penalty;
+}
+
+/**
+ * @brief Encode text as a QR code in byte mode, in the smallest version
+ * it fits.
+ */
+static struct barcode *encode_qr(const char *text)
+{
+    size_t length = strlen(text);
+    BYTE data[QR_MAX_CODEWORDS] = {0};
+    BYTE ecc[QR_MAX_CODEWORDS];
+    BYTE codewords[QR_MAX_CODEWORDS];
+    int starts[QR_MAX_BLOCKS];
+    int version, raw_codewords = 0, data_codewords = 0, count_bits = 0;
+    int blocks, ecc_length, short_blocks, short_data;
+    int bit = 0, count = 0, mask = 0;
+    long best_penalty = -1;
+    struct qr_matrix *qr = NULL;
+    struct barcode *barcode = NULL;
+
+    for (version = 1; version <= QR_MAX_VERSION; version++)
+    {
+        raw_codewords = get_qr_data_modules(version) / 8;
+        data_codewords = raw_codewords - qr_ecc_lengths[version] * qr_block_counts[version];
+        count_bits = version < 10 ? 8 : 16;
+
+        if (4 + count_bits + 8 * length <= (size_t)data_codewords * 8)
+            break;
+    }
+
+    if (version > QR_MAX_VERSION)
+    {
+        ERR("Too much text for a QR code: %zu bytes.\n", length);
+        return NULL;
+    }
+
+    /* Byte mode, the length, the text, and then as much of a terminator as
+     * fits. The rest is padding. */
+    for (int i = -2; i < (int)length; i++)
+    {
+        int value = i == -2 ? 0x4 : i == -1 ? (int)length : (BYTE)text[i];
+        int bits = i == -2 ? 4 : i == -1 ? count_bits : 8;
+
+        for (int b = bits - 1; b >= 0; b--, bit++)
+        {
+            if ((value >> b) & 1)
+                data[bit >> 3] |= 0x80 >> (bit & 7);
+        }
+    }
+
+    bit += min(4, data_codewords * 8 - bit);
+    for (int i = (bit + 7) / 8, pad = 0; i < data_codewords; i++, pad++)
+        data[i] = pad % 2 == 0 ? 0xEC : 0x11;
+
+    /* The codewords are split into blocks, the last few one longer than
+     * the rest, and then interleaved, so damage is spread between them. */
+    blocks = qr_block_counts[version];
+    ecc_length = qr_ecc_lengths[version];
+    short_blocks = blocks - raw_codewords % blocks;
+    short_data = raw_codewords / blocks - ecc_length;
+
+    for (int b = 0, start = 0; b < blocks; b++)
+    {
+        int block_data = short_data + (b >= short_blocks ? 1 : 0);
+
+        starts[b] = start;
+        reed_solomon(data + start, block_data, ecc + b * ecc_length, ecc_length, 1, QR_POLYNOMIAL, 1);
+        start += block_data;
+    }
+
+    for (int i = 0; i <= short_data; i++)
+    {
+        for (int b = 0; b < blocks; b++)
+        {
+            if (i < short_data || b >= short_blocks)
+                codewords[count++] = data[starts[b] + i];
+        }
+    }
+
+    for (int i = 0; i < ecc_length; i++)
+    {
+        for (int b = 0; b < blocks; b++)
+            codewords[count++] = ecc[b * ecc_length + i];
+    }
+
+    qr = (struct qr_matrix *)calloc(1, sizeof(struct qr_matrix));
+    if (qr == NULL)
+    {
+        ERR("Failed to allocate memory for barcode.\n");
+        return NULL;
+    }
+
+    qr->size = version * 4 + 17;
+    draw_qr_patterns(qr, version);
+    draw_qr_codewords(qr, codewords, count);
+
+    for (int i = 0; i < 8; i++)
+    {
+        long penalty;
+
+        apply_qr_mask(qr, i);
+        draw_qr_format(qr, i);
+        penalty = get_qr_penalty(qr);
+        apply_qr_mask(qr, i);
+
+        if (best_penalty < 0 || penalty < best_penalty)
+        {
+            best_penalty = penalty;
+            mask = i;
+        }
+    }
+
+    apply_qr_mask(qr, mask);
+    draw_qr_format(qr, mask);
+
+    barcode = new_barcode(BARCODE_QR, qr->size + 2 * QR_QUIET_ZONE, qr->size + 2 * QR_QUIET_ZONE);
+    if (barcode != NULL)
+    {
+        for (int y = 0; y < qr->size; y++)
+        {
+            memcpy(
+                barcode->modules + (size_t)(y + QR_QUIET_ZONE) * barcode->width + QR_QUIET_ZONE,
+                qr->modules + y * qr->size,
+                qr->size);
+        }
+
+        DBG("QR code version %d, mask %d: %s\n", version, mask, text);
+    }
+
+    free(qr);
+
+    return barcode;
+}
+
+/**
+ * @brief Where each bit of each codeword goes in a Data Matrix, following
+ * the diagonal "Utah" shapes and the four corner cases of ISO/IEC 16022.
+ */
+struct datamatrix_placement
+{
+    int rows, columns;
+
+    /* Ten times the codeword, counting from 1, plus the bit, counting from
+     * 1 at the most significant; 1 for a fixed dark module; 0 for unset,
+     * which leaves a fixed light one. */
+    int *modules;
+};
+
+static void place_datamatrix_module(struct datamatrix_placement *placement, int row, int column, int codeword, int bit)
+{
+    if (row < 0)
+    {
+        row += placement->rows;
+        column += 4 - ((placement->rows + 4) % 8);
+    }
+
+    if (column < 0)
+    {
+        column += placement->columns;
+        row += 4 - ((placement->columns + 4) % 8);
+    }
+
+    placement->modules[row * placement->columns + column] = 10 * codeword + bit;
+}
+
+static void place_datamatrix_utah(struct datamatrix_placement *placement, int row, int column, int codeword)
+{
+    place_datamatrix_module(placement, row - 2, column - 2, codeword, 1);
+    place_datamatrix_module(placement, row - 2, column - 1, codeword, 2);
+    place_datamatrix_module(placement, row - 1, column - 2, codeword, 3);
+    place_datamatrix_module(placement, row - 1, column - 1, codeword, 4);
+    place_datamatrix_module(placement, row - 1, column, codeword, 5);
+    place_datamatrix_module(placement, row, column - 2, codeword, 6);
+    place_datamatrix_module(placement, row, column - 1, codeword, 7);
+    place_datamatrix_module(placement, row, column, codeword, 8);
+}
+
+/**
+ * @brief Place a codeword that wraps around a corner. Each corner case
+ * lists its eight modules, most significant bit first.
+ */
+static void place_datamatrix_corner(struct datamatrix_placement *placement, int corner, int codeword)
+{
+    int rows = placement->rows, columns = placement->columns;
+    const int cases[4][8][2] = {
+        {{rows - 1, 0}, {rows - 1, 1}, {rows - 1, 2}, {0, columns - 2}, {0, columns - 1}, {1, columns - 1}, {2, columns - 1}, {3, columns - 1}},
+        {{rows - 3, 0}, {rows - 2, 0}, {rows - 1, 0}, {0, columns - 4}, {0, columns - 3}, {0, columns - 2}, {0, columns - 1}, {1, columns - 1}},
+        {{rows - 3, 0}, {rows - 2, 0}, {rows - 1, 0}, {0, columns - 2}, {0, columns - 1}, {1, columns - 1}, {2, columns - 1}, {3, columns - 1}},
+        {{rows - 1, 0}, {rows - 1, columns - 1}, {0, columns - 3}, {0, columns - 2}, {0, columns - 1}, {1, columns - 3}, {1, columns - 2}, {1, columns - 1}},
+    };
+
+    for (int i = 0; i < 8; i++)
+        place_datamatrix_module(placement, cases[corner][i][0], cases[corner][i][1], codeword, i + 1);
+}
+
+static void place_datamatrix(struct datamatrix_placement *placement)
+{
+    int rows = placement->rows, columns = placement->columns;
+    int codeword = 1, row = 4, column = 0;
+
+    do
+    {
+        if (row == rows && column == 0)
+            place_datamatrix_corner(placement, 0, codeword++);
+        if (row == rows - 2 && column == 0 && columns % 4 != 0)
+            place_datamatrix_corner(placement, 1, codeword++);
+        if (row == rows - 2 && column == 0 && columns % 8 == 4)
+            place_datamatrix_corner(placement, 2, codeword++);
+        if (row == rows + 4 && column == 2 && columns % 8 == 0)
+            place_datamatrix_corner(placement, 3, codeword++);
+
+        /* Up and to the right... */
+        do
+        {
+            if (row < rows && column >= 0 && placement->modules[row * columns + column] == 0)
+                place_datamatrix_utah(placement, row, column, codeword++);
+
+            row -= 2;
+            column += 2;
+        } while (row >= 0 && column < columns);
+
+        row += 1;
+        column += 3;
+
+        /* ...then down and to the left. */
+        do
+        {
+            if (row >= 0 && column < columns && placement->modules[row * columns + column] == 0)
+                place_datamatrix_utah(placement, row, column, codeword++);
+
+            row += 2;
+            column -= 2;
+        } while (row < rows && column >= 0);
+
+        row += 3;
+        column += 1;
+    } while (row < rows || column < columns);
+
+    /* Sizes that leave the bottom right corner spare fill it with a fixed
+     * pattern. */
+    if (placement->modules[rows * columns - 1] == 0)
+    {
+        placement->modules[rows * columns - 1] = 1;
+        placement->modules[rows * columns - columns - 2] = 1;
+    }
+}
+
+/**
+ * @brief Encode text as a square ECC 200 Data Matrix, in ASCII encodation,
+ * in the smallest size it fits.
+ */
+static struct barcode *encode_datamatrix(const char *text)
+{
+    BYTE codewords[DATAMATRIX_MAX_CODEWORDS];
+    const struct datamatrix_size *symbol = NULL;
+    const BYTE *p = (const BYTE *)text;
+    const int capacity = datamatrix_sizes[DATAMATRIX_SIZE_COUNT - 1].data;
+    struct datamatrix_placement placement;
+    struct barcode *barcode;
+    int count = 0;
+
+    /* Pairs of digits share a codeword, and anything past ASCII needs a
+     * shift first. */
+    while (*p != '\0')
+    {
+        if (count + (*p >= 128 ? 2 : 1) > capacity)
+        {
+            ERR("Too much text for a Data Matrix: %zu bytes.\n", strlen(text));
+            return NULL;
+        }
+
+        if (p[0] >= '0' && p[0] <= '9' && p[1] >= '0' && p[1] <= '9')
+        {
+            codewords[count++] = (BYTE)(130 + (p[0] - '0') * 10 + p[1] - '0');
+            p += 2;
+        }
+        else if (*p >= 128)
+        {
+            codewords[count++] = 235;
+            codewords[count++] = (BYTE)(*p++ - 127);
+        }
+        else
+        {
+            codewords[count++] = (BYTE)(*p++ + 1);
+        }
+    }
+
+    for (size_t i = 0; i < DATAMATRIX_SIZE_COUNT && symbol == NULL; i++)
+    {
+        if (datamatrix_sizes[i].data >= count)
+            symbol = &datamatrix_sizes[i];
+    }
+
+    if (symbol == NULL)
+    {
+        ERR("Too much text for a Data Matrix: %zu bytes.\n", strlen(text));
+        return NULL;
+    }
+
+    /* The first pad is plain, and the rest are scrambled by where they
+     * are, so they don't make a pattern. */
+    for (int i = count; i < symbol->data; i++)
+    {
+        int pad = 129;
+
+        if (i > count)
+        {
+            pad = 129 + (149 * (i + 1)) % 253 + 1;
+            if (pad > 254)
+                pad -= 254;
+        }
+
+        codewords[i] = (BYTE)pad;
+    }
+
+    /* Bigger symbols share their codewords between blocks in turn, and
+     * keep them in place. */
+    for (int b = 0; b < symbol->blocks; b++)
+    {
+        reed_solomon(
+            codewords + b,
+            symbol->data / symbol->blocks,
+            codewords + symbol->data + b,
+            symbol->ecc / symbol->blocks,
+            symbol->blocks,
+            DATAMATRIX_POLYNOMIAL,
+            2);
+    }
+
+    placement.rows = placement.columns = symbol->region * symbol->regions;
+    placement.modules = (int *)calloc((size_t)placement.rows * placement.columns, sizeof(int));
+    if (placement.modules == NULL)
+    {
+        ERR("Failed to allocate memory for barcode.\n");
+        return NULL;
+    }
+
+    place_datamatrix(&placement);
+
+    barcode = new_barcode(
+        BARCODE_DATAMATRIX,
+        symbol->size + 2 * DATAMATRIX_QUIET_ZONE,
+        symbol->size + 2 * DATAMATRIX_QUIET_ZONE);
+    if (barcode != NULL)
+    {
+        int box = symbol->region + 2;
+
+        /* Each region has a solid edge on its left and bottom, and a
+         * dotted one on its top and right. */
+        for (int y = 0; y < symbol->size; y++)
+        {
+            for (int x = 0; x < symbol->size; x++)
+            {
+                int region_y = y % box, region_x = x % box;
+                BOOL dark;
+
+                if (region_x == 0 || region_y == box - 1)
+                    dark = TRUE;
+                else if (region_y == 0)
+                    dark = region_x % 2 == 0;
+                else if (region_x == box - 1)
+                    dark = region_y % 2 == 1;
+                else
+                {
+                    int row = y / box * symbol->region + region_y - 1;
+                    int column = x / box * symbol->region + region_x - 1;
+                    int module = placement.modules[row * placement.columns + column];
+
+                    dark = module == 1 ||
+                           (module >= 10 && ((codewords[module / 10 - 1] >> (8 - module % 10)) & 1));
+                }
+
+                barcode->modules[(size_t)(y + DATAMATRIX_QUIET_ZONE) * barcode->width + x + DATAMATRIX_QUIET_ZONE] = dark ? 1 : 0;
+            }
+        }
+
+        DBG("Data Matrix %d x %d: %s\n", symbol->size, symbol->size, text);
+    }
+
+    free(placement.modules);
+
+    return barcode;
+}
+
+struct barcode *encode_barcode(enum barcode_type type, const char *text)
+{
+    switch (type)
+    {
+    case BARCODE_CODE128:
+        return encode_code128(text);
+    case BARCODE_QR:
+        return encode_qr(text);
+    case BARCODE_DATAMATRIX:
+        return encode_datamatrix(text);
+    }
+
+    ERR("Unknown barcode type.\n");
+    return NULL;
+}
+
+void free_barcode(struct barcode *barcode)
+{
+    free(barcode);
+}
+
+BOOL rasterize_barcode(
+    const struct barcode *barcode,
+    int module_width,
+    int module_height,
+    struct barcode_bitmap *bitmap)
+{
+    BITMAPINFOHEADER *header = &bitmap->info.header;
+    RGBQUAD white = {255, 255, 255, 0}, black = {0, 0, 0, 0};
+    int width, height;
+    size_t stride;
+
+    memset(bitmap, 0, sizeof(*bitmap));
+
+    if (module_width < 1 || module_height < 1 ||
+        module_width > MAX_BARCODE_DOTS / barcode->width ||
+        module_height > MAX_BARCODE_DOTS / barcode->height)
+    {
+        ERR("Barcode is too big to draw: %d x %d dots a module.\n", module_width, module_height);
+        return FALSE;
+    }
+
+    width = barcode->width * module_width;
+    height = barcode->height * module_height;
+    stride = (((size_t)width + 31) / 32) * 4;
+
+    bitmap->bits = (BYTE *)calloc(height, stride);
+    if (bitmap->bits == NULL)
+    {
+        ERR("Failed to allocate memory for barcode.\n");
+        return FALSE;
+    }
+
+    header->biSize = sizeof(BITMAPINFOHEADER);
+    header->biWidth = width;
+    header->biHeight = height;
+    header->biPlanes = 1;
+    header->biBitCount = 1;
+    header->biCompression = BI_RGB;
+    header->biSizeImage = (DWORD)(stride * height);
+    header->biClrUsed = 2;
+    bitmap->info.colors[0] = white;
+    bitmap->info.colors[1] = black;
+
+    /* Draw one row of dots for each row of modules, and copy it down for
+     * the rest of the module. The bitmap is bottom-up, so the barcode's
+     * first row is its last. */
+    for (int y = 0; y < barcode->height; y++)
+    {
+        const BYTE *modules = barcode->modules + (size_t)y * barcode->width;
+        BYTE *row = bitmap->bits + stride * (height - 1 - y * module_height);
+
+        for (int x = 0; x < barcode->width; x++)
+        {
+            if (!modules[x])
+                continue;
+
+            for (int dot = x * module_width; dot < (x + 1) * module_width; dot++)
+                row[dot >> 3] |= 0x80 >> (dot & 7);
+        }
+
+        for (int copy = 1; copy < module_height; copy++)
+            memcpy(row - stride * copy, row, stride);
+    }
+
+    return TRUE;
+}
+
+void free_barcode_bitmap(struct barcode_bitmap *bitmap)
+{
+    free(bitmap->bits);
+    bitmap->bits = NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef BARCODE_H
+#define BARCODE_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+enum barcode_type
+{
+    BARCODE_CODE128,
+    BARCODE_QR,
+    BARCODE_DATAMATRIX,
+};
+
+/* A barcode as a grid of modules, quiet zone and all, so it can be drawn at
+ * whatever size suits the printer. Linear barcodes are a single row, and
+ * only get their height when they're drawn. */
+struct barcode
+{
+    enum barcode_type type;
+    int width, height;
+    BOOL linear;
+
+    /* One byte per module, from the top left a row at a time, nonzero where
+     * the module is dark. */
+    BYTE modules[];
+};
+
+/* A barcode drawn at a printer's resolution, as a 1bpp bitmap for GDI. */
+struct barcode_bitmap
+{
+    struct
+    {
+        BITMAPINFOHEADER header;
+        RGBQUAD colors[2];
+    } info;
+    BYTE *bits;
+};
+
+/**
+ * @brief Look up a barcode type by name: `code128`, `qr` or `datamatrix`.
+ *
+ * @param name The name, in any case.
+ * @param type Set to the type.
+ * @return `TRUE` if the name is one we know.
+ */
+BOOL parse_barcode_type(const char *name, enum barcode_type *type);
+
+/**
+ * @brief Encode text as a barcode.
+ *
+ * Code128 takes printable ASCII, and runs of digits are packed two to a
+ * symbol. QR codes hold the text's bytes at error correction level M, and
+ * Data Matrix codes are square ECC 200 symbols; both are made as small as
+ * the text allows.
+ *
+ * @param type What kind of barcode to make.
+ * @param text The text to encode, in UTF-8.
+ * @return The barcode, or `NULL` if the text can't be encoded. Release it
+ * with `free_barcode()`.
+ */
+struct barcode *encode_barcode(enum barcode_type type, const char *text);
+
+/**
+ * @brief Release a barcode.
+ *
+ * @param barcode The barcode to release. May be `NULL`.
+ */
+void free_barcode(struct barcode *barcode);
+
+/**
+ * @brief Draw a barcode as a bitmap, with every module a whole number of
+ * printer dots, so no module comes out a dot wider than its neighbours.
+ *
+ * @param barcode The barcode to draw.
+ * @param module_width How wide a module is, in dots.
+ * @param module_height How tall a module is, in dots. For linear barcodes,
+ * this is the height of the bars.
+ * @param bitmap Set to the bitmap. Release it with `free_barcode_bitmap()`.
+ * @return `TRUE` if the bitmap was drawn.
+ */
+BOOL rasterize_barcode(
+    const struct barcode *barcode,
+    int module_width,
+    int module_height,
+    struct barcode_bitmap *bitmap);
+
+/**
+ * @brief Release a barcode's bitmap.
+ *
+ * @param bitmap The bitmap to release.
+ */
+void free_barcode_bitmap(struct barcode_bitmap *bitmap);
+
+#endif /* BARCODE_H */
@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <windows.h>
+
+#include "label.h"
+#include "label_cache.h"
+#include "log.h"
+#include "print.h"
+#include "render.h"
+#include "timing.h"
+
+/* An A4 page at a laser printer's resolution, which is what the sample
+ * labels are drawn for. */
+#define DEFAULT_DPI (300)
+#define DEFAULT_PAGE_WIDTH_MM (210.0f)
+#define DEFAULT_PAGE_HEIGHT_MM (297.0f)
+#define DEFAULT_REPEAT (10)
+
+enum
+{
+    OPT_DPI = 0x100,
+    OPT_PRESCALE,
+    OPT_SINGLE_JOB,
+    OPT_CACHE_LABELS,
+    OPT_OUTPUT,
+    OPT_TIMINGS_OUTPUT,
+    OPT_BAND_ROWS,
+    OPT_CROP,
+};
+
+static struct option long_options[] = {
+    {"page-size", required_argument, NULL, 's'},
+    {"repeat", required_argument, NULL, 'n'},
+    {"dpi", required_argument, NULL, OPT_DPI},
+    {"prescale", 0, NULL, OPT_PRESCALE},
+    {"single-job", 0, NULL, OPT_SINGLE_JOB},
+    {"cache-labels", 0, NULL, OPT_CACHE_LABELS},
+    {"output", required_argument, NULL, OPT_OUTPUT},
+    {"timings-output", required_argument, NULL, OPT_TIMINGS_OUTPUT},
+    {"band-rows", required_argument, NULL, OPT_BAND_ROWS},
+    {"crop", 0, NULL, OPT_CROP},
+    {"verbose", 0, NULL, 'v'},
+    {"help", 0, NULL, 'h'},
+    {NULL, 0, NULL, 0}};
+
+BOOL verbose = FALSE;
+BOOL dry_run = FALSE;
+
+static void print_usage(void)
+{
+    fprintf(stderr, "Usage: labelprinter_bench [options] filename...\n");
+    fprintf(stderr, "Prints labels to memory instead of a printer, and reports how fast it went.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -s, --page-size WxH                     Page size in mm (default: %.0fx%.0f)\n", DEFAULT_PAGE_WIDTH_MM, DEFAULT_PAGE_HEIGHT_MM);
+    fprintf(stderr, "  -n, --repeat N                          Print every file N times (default: %d)\n", DEFAULT_REPEAT);
+    fprintf(stderr, "      --dpi N                             Resolution to render at (default: %d)\n", DEFAULT_DPI);
+    fprintf(stderr, "      --prescale                          Scale monochrome labels to the page's resolution before rendering them\n");
+    fprintf(stderr, "      --single-job                        Render all labels as pages of one document\n");
+    fprintf(stderr, "      --cache-labels                      Keep labels in memory between repeats\n");
+    fprintf(stderr, "      --output DIR                        Write each rendered page to DIR as a bitmap\n");
+    fprintf(stderr, "      --timings-output FILE               Also write the timings to FILE, as JSON if it ends in .json, otherwise CSV\n");
+    fprintf(stderr, "      --band-rows N                       Render labels taller than N rows a band of N rows at a time\n");
+    fprintf(stderr, "      --crop                              Render only the inked part of each label\n");
+    fprintf(stderr, "  -v, --verbose                           Enable verbose output\n");
+    fprintf(stderr, "  -h, --help                              Display this help message and exit\n");
+}
+
+int main(int argc, char **argv)
+{
+    float page_width_mm = DEFAULT_PAGE_WIDTH_MM, page_height_mm = DEFAULT_PAGE_HEIGHT_MM;
+    int dpi = DEFAULT_DPI;
+    int repeat = DEFAULT_REPEAT;
+    int band_rows = 0;
+    BOOL single_job = FALSE;
+    BOOL document_started = FALSE;
+    char *output_dir = NULL;
+    char *timings_output = NULL;
+    struct print_target target = {0};
+    struct prepare_options prepare = {0};
+    struct label *label = NULL;
+    LARGE_INTEGER frequency, start, end;
+    int file_count;
+    int printed = 0;
+    double seconds;
+    int ret = EXIT_FAILURE;
+    int opt;
+
+    SetConsoleOutputCP(CP_UTF8);
+
+    while ((opt = getopt_long(
+                argc,
+                argv,
+                "s:n:vh",
+                long_options,
+                NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            if (sscanf(optarg, "%fx%f", &page_width_mm, &page_height_mm) != 2 ||
+                page_width_mm <= 0 || page_height_mm <= 0)
+            {
+                ERR("Invalid page size: %s\n", optarg);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'n':
+            repeat = atoi(optarg);
+            if (repeat < 1)
+            {
+                ERR("Repeat must be at least 1.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_DPI:
+            dpi = atoi(optarg);
+            if (dpi < 72 || dpi > 2400)
+            {
+                ERR("DPI must be between 72 and 2400.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case OPT_PRESCALE:
+            prepare.prescale = TRUE;
+            break;
+
+        case OPT_CROP:
+            prepare.crop = TRUE;
+            break;
+
+        case OPT_SINGLE_JOB:
+            single_job = TRUE;
+            break;
+
+        case OPT_CACHE_LABELS:
+            label_cache_enable();
+            break;
+
+        case OPT_OUTPUT:
+            output_dir = optarg;
+            break;
+
+        case OPT_TIMINGS_OUTPUT:
+            timings_output = optarg;
+            break;
+
+        case OPT_BAND_ROWS:
+            band_rows = atoi(optarg);
+            if (band_rows < 1)
+            {
+                ERR("Band rows must be at least 1.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
+
+        case 'v':
+            verbose = TRUE;
+            break;
+
+        case 'h':
+            print_usage();
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            print_usage();
+            exit(EXIT_FAILURE);
+            break;
+        }
+    }
+
+    file_count = argc - optind;
+    if (file_count <= 0)
+    {
+        ERR("No files to process!\n");
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+
+    if (output_dir != NULL && !CreateDirectory(output_dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        ERR("Failed to create %s.\n", output_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    timing_enable();
+
+    if (!open_render_target(&target, page_width_mm, page_height_mm, dpi, output_dir))
+    {
+        goto exit;
+    }
+
+    target.band_rows = band_rows;
+    prepare.geometry = &target.geometry;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    if (single_job && !start_document(&target, "labelprinter_bench"))
+    {
+        goto exit;
+    }
+
+    document_started = single_job;
+
+    /* The same work as printing, label by label, but without the loader's
+     * threads, so the timings are all for the print path. */
+    for (int pass = 0; pass < repeat; pass++)
+    {
+        for (int i = 0; i < file_count; i++)
+        {
+            char *filename = argv[optind + i];
+
+            label = open_cached_label(filename);
+            if (label == NULL)
+            {
+                ERR("Failed to open %s.\n", filename);
+                goto exit;
+            }
+
+            if (!prepare_label(label, &prepare) ||
+                !print_label(&target, label, filename, !single_job))
+            {
+                ERR("Failed to render %s.\n", filename);
+                goto exit;
+            }
+
+            close_label(label);
+            label = NULL;
+            printed++;
+        }
+    }
+
+    if (document_started)
+    {
+        document_started = FALSE;
+        if (!end_document(&target))
+        {
+            goto exit;
+        }
+    }
+
+    QueryPerformanceCounter(&end);
+    seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+    printf(
+        " ⏱️ %d labels in %.3f s: %.1f labels/s\n",
+        printed,
+        seconds,
+        seconds > 0 ? printed / seconds : 0.0);
+    printf(
+        " 📄 %llu bytes sent to GDI, %.1f KB per label\n",
+        target.bytes_sent,
+        target.bytes_sent / 1024.0 / printed);
+
+    if (output_dir != NULL)
+    {
+        printf(" 📄 %llu bytes written to %s\n", get_render_bytes_written(target.render), output_dir);
+    }
+
+    ret = EXIT_SUCCESS;
+
+exit:
+    if (label != NULL)
+        close_label(label);
+
+    if (document_started)
+        abort_document(&target);
+
+    close_print_target(&target);
+
+    drain_label_cache();
+    drain_label_pool();
+
+    timing_report(stdout);
+
+    if (timings_output != NULL)
+        timing_write(timings_output);
+
+    return ret;
+}
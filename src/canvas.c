@@ -0,0 +1,72 @@
+#include <stdlib.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "canvas.h"
+
+void init_canvas(struct canvas *canvas, const BITMAPINFOHEADER *info_header, void *bits)
+{
+    const RGBQUAD *colors = (const RGBQUAD *)((const char *)info_header + info_header->biSize);
+
+    canvas->bits = (BYTE *)bits;
+    canvas->width = info_header->biWidth;
+    canvas->height = abs(info_header->biHeight);
+    canvas->stride = (((size_t)canvas->width + 31) / 32) * 4;
+    canvas->top_down = info_header->biHeight < 0;
+    canvas->ink = colors[1].rgbRed + colors[1].rgbGreen + colors[1].rgbBlue <
+                  colors[0].rgbRed + colors[0].rgbGreen + colors[0].rgbBlue;
+}
+
+/**
+ * @brief Get one of a canvas's rows, counting from the top.
+ */
+static BYTE *canvas_row(struct canvas *canvas, int y)
+{
+    return canvas->bits + canvas->stride * (canvas->top_down ? y : canvas->height - 1 - y);
+}
+
+void canvas_draw_bits(
+    struct canvas *canvas,
+    int x,
+    int y,
+    const BYTE *bits,
+    size_t stride,
+    int width,
+    int height)
+{
+    /* Only the part that lands on the canvas. */
+    int first_column = x < 0 ? -x : 0;
+    int last_column = x + width > canvas->width ? canvas->width - x : width;
+    int first_row = y < 0 ? -y : 0;
+    int last_row = y + height > canvas->height ? canvas->height - y : height;
+
+    for (int row = first_row; row < last_row; row++)
+    {
+        const BYTE *src = bits + stride * row;
+        BYTE *dst = canvas_row(canvas, y + row);
+
+        for (int column = first_column; column < last_column; column++)
+        {
+            int dst_x;
+            BYTE mask;
+
+            /* Glyphs are mostly empty, so skip a byte of nothing at once. */
+            if ((column & 7) == 0 && src[column >> 3] == 0)
+            {
+                column += 7;
+                continue;
+            }
+
+            if (!(src[column >> 3] & (0x80 >> (column & 7))))
+                continue;
+
+            dst_x = x + column;
+            mask = (BYTE)(0x80 >> (dst_x & 7));
+            if (canvas->ink)
+                dst[dst_x >> 3] |= mask;
+            else
+                dst[dst_x >> 3] &= (BYTE)~mask;
+        }
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef CANVAS_H
+#define CANVAS_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+/* A 1bpp bitmap to draw on, addressed in pixels from its top left whichever
+ * way up it's stored. Drawing only ever adds ink. */
+struct canvas
+{
+    BYTE *bits;
+    int width, height;
+    size_t stride;
+    BOOL top_down;
+
+    /* The bit that means ink, which depends on the palette. */
+    BYTE ink;
+};
+
+/**
+ * @brief Set up a canvas over an uncompressed 1bpp bitmap.
+ *
+ * @param canvas The canvas to set up.
+ * @param info_header The bitmap's header, followed by its two colours. Ink
+ * is whichever colour is darker.
+ * @param bits The bitmap's rows, which are drawn on in place.
+ */
+void init_canvas(struct canvas *canvas, const BITMAPINFOHEADER *info_header, void *bits);
+
+/**
+ * @brief Draw a 1bpp image onto a canvas, clipped to its edges. Set bits in
+ * the image are ink; clear ones leave the canvas alone.
+ *
+ * @param canvas The canvas to draw on.
+ * @param x Where the image's left edge goes.
+ * @param y Where the image's top row goes.
+ * @param bits The image's rows, top row first, most significant bit first.
+ * @param stride The number of bytes from one of the image's rows to the next.
+ * @param width The image's width in pixels.
+ * @param height The image's height in pixels.
+ */
+void canvas_draw_bits(
+    struct canvas *canvas,
+    int x,
+    int y,
+    const BYTE *bits,
+    size_t stride,
+    int width,
+    int height);
+
+#endif /* CANVAS_H */
@@ -0,0 +1,559 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "convert.h"
+#include "label.h"
+#include "log.h"
+
+/* Pixels at least this light come out white, unless we're dithering. */
+#define WHITE_THRESHOLD (128)
+
+/* The 8x8 Bayer matrix, for ordered dithering. Each pixel's threshold comes
+ * from its place in the pattern, so flat greys become dot patterns. */
+static const uint8_t bayer[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static BOOL dither_enabled;
+
+/* One colour channel of a bitfields pixel. */
+struct channel
+{
+    DWORD mask;
+    int shift;
+    DWORD max;
+};
+
+/* How to turn each row of the source bitmap into grey levels. */
+struct converter
+{
+    int bit_count;
+    int width, height;
+    BOOL top_down;
+    const uint8_t *bits;
+    size_t stride;
+
+    /* The grey level of each palette entry, for indexed bitmaps. */
+    uint8_t palette[256];
+
+    /* Red, green, blue and alpha, for 16 and 32bpp bitmaps. */
+    struct channel channels[4];
+    BOOL bitfields;
+};
+
+void convert_dither_enable(void)
+{
+    dither_enabled = TRUE;
+}
+
+static uint8_t luminance(unsigned int red, unsigned int green, unsigned int blue)
+{
+    return (uint8_t)((red * 77 + green * 150 + blue * 29) >> 8);
+}
+
+static uint8_t reverse_bits(uint8_t b)
+{
+    b = (uint8_t)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+    b = (uint8_t)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+    b = (uint8_t)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+
+    return b;
+}
+
+static void set_channel(struct channel *channel, DWORD mask)
+{
+    channel->mask = mask;
+    channel->shift = 0;
+    channel->max = 0;
+
+    if (mask == 0)
+        return;
+
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        channel->shift++;
+    }
+
+    channel->max = mask;
+}
+
+static unsigned int read_channel(const struct channel *channel, DWORD pixel)
+{
+    if (channel->max == 0)
+        return 0;
+
+    return (unsigned int)((((pixel & channel->mask) >> channel->shift) * 255 + channel->max / 2) / channel->max);
+}
+
+BOOL label_needs_conversion(const struct label *label)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+
+    switch (info_header->biCompression)
+    {
+    case BI_RGB:
+        return info_header->biBitCount != 1;
+
+    case BI_RLE8:
+    case BI_RLE4:
+    case BI_BITFIELDS:
+        return TRUE;
+
+    default:
+        /* JPEG and PNG are for the driver to make sense of, if it can. */
+        return FALSE;
+    }
+}
+
+/**
+ * @brief Find where the colour table or masks that follow the info header
+ * are, and check they're all inside the file.
+ *
+ * @return The start of them, or `NULL` if they aren't all there.
+ */
+static const uint8_t *get_header_extra(const struct label *label, size_t size)
+{
+    const uint8_t *extra = (const uint8_t *)label->info_header + label->info_header->biSize;
+    const uint8_t *end = (const uint8_t *)label->header + label->size;
+
+    if (extra > end || (size_t)(end - extra) < size)
+        return NULL;
+
+    return extra;
+}
+
+static BOOL set_up_palette(struct converter *converter, const struct label *label)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+    DWORD count = info_header->biClrUsed;
+    const RGBQUAD *colors;
+
+    if (count == 0 || count > (1u << converter->bit_count))
+        count = 1u << converter->bit_count;
+
+    memset(converter->palette, 0, sizeof(converter->palette));
+
+    colors = (const RGBQUAD *)get_header_extra(label, count * sizeof(RGBQUAD));
+    if (colors == NULL)
+        return FALSE;
+
+    for (DWORD i = 0; i < count; i++)
+        converter->palette[i] = luminance(colors[i].rgbRed, colors[i].rgbGreen, colors[i].rgbBlue);
+
+    return TRUE;
+}
+
+static BOOL set_up_bitfields(struct converter *converter, const struct label *label)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+    DWORD masks[4] = {0};
+
+    /* Masks live in the header from V2 on. Before that, they follow it,
+     * where the colour table would be. */
+    if (info_header->biSize >= 52)
+    {
+        const BITMAPV4HEADER *v4_header = (const BITMAPV4HEADER *)info_header;
+
+        masks[0] = v4_header->bV4RedMask;
+        masks[1] = v4_header->bV4GreenMask;
+        masks[2] = v4_header->bV4BlueMask;
+        if (info_header->biSize >= 56)
+            masks[3] = v4_header->bV4AlphaMask;
+    }
+    else
+    {
+        const DWORD *extra = (const DWORD *)get_header_extra(label, 3 * sizeof(DWORD));
+        if (extra == NULL)
+            return FALSE;
+
+        memcpy(masks, extra, 3 * sizeof(DWORD));
+    }
+
+    for (int i = 0; i < 4; i++)
+        set_channel(&converter->channels[i], masks[i]);
+
+    converter->bitfields = TRUE;
+
+    return TRUE;
+}
+
+/**
+ * @brief Expand an RLE bitmap into 8bpp palette indexes, one byte per pixel,
+ * bottom-up.
+ *
+ * @return The pixels, or `NULL` if they couldn't be decoded. Release them
+ * with `free()`.
+ */
+static uint8_t *decode_rle(const struct label *label, BOOL rle4, const char *name)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+    int width = info_header->biWidth;
+    int height = info_header->biHeight;
+    const uint8_t *p = (const uint8_t *)label->bits;
+    const uint8_t *end = p + info_header->biSizeImage;
+    uint8_t *pixels;
+    int x = 0, y = 0;
+
+    pixels = (uint8_t *)calloc((size_t)width, (size_t)height);
+    if (pixels == NULL)
+    {
+        ERR("Failed to allocate memory to convert %s.\n", name);
+        return NULL;
+    }
+
+    while (end - p >= 2)
+    {
+        int count = p[0];
+        int value = p[1];
+
+        p += 2;
+
+        /* A run of one value, or two alternating ones for RLE4. */
+        if (count > 0)
+        {
+            for (int i = 0; i < count; i++, x++)
+            {
+                if (x < width && y < height)
+                    pixels[(size_t)y * width + x] = rle4 ? (i & 1 ? value & 0x0F : value >> 4) : value;
+            }
+
+            continue;
+        }
+
+        if (value == 0)
+        {
+            /* End of the line. */
+            x = 0;
+            y++;
+        }
+        else if (value == 1)
+        {
+            /* End of the bitmap. */
+            return pixels;
+        }
+        else if (value == 2)
+        {
+            /* Skip ahead to another pixel. */
+            if (end - p < 2)
+                break;
+
+            x += p[0];
+            y += p[1];
+            p += 2;
+        }
+        else
+        {
+            /* A run of literal pixels, padded to a whole 16-bit word. */
+            int bytes = rle4 ? (value + 1) / 2 : value;
+
+            if (end - p < bytes)
+                break;
+
+            for (int i = 0; i < value; i++, x++)
+            {
+                if (x < width && y < height)
+                    pixels[(size_t)y * width + x] = rle4 ? (i & 1 ? p[i / 2] & 0x0F : p[i / 2] >> 4) : p[i];
+            }
+
+            p += bytes;
+            if ((bytes & 1) && p < end)
+                p++;
+        }
+    }
+
+    /* Plenty of encoders leave off the end marker, so running out of data
+     * is fine as long as there wasn't a code cut off half way. */
+    if (p != end)
+    {
+        ERR("%s is truncated.\n", name);
+        free(pixels);
+        return NULL;
+    }
+
+    return pixels;
+}
+
+/**
+ * @brief Turn one row of the source bitmap into grey levels.
+ *
+ * @param y The row, counting from the bottom.
+ */
+static void decode_row(const struct converter *converter, int y, uint8_t *gray)
+{
+    int width = converter->width;
+    const uint8_t *src;
+
+    if (converter->top_down)
+        y = converter->height - 1 - y;
+
+    src = converter->bits + (size_t)y * converter->stride;
+
+    switch (converter->bit_count)
+    {
+    case 2:
+        for (int x = 0; x < width; x++)
+            gray[x] = converter->palette[(src[x >> 2] >> (6 - 2 * (x & 3))) & 3];
+        break;
+
+    case 4:
+        for (int x = 0; x < width; x++)
+            gray[x] = converter->palette[x & 1 ? src[x >> 1] & 0x0F : src[x >> 1] >> 4];
+        break;
+
+    case 8:
+        for (int x = 0; x < width; x++)
+            gray[x] = converter->palette[src[x]];
+        break;
+
+    case 24:
+        for (int x = 0; x < width; x++, src += 3)
+            gray[x] = luminance(src[2], src[1], src[0]);
+        break;
+
+    case 16:
+    case 32:
+        if (!converter->bitfields)
+        {
+            for (int x = 0; x < width; x++, src += 4)
+                gray[x] = luminance(src[2], src[1], src[0]);
+            break;
+        }
+
+        for (int x = 0; x < width; x++)
+        {
+            DWORD pixel;
+            uint8_t level;
+
+            if (converter->bit_count == 16)
+            {
+                pixel = src[0] | (DWORD)src[1] << 8;
+                src += 2;
+            }
+            else
+            {
+                pixel = src[0] | (DWORD)src[1] << 8 | (DWORD)src[2] << 16 | (DWORD)src[3] << 24;
+                src += 4;
+            }
+
+            level = luminance(
+                read_channel(&converter->channels[0], pixel),
+                read_channel(&converter->channels[1], pixel),
+                read_channel(&converter->channels[2], pixel));
+
+            /* Labels are printed on white, so that's what shows through
+             * anything transparent. */
+            if (converter->channels[3].mask != 0)
+            {
+                unsigned int alpha = read_channel(&converter->channels[3], pixel);
+                level = (uint8_t)(255 - ((255 - level) * alpha + 127) / 255);
+            }
+
+            gray[x] = level;
+        }
+        break;
+    }
+}
+
+/**
+ * @brief Pack a row of grey levels into 1bpp, white wherever the level is at
+ * least the threshold.
+ */
+static void pack_row(const uint8_t *gray, const uint8_t *threshold, uint8_t *dst, int width)
+{
+    int x = 0;
+
+#ifdef __SSE2__
+    /* Sixteen pixels at a time. There's no unsigned byte compare, but a
+     * level that's at least its threshold is its own maximum. The mask comes
+     * out least significant pixel first, and bitmaps want the opposite. */
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i levels = _mm_loadu_si128((const __m128i *)(gray + x));
+        __m128i thresholds = _mm_loadu_si128((const __m128i *)(threshold + x));
+        __m128i white = _mm_cmpeq_epi8(_mm_max_epu8(levels, thresholds), levels);
+        int mask = _mm_movemask_epi8(white);
+
+        *dst++ = reverse_bits((uint8_t)mask);
+        *dst++ = reverse_bits((uint8_t)(mask >> 8));
+    }
+#endif
+
+    for (; x + 8 <= width; x += 8)
+    {
+        uint8_t out = 0;
+
+        for (int bit = 0; bit < 8; bit++)
+            out |= (gray[x + bit] >= threshold[x + bit]) << (7 - bit);
+
+        *dst++ = out;
+    }
+
+    if (x < width)
+    {
+        uint8_t out = 0;
+
+        for (int bit = 0; x + bit < width; bit++)
+            out |= (gray[x + bit] >= threshold[x + bit]) << (7 - bit);
+
+        *dst = out;
+    }
+}
+
+BOOL convert_label(struct label *label, const char *name)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+    struct converter converter = {0};
+    uint8_t *rle_pixels = NULL;
+    uint8_t *gray = NULL, *threshold;
+    uint8_t *dst;
+    size_t dst_stride;
+    BOOL success = FALSE;
+
+    converter.bit_count = info_header->biBitCount;
+    converter.width = info_header->biWidth;
+    converter.height = info_header->biHeight < 0 ? -info_header->biHeight : info_header->biHeight;
+    converter.top_down = info_header->biHeight < 0;
+    converter.bits = (const uint8_t *)label->bits;
+    converter.stride = (((size_t)converter.width * converter.bit_count + 31) / 32) * 4;
+
+    switch (info_header->biCompression)
+    {
+    case BI_RGB:
+        if (converter.bit_count != 2 && converter.bit_count != 4 && converter.bit_count != 8 &&
+            converter.bit_count != 16 && converter.bit_count != 24 && converter.bit_count != 32)
+            goto unsupported;
+
+        /* 16bpp without masks is 5-5-5. */
+        if (converter.bit_count == 16)
+        {
+            set_channel(&converter.channels[0], 0x7C00);
+            set_channel(&converter.channels[1], 0x03E0);
+            set_channel(&converter.channels[2], 0x001F);
+            converter.bitfields = TRUE;
+        }
+        break;
+
+    case BI_RLE8:
+    case BI_RLE4:
+        if (converter.top_down ||
+            converter.bit_count != (info_header->biCompression == BI_RLE8 ? 8 : 4))
+            goto unsupported;
+
+        rle_pixels = decode_rle(label, info_header->biCompression == BI_RLE4, name);
+        if (rle_pixels == NULL)
+            return FALSE;
+
+        /* Once it's expanded, it's just an 8bpp bitmap without the
+         * padding. */
+        if (!set_up_palette(&converter, label))
+            goto invalid;
+
+        converter.bit_count = 8;
+        converter.bits = rle_pixels;
+        converter.stride = converter.width;
+        break;
+
+    case BI_BITFIELDS:
+        if (converter.bit_count != 16 && converter.bit_count != 32)
+            goto unsupported;
+
+        if (!set_up_bitfields(&converter, label))
+            goto invalid;
+        break;
+
+    default:
+        goto unsupported;
+    }
+
+    if (converter.bit_count <= 8 && rle_pixels == NULL && !set_up_palette(&converter, label))
+        goto invalid;
+
+    DBG("Converting %d bpp label to 1 bpp%s\n", info_header->biBitCount, dither_enabled ? ", dithered" : "");
+
+    dst_stride = (((size_t)converter.width + 31) / 32) * 4;
+    dst = (uint8_t *)reserve_label_mono_buffer(label, dst_stride * converter.height);
+    if (dst == NULL)
+        goto exit;
+
+    gray = (uint8_t *)malloc((size_t)converter.width * 2);
+    if (gray == NULL)
+    {
+        ERR("Failed to allocate memory to convert %s.\n", name);
+        goto exit;
+    }
+
+    threshold = gray + converter.width;
+    memset(threshold, WHITE_THRESHOLD, converter.width);
+
+    for (int y = 0; y < converter.height; y++)
+    {
+        uint8_t *dst_row = dst + (size_t)y * dst_stride;
+
+        if (dither_enabled)
+        {
+            for (int x = 0; x < converter.width; x++)
+                threshold[x] = (uint8_t)(bayer[y & 7][x & 7] * 4 + 2);
+        }
+
+        decode_row(&converter, y, gray);
+
+        memset(dst_row, 0, dst_stride);
+        pack_row(gray, threshold, dst_row, converter.width);
+    }
+
+    /* Black ink on white, the same as a label drawn in 1bpp. */
+    memset(&label->mono_info, 0, sizeof(label->mono_info));
+    label->mono_info.header.biSize = sizeof(BITMAPINFOHEADER);
+    label->mono_info.header.biWidth = converter.width;
+    label->mono_info.header.biHeight = converter.height;
+    label->mono_info.header.biPlanes = 1;
+    label->mono_info.header.biBitCount = 1;
+    label->mono_info.header.biCompression = BI_RGB;
+    label->mono_info.header.biSizeImage = dst_stride * converter.height;
+    label->mono_info.header.biXPelsPerMeter = info_header->biXPelsPerMeter;
+    label->mono_info.header.biYPelsPerMeter = info_header->biYPelsPerMeter;
+    label->mono_info.header.biClrUsed = 2;
+    label->mono_info.colors[1].rgbRed = 255;
+    label->mono_info.colors[1].rgbGreen = 255;
+    label->mono_info.colors[1].rgbBlue = 255;
+
+    label->info_header = &label->mono_info.header;
+    label->bits = dst;
+    label->converted = TRUE;
+
+    success = TRUE;
+    goto exit;
+
+unsupported:
+    ERR("%s is a %d bpp bitmap with compression %lu, which isn't supported.\n",
+        name, info_header->biBitCount, (unsigned long)info_header->biCompression);
+    goto exit;
+
+invalid:
+    ERR("%s is not a valid bitmap file.\n", name);
+
+exit:
+    if (gray != NULL)
+        free(gray);
+
+    if (rle_pixels != NULL)
+        free(rle_pixels);
+
+    return success;
+}
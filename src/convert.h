@@ -0,0 +1,39 @@
+#ifndef CONVERT_H
+#define CONVERT_H
+
+#include <windows.h>
+
+#include "label.h"
+
+/* Turns colour, greyscale and compressed bitmaps into plain 1bpp ones when
+ * they're opened, so the driver gets the same small monochrome bitmap it
+ * would from a label drawn that way in the first place. */
+
+/**
+ * @brief Dither converted labels, rather than cutting them off at mid-grey.
+ * Better for photos and shading, worse for barcodes and text.
+ */
+void convert_dither_enable(void);
+
+/**
+ * @brief Check whether a label needs converting before it's printed.
+ *
+ * @param label The label to check. Its headers must already be validated.
+ * @return `TRUE` unless the label is already uncompressed 1bpp, or is in a
+ * format we leave to the driver.
+ */
+BOOL label_needs_conversion(const struct label *label);
+
+/**
+ * @brief Convert a label to uncompressed, bottom-up 1bpp.
+ *
+ * The result is kept in the label, and `info_header` and `bits` are pointed
+ * at it.
+ *
+ * @param label The label to convert.
+ * @param name The name to use for the bitmap in messages.
+ * @return `TRUE` if the label was converted.
+ */
+BOOL convert_label(struct label *label, const char *name);
+
+#endif /* CONVERT_H */
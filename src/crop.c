@@ -0,0 +1,159 @@
+#include <stdint.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "crop.h"
+#include "label.h"
+#include "log.h"
+
+/**
+ * @brief Get the ink in one byte of a row, as set bits. Pixels run from the
+ * top bit of each byte, so only the top bits of a row's last byte are in the
+ * picture.
+ */
+static uint8_t ink_bits(const uint8_t *row, size_t i, size_t bytes, uint8_t last_mask, uint8_t background)
+{
+    return (row[i] ^ background) & (i == bytes - 1 ? last_mask : 0xFF);
+}
+
+/**
+ * @brief Find the first and last inked pixels in a row.
+ *
+ * @return `TRUE` if the row has any ink.
+ */
+static BOOL find_row_ink(
+    const uint8_t *row,
+    size_t bytes,
+    uint8_t last_mask,
+    uint8_t background,
+    int *left,
+    int *right)
+{
+    uint64_t background_word = background ? ~(uint64_t)0 : 0;
+    uint64_t word;
+    size_t first = 0, last = bytes - 1;
+    uint8_t bits;
+    int bit;
+
+    /* Most rows are mostly background, so skip it a word at a time. The
+     * last byte is left out, since its padding bits can be anything. */
+    while (first + sizeof(word) < bytes)
+    {
+        memcpy(&word, row + first, sizeof(word));
+        if (word != background_word)
+            break;
+
+        first += sizeof(word);
+    }
+
+    while (first < bytes && ink_bits(row, first, bytes, last_mask, background) == 0)
+        first++;
+
+    if (first == bytes)
+        return FALSE;
+
+    /* Now the same from the other end, which has to stop at ink by the
+     * time it gets back to `first`. */
+    if (ink_bits(row, last, bytes, last_mask, background) == 0)
+    {
+        last--;
+        while (last >= first + sizeof(word))
+        {
+            memcpy(&word, row + last + 1 - sizeof(word), sizeof(word));
+            if (word != background_word)
+                break;
+
+            last -= sizeof(word);
+        }
+
+        while (ink_bits(row, last, bytes, last_mask, background) == 0)
+            last--;
+    }
+
+    bits = ink_bits(row, first, bytes, last_mask, background);
+    for (bit = 0; !(bits & (0x80 >> bit)); bit++)
+        ;
+    *left = (int)(first * 8) + bit;
+
+    bits = ink_bits(row, last, bytes, last_mask, background);
+    for (bit = 7; !(bits & (0x80 >> bit)); bit--)
+        ;
+    *right = (int)(last * 8) + bit;
+
+    return TRUE;
+}
+
+BOOL find_bitmap_ink(const BITMAPINFOHEADER *info_header, const void *bits, RECT *ink)
+{
+    const RGBQUAD *colors = (const RGBQUAD *)((const char *)info_header + info_header->biSize);
+    int width = info_header->biWidth;
+    int height = info_header->biHeight < 0 ? -info_header->biHeight : info_header->biHeight;
+    BOOL top_down = info_header->biHeight < 0;
+    size_t stride = (((size_t)width + 31) / 32) * 4;
+    size_t bytes = ((size_t)width + 7) / 8;
+    uint8_t last_mask = (uint8_t)(0xFF << (bytes * 8 - width));
+    uint8_t background;
+    int top = -1, bottom = -1;
+    int left = width, right = -1;
+
+    if (info_header->biBitCount != 1 || info_header->biCompression != BI_RGB ||
+        info_header->biClrUsed == 1 || width <= 0 || height <= 0)
+        return FALSE;
+
+    /* Paper is the lighter of the two colours, whichever way round they are. */
+    background = (colors[1].rgbRed + colors[1].rgbGreen + colors[1].rgbBlue >=
+                  colors[0].rgbRed + colors[0].rgbGreen + colors[0].rgbBlue)
+                     ? 0xFF
+                     : 0x00;
+
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row = (const uint8_t *)bits + stride * (top_down ? y : height - 1 - y);
+        int row_left, row_right;
+
+        if (!find_row_ink(row, bytes, last_mask, background, &row_left, &row_right))
+            continue;
+
+        if (top < 0)
+            top = y;
+        bottom = y;
+
+        if (row_left < left)
+            left = row_left;
+        if (row_right > right)
+            right = row_right;
+    }
+
+    /* Nothing at all to print, so nothing to send. */
+    if (top < 0)
+    {
+        SetRectEmpty(ink);
+        return TRUE;
+    }
+
+    ink->left = left;
+    ink->top = top;
+    ink->right = right + 1;
+    ink->bottom = bottom + 1;
+
+    return TRUE;
+}
+
+void crop_label(struct label *label)
+{
+    if (!label->cropped)
+    {
+        label->cropped = find_bitmap_ink(label->info_header, label->bits, &label->ink);
+        if (label->cropped)
+        {
+            DBG("Label ink: %ld x %ld px at %ld, %ld\n",
+                label->ink.right - label->ink.left, label->ink.bottom - label->ink.top,
+                label->ink.left, label->ink.top);
+        }
+    }
+
+    if (label->prescaled && !label->device_cropped)
+        label->device_cropped = find_bitmap_ink(&label->device_info.header, label->device_bits, &label->device_ink);
+}
@@ -0,0 +1,36 @@
+#ifndef CROP_H
+#define CROP_H
+
+#include <windows.h>
+
+#include "label.h"
+
+/* Finds the part of a label that's actually inked, so the white around it
+ * never has to be sent to the printer. */
+
+/**
+ * @brief Find the smallest rectangle holding all of a bitmap's ink.
+ *
+ * Ink is whichever of its two colours is darker. Only uncompressed 1bpp
+ * bitmaps can be searched.
+ *
+ * @param info_header The bitmap's header, followed by its palette.
+ * @param bits The bitmap's rows.
+ * @param ink Set to the inked rectangle, in pixels from the top left. The
+ * right and bottom edges are exclusive. It's empty if the bitmap is blank.
+ * @return `TRUE` if the bitmap could be searched.
+ */
+BOOL find_bitmap_ink(const BITMAPINFOHEADER *info_header, const void *bits, RECT *ink);
+
+/**
+ * @brief Find the inked rectangle of a label, and of its prescaled copy if
+ * it has one, unless we already have.
+ *
+ * The label's `cropped` and `ink`, and `device_cropped` and `device_ink`,
+ * are set for whichever of its bitmaps could be searched.
+ *
+ * @param label The label to crop. Shared labels must be locked.
+ */
+void crop_label(struct label *label);
+
+#endif /* CROP_H */
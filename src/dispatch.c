@@ -0,0 +1,570 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "dispatch.h"
+#include "failure_list.h"
+#include "job.h"
+#include "label.h"
+#include "log.h"
+#include "print.h"
+
+/* A label that fails on this many printers is taken to be the problem,
+ * rather than the printers, so it's given up on. */
+#define MAX_JOB_FAILURES (2)
+
+/* A printer that fails this many labels in a row is taken to be the
+ * problem, so it takes no more. */
+#define MAX_PRINTER_FAILURES (2)
+
+struct dispatch_worker;
+
+struct dispatch
+{
+    struct job_source *source;
+    const struct dispatch_options *options;
+
+    struct dispatch_worker *workers;
+    int worker_count;
+
+    /* Jobs waiting for a printer to take them: ones that failed on another
+     * printer, and ones meant for a printer that's busy. They're handed out
+     * before any new jobs, so they aren't left until the end of the batch. */
+    struct print_job **waiting;
+    int waiting_count;
+    int waiting_capacity;
+
+    /* Jobs handed to a printer that haven't been printed or given back yet.
+     * While there are any, idle printers wait around in case they come
+     * back. */
+    int in_flight;
+    BOOL exhausted;
+    BOOL stopping;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE changed;
+};
+
+struct dispatch_worker
+{
+    struct dispatch *dispatch;
+    char *printer_name;
+    HANDLE thread;
+    BOOL active;
+
+    /* Some of the printer's jobs were spooled, but never printed. */
+    BOOL lost_jobs;
+
+    /* Labels the printer has failed to print since it last printed one. */
+    int failures;
+
+    /* The jobs on the pages of the current document. They aren't printed
+     * until the document is, and go back to the queue if it's aborted. */
+    struct print_job **pages;
+    int page_count;
+    int page_capacity;
+};
+
+static BOOL wants_job(const struct dispatch_worker *worker, const struct print_job *job)
+{
+    if (job->failed_printer == worker->printer_name)
+        return FALSE;
+
+    return job->printer_name == NULL ||
+           _stricmp(job->printer_name, worker->printer_name) == 0;
+}
+
+/**
+ * @brief Check whether any printer that's still going could take a job.
+ */
+static BOOL job_has_taker(const struct dispatch *dispatch, const struct print_job *job)
+{
+    for (int i = 0; i < dispatch->worker_count; i++)
+    {
+        if (dispatch->workers[i].active && wants_job(&dispatch->workers[i], job))
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+/**
+ * @brief Put a job on the waiting list. Must be called with the lock held.
+ */
+static void wait_job(struct dispatch *dispatch, struct print_job *job)
+{
+    if (!append_print_job(&dispatch->waiting, &dispatch->waiting_count, &dispatch->waiting_capacity, job))
+    {
+        free_print_job(job);
+        dispatch->stopping = TRUE;
+    }
+}
+
+/**
+ * @brief Take the next job a printer can print.
+ *
+ * @param dispatch The batch to take from.
+ * @param worker The printer taking the job.
+ * @param job Set to the job.
+ * @param wait Wait for jobs that other printers might give back.
+ * @return `FALSE` if there's nothing to take.
+ */
+static BOOL take_job(
+    struct dispatch *dispatch,
+    struct dispatch_worker *worker,
+    struct print_job **job,
+    BOOL wait)
+{
+    BOOL taken = FALSE;
+
+    EnterCriticalSection(&dispatch->lock);
+
+    while (!taken && !dispatch->stopping)
+    {
+        BOOL others_pending = dispatch->in_flight > 0;
+
+        for (int i = 0; i < dispatch->waiting_count; i++)
+        {
+            if (wants_job(worker, dispatch->waiting[i]))
+            {
+                *job = dispatch->waiting[i];
+                memmove(
+                    &dispatch->waiting[i],
+                    &dispatch->waiting[i + 1],
+                    (dispatch->waiting_count - i - 1) * sizeof(struct print_job *));
+                dispatch->waiting_count--;
+                taken = TRUE;
+                break;
+            }
+
+            if (job_has_taker(dispatch, dispatch->waiting[i]))
+                others_pending = TRUE;
+        }
+
+        /* Jobs for other printers are set aside for them as we come to
+         * them. */
+        while (!taken && !dispatch->exhausted && !dispatch->stopping)
+        {
+            if (!next_job(dispatch->source, job))
+            {
+                dispatch->exhausted = TRUE;
+                break;
+            }
+
+            if (wants_job(worker, *job))
+            {
+                taken = TRUE;
+            }
+            else if (!job_has_taker(dispatch, *job))
+            {
+                ERR("%s is for printer %s, which isn't printing.\n", (*job)->filename, (*job)->printer_name);
+
+                if (dispatch->options->keep_going)
+                {
+                    record_failed_job(*job, "its printer isn't printing");
+                }
+                else
+                {
+                    dispatch->stopping = TRUE;
+                }
+
+                free_print_job(*job);
+            }
+            else
+            {
+                wait_job(dispatch, *job);
+                others_pending = TRUE;
+                WakeAllConditionVariable(&dispatch->changed);
+            }
+        }
+
+        if (taken || !wait || !others_pending)
+            break;
+
+        SleepConditionVariableCS(&dispatch->changed, &dispatch->lock, INFINITE);
+    }
+
+    if (taken)
+        dispatch->in_flight++;
+
+    LeaveCriticalSection(&dispatch->lock);
+
+    return taken;
+}
+
+/**
+ * @brief Hand back jobs taken with `take_job()`.
+ *
+ * @param dispatch The batch the jobs were taken from.
+ * @param jobs The jobs.
+ * @param count The number of jobs.
+ * @param printed `TRUE` if the jobs were printed, otherwise they're queued
+ * for another printer.
+ */
+static void give_back_jobs(struct dispatch *dispatch, struct print_job **jobs, int count, BOOL printed)
+{
+    EnterCriticalSection(&dispatch->lock);
+
+    dispatch->in_flight -= count;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (printed)
+            free_print_job(jobs[i]);
+        else
+            wait_job(dispatch, jobs[i]);
+    }
+
+    WakeAllConditionVariable(&dispatch->changed);
+    LeaveCriticalSection(&dispatch->lock);
+}
+
+/**
+ * @brief Give up on a job that no printer could print, and unless we're
+ * keeping going, on the whole batch.
+ */
+static void stop_dispatch(struct dispatch *dispatch, struct print_job *job, const char *reason)
+{
+    EnterCriticalSection(&dispatch->lock);
+
+    if (dispatch->options->keep_going)
+    {
+        record_failed_job(job, reason);
+    }
+    else
+    {
+        dispatch->stopping = TRUE;
+    }
+
+    free_print_job(job);
+    dispatch->in_flight--;
+
+    WakeAllConditionVariable(&dispatch->changed);
+    LeaveCriticalSection(&dispatch->lock);
+}
+
+/**
+ * @brief Hand back a job a printer failed to print. It goes to another
+ * printer, unless it's failed on enough of them already that it's probably
+ * the label at fault.
+ *
+ * @param worker The printer that failed to print the job.
+ * @param job The job.
+ * @return `FALSE` if the printer has failed too often to take any more.
+ */
+static BOOL fail_job(struct dispatch_worker *worker, struct print_job *job)
+{
+    job->failures++;
+    job->failed_printer = worker->printer_name;
+
+    if (job->failures >= MAX_JOB_FAILURES)
+    {
+        ERR("Giving up on %s, which failed on %d printers.\n", job->filename, job->failures);
+        stop_dispatch(worker->dispatch, job, "it failed on every printer it was tried on");
+        return TRUE;
+    }
+
+    give_back_jobs(worker->dispatch, &job, 1, FALSE);
+
+    return ++worker->failures < MAX_PRINTER_FAILURES;
+}
+
+/**
+ * @brief Take a printer out of the batch, so nobody waits for it any more.
+ */
+static void retire_worker(struct dispatch_worker *worker)
+{
+    struct dispatch *dispatch = worker->dispatch;
+
+    EnterCriticalSection(&dispatch->lock);
+
+    worker->active = FALSE;
+
+    WakeAllConditionVariable(&dispatch->changed);
+    LeaveCriticalSection(&dispatch->lock);
+}
+
+static DWORD WINAPI dispatch_worker(LPVOID param)
+{
+    struct dispatch_worker *worker = (struct dispatch_worker *)param;
+    struct dispatch *dispatch = worker->dispatch;
+    const struct dispatch_options *options = dispatch->options;
+    struct print_target target;
+    struct prepare_options prepare = {0};
+    BOOL document_started = FALSE;
+    struct print_job *job;
+
+    if (!open_print_target(
+            &target,
+            worker->printer_name,
+            options->paper_size_name,
+            options->landscape,
+            options->copies,
+            NULL,
+            options->refresh_printer_cache))
+    {
+        ERR("Leaving %s out of the batch.\n", worker->printer_name);
+        goto exit;
+    }
+
+    target.auto_paper = options->auto_paper;
+    target.retries = options->retries;
+    target.band_rows = options->band_rows;
+    prepare.geometry = &target.geometry;
+    prepare.prescale = options->prescale;
+    prepare.crop = options->crop;
+
+    /* Without a tracker we can still print, we just won't know how it went
+     * once the jobs leave the spooler. */
+    if (options->max_in_flight > 0 && !dry_run)
+    {
+        target.tracker = start_job_tracker(&target.session, options->max_in_flight);
+        if (target.tracker == NULL)
+            ERR("Not tracking jobs on %s.\n", worker->printer_name);
+    }
+
+    for (;;)
+    {
+        struct label *label;
+        BOOL printed;
+
+        /* Never wait on the other printers while we're holding pages of our
+         * own. They might be the jobs everyone's waiting for. */
+        if (!take_job(dispatch, worker, &job, worker->page_count == 0))
+        {
+            if (worker->page_count == 0)
+                break;
+
+            document_started = FALSE;
+            printed = end_document(&target);
+            give_back_jobs(dispatch, worker->pages, worker->page_count, printed);
+            worker->page_count = 0;
+
+            if (!printed)
+                break;
+
+            continue;
+        }
+
+        label = open_job_label(dispatch->source, job);
+        if (label == NULL)
+        {
+            ERR("Failed to open %s.\n", job->filename);
+            stop_dispatch(dispatch, job, "it couldn't be opened");
+            if (!options->keep_going)
+                goto exit;
+
+            continue;
+        }
+
+        /* A printer that can't switch paper is as good as out of stock, so
+         * the job is left for the others. */
+        if (!set_job_paper(&target, job, label))
+        {
+            close_label(label);
+            give_back_jobs(dispatch, &job, 1, FALSE);
+            goto exit;
+        }
+
+        if (!prepare_label(label, &prepare))
+        {
+            ERR("Failed to open %s.\n", job->filename);
+            close_label(label);
+            stop_dispatch(dispatch, job, "it couldn't be prepared");
+            if (!options->keep_going)
+                goto exit;
+
+            continue;
+        }
+
+        if (options->single_job && !dry_run && !document_started)
+        {
+            if (!start_document(&target, "labelprinter"))
+            {
+                close_label(label);
+                give_back_jobs(dispatch, &job, 1, FALSE);
+                goto exit;
+            }
+
+            document_started = TRUE;
+        }
+
+        printed = print_label_copies(
+            &target,
+            label,
+            job->filename,
+            job->copies,
+            !document_started);
+        close_label(label);
+
+        if (!printed)
+        {
+            ERR("Failed to print %s on %s.\n", job->filename, worker->printer_name);
+
+            /* The rest of the document goes back too, but it wasn't their
+             * fault. */
+            if (document_started)
+            {
+                document_started = FALSE;
+                abort_document(&target);
+                give_back_jobs(dispatch, worker->pages, worker->page_count, FALSE);
+                worker->page_count = 0;
+            }
+
+            if (!fail_job(worker, job))
+                goto exit;
+
+            continue;
+        }
+
+        printf(" 🏷️ %s (%s)\n", job->filename, worker->printer_name);
+        worker->failures = 0;
+
+        if (!document_started)
+        {
+            give_back_jobs(dispatch, &job, 1, TRUE);
+        }
+        else if (!append_print_job(&worker->pages, &worker->page_count, &worker->page_capacity, job))
+        {
+            /* Without a record of the page, we can't give it back if the
+             * document fails, so the document has to go now. */
+            give_back_jobs(dispatch, &job, 1, FALSE);
+            goto exit;
+        }
+    }
+
+exit:
+    if (document_started)
+    {
+        abort_document(&target);
+        give_back_jobs(dispatch, worker->pages, worker->page_count, FALSE);
+        worker->page_count = 0;
+    }
+
+    retire_worker(worker);
+
+    /* The jobs have already left the dispatch, so there's nobody to hand
+     * them to if they don't print. */
+    worker->lost_jobs = !stop_job_tracker(target.tracker);
+    close_print_target(&target);
+
+    return 0;
+}
+
+BOOL dispatch_labels(
+    char **printer_names,
+    int printer_count,
+    struct job_source *source,
+    const struct dispatch_options *options)
+{
+    struct dispatch dispatch = {0};
+    HANDLE threads[MAX_DISPATCH_PRINTERS];
+    int thread_count = 0;
+    BOOL lost_jobs = FALSE;
+    BOOL ret = FALSE;
+
+    if (printer_count > MAX_DISPATCH_PRINTERS)
+    {
+        ERR("Can't print to more than %d printers at once.\n", MAX_DISPATCH_PRINTERS);
+        return FALSE;
+    }
+
+    dispatch.source = source;
+    dispatch.options = options;
+    InitializeCriticalSection(&dispatch.lock);
+    InitializeConditionVariable(&dispatch.changed);
+
+    dispatch.workers = (struct dispatch_worker *)calloc(printer_count, sizeof(struct dispatch_worker));
+    if (dispatch.workers == NULL)
+    {
+        ERR("Failed to allocate memory for print dispatch.\n");
+        goto exit;
+    }
+
+    /* Every printer counts as going until its thread says otherwise, so no
+     * jobs are turned away before they've all started. */
+    dispatch.worker_count = printer_count;
+    for (int i = 0; i < printer_count; i++)
+    {
+        dispatch.workers[i].dispatch = &dispatch;
+        dispatch.workers[i].printer_name = printer_names[i];
+        dispatch.workers[i].active = TRUE;
+    }
+
+    for (int i = 0; i < printer_count; i++)
+    {
+        dispatch.workers[i].thread = CreateThread(NULL, 0, dispatch_worker, &dispatch.workers[i], 0, NULL);
+        if (dispatch.workers[i].thread == NULL)
+        {
+            ERR("Failed to start a thread for %s.\n", printer_names[i]);
+            retire_worker(&dispatch.workers[i]);
+            continue;
+        }
+
+        threads[thread_count++] = dispatch.workers[i].thread;
+    }
+
+    DBG("Dispatching labels to %d printers\n", thread_count);
+
+    if (thread_count > 0)
+    {
+        WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+    }
+
+    /* Anything still waiting was meant for printers that dropped out. */
+    if (dispatch.waiting_count > 0 && !dispatch.stopping)
+    {
+        ERR("%d labels couldn't be printed on any printer.\n", dispatch.waiting_count);
+
+        if (options->keep_going)
+        {
+            for (int i = 0; i < dispatch.waiting_count; i++)
+                record_failed_job(dispatch.waiting[i], "no printer could print it");
+        }
+    }
+
+    if (!dispatch.exhausted && !dispatch.stopping)
+    {
+        ERR("Every printer dropped out before the batch was finished.\n");
+    }
+
+    for (int i = 0; i < printer_count; i++)
+    {
+        if (dispatch.workers[i].lost_jobs)
+        {
+            ERR("Some labels sent to %s didn't print.\n", printer_names[i]);
+            lost_jobs = TRUE;
+        }
+    }
+
+    /* Jobs we kept going without are on the failure list, and count as seen
+     * to. */
+    ret = !lost_jobs &&
+          dispatch.exhausted &&
+          (dispatch.waiting_count == 0 || options->keep_going) &&
+          !dispatch.stopping &&
+          !source->failed;
+
+exit:
+    for (int i = 0; i < thread_count; i++)
+        CloseHandle(threads[i]);
+
+    for (int i = 0; i < dispatch.waiting_count; i++)
+        free_print_job(dispatch.waiting[i]);
+
+    if (dispatch.workers != NULL)
+    {
+        for (int i = 0; i < printer_count; i++)
+            free(dispatch.workers[i].pages);
+    }
+
+    DeleteCriticalSection(&dispatch.lock);
+
+    free(dispatch.workers);
+    free(dispatch.waiting);
+
+    return ret;
+}
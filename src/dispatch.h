@@ -0,0 +1,78 @@
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include <windows.h>
+
+#include "job.h"
+
+/* Spreads one batch of labels across several printers. Each printer gets its
+ * own thread and printer context, and takes the next label whenever it's
+ * ready for one, so a slow printer simply ends up printing fewer of them. */
+
+/* Each printer's thread is waited on together, which bounds how many there
+ * can be. */
+#define MAX_DISPATCH_PRINTERS (MAXIMUM_WAIT_OBJECTS)
+
+/* How every printer in a dispatch is set up. */
+struct dispatch_options
+{
+    /* The paper size to print on, or `NULL` for each printer's default. */
+    const char *paper_size_name;
+    BOOL landscape;
+    BOOL refresh_printer_cache;
+
+    /* Switch each printer's paper to suit each label. */
+    BOOL auto_paper;
+
+    /* Print each printer's share of the batch as one document. */
+    BOOL single_job;
+
+    /* How many copies of each page the printers' drivers should print, when
+     * every job wants the same number. */
+    int copies;
+
+    /* Prescale labels to each printer's resolution. */
+    BOOL prescale;
+
+    /* Send only the inked part of each label. */
+    BOOL crop;
+
+    /* Follow each printer's jobs through to the printer, with at most this
+     * many in its spooler at once, or 0 not to. */
+    int max_in_flight;
+
+    /* How many more times to try a label the spooler turns away. */
+    int retries;
+
+    /* Send tall labels in bands of this many rows, or 0 to send them whole. */
+    int band_rows;
+
+    /* Skip labels that can't be printed anywhere, rather than stopping the
+     * batch, and record them with `record_failed_job()`. */
+    BOOL keep_going;
+};
+
+/**
+ * @brief Print a batch of labels across several printers.
+ *
+ * Labels that fail to print are handed to another printer, and a label that
+ * fails on two printers is given up on. A printer that fails two labels in a
+ * row takes no more. Jobs that ask for a printer only go to that
+ * one. Files that can't be opened stop the batch, unless the options say to
+ * keep going.
+ *
+ * @param printer_names The printers to print to.
+ * @param printer_count The number of printers.
+ * @param source Where the jobs come from. Their order across the printers
+ * isn't preserved.
+ * @param options How to set up the printers.
+ * @return `TRUE` if every label was printed, or recorded with
+ * `record_failed_job()` when keeping going.
+ */
+BOOL dispatch_labels(
+    char **printer_names,
+    int printer_count,
+    struct job_source *source,
+    const struct dispatch_options *options);
+
+#endif /* DISPATCH_H */
@@ -0,0 +1,76 @@
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <windows.h>
+
+#include "failure_list.h"
+#include "job.h"
+#include "log.h"
+#include "manifest.h"
+
+static SRWLOCK failure_lock = SRWLOCK_INIT;
+static FILE *failure_file;
+static const char *failure_path;
+static int failure_count;
+
+BOOL failure_list_open(const char *path)
+{
+    failure_file = fopen(path, "w");
+    if (failure_file == NULL)
+    {
+        ERR("Failed to open %s.\n", path);
+        return FALSE;
+    }
+
+    failure_path = path;
+
+    return TRUE;
+}
+
+void record_failed_job(const struct print_job *job, const char *reason)
+{
+    AcquireSRWLockExclusive(&failure_lock);
+
+    printf(" ⚠️ Skipping %s: %s\n", job->filename, reason);
+    failure_count++;
+
+    /* Written as we go, so the list is still there if the run is killed. */
+    if (failure_file != NULL)
+    {
+        if (!write_manifest(failure_file, job) || fflush(failure_file) != 0)
+            ERR("Failed to write %s to %s.\n", job->filename, failure_path);
+    }
+
+    ReleaseSRWLockExclusive(&failure_lock);
+}
+
+int failed_job_count(void)
+{
+    int count;
+
+    AcquireSRWLockShared(&failure_lock);
+    count = failure_count;
+    ReleaseSRWLockShared(&failure_lock);
+
+    return count;
+}
+
+void failure_list_close(void)
+{
+    AcquireSRWLockExclusive(&failure_lock);
+
+    if (failure_count > 0)
+    {
+        if (failure_path != NULL)
+            printf(" ⚠️ %d labels didn't print, listed in %s\n", failure_count, failure_path);
+        else
+            printf(" ⚠️ %d labels didn't print\n", failure_count);
+    }
+
+    if (failure_file != NULL)
+        fclose(failure_file);
+
+    failure_file = NULL;
+
+    ReleaseSRWLockExclusive(&failure_lock);
+}
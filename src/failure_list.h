@@ -0,0 +1,42 @@
+#ifndef FAILURE_LIST_H
+#define FAILURE_LIST_H
+
+#include <windows.h>
+
+#include "job.h"
+
+/* Keeps track of the jobs in a batch that didn't print, so the rest of the
+ * batch can carry on without them. They can be written out as a manifest,
+ * for a later run to print just those. Safe to use from any thread. */
+
+/**
+ * @brief Start writing failed jobs to a file, as manifest lines.
+ *
+ * @param path The file to write to. It's replaced if it exists, and left
+ * empty if nothing fails.
+ * @return `TRUE` if the file was opened.
+ */
+BOOL failure_list_open(const char *path);
+
+/**
+ * @brief Record a job that didn't print.
+ *
+ * @param job The job. The caller still owns it.
+ * @param reason Why it didn't print, for the user.
+ */
+void record_failed_job(const struct print_job *job, const char *reason);
+
+/**
+ * @brief Count the jobs that didn't print so far.
+ *
+ * @return The number of jobs recorded with `record_failed_job()`.
+ */
+int failed_job_count(void);
+
+/**
+ * @brief Report on the jobs that didn't print, and close the file, if there
+ * is one.
+ */
+void failure_list_close(void);
+
+#endif /* FAILURE_LIST_H */
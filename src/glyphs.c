@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "canvas.h"
+#include "glyphs.h"
+#include "log.h"
+
+/* The most characters in one line of text, with its terminator. */
+#define MAX_TEXT_LENGTH (512)
+
+/* Printable ASCII covers nearly every serial number and asset tag, so it's
+ * rasterized up front rather than one missed lookup at a time. */
+#define FIRST_COMMON_GLYPH (0x20)
+#define LAST_COMMON_GLYPH (0x7E)
+
+#define INITIAL_GLYPH_SLOTS (256)
+
+struct glyph
+{
+    UINT code;
+
+    /* The font doesn't have it. It's kept anyway, so it's only ever looked
+     * for once, and has no size. */
+    BOOL missing;
+
+    /* How far the pen moves after this glyph. */
+    int advance;
+
+    /* Where the image's top left goes, from the pen's position at the top
+     * of the line. */
+    int left, top;
+
+    int width, height;
+    size_t stride;
+    BYTE bits[];
+};
+
+struct glyph_atlas
+{
+    char *face;
+    int height;
+    BOOL bold;
+
+    /* Used for rasterizing, only under the exclusive lock. */
+    HDC context;
+    HFONT font;
+    HGDIOBJ old_font;
+    int ascent;
+
+    /* An open-addressed table of glyphs by code point, never more than
+     * half full. Glyphs are never moved or freed until the atlas is, so
+     * they can be used after the lock's released. */
+    struct glyph **slots;
+    int capacity;
+    int count;
+
+    SRWLOCK lock;
+};
+
+static const MAT2 identity = {{0, 1}, {0, 0}, {0, 0}, {0, 1}};
+
+/**
+ * @brief Find a glyph's slot in the table, or the empty slot it'd go in.
+ */
+static struct glyph **find_slot(struct glyph **slots, int capacity, UINT code)
+{
+    int i = (int)(code * 2654435761u) & (capacity - 1);
+
+    while (slots[i] != NULL && slots[i]->code != code)
+        i = (i + 1) & (capacity - 1);
+
+    return &slots[i];
+}
+
+/**
+ * @brief Add a glyph to the table, doubling it first if it'd be more than
+ * half full. Call with the exclusive lock held.
+ *
+ * @return `FALSE` if the table couldn't grow.
+ */
+static BOOL add_glyph(struct glyph_atlas *atlas, struct glyph *glyph)
+{
+    if ((atlas->count + 1) * 2 > atlas->capacity)
+    {
+        int capacity = atlas->capacity > 0 ? atlas->capacity * 2 : INITIAL_GLYPH_SLOTS;
+        struct glyph **slots = (struct glyph **)calloc(capacity, sizeof(struct glyph *));
+        if (slots == NULL)
+        {
+            ERR("Failed to allocate memory for glyphs.\n");
+            return FALSE;
+        }
+
+        for (int i = 0; i < atlas->capacity; i++)
+        {
+            if (atlas->slots[i] != NULL)
+                *find_slot(slots, capacity, atlas->slots[i]->code) = atlas->slots[i];
+        }
+
+        free(atlas->slots);
+        atlas->slots = slots;
+        atlas->capacity = capacity;
+    }
+
+    *find_slot(atlas->slots, atlas->capacity, glyph->code) = glyph;
+    atlas->count++;
+
+    return TRUE;
+}
+
+/**
+ * @brief Remember that the font doesn't have a glyph, so the next lookup
+ * doesn't have to ask GDI again. Call with the exclusive lock held.
+ */
+static void add_missing_glyph(struct glyph_atlas *atlas, UINT code)
+{
+    struct glyph *glyph = (struct glyph *)calloc(1, sizeof(struct glyph));
+
+    if (glyph == NULL)
+        return;
+
+    glyph->code = code;
+    glyph->missing = TRUE;
+
+    if (!add_glyph(atlas, glyph))
+        free(glyph);
+}
+
+/**
+ * @brief Rasterize a glyph with GDI. Call with the exclusive lock held.
+ *
+ * @return The glyph, or `NULL` if the font doesn't have it.
+ */
+static struct glyph *rasterize_glyph(struct glyph_atlas *atlas, UINT code)
+{
+    GLYPHMETRICS metrics;
+    struct glyph *glyph;
+    DWORD size;
+
+    /* GDI takes the whole code point, even beyond the BMP. */
+    size = GetGlyphOutlineW(atlas->context, code, GGO_BITMAP, &metrics, 0, NULL, &identity);
+    if (size == GDI_ERROR)
+    {
+        add_missing_glyph(atlas, code);
+        return NULL;
+    }
+
+    glyph = (struct glyph *)calloc(1, sizeof(struct glyph) + size);
+    if (glyph == NULL)
+    {
+        ERR("Failed to allocate memory for glyph.\n");
+        return NULL;
+    }
+
+    glyph->code = code;
+    glyph->advance = metrics.gmCellIncX;
+
+    /* Blank glyphs, like spaces, have a size of 0 and nothing to copy. */
+    if (size > 0)
+    {
+        if (GetGlyphOutlineW(atlas->context, code, GGO_BITMAP, &metrics, size, glyph->bits, &identity) == GDI_ERROR)
+        {
+            free(glyph);
+            add_missing_glyph(atlas, code);
+            return NULL;
+        }
+
+        glyph->left = metrics.gmptGlyphOrigin.x;
+        glyph->top = atlas->ascent - metrics.gmptGlyphOrigin.y;
+        glyph->width = metrics.gmBlackBoxX;
+        glyph->height = metrics.gmBlackBoxY;
+        glyph->stride = (((size_t)metrics.gmBlackBoxX + 31) / 32) * 4;
+    }
+
+    if (!add_glyph(atlas, glyph))
+    {
+        free(glyph);
+        return NULL;
+    }
+
+    return glyph;
+}
+
+/**
+ * @brief Get a glyph, rasterizing it if it isn't in the atlas yet.
+ *
+ * @return The glyph, or `NULL` if the font doesn't have it.
+ */
+static const struct glyph *get_glyph(struct glyph_atlas *atlas, UINT code)
+{
+    struct glyph *glyph;
+
+    AcquireSRWLockShared(&atlas->lock);
+    glyph = *find_slot(atlas->slots, atlas->capacity, code);
+    ReleaseSRWLockShared(&atlas->lock);
+
+    if (glyph == NULL)
+    {
+        /* Someone else might have got there while we let go of the lock. */
+        AcquireSRWLockExclusive(&atlas->lock);
+        glyph = *find_slot(atlas->slots, atlas->capacity, code);
+        if (glyph == NULL)
+            glyph = rasterize_glyph(atlas, code);
+        ReleaseSRWLockExclusive(&atlas->lock);
+    }
+
+    if (glyph == NULL || glyph->missing)
+        return NULL;
+
+    return glyph;
+}
+
+struct glyph_atlas *open_glyph_atlas(const char *face, int height, BOOL bold)
+{
+    struct glyph_atlas *atlas = NULL;
+    WCHAR wide_face[LF_FACESIZE];
+    TEXTMETRICW metrics;
+
+    atlas = (struct glyph_atlas *)calloc(1, sizeof(struct glyph_atlas));
+    if (atlas == NULL)
+    {
+        ERR("Failed to allocate memory for glyph atlas.\n");
+        return NULL;
+    }
+
+    InitializeSRWLock(&atlas->lock);
+    atlas->height = height;
+    atlas->bold = bold;
+
+    atlas->face = _strdup(face);
+    atlas->slots = (struct glyph **)calloc(INITIAL_GLYPH_SLOTS, sizeof(struct glyph *));
+    if (atlas->face == NULL || atlas->slots == NULL)
+    {
+        ERR("Failed to allocate memory for glyph atlas.\n");
+        goto exit;
+    }
+
+    atlas->capacity = INITIAL_GLYPH_SLOTS;
+
+    if (MultiByteToWideChar(CP_UTF8, 0, face, -1, wide_face, LF_FACESIZE) == 0)
+    {
+        ERR("Invalid font name: %s\n", face);
+        goto exit;
+    }
+
+    atlas->context = CreateCompatibleDC(NULL);
+    if (atlas->context == NULL)
+    {
+        ERR("Failed to create a context for drawing text.\n");
+        goto exit;
+    }
+
+    /* A negative height asks for the size of the characters themselves,
+     * like a point size, rather than of the whole cell. Glyphs come out as
+     * plain 1bpp, so there's no antialiasing to ask for. */
+    atlas->font = CreateFontW(
+        -height, 0, 0, 0,
+        bold ? FW_BOLD : FW_NORMAL,
+        FALSE, FALSE, FALSE,
+        DEFAULT_CHARSET,
+        OUT_DEFAULT_PRECIS,
+        CLIP_DEFAULT_PRECIS,
+        NONANTIALIASED_QUALITY,
+        DEFAULT_PITCH,
+        wide_face);
+    if (atlas->font == NULL)
+    {
+        ERR("Failed to create font %s.\n", face);
+        goto exit;
+    }
+
+    atlas->old_font = SelectObject(atlas->context, atlas->font);
+    if (!GetTextMetricsW(atlas->context, &metrics))
+    {
+        ERR("Failed to get metrics for font %s.\n", face);
+        goto exit;
+    }
+
+    atlas->ascent = metrics.tmAscent;
+
+    AcquireSRWLockExclusive(&atlas->lock);
+    for (UINT code = FIRST_COMMON_GLYPH; code <= LAST_COMMON_GLYPH; code++)
+        rasterize_glyph(atlas, code);
+    ReleaseSRWLockExclusive(&atlas->lock);
+
+    DBG("Font %s at %d px: %d glyphs\n", face, height, atlas->count);
+
+    return atlas;
+
+exit:
+    close_glyph_atlas(atlas);
+
+    return NULL;
+}
+
+BOOL glyph_atlas_matches(const struct glyph_atlas *atlas, const char *face, int height, BOOL bold)
+{
+    return atlas->height == height &&
+           atlas->bold == bold &&
+           _stricmp(atlas->face, face) == 0;
+}
+
+BOOL draw_text(
+    struct canvas *canvas,
+    struct glyph_atlas *atlas,
+    int x,
+    int y,
+    enum text_align align,
+    const char *text)
+{
+    WCHAR wide_text[MAX_TEXT_LENGTH];
+    const struct glyph *glyphs[MAX_TEXT_LENGTH];
+    int length, glyph_count = 0;
+    int width = 0;
+
+    if (*text == '\0')
+        return TRUE;
+
+    /* The count includes the terminator. */
+    length = MultiByteToWideChar(CP_UTF8, 0, text, -1, wide_text, MAX_TEXT_LENGTH);
+    if (length == 0)
+    {
+        if (GetLastError() == ERROR_INSUFFICIENT_BUFFER)
+        {
+            ERR("Text is longer than %d characters: %s\n", MAX_TEXT_LENGTH - 1, text);
+        }
+        else
+        {
+            ERR("Invalid text: %s\n", text);
+        }
+
+        return FALSE;
+    }
+
+    length--;
+
+    for (int i = 0; i < length; i++)
+    {
+        const struct glyph *glyph;
+        UINT code = wide_text[i];
+
+        /* Characters beyond the BMP take two units, but they're one glyph. */
+        if (code >= 0xD800 && code <= 0xDBFF &&
+            wide_text[i + 1] >= 0xDC00 && wide_text[i + 1] <= 0xDFFF)
+        {
+            code = 0x10000 + ((code - 0xD800) << 10) + (wide_text[i + 1] - 0xDC00);
+            i++;
+        }
+
+        glyph = get_glyph(atlas, code);
+        if (glyph == NULL)
+            glyph = get_glyph(atlas, '?');
+        if (glyph != NULL)
+            width += glyph->advance;
+
+        glyphs[glyph_count++] = glyph;
+    }
+
+    if (align == TEXT_ALIGN_CENTER)
+        x -= width / 2;
+    else if (align == TEXT_ALIGN_RIGHT)
+        x -= width;
+
+    for (int i = 0; i < glyph_count; i++)
+    {
+        if (glyphs[i] == NULL)
+            continue;
+
+        if (glyphs[i]->width > 0)
+        {
+            canvas_draw_bits(
+                canvas,
+                x + glyphs[i]->left,
+                y + glyphs[i]->top,
+                glyphs[i]->bits,
+                glyphs[i]->stride,
+                glyphs[i]->width,
+                glyphs[i]->height);
+        }
+
+        x += glyphs[i]->advance;
+    }
+
+    return TRUE;
+}
+
+void close_glyph_atlas(struct glyph_atlas *atlas)
+{
+    if (atlas == NULL)
+        return;
+
+    for (int i = 0; i < atlas->capacity; i++)
+        free(atlas->slots[i]);
+
+    free(atlas->slots);
+
+    if (atlas->old_font != NULL)
+        SelectObject(atlas->context, atlas->old_font);
+
+    if (atlas->font != NULL)
+        DeleteObject(atlas->font);
+
+    if (atlas->context != NULL)
+        DeleteDC(atlas->context);
+
+    free(atlas->face);
+    free(atlas);
+}
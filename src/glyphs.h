@@ -0,0 +1,65 @@
+#ifndef GLYPHS_H
+#define GLYPHS_H
+
+#include <windows.h>
+
+#include "canvas.h"
+
+/* Draws text onto labels from a cache of glyphs, each rasterized by GDI the
+ * first time it's needed and then copied straight from memory. Safe to use
+ * from several threads at once. */
+struct glyph_atlas;
+
+enum text_align
+{
+    TEXT_ALIGN_LEFT,
+    TEXT_ALIGN_CENTER,
+    TEXT_ALIGN_RIGHT,
+};
+
+/**
+ * @brief Create a glyph cache for one font at one size.
+ *
+ * @param face The font's name, in UTF-8.
+ * @param height The font's size, in pixels of the label it's drawn on.
+ * @param bold `TRUE` for the bold weight.
+ * @return The atlas, or `NULL` on failure. Release it with
+ * `close_glyph_atlas()`.
+ */
+struct glyph_atlas *open_glyph_atlas(const char *face, int height, BOOL bold);
+
+/**
+ * @brief Check whether an atlas is for a font, so fields can share it.
+ *
+ * @return `TRUE` if the atlas draws that font at that size.
+ */
+BOOL glyph_atlas_matches(const struct glyph_atlas *atlas, const char *face, int height, BOOL bold);
+
+/**
+ * @brief Draw a line of text onto a canvas.
+ *
+ * @param canvas The canvas to draw on.
+ * @param atlas The font to draw in.
+ * @param x Where the text starts, ends or is centred, depending on `align`.
+ * @param y Where the top of the text goes.
+ * @param align How the text lines up with `x`.
+ * @param text The text, in UTF-8.
+ * @return `TRUE` if the text was drawn. Characters the font doesn't have
+ * come out as `?`.
+ */
+BOOL draw_text(
+    struct canvas *canvas,
+    struct glyph_atlas *atlas,
+    int x,
+    int y,
+    enum text_align align,
+    const char *text);
+
+/**
+ * @brief Release an atlas and every glyph in it.
+ *
+ * @param atlas The atlas to release. May be `NULL`.
+ */
+void close_glyph_atlas(struct glyph_atlas *atlas);
+
+#endif /* GLYPHS_H */
@@ -0,0 +1,262 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "job.h"
+#include "label.h"
+#include "label_cache.h"
+#include "log.h"
+#include "manifest.h"
+#include "print.h"
+#include "printer.h"
+#include "template.h"
+
+struct print_job *new_print_job(
+    const char *filename,
+    const char *paper_size_name,
+    const char *printer_name)
+{
+    size_t filename_size = strlen(filename) + 1;
+    size_t paper_size_name_size = paper_size_name != NULL ? strlen(paper_size_name) + 1 : 0;
+    size_t printer_name_size = printer_name != NULL ? strlen(printer_name) + 1 : 0;
+    struct print_job *job;
+    char *strings;
+
+    /* The strings live straight after the job, so it's one allocation. */
+    job = (struct print_job *)malloc(
+        sizeof(struct print_job) + filename_size + paper_size_name_size + printer_name_size);
+    if (job == NULL)
+    {
+        ERR("Failed to allocate memory for job.\n");
+        return NULL;
+    }
+
+    memset(job, 0, sizeof(*job));
+    job->copies = 1;
+    job->orientation = JOB_ORIENTATION_DEFAULT;
+
+    strings = (char *)(job + 1);
+
+    job->filename = strings;
+    memcpy(strings, filename, filename_size);
+    strings += filename_size;
+
+    if (paper_size_name != NULL)
+    {
+        job->paper_size_name = strings;
+        memcpy(strings, paper_size_name, paper_size_name_size);
+        strings += paper_size_name_size;
+    }
+
+    if (printer_name != NULL)
+    {
+        job->printer_name = strings;
+        memcpy(strings, printer_name, printer_name_size);
+    }
+
+    return job;
+}
+
+void free_print_job(struct print_job *job)
+{
+    if (job == NULL)
+        return;
+
+    free(job->values);
+    free(job);
+}
+
+BOOL append_print_job(
+    struct print_job ***jobs,
+    int *count,
+    int *capacity,
+    struct print_job *job)
+{
+    if (*count == *capacity)
+    {
+        int new_capacity = *capacity > 0 ? *capacity * 2 : 16;
+        struct print_job **new_jobs = (struct print_job **)realloc(
+            *jobs, new_capacity * sizeof(struct print_job *));
+        if (new_jobs == NULL)
+        {
+            ERR("Failed to allocate memory for jobs.\n");
+            return FALSE;
+        }
+
+        *jobs = new_jobs;
+        *capacity = new_capacity;
+    }
+
+    (*jobs)[(*count)++] = job;
+
+    return TRUE;
+}
+
+void open_file_job_source(
+    struct job_source *source,
+    char **filenames,
+    int count,
+    int copies)
+{
+    memset(source, 0, sizeof(*source));
+    source->filenames = filenames;
+    source->count = count;
+    source->copies = copies;
+}
+
+BOOL open_manifest_job_source(struct job_source *source, const char *path, int copies)
+{
+    memset(source, 0, sizeof(*source));
+    source->copies = copies;
+
+    source->manifest = open_manifest(path);
+
+    return source->manifest != NULL;
+}
+
+BOOL open_template_job_source(
+    struct job_source *source,
+    const char *template_path,
+    const char *data_path,
+    int copies)
+{
+    memset(source, 0, sizeof(*source));
+    source->copies = copies;
+
+    source->template = open_template(template_path);
+    if (source->template == NULL)
+        return FALSE;
+
+    source->data = open_template_data(source->template, data_path);
+
+    return source->data != NULL;
+}
+
+BOOL next_job(struct job_source *source, struct print_job **job)
+{
+    *job = NULL;
+
+    if (source->failed)
+        return FALSE;
+
+    if (source->data != NULL)
+    {
+        if (!read_template_job(source->data, job))
+        {
+            source->failed = TRUE;
+            return FALSE;
+        }
+
+        if (*job == NULL)
+            return FALSE;
+
+        if ((*job)->copies == 0)
+            (*job)->copies = source->copies;
+
+        return TRUE;
+    }
+
+    if (source->manifest != NULL)
+    {
+        if (!read_manifest(source->manifest, job))
+        {
+            source->failed = TRUE;
+            return FALSE;
+        }
+
+        if (*job == NULL)
+            return FALSE;
+
+        if ((*job)->copies == 0)
+            (*job)->copies = source->copies;
+
+        return TRUE;
+    }
+
+    if (source->next >= source->count)
+        return FALSE;
+
+    *job = new_print_job(source->filenames[source->next], NULL, NULL);
+    if (*job == NULL)
+    {
+        source->failed = TRUE;
+        return FALSE;
+    }
+
+    (*job)->copies = source->copies;
+    source->next++;
+
+    return TRUE;
+}
+
+struct label *open_job_label(const struct job_source *source, const struct print_job *job)
+{
+    if (job->values != NULL)
+        return compose_label(source->template, job);
+
+    return open_cached_label(job->filename);
+}
+
+void close_job_source(struct job_source *source)
+{
+    close_manifest(source->manifest);
+    close_template_data(source->data);
+    close_template(source->template);
+
+    memset(source, 0, sizeof(*source));
+}
+
+BOOL parse_job_copies(const char *value, int *copies)
+{
+    char *end;
+    long number = strtol(value, &end, 10);
+
+    if (end == value || *end != '\0' || number < 1 || number > MAX_JOB_COPIES)
+        return FALSE;
+
+    *copies = (int)number;
+
+    return TRUE;
+}
+
+BOOL parse_job_orientation(const char *value, enum job_orientation *orientation)
+{
+    if (_stricmp(value, "landscape") == 0)
+        *orientation = JOB_ORIENTATION_LANDSCAPE;
+    else if (_stricmp(value, "portrait") == 0)
+        *orientation = JOB_ORIENTATION_PORTRAIT;
+    else
+        return FALSE;
+
+    return TRUE;
+}
+
+BOOL set_job_paper(
+    struct print_target *target,
+    const struct print_job *job,
+    const struct label *label)
+{
+    const struct paper_size *paper_size = target->default_paper_size;
+    BOOL landscape = target->default_landscape;
+
+    if (job->paper_size_name != NULL)
+    {
+        paper_size = find_paper_size(target->paper_table, job->paper_size_name);
+        if (paper_size == NULL)
+        {
+            return FALSE;
+        }
+    }
+    else if (target->auto_paper && job->orientation == JOB_ORIENTATION_DEFAULT)
+    {
+        return fit_print_target(target, label);
+    }
+
+    if (job->orientation != JOB_ORIENTATION_DEFAULT)
+    {
+        landscape = job->orientation == JOB_ORIENTATION_LANDSCAPE;
+    }
+
+    return set_print_target_paper(target, paper_size, landscape);
+}
@@ -0,0 +1,209 @@
+#ifndef JOB_H
+#define JOB_H
+
+#include <windows.h>
+
+#include "label.h"
+#include "print.h"
+
+struct manifest;
+struct template;
+struct template_data;
+
+/* Nobody prints a label this many times over, so it's probably a typo. */
+#define MAX_JOB_COPIES (10000)
+
+enum job_orientation
+{
+    JOB_ORIENTATION_DEFAULT,
+    JOB_ORIENTATION_PORTRAIT,
+    JOB_ORIENTATION_LANDSCAPE,
+};
+
+/* One label to print, and anything about printing it that's different from
+ * the rest of the batch. */
+struct print_job
+{
+    char *filename;
+    int copies;
+
+    /* The paper size to print on, or `NULL` for the batch's. */
+    char *paper_size_name;
+    enum job_orientation orientation;
+
+    /* The printer to print on, or `NULL` for any of them. */
+    char *printer_name;
+
+    /* For labels composed from a template, the row of data that fills it
+     * in, one value per column, and the row's serial number. `values` is
+     * `NULL` for labels from files. */
+    char **values;
+    long serial;
+
+    /* How many printers have failed to print it in a dispatch, and the last
+     * of them, which doesn't get it back. */
+    int failures;
+    const char *failed_printer;
+};
+
+/* Where the jobs in a batch come from: a manifest or a template's data if
+ * there is one, otherwise a list of files. Jobs are read as they're needed, so a batch can be far
+ * bigger than we could hold in memory. Not thread safe. */
+struct job_source
+{
+    struct manifest *manifest;
+
+    /* Rows of data composed onto a template, rather than label files. */
+    struct template *template;
+    struct template_data *data;
+
+    char **filenames;
+    int count;
+    int next;
+
+    /* How many copies of each label to print, unless the job says. */
+    int copies;
+
+    /* Set if the jobs stopped early because the manifest was bad. */
+    BOOL failed;
+};
+
+/**
+ * @brief Make a job, copying its strings.
+ *
+ * @param filename The label file to print.
+ * @param paper_size_name The paper size to print on, or `NULL`.
+ * @param printer_name The printer to print on, or `NULL`.
+ * @return The job, or `NULL` on failure. Release it with `free_print_job()`.
+ */
+struct print_job *new_print_job(
+    const char *filename,
+    const char *paper_size_name,
+    const char *printer_name);
+
+/**
+ * @brief Release a job.
+ *
+ * @param job The job to release. May be `NULL`.
+ */
+void free_print_job(struct print_job *job);
+
+/**
+ * @brief Add a job to a growable list of jobs.
+ *
+ * @param jobs The list, which may start out `NULL`. Release it with `free()`.
+ * @param count The number of jobs in the list.
+ * @param capacity The number of jobs the list has room for.
+ * @param job The job to add. The list doesn't own it.
+ * @return `FALSE` if there wasn't room and we couldn't make any.
+ */
+BOOL append_print_job(
+    struct print_job ***jobs,
+    int *count,
+    int *capacity,
+    struct print_job *job);
+
+/**
+ * @brief Take jobs from a list of files, printed once each with the batch's
+ * settings.
+ *
+ * @param source The source to set up.
+ * @param filenames The files. Must outlive the source.
+ * @param count The number of files.
+ * @param copies How many copies of each to print.
+ */
+void open_file_job_source(
+    struct job_source *source,
+    char **filenames,
+    int count,
+    int copies);
+
+/**
+ * @brief Take jobs from a manifest file.
+ *
+ * @param source The source to set up.
+ * @param path The manifest to read.
+ * @param copies How many copies to print of jobs that don't say.
+ * @return `TRUE` if the manifest was opened. Release the source with
+ * `close_job_source()` either way.
+ */
+BOOL open_manifest_job_source(struct job_source *source, const char *path, int copies);
+
+/**
+ * @brief Take jobs from the rows of a data file, each composed onto a
+ * template.
+ *
+ * @param source The source to set up.
+ * @param template_path The template to compose onto.
+ * @param data_path The data file, with a row for each label.
+ * @param copies How many copies to print of rows that don't say.
+ * @return `TRUE` if the template and data were opened. Release the source
+ * with `close_job_source()` either way.
+ */
+BOOL open_template_job_source(
+    struct job_source *source,
+    const char *template_path,
+    const char *data_path,
+    int copies);
+
+/**
+ * @brief Take the next job.
+ *
+ * @param source The source to take it from.
+ * @param job Set to the job. Release it with `free_print_job()`.
+ * @return `FALSE` once there are no more jobs, or if the next one couldn't
+ * be read, in which case `failed` is set.
+ */
+BOOL next_job(struct job_source *source, struct print_job **job);
+
+/**
+ * @brief Open a job's label, from its file or composed from its template.
+ *
+ * @param source The source the job came from. Composing doesn't touch
+ * anything `next_job()` does, so this can be called from any thread.
+ * @param job The job to open the label for.
+ * @return The label, or `NULL` on failure. Release it with `close_label()`.
+ */
+struct label *open_job_label(const struct job_source *source, const struct print_job *job);
+
+/**
+ * @brief Release a job source.
+ *
+ * @param source The source to release.
+ */
+void close_job_source(struct job_source *source);
+
+/**
+ * @brief Parse the number of copies a job asks for.
+ *
+ * @param value The value to parse.
+ * @param copies Set to the number of copies.
+ * @return `FALSE` unless the value is a number from 1 to `MAX_JOB_COPIES`.
+ */
+BOOL parse_job_copies(const char *value, int *copies);
+
+/**
+ * @brief Parse the orientation a job asks for: `landscape` or `portrait`.
+ *
+ * @param value The value to parse.
+ * @param orientation Set to the orientation.
+ * @return `FALSE` if the value isn't an orientation.
+ */
+BOOL parse_job_orientation(const char *value, enum job_orientation *orientation);
+
+/**
+ * @brief Switch a print target to the paper a job asks for. Jobs that don't
+ * ask for anything get the target's own paper, or the best fit for the label
+ * if the target picks paper for each label. Only call this between pages.
+ *
+ * @param target The target to switch.
+ * @param job The job about to be printed.
+ * @param label The job's label.
+ * @return `TRUE` if the target is ready to print the job.
+ */
+BOOL set_job_paper(
+    struct print_target *target,
+    const struct print_job *job,
+    const struct label *label);
+
+#endif /* JOB_H */
@@ -0,0 +1,429 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <winspool.h>
+
+#include "job_tracker.h"
+#include "log.h"
+#include "metrics.h"
+
+/* Change notifications can be missed, or not supported by the port monitor,
+ * so we also look at the jobs this often regardless. */
+#define JOB_POLL_INTERVAL_MS (1000)
+
+#define JOB_NAME_SIZE (64)
+
+/* Anything that'll keep a job from printing until someone does something. */
+#define JOB_STATUS_PROBLEMS (JOB_STATUS_ERROR | JOB_STATUS_OFFLINE | JOB_STATUS_PAPEROUT | \
+                             JOB_STATUS_USER_INTERVENTION | JOB_STATUS_BLOCKED_DEVQ)
+
+struct tracked_job
+{
+    DWORD id;
+    char name[JOB_NAME_SIZE];
+    LONGLONG started;
+
+    /* The problems we've already told the user about. */
+    DWORD problems;
+};
+
+struct job_tracker
+{
+    char *printer_name;
+
+    struct printer_metrics *metrics;
+
+    /* Borrowed from the session, which closes it. */
+    HANDLE printer;
+    HANDLE change;
+    HANDLE wake;
+    HANDLE thread;
+    LARGE_INTEGER frequency;
+
+    /* Slots are reserved before a document starts, and held until its job
+     * is finished with. */
+    int max_in_flight;
+    int in_flight;
+
+    struct tracked_job *pending;
+    int pending_count;
+    int pending_capacity;
+
+    /* The background thread's own copy of the pending jobs, so it can ask
+     * the spooler about them without holding the lock. */
+    struct tracked_job *polling;
+    int polling_capacity;
+    void *info;
+    DWORD info_size;
+
+    double *latencies;
+    int latency_capacity;
+    int printed;
+    int failed;
+
+    BOOL stopping;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE slot_free;
+};
+
+/**
+ * @brief Ask the spooler about a job.
+ *
+ * @return The job's details, or `NULL` if the spooler has no such job.
+ */
+static JOB_INFO_1 *get_job_info(struct job_tracker *tracker, DWORD id)
+{
+    DWORD needed = 0;
+
+    while (!GetJob(tracker->printer, id, 1, (LPBYTE)tracker->info, tracker->info_size, &needed))
+    {
+        void *info;
+
+        if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+            return NULL;
+
+        info = realloc(tracker->info, needed);
+        if (info == NULL)
+            return NULL;
+
+        tracker->info = info;
+        tracker->info_size = needed;
+    }
+
+    return (JOB_INFO_1 *)tracker->info;
+}
+
+/**
+ * @brief Record that a job's done with, and give up its slot. Must be called
+ * with the lock held.
+ */
+static void finish_job(struct job_tracker *tracker, int index, BOOL printed, LONGLONG now)
+{
+    struct tracked_job *job = &tracker->pending[index];
+    double latency = (double)(now - job->started) / tracker->frequency.QuadPart;
+
+    if (printed)
+    {
+        printf(" 📬 %s printed after %.1f s\n", job->name, latency);
+
+        if (tracker->printed == tracker->latency_capacity)
+        {
+            int capacity = tracker->latency_capacity > 0 ? tracker->latency_capacity * 2 : 64;
+            double *latencies = (double *)realloc(tracker->latencies, capacity * sizeof(double));
+            if (latencies != NULL)
+            {
+                tracker->latencies = latencies;
+                tracker->latency_capacity = capacity;
+            }
+        }
+
+        if (tracker->printed < tracker->latency_capacity)
+            tracker->latencies[tracker->printed] = latency;
+
+        tracker->printed++;
+    }
+    else
+    {
+        ERR("%s was deleted before it printed.\n", job->name);
+        tracker->failed++;
+    }
+
+    metrics_job_finished(tracker->metrics, printed);
+
+    tracker->pending[index] = tracker->pending[--tracker->pending_count];
+    tracker->in_flight--;
+    WakeAllConditionVariable(&tracker->slot_free);
+}
+
+/**
+ * @brief Check on every pending job.
+ */
+static void poll_jobs(struct job_tracker *tracker)
+{
+    int count;
+    LARGE_INTEGER now;
+
+    EnterCriticalSection(&tracker->lock);
+    if (tracker->pending_count > tracker->polling_capacity)
+    {
+        struct tracked_job *polling = (struct tracked_job *)realloc(
+            tracker->polling, tracker->pending_count * sizeof(struct tracked_job));
+        if (polling != NULL)
+        {
+            tracker->polling = polling;
+            tracker->polling_capacity = tracker->pending_count;
+        }
+    }
+
+    count = min(tracker->pending_count, tracker->polling_capacity);
+    memcpy(tracker->polling, tracker->pending, count * sizeof(struct tracked_job));
+    LeaveCriticalSection(&tracker->lock);
+
+    for (int i = 0; i < count; i++)
+    {
+        struct tracked_job *job = &tracker->polling[i];
+        JOB_INFO_1 *info = get_job_info(tracker, job->id);
+        BOOL finished = FALSE, printed = FALSE;
+        DWORD problems = 0;
+
+        /* Unless the printer's set to keep printed documents, a job that's
+         * printed is just gone. One that vanished while it was stuck was
+         * more likely cancelled. */
+        if (info == NULL)
+        {
+            finished = TRUE;
+            printed = (job->problems & JOB_STATUS_PROBLEMS) == 0;
+        }
+        else if (info->Status & JOB_STATUS_PRINTED)
+        {
+            finished = TRUE;
+            printed = TRUE;
+        }
+        else if (info->Status & JOB_STATUS_DELETED)
+        {
+            finished = TRUE;
+        }
+        else
+        {
+            problems = info->Status & JOB_STATUS_PROBLEMS;
+            if (problems & ~job->problems)
+            {
+                printf(
+                    " ⚠️ %s is stuck: %s\n",
+                    job->name,
+                    info->pStatus != NULL ? info->pStatus : (problems & JOB_STATUS_PAPEROUT) ? "out of paper"
+                                                          : (problems & JOB_STATUS_OFFLINE)  ? "printer offline"
+                                                                                             : "printer error");
+            }
+        }
+
+        QueryPerformanceCounter(&now);
+
+        EnterCriticalSection(&tracker->lock);
+        for (int j = 0; j < tracker->pending_count; j++)
+        {
+            if (tracker->pending[j].id != job->id)
+                continue;
+
+            if (finished)
+                finish_job(tracker, j, printed, now.QuadPart);
+            else
+                tracker->pending[j].problems |= problems;
+
+            break;
+        }
+        LeaveCriticalSection(&tracker->lock);
+    }
+}
+
+static DWORD WINAPI job_tracker_thread(LPVOID param)
+{
+    struct job_tracker *tracker = (struct job_tracker *)param;
+    HANDLE handles[2] = {tracker->wake, tracker->change};
+    DWORD handle_count = tracker->change != INVALID_HANDLE_VALUE ? 2 : 1;
+
+    for (;;)
+    {
+        BOOL done;
+        DWORD result = WaitForMultipleObjects(handle_count, handles, FALSE, JOB_POLL_INTERVAL_MS);
+
+        /* The notification has to be re-armed each time it fires. */
+        if (result == WAIT_OBJECT_0 + 1)
+            FindNextPrinterChangeNotification(tracker->change, NULL, NULL, NULL);
+
+        poll_jobs(tracker);
+
+        EnterCriticalSection(&tracker->lock);
+        done = tracker->stopping && tracker->pending_count == 0;
+        LeaveCriticalSection(&tracker->lock);
+
+        if (done)
+            break;
+    }
+
+    return 0;
+}
+
+static void free_job_tracker(struct job_tracker *tracker)
+{
+    if (tracker->change != INVALID_HANDLE_VALUE)
+        FindClosePrinterChangeNotification(tracker->change);
+
+    if (tracker->wake != NULL)
+        CloseHandle(tracker->wake);
+
+    DeleteCriticalSection(&tracker->lock);
+
+    free(tracker->pending);
+    free(tracker->polling);
+    free(tracker->info);
+    free(tracker->latencies);
+    free(tracker);
+}
+
+struct job_tracker *start_job_tracker(const struct printer_session *session, int max_in_flight)
+{
+    struct job_tracker *tracker;
+
+    tracker = (struct job_tracker *)calloc(1, sizeof(struct job_tracker));
+    if (tracker == NULL)
+    {
+        ERR("Failed to allocate memory for job tracker.\n");
+        return NULL;
+    }
+
+    tracker->printer_name = session->printer_name;
+    tracker->printer = session->handle;
+    tracker->metrics = metrics_printer(session->printer_name);
+    tracker->max_in_flight = max_in_flight;
+    tracker->change = INVALID_HANDLE_VALUE;
+    QueryPerformanceFrequency(&tracker->frequency);
+    InitializeCriticalSection(&tracker->lock);
+    InitializeConditionVariable(&tracker->slot_free);
+
+    tracker->change = FindFirstPrinterChangeNotification(tracker->printer, PRINTER_CHANGE_JOB, 0, NULL);
+    if (tracker->change == INVALID_HANDLE_VALUE)
+    {
+        DBG("No job notifications from %s, polling instead\n", tracker->printer_name);
+    }
+
+    tracker->wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (tracker->wake == NULL)
+    {
+        ERR("Failed to create job tracker event.\n");
+        goto exit;
+    }
+
+    tracker->thread = CreateThread(NULL, 0, job_tracker_thread, tracker, 0, NULL);
+    if (tracker->thread == NULL)
+    {
+        ERR("Failed to start job tracker thread.\n");
+        goto exit;
+    }
+
+    return tracker;
+
+exit:
+    free_job_tracker(tracker);
+
+    return NULL;
+}
+
+LONGLONG reserve_job_slot(struct job_tracker *tracker)
+{
+    LARGE_INTEGER now;
+
+    EnterCriticalSection(&tracker->lock);
+    while (tracker->in_flight >= tracker->max_in_flight)
+    {
+        SleepConditionVariableCS(&tracker->slot_free, &tracker->lock, INFINITE);
+    }
+
+    tracker->in_flight++;
+    LeaveCriticalSection(&tracker->lock);
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+void release_job_slot(struct job_tracker *tracker)
+{
+    EnterCriticalSection(&tracker->lock);
+    tracker->in_flight--;
+    WakeAllConditionVariable(&tracker->slot_free);
+    LeaveCriticalSection(&tracker->lock);
+}
+
+void track_job(struct job_tracker *tracker, DWORD job_id, const char *name, LONGLONG started)
+{
+    struct tracked_job *job;
+
+    EnterCriticalSection(&tracker->lock);
+
+    if (tracker->pending_count == tracker->pending_capacity)
+    {
+        int capacity = tracker->pending_capacity > 0 ? tracker->pending_capacity * 2 : 16;
+        struct tracked_job *pending = (struct tracked_job *)realloc(
+            tracker->pending, capacity * sizeof(struct tracked_job));
+        if (pending == NULL)
+        {
+            /* We can't follow it, but it's still in the spooler. */
+            ERR("Failed to allocate memory to track %s.\n", name);
+            tracker->in_flight--;
+            WakeAllConditionVariable(&tracker->slot_free);
+            LeaveCriticalSection(&tracker->lock);
+            return;
+        }
+
+        tracker->pending = pending;
+        tracker->pending_capacity = capacity;
+    }
+
+    job = &tracker->pending[tracker->pending_count++];
+    memset(job, 0, sizeof(*job));
+    job->id = job_id;
+    job->started = started;
+    snprintf(job->name, sizeof(job->name), "%s", name);
+
+    metrics_job_queued(tracker->metrics);
+
+    LeaveCriticalSection(&tracker->lock);
+
+    /* Have a look at it straight away, rather than at the next poll. */
+    SetEvent(tracker->wake);
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    double latency_a = *(const double *)a;
+    double latency_b = *(const double *)b;
+
+    return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+BOOL stop_job_tracker(struct job_tracker *tracker)
+{
+    int latency_count;
+    BOOL all_printed;
+
+    if (tracker == NULL)
+        return TRUE;
+
+    EnterCriticalSection(&tracker->lock);
+    if (tracker->pending_count > 0)
+        printf(" ⏳ Waiting for %d jobs on %s\n", tracker->pending_count, tracker->printer_name);
+
+    tracker->stopping = TRUE;
+    LeaveCriticalSection(&tracker->lock);
+
+    SetEvent(tracker->wake);
+    WaitForSingleObject(tracker->thread, INFINITE);
+    CloseHandle(tracker->thread);
+
+    latency_count = min(tracker->printed, tracker->latency_capacity);
+    printf(
+        " 📬 %s: %d of %d jobs printed\n",
+        tracker->printer_name,
+        tracker->printed,
+        tracker->printed + tracker->failed);
+
+    if (latency_count > 0)
+    {
+        qsort(tracker->latencies, latency_count, sizeof(double), compare_latencies);
+        printf(
+            " 📬 Time to print: min %.1f s, median %.1f s, max %.1f s\n",
+            tracker->latencies[0],
+            tracker->latencies[latency_count / 2],
+            tracker->latencies[latency_count - 1]);
+    }
+
+    all_printed = tracker->failed == 0;
+
+    free_job_tracker(tracker);
+
+    return all_printed;
+}
@@ -0,0 +1,61 @@
+#ifndef JOB_TRACKER_H
+#define JOB_TRACKER_H
+
+#include <windows.h>
+
+#include "printer.h"
+
+/* Follows spooled jobs through to the printer on a background thread, so we
+ * can get on with the next label and still find out whether each one
+ * printed. It also bounds how many jobs we have in the spooler at once. */
+struct job_tracker;
+
+/**
+ * @brief Start tracking jobs on a printer.
+ *
+ * @param session The printer the jobs go to. The tracker watches the jobs
+ * through the session's handle, so the session must outlive it.
+ * @param max_in_flight The most jobs that may be in the spooler at once.
+ * @return The tracker, or `NULL` on failure. Release it with
+ * `stop_job_tracker()`.
+ */
+struct job_tracker *start_job_tracker(const struct printer_session *session, int max_in_flight);
+
+/**
+ * @brief Wait until there's room for another job, and claim it. Call this
+ * before starting a document.
+ *
+ * @param tracker The tracker.
+ * @return When the job was started, for working out its latency.
+ */
+LONGLONG reserve_job_slot(struct job_tracker *tracker);
+
+/**
+ * @brief Give back a slot from `reserve_job_slot()` that didn't end up with a
+ * job in it, because the document failed or was aborted.
+ *
+ * @param tracker The tracker.
+ */
+void release_job_slot(struct job_tracker *tracker);
+
+/**
+ * @brief Follow a job that's been spooled, until it prints or fails. The job
+ * takes over its reserved slot until then.
+ *
+ * @param tracker The tracker.
+ * @param job_id The spooler's job ID, from `StartDoc()`.
+ * @param name The job's name, for messages.
+ * @param started When the job was started, from `reserve_job_slot()`.
+ */
+void track_job(struct job_tracker *tracker, DWORD job_id, const char *name, LONGLONG started);
+
+/**
+ * @brief Wait for every tracked job to finish, report on them and stop
+ * tracking.
+ *
+ * @param tracker The tracker to stop. May be `NULL`.
+ * @return `TRUE` if every job printed.
+ */
+BOOL stop_job_tracker(struct job_tracker *tracker);
+
+#endif /* JOB_TRACKER_H */
@@ -0,0 +1,567 @@
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "barcode.h"
+#include "convert.h"
+#include "label.h"
+#include "log.h"
+#include "timing.h"
+
+/* Labels are handed back to the pool when they're closed, rather than freed,
+ * so a batch soon stops allocating. Each keeps its buffer, which only ever
+ * grows, so the pool's buffers end up sized to the largest labels seen. */
+#define LABEL_POOL_SIZE (32)
+
+static SRWLOCK pool_lock = SRWLOCK_INIT;
+static struct label *pool_free;
+static int pool_count;
+
+/**
+ * @brief Work out how many bytes of pixel data a bitmap needs.
+ *
+ * @param info_header The bitmap's info header.
+ * @return The size of the pixel data in bytes, or -1 if it can't be known.
+ */
+static LONGLONG bitmap_bits_size(const BITMAPINFOHEADER *info_header)
+{
+    LONGLONG stride, rows;
+
+    /* Compressed bitmaps have to tell us how big they are. */
+    if (info_header->biCompression != BI_RGB &&
+        info_header->biCompression != BI_BITFIELDS)
+    {
+        return info_header->biSizeImage > 0 ? info_header->biSizeImage : -1;
+    }
+
+    if (info_header->biBitCount == 0)
+        return -1;
+
+    /* Rows are padded out to a whole number of 32-bit words. */
+    stride = (((LONGLONG)info_header->biWidth * info_header->biBitCount + 31) / 32) * 4;
+    rows = info_header->biHeight < 0 ? -(LONGLONG)info_header->biHeight : info_header->biHeight;
+
+    return stride * rows;
+}
+
+/**
+ * @brief Validate a bitmap file held in memory, and describe it as a label.
+ *
+ * @param label The label to fill in.
+ * @param data The contents of the bitmap file.
+ * @param size The size of the bitmap file in bytes.
+ * @param name The name to use for the bitmap in error messages.
+ * @return `TRUE` if the bitmap is valid. The label then points into `data`.
+ */
+static BOOL parse_label(
+    struct label *label,
+    void *data,
+    LONGLONG size,
+    const char *name)
+{
+    BITMAPFILEHEADER *header = (BITMAPFILEHEADER *)data;
+    BITMAPINFOHEADER *info_header = (BITMAPINFOHEADER *)(header + 1);
+    LONGLONG bits_size;
+
+    if (size < (LONGLONG)(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)))
+    {
+        ERR("%s is not a valid bitmap file.\n", name);
+        return FALSE;
+    }
+
+    DBG("Bitmap type: %x\n", header->bfType);
+    DBG("Bitmap size: %d\n", header->bfSize);
+
+    /* Ensure we're dealing with a bitmap file. The size field is only 32
+     * bits wide, so it can't describe files bigger than that. */
+    if ((header->bfType != 0x4D42) ||
+        (size <= MAXDWORD && header->bfSize != size))
+    {
+        ERR("%s is not a valid bitmap file.\n", name);
+        return FALSE;
+    }
+
+    /* Ensure the file is well-formed. Everything is read straight out of the
+     * data, so anything pointing past the end of it could fault rather than
+     * just read garbage. */
+    if (header->bfOffBits < (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) ||
+        header->bfOffBits > size ||
+        info_header->biSize < sizeof(BITMAPINFOHEADER) ||
+        sizeof(BITMAPFILEHEADER) + info_header->biSize > header->bfOffBits)
+    {
+        ERR("%s is not a valid bitmap file.\n", name);
+        return FALSE;
+    }
+
+    /* Top-down bitmaps have a negative height, but nothing has a negative
+     * width, or no height. */
+    if (info_header->biWidth <= 0 || info_header->biHeight == 0 ||
+        info_header->biHeight == LONG_MIN)
+    {
+        ERR("%s is not a valid bitmap file.\n", name);
+        return FALSE;
+    }
+
+    bits_size = bitmap_bits_size(info_header);
+    if (bits_size < 0 || header->bfOffBits + bits_size > size)
+    {
+        ERR("%s is truncated.\n", name);
+        return FALSE;
+    }
+
+    /* We scale by the bitmap's resolution, so it has to have one. */
+    if (info_header->biXPelsPerMeter <= 0 || info_header->biYPelsPerMeter <= 0)
+    {
+        ERR("%s has no resolution information.\n", name);
+        return FALSE;
+    }
+
+    label->header = header;
+    label->info_header = info_header;
+    label->bits = (char *)header + header->bfOffBits;
+    label->width = label->info_header->biWidth;
+    label->height = abs(label->info_header->biHeight);
+    label->xres = label->info_header->biXPelsPerMeter;
+    label->yres = label->info_header->biYPelsPerMeter;
+    label->size = (size_t)size;
+    label->converted = FALSE;
+
+    DBG("Bitmap width: %d px\n", label->width);
+    DBG("Bitmap height: %d px\n", label->height);
+    DBG("Bitmap xres: %d px/m\n", label->xres);
+    DBG("Bitmap yres: %d px/m\n", label->yres);
+
+    /* Done here, off the printer's thread, so the driver only ever sees
+     * small 1bpp bitmaps. */
+    if (label_needs_conversion(label) && !convert_label(label, name))
+        return FALSE;
+
+    return TRUE;
+}
+
+struct label *new_label(void)
+{
+    struct label *label;
+    struct label pooled = {0};
+
+    AcquireSRWLockExclusive(&pool_lock);
+    label = pool_free;
+    if (label != NULL)
+    {
+        pool_free = label->next_free;
+        pool_count--;
+    }
+    ReleaseSRWLockExclusive(&pool_lock);
+
+    if (label == NULL)
+    {
+        label = (struct label *)malloc(sizeof(struct label));
+        if (label == NULL)
+        {
+            ERR("Failed to allocate memory for label structure.\n");
+            return NULL;
+        }
+    }
+    else
+    {
+        pooled = *label;
+    }
+
+    /* Start afresh, but hang on to the buffers. */
+    memset(label, 0, sizeof(*label));
+    label->buffer = pooled.buffer;
+    label->buffer_size = pooled.buffer_size;
+    label->device_buffer = pooled.device_buffer;
+    label->device_buffer_size = pooled.device_buffer_size;
+    label->mono_buffer = pooled.mono_buffer;
+    label->mono_buffer_size = pooled.mono_buffer_size;
+    label->refs = 1;
+
+    return label;
+}
+
+/**
+ * @brief Grow one of a label's buffers to at least `size` bytes.
+ */
+static void *reserve_buffer(void **buffer, size_t *buffer_size, size_t size)
+{
+    void *new_buffer;
+
+    if (size <= *buffer_size)
+        return *buffer;
+
+    /* Whatever was in there is about to be replaced, so there's no point
+     * having realloc() copy it. */
+    new_buffer = malloc(size);
+    if (new_buffer == NULL)
+    {
+        ERR("Failed to allocate memory for label data.\n");
+        return NULL;
+    }
+
+    if (*buffer != NULL)
+        free(*buffer);
+
+    *buffer = new_buffer;
+    *buffer_size = size;
+
+    return new_buffer;
+}
+
+void *reserve_label_buffer(struct label *label, size_t size)
+{
+    return reserve_buffer(&label->buffer, &label->buffer_size, size);
+}
+
+void *reserve_label_device_buffer(struct label *label, size_t size)
+{
+    return reserve_buffer(&label->device_buffer, &label->device_buffer_size, size);
+}
+
+void *reserve_label_mono_buffer(struct label *label, size_t size)
+{
+    return reserve_buffer(&label->mono_buffer, &label->mono_buffer_size, size);
+}
+
+BOOL add_label_layer(struct label *label, const struct label_layer *layer)
+{
+    if (label->layer_count == label->layer_capacity)
+    {
+        int capacity = label->layer_capacity > 0 ? label->layer_capacity * 2 : 16;
+        struct label_layer *layers;
+
+        layers = (struct label_layer *)realloc(label->layers, capacity * sizeof(struct label_layer));
+        if (layers == NULL)
+        {
+            ERR("Failed to allocate memory for label layer.\n");
+            free_barcode(layer->barcode);
+            return FALSE;
+        }
+
+        label->layers = layers;
+        label->layer_capacity = capacity;
+    }
+
+    label->layers[label->layer_count++] = *layer;
+
+    return TRUE;
+}
+
+/**
+ * @brief Let go of a label's layers.
+ */
+static void free_label_layers(struct label *label)
+{
+    for (int i = 0; i < label->layer_count; i++)
+        free_barcode(label->layers[i].barcode);
+
+    free(label->layers);
+    label->layers = NULL;
+    label->layer_count = 0;
+    label->layer_capacity = 0;
+}
+
+/**
+ * @brief Free a label for good, along with its buffers.
+ */
+static void free_label(struct label *label)
+{
+    if (label->buffer != NULL)
+        free(label->buffer);
+
+    if (label->device_buffer != NULL)
+        free(label->device_buffer);
+
+    if (label->mono_buffer != NULL)
+        free(label->mono_buffer);
+
+    free(label);
+}
+
+BOOL parse_label_buffer(struct label *label, size_t size, const char *name)
+{
+    if (label->buffer == NULL || size > label->buffer_size)
+    {
+        ERR("Label buffer is too small.\n");
+        return FALSE;
+    }
+
+    DBG("Opening label from memory: %s\n", name);
+
+    return parse_label(label, label->buffer, size, name);
+}
+
+struct label *open_label(char *filename)
+{
+    HANDLE f = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    LARGE_INTEGER file_size;
+    void *view = NULL;
+    struct label *label = NULL;
+    LONGLONG start = timing_start();
+
+    if (filename == NULL)
+    {
+        ERR("Filename is NULL.\n");
+        return NULL;
+    }
+
+    DBG("Opening label file: %s\n", filename);
+
+    f = CreateFile(
+        filename,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        goto exit;
+    }
+
+    if (!GetFileSizeEx(f, &file_size))
+    {
+        ERR("Failed to get the size of %s.\n", filename);
+        goto exit;
+    }
+
+    /* We can only map what fits in our address space. */
+    if ((ULONGLONG)file_size.QuadPart > SIZE_MAX)
+    {
+        ERR("%s is too large to process.\n", filename);
+        goto exit;
+    }
+
+    /* Empty files can't be mapped, and wouldn't be bitmaps anyway. */
+    if (file_size.QuadPart < (LONGLONG)(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)))
+    {
+        ERR("%s is not a valid bitmap file.\n", filename);
+        goto exit;
+    }
+
+    mapping = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        ERR("Failed to map %s.\n", filename);
+        goto exit;
+    }
+
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        ERR("Failed to map a view of %s.\n", filename);
+        goto exit;
+    }
+
+    /* The mapping keeps the file open for us. */
+    CloseHandle(f);
+    f = INVALID_HANDLE_VALUE;
+
+    DBG("Mapped %lld bytes\n", file_size.QuadPart);
+
+    label = new_label();
+    if (label == NULL || !parse_label(label, view, file_size.QuadPart, filename))
+    {
+        goto exit;
+    }
+
+    label->mapping = mapping;
+    label->view = view;
+
+    timing_end(PHASE_OPEN_LABEL, start);
+
+    return label;
+
+exit:
+    if (label != NULL)
+        close_label(label);
+
+    if (view != NULL)
+        UnmapViewOfFile(view);
+
+    if (mapping != NULL)
+        CloseHandle(mapping);
+
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    return NULL;
+}
+
+BOOL read_label_size(const char *filename, struct label_size *size)
+{
+    HANDLE f;
+    struct
+    {
+        BITMAPFILEHEADER file;
+        BITMAPINFOHEADER info;
+    } headers;
+    DWORD bytes_read;
+    BOOL read;
+
+    f = CreateFile(
+        filename,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+        return FALSE;
+
+    /* One at a time, as the struct around them may well be padded. */
+    read = ReadFile(f, &headers.file, sizeof(headers.file), &bytes_read, NULL) &&
+           bytes_read == sizeof(headers.file) &&
+           ReadFile(f, &headers.info, sizeof(headers.info), &bytes_read, NULL) &&
+           bytes_read == sizeof(headers.info);
+    CloseHandle(f);
+
+    if (!read ||
+        headers.file.bfType != 0x4D42 ||
+        headers.info.biSize < sizeof(BITMAPINFOHEADER) ||
+        headers.info.biWidth <= 0 ||
+        headers.info.biHeight == 0 ||
+        headers.info.biHeight == LONG_MIN ||
+        headers.info.biXPelsPerMeter <= 0 ||
+        headers.info.biYPelsPerMeter <= 0)
+    {
+        return FALSE;
+    }
+
+    size->width = headers.info.biWidth;
+    size->height = abs(headers.info.biHeight);
+    size->xres = headers.info.biXPelsPerMeter;
+    size->yres = headers.info.biYPelsPerMeter;
+
+    return TRUE;
+}
+
+struct label *open_label_memory(void *data, size_t size, const char *name)
+{
+    struct label *label;
+
+    if (data == NULL)
+    {
+        ERR("Label data is NULL.\n");
+        return NULL;
+    }
+
+    DBG("Opening label from memory: %s\n", name);
+
+    label = new_label();
+    if (label == NULL)
+        return NULL;
+
+    if (!parse_label(label, data, size, name))
+    {
+        close_label(label);
+        return NULL;
+    }
+
+    return label;
+}
+
+BOOL detach_label(struct label *label, const char *name)
+{
+    void *buffer;
+
+    if (label->view == NULL)
+        return TRUE;
+
+    /* A converted label's bitmap is already its own, and the file's only
+     * needed for its file header, which nothing looks at again. */
+    if (label->converted)
+    {
+        label->header = NULL;
+        goto unmap;
+    }
+
+    buffer = reserve_label_buffer(label, label->size);
+    if (buffer == NULL)
+        return FALSE;
+
+    memcpy(buffer, label->view, label->size);
+
+    /* It was valid in the file, so it's still valid here. This just points
+     * the label at the copy, and if it somehow fails the label is left
+     * pointing at the file. */
+    if (!parse_label_buffer(label, label->size, name))
+        return FALSE;
+
+unmap:
+    UnmapViewOfFile(label->view);
+    CloseHandle(label->mapping);
+    label->view = NULL;
+    label->mapping = NULL;
+
+    return TRUE;
+}
+
+struct label *share_label(struct label *label)
+{
+    InterlockedIncrement(&label->refs);
+
+    return label;
+}
+
+void close_label(struct label *label)
+{
+    if (label == NULL)
+        return;
+
+    if (InterlockedDecrement(&label->refs) > 0)
+        return;
+
+    if (label->view != NULL)
+        UnmapViewOfFile(label->view);
+
+    if (label->mapping != NULL)
+        CloseHandle(label->mapping);
+
+    label->view = NULL;
+    label->mapping = NULL;
+
+    free_label_layers(label);
+
+    AcquireSRWLockExclusive(&pool_lock);
+    if (pool_count < LABEL_POOL_SIZE)
+    {
+        label->next_free = pool_free;
+        pool_free = label;
+        pool_count++;
+        label = NULL;
+    }
+    ReleaseSRWLockExclusive(&pool_lock);
+
+    /* The pool is full, so this one really goes. */
+    if (label != NULL)
+        free_label(label);
+}
+
+void drain_label_pool(void)
+{
+    struct label *label;
+
+    AcquireSRWLockExclusive(&pool_lock);
+    label = pool_free;
+    pool_free = NULL;
+    pool_count = 0;
+    ReleaseSRWLockExclusive(&pool_lock);
+
+    while (label != NULL)
+    {
+        struct label *next = label->next_free;
+
+        free_label(label);
+        label = next;
+    }
+}
@@ -0,0 +1,225 @@
+#ifndef LABEL_H
+#define LABEL_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "barcode.h"
+
+/* Something drawn over a label at the printer's own resolution, rather than
+ * scaled up with the bitmap, so its edges land on whole dots. */
+struct label_layer
+{
+    /* Where its top left goes, in the label's pixels. */
+    int x, y;
+
+    /* How big a module is, and how tall the bars of a linear barcode are,
+     * in the label's pixels. Modules are rounded to whole dots when they're
+     * drawn. */
+    float module;
+    int bar_height;
+
+    struct barcode *barcode;
+};
+
+struct label
+{
+    BITMAPFILEHEADER *header;
+    BITMAPINFOHEADER *info_header;
+    void *bits;
+    int width, height;
+    int xres, yres;
+
+    /* The size of the whole bitmap file. */
+    size_t size;
+
+    /* For labels opened from a file, the headers and bits all point into a
+     * read-only view of it. Otherwise these are `NULL`, and the headers and
+     * bits point into the caller's memory. */
+    HANDLE mapping;
+    void *view;
+
+    /* When the bitmap wasn't uncompressed 1bpp, we make a 1bpp copy of it,
+     * and `info_header` and `bits` point at that instead. `bits` is then in
+     * `mono_buffer`. */
+    BOOL converted;
+    struct
+    {
+        BITMAPINFOHEADER header;
+        RGBQUAD colors[2];
+    } mono_info;
+
+    /* When the label's been prescaled, the copy of it at the printer's
+     * resolution. `device_bits` points into `device_buffer`. */
+    BOOL prescaled;
+    struct
+    {
+        BITMAPINFOHEADER header;
+        RGBQUAD colors[2];
+    } device_info;
+    void *device_bits;
+
+    /* When the label's been cropped, the part of it that's inked, in pixels
+     * from its top left, and the same for its prescaled copy. Only that
+     * much of it is sent to the printer. */
+    BOOL cropped;
+    RECT ink;
+    BOOL device_cropped;
+    RECT device_ink;
+
+    /* Barcodes to draw over the bitmap. They belong to the label. */
+    struct label_layer *layers;
+    int layer_count;
+    int layer_capacity;
+
+    /* Storage owned by the label. It stays with the label while it's in the
+     * pool, so it can be reused without allocating. */
+    void *buffer;
+    size_t buffer_size;
+    void *device_buffer;
+    size_t device_buffer_size;
+    void *mono_buffer;
+    size_t mono_buffer_size;
+
+    /* How many holders the label has. A label can be shared, once it's
+     * been detached from its file, and then it's only released when the
+     * last holder closes it. Shared labels are only changed under `lock`. */
+    LONG refs;
+    SRWLOCK lock;
+
+    struct label *next_free;
+};
+
+/**
+ * @brief Get an empty label, from the pool if there's one available.
+ *
+ * @return The label, or `NULL` on failure. Release it with `close_label()`.
+ */
+struct label *new_label(void);
+
+/**
+ * @brief Make sure a label's buffer is at least `size` bytes.
+ *
+ * Anything already in the buffer is lost if it has to grow.
+ *
+ * @param label The label to reserve space in.
+ * @param size The number of bytes needed.
+ * @return The buffer, or `NULL` on failure.
+ */
+void *reserve_label_buffer(struct label *label, size_t size);
+
+/**
+ * @brief Make sure a label's device buffer, used for the prescaled copy, is
+ * at least `size` bytes.
+ *
+ * @param label The label to reserve space in.
+ * @param size The number of bytes needed.
+ * @return The buffer, or `NULL` on failure.
+ */
+void *reserve_label_device_buffer(struct label *label, size_t size);
+
+/**
+ * @brief Make sure a label's mono buffer, used for the 1bpp copy of a label
+ * that wasn't 1bpp, is at least `size` bytes.
+ *
+ * @param label The label to reserve space in.
+ * @param size The number of bytes needed.
+ * @return The buffer, or `NULL` on failure.
+ */
+void *reserve_label_mono_buffer(struct label *label, size_t size);
+
+/**
+ * @brief Add a layer to a label, to be drawn over its bitmap.
+ *
+ * @param label The label to add to.
+ * @param layer The layer. The label takes its barcode, even if this fails.
+ * @return `TRUE` if the layer was added.
+ */
+BOOL add_label_layer(struct label *label, const struct label_layer *layer);
+
+/**
+ * @brief Validate a bitmap that's been put in a label's buffer, and point the
+ * label at it. Bitmaps that aren't 1bpp are converted.
+ *
+ * @param label The label, from `new_label()`.
+ * @param size The size of the bitmap file in the buffer.
+ * @param name The name to use for the bitmap in messages.
+ * @return `TRUE` if the bitmap is valid.
+ */
+BOOL parse_label_buffer(struct label *label, size_t size, const char *name);
+
+/**
+ * @brief Open and validate a bitmap label file. Bitmaps that aren't 1bpp are
+ * converted.
+ *
+ * The file is mapped into memory rather than read, so the label's headers and
+ * bits point straight into the file's pages and nothing is copied.
+ *
+ * @param filename The bitmap file to open.
+ * @return The label, or `NULL` on failure. Release it with `close_label()`.
+ */
+struct label *open_label(char *filename);
+
+/* How big a label is, as its file's headers give it. */
+struct label_size
+{
+    int width, height;
+    int xres, yres;
+};
+
+/**
+ * @brief Read how big a bitmap label file is, without opening it as a label.
+ *
+ * Only the headers are read, so this is much cheaper than `open_label()`,
+ * but nothing past them is checked.
+ *
+ * @param filename The bitmap file.
+ * @param size Set to the label's size.
+ * @return `TRUE` if the headers are a bitmap's, with a resolution.
+ */
+BOOL read_label_size(const char *filename, struct label_size *size);
+
+/**
+ * @brief Validate a bitmap that's already in memory, and open it as a label.
+ *
+ * @param data The contents of the bitmap file. This must stay valid until
+ * the label is closed, as the label points straight into it.
+ * @param size The size of the bitmap file in bytes.
+ * @param name The name to use for the bitmap in messages.
+ * @return The label, or `NULL` on failure. Release it with `close_label()`.
+ */
+struct label *open_label_memory(void *data, size_t size, const char *name);
+
+/**
+ * @brief Copy a label's bitmap out of its file into the label's own buffer,
+ * and let go of the file, so the label can outlive it.
+ *
+ * @param label The label to detach.
+ * @param name The name to use for the bitmap in messages.
+ * @return `TRUE` if the label no longer needs its file.
+ */
+BOOL detach_label(struct label *label, const char *name);
+
+/**
+ * @brief Take another hold on a label. Each hold is released with
+ * `close_label()`.
+ *
+ * @param label The label to share.
+ * @return The label.
+ */
+struct label *share_label(struct label *label);
+
+/**
+ * @brief Release a label, handing it back to the pool once nobody else holds
+ * it.
+ *
+ * @param label The label to release. May be `NULL`.
+ */
+void close_label(struct label *label);
+
+/**
+ * @brief Free every label in the pool.
+ */
+void drain_label_pool(void);
+
+#endif /* LABEL_H */
@@ -0,0 +1,171 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "label.h"
+#include "label_cache.h"
+#include "log.h"
+
+/* The cache holds its own copy of every label, so it's bounded by both the
+ * number of labels and their total size. */
+#define LABEL_CACHE_SIZE (64)
+#define LABEL_CACHE_BYTES (64u * 1024u * 1024u)
+
+struct label_cache_entry
+{
+    char path[MAX_PATH];
+    FILETIME write_time;
+    ULONGLONG file_size;
+
+    struct label *label;
+    ULONGLONG last_used;
+};
+
+static SRWLOCK cache_lock = SRWLOCK_INIT;
+static BOOL cache_enabled;
+static struct label_cache_entry entries[LABEL_CACHE_SIZE];
+static int entry_count;
+static size_t cache_bytes;
+static ULONGLONG use_clock;
+
+void label_cache_enable(void)
+{
+    cache_enabled = TRUE;
+}
+
+/**
+ * @brief Drop an entry from the cache. Must be called with the lock held.
+ */
+static void evict_entry(int i)
+{
+    DBG("Evicting %s from the label cache\n", entries[i].path);
+
+    cache_bytes -= entries[i].label->size;
+    close_label(entries[i].label);
+
+    entries[i] = entries[--entry_count];
+}
+
+/**
+ * @brief Find a file in the cache, dropping any stale copy of it. Must be
+ * called with the lock held.
+ *
+ * @return The entry's index, or -1 if it isn't cached.
+ */
+static int find_entry(const char *path, const WIN32_FILE_ATTRIBUTE_DATA *attributes)
+{
+    ULONGLONG file_size = ((ULONGLONG)attributes->nFileSizeHigh << 32) | attributes->nFileSizeLow;
+
+    for (int i = 0; i < entry_count; i++)
+    {
+        if (_stricmp(entries[i].path, path) != 0)
+            continue;
+
+        if (entries[i].file_size == file_size &&
+            CompareFileTime(&entries[i].write_time, &attributes->ftLastWriteTime) == 0)
+        {
+            return i;
+        }
+
+        /* The file's changed since we cached it. */
+        evict_entry(i);
+        return -1;
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Add a label to the cache, making room for it. Must be called with
+ * the lock held.
+ */
+static void add_entry(
+    const char *path,
+    const WIN32_FILE_ATTRIBUTE_DATA *attributes,
+    struct label *label)
+{
+    struct label_cache_entry *entry;
+
+    if (label->size > LABEL_CACHE_BYTES)
+        return;
+
+    while (entry_count == LABEL_CACHE_SIZE || cache_bytes + label->size > LABEL_CACHE_BYTES)
+    {
+        int oldest = 0;
+
+        for (int i = 1; i < entry_count; i++)
+        {
+            if (entries[i].last_used < entries[oldest].last_used)
+                oldest = i;
+        }
+
+        evict_entry(oldest);
+    }
+
+    entry = &entries[entry_count++];
+    strcpy(entry->path, path);
+    entry->write_time = attributes->ftLastWriteTime;
+    entry->file_size = ((ULONGLONG)attributes->nFileSizeHigh << 32) | attributes->nFileSizeLow;
+    entry->label = share_label(label);
+    entry->last_used = ++use_clock;
+
+    cache_bytes += label->size;
+}
+
+struct label *open_cached_label(char *filename)
+{
+    char path[MAX_PATH];
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    struct label *label = NULL;
+    DWORD length;
+    int i;
+
+    if (!cache_enabled || filename == NULL)
+        return open_label(filename);
+
+    /* The same file can be named in different ways, so we go by its full
+     * path. If we can't tell what the file is, it isn't cached. */
+    length = GetFullPathName(filename, sizeof(path), path, NULL);
+    if (length == 0 || length >= sizeof(path) ||
+        !GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+    {
+        return open_label(filename);
+    }
+
+    AcquireSRWLockExclusive(&cache_lock);
+    i = find_entry(path, &attributes);
+    if (i >= 0)
+    {
+        entries[i].last_used = ++use_clock;
+        label = share_label(entries[i].label);
+    }
+    ReleaseSRWLockExclusive(&cache_lock);
+
+    if (label != NULL)
+    {
+        DBG("Using cached label for %s\n", filename);
+        return label;
+    }
+
+    label = open_label(filename);
+    if (label == NULL || !detach_label(label, filename))
+        return label;
+
+    /* Someone else may have cached it while we were reading it, in which
+     * case ours is just used the once. */
+    AcquireSRWLockExclusive(&cache_lock);
+    if (find_entry(path, &attributes) < 0)
+        add_entry(path, &attributes, label);
+    ReleaseSRWLockExclusive(&cache_lock);
+
+    return label;
+}
+
+void drain_label_cache(void)
+{
+    AcquireSRWLockExclusive(&cache_lock);
+    while (entry_count > 0)
+        evict_entry(entry_count - 1);
+    ReleaseSRWLockExclusive(&cache_lock);
+}
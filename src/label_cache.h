@@ -0,0 +1,35 @@
+#ifndef LABEL_CACHE_H
+#define LABEL_CACHE_H
+
+#include <windows.h>
+
+#include "label.h"
+
+/* Keeps the most recently used labels around, so printing the same file
+ * again skips reading, validating and prescaling it. Files are recognised by
+ * their full path, size and last write time, so a file that's changed is
+ * read afresh. Cached labels are copied out of their files, so the files can
+ * still be changed or deleted while they're cached. */
+
+/**
+ * @brief Start caching labels. Until this is called, `open_cached_label()`
+ * just opens the file.
+ */
+void label_cache_enable(void);
+
+/**
+ * @brief Open a label file, from the cache if it's there.
+ *
+ * @param filename The bitmap file to open.
+ * @return The label, or `NULL` on failure. It may be shared, so it must not
+ * be changed other than by `prepare_label()`. Release it with
+ * `close_label()`.
+ */
+struct label *open_cached_label(char *filename);
+
+/**
+ * @brief Release every label in the cache.
+ */
+void drain_label_cache(void);
+
+#endif /* LABEL_CACHE_H */
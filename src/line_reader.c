@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "line_reader.h"
+#include "log.h"
+
+#define INITIAL_LINE_SIZE (256)
+
+BOOL open_line_reader(struct line_reader *reader, const char *path)
+{
+    memset(reader, 0, sizeof(*reader));
+
+    /* Callers say which kind of file it was. */
+    reader->file = fopen(path, "rb");
+    if (reader->file == NULL)
+        return FALSE;
+
+    reader->capacity = INITIAL_LINE_SIZE;
+    reader->line = (char *)malloc(reader->capacity);
+    if (reader->line == NULL)
+    {
+        ERR("Failed to allocate memory for reading %s.\n", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL read_line(struct line_reader *reader)
+{
+    size_t length = 0;
+
+    for (;;)
+    {
+        if (fgets(reader->line + length, (int)(reader->capacity - length), reader->file) == NULL)
+        {
+            if (length == 0)
+                return FALSE;
+
+            break;
+        }
+
+        length += strlen(reader->line + length);
+        if (length > 0 && reader->line[length - 1] == '\n')
+            break;
+
+        /* The line didn't fit, so make room for the rest of it. */
+        if (length + 1 >= reader->capacity)
+        {
+            char *line = (char *)realloc(reader->line, reader->capacity * 2);
+            if (line == NULL)
+            {
+                ERR("Failed to allocate memory for line.\n");
+                reader->failed = TRUE;
+                return FALSE;
+            }
+
+            reader->line = line;
+            reader->capacity *= 2;
+        }
+    }
+
+    while (length > 0 && (reader->line[length - 1] == '\n' || reader->line[length - 1] == '\r'))
+        reader->line[--length] = '\0';
+
+    reader->line_number++;
+
+    /* Skip the byte order mark some editors put at the start. */
+    if (reader->line_number == 1 && strncmp(reader->line, "\xEF\xBB\xBF", 3) == 0)
+        memmove(reader->line, reader->line + 3, length - 2);
+
+    return TRUE;
+}
+
+BOOL line_reader_failed(const struct line_reader *reader)
+{
+    return reader->failed || ferror(reader->file);
+}
+
+void close_line_reader(struct line_reader *reader)
+{
+    if (reader->file != NULL)
+        fclose(reader->file);
+
+    free(reader->line);
+
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,62 @@
+#ifndef LINE_READER_H
+#define LINE_READER_H
+
+#include <stdio.h>
+
+#include <windows.h>
+
+/* Reads a text file a line at a time, however long the lines are. Shared by
+ * the manifest, template and data file readers. */
+struct line_reader
+{
+    FILE *file;
+
+    /* The line just read, without its line ending. */
+    char *line;
+    size_t capacity;
+
+    /* The number of the line just read, counting from 1, for messages. */
+    long line_number;
+
+    /* Set when a line was too long to find room for. */
+    BOOL failed;
+};
+
+/**
+ * @brief Open a file for reading a line at a time.
+ *
+ * @param reader The reader to set up.
+ * @param path The file to read.
+ * @return `TRUE` if the file was opened. Release the reader with
+ * `close_line_reader()` either way.
+ */
+BOOL open_line_reader(struct line_reader *reader, const char *path);
+
+/**
+ * @brief Read the next line into the reader's buffer, growing it as needed,
+ * and strip the line ending. A byte order mark at the start of the file is
+ * skipped.
+ *
+ * @param reader The reader to read from.
+ * @return `FALSE` at the end of the file, or if it couldn't be read, which
+ * `line_reader_failed()` tells apart.
+ */
+BOOL read_line(struct line_reader *reader);
+
+/**
+ * @brief Check whether a reader stopped because something went wrong, rather
+ * than because it reached the end of the file.
+ *
+ * @param reader The reader to check.
+ * @return `TRUE` if the file couldn't be read, or a line didn't fit in memory.
+ */
+BOOL line_reader_failed(const struct line_reader *reader);
+
+/**
+ * @brief Close a reader's file and release its buffer.
+ *
+ * @param reader The reader to close.
+ */
+void close_line_reader(struct line_reader *reader);
+
+#endif /* LINE_READER_H */
@@ -0,0 +1,278 @@
+#include <stdlib.h>
+
+#include <windows.h>
+
+#include "loader.h"
+#include "log.h"
+
+/* How many labels each worker may have loaded ahead of the printer. This
+ * bounds how much of the batch is mapped at once. */
+#define LABELS_PER_THREAD (2)
+
+struct loader_slot
+{
+    struct print_job *job;
+    struct label *label;
+    BOOL ready;
+};
+
+struct loader
+{
+    struct job_source *source;
+    const struct prepare_options *prepare;
+
+    /* Job `i` is loaded into slot `i % depth`. Workers can't claim a job
+     * until the label that last used its slot has been taken. */
+    struct loader_slot *slots;
+    int depth;
+    int next_claim;
+    int next_take;
+    BOOL exhausted;
+    BOOL stopping;
+
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE slot_ready;
+    CONDITION_VARIABLE slot_free;
+
+    HANDLE *threads;
+    int thread_count;
+};
+
+/**
+ * @brief Open and prepare a label.
+ *
+ * @return The label, or `NULL` if it couldn't be opened or prepared.
+ */
+static struct label *load_label(struct loader *loader, const struct print_job *job)
+{
+    struct label *label = open_job_label(loader->source, job);
+
+    if (label != NULL && !prepare_label(label, loader->prepare))
+    {
+        close_label(label);
+        label = NULL;
+    }
+
+    return label;
+}
+
+static DWORD WINAPI loader_worker(LPVOID param)
+{
+    struct loader *loader = (struct loader *)param;
+
+    EnterCriticalSection(&loader->lock);
+
+    for (;;)
+    {
+        struct print_job *job;
+        struct label *label;
+        int i;
+
+        while (!loader->stopping &&
+               !loader->exhausted &&
+               loader->next_claim >= loader->next_take + loader->depth)
+        {
+            SleepConditionVariableCS(&loader->slot_free, &loader->lock, INFINITE);
+        }
+
+        if (loader->stopping || loader->exhausted)
+            break;
+
+        /* Jobs are read under the lock, which keeps them in order. */
+        if (!next_job(loader->source, &job))
+        {
+            loader->exhausted = TRUE;
+            WakeAllConditionVariable(&loader->slot_ready);
+            break;
+        }
+
+        i = loader->next_claim++;
+
+        /* Don't hold anyone else up while we wait on the disk. */
+        LeaveCriticalSection(&loader->lock);
+        label = load_label(loader, job);
+        EnterCriticalSection(&loader->lock);
+
+        loader->slots[i % loader->depth].job = job;
+        loader->slots[i % loader->depth].label = label;
+        loader->slots[i % loader->depth].ready = TRUE;
+        WakeAllConditionVariable(&loader->slot_ready);
+    }
+
+    LeaveCriticalSection(&loader->lock);
+
+    return 0;
+}
+
+struct loader *loader_start(
+    struct job_source *source,
+    int thread_count,
+    const struct prepare_options *prepare)
+{
+    struct loader *loader = NULL;
+
+    loader = (struct loader *)calloc(1, sizeof(struct loader));
+    if (loader == NULL)
+    {
+        ERR("Failed to allocate memory for label loader.\n");
+        return NULL;
+    }
+
+    loader->source = source;
+    loader->prepare = prepare;
+    InitializeCriticalSection(&loader->lock);
+    InitializeConditionVariable(&loader->slot_ready);
+    InitializeConditionVariable(&loader->slot_free);
+
+    if (thread_count <= 0)
+        return loader;
+
+    loader->slots = (struct loader_slot *)calloc(thread_count * LABELS_PER_THREAD, sizeof(struct loader_slot));
+    loader->threads = (HANDLE *)calloc(thread_count, sizeof(HANDLE));
+    if (loader->slots == NULL || loader->threads == NULL)
+    {
+        ERR("Failed to allocate memory for label loader.\n");
+        goto exit;
+    }
+
+    /* Not until the slots are there, as cleaning up goes through them. */
+    loader->depth = thread_count * LABELS_PER_THREAD;
+
+    for (int i = 0; i < thread_count; i++)
+    {
+        loader->threads[i] = CreateThread(NULL, 0, loader_worker, loader, 0, NULL);
+        if (loader->threads[i] == NULL)
+        {
+            ERR("Failed to start label loader thread.\n");
+            goto exit;
+        }
+
+        loader->thread_count++;
+    }
+
+    DBG("Started %d label loader threads\n", loader->thread_count);
+
+    return loader;
+
+exit:
+    loader_stop(loader);
+
+    return NULL;
+}
+
+/**
+ * @brief Stop the workers, and wait for them to finish the labels they're
+ * loading.
+ */
+static void stop_workers(struct loader *loader)
+{
+    EnterCriticalSection(&loader->lock);
+    loader->stopping = TRUE;
+    WakeAllConditionVariable(&loader->slot_free);
+    LeaveCriticalSection(&loader->lock);
+
+    if (loader->thread_count > 0)
+    {
+        WaitForMultipleObjects(loader->thread_count, loader->threads, TRUE, INFINITE);
+    }
+
+    for (int i = 0; i < loader->thread_count; i++)
+        CloseHandle(loader->threads[i]);
+
+    loader->thread_count = 0;
+}
+
+BOOL loader_next(struct loader *loader, struct print_job **job, struct label **label)
+{
+    struct loader_slot *slot;
+
+    /* Without any workers, we do the loading ourselves. */
+    if (loader->thread_count == 0)
+    {
+        if (!next_job(loader->source, job))
+            return FALSE;
+
+        *label = load_label(loader, *job);
+        return TRUE;
+    }
+
+    EnterCriticalSection(&loader->lock);
+
+    slot = &loader->slots[loader->next_take % loader->depth];
+    while (!slot->ready &&
+           !(loader->exhausted && loader->next_take == loader->next_claim))
+    {
+        SleepConditionVariableCS(&loader->slot_ready, &loader->lock, INFINITE);
+    }
+
+    if (!slot->ready)
+    {
+        LeaveCriticalSection(&loader->lock);
+        return FALSE;
+    }
+
+    *job = slot->job;
+    *label = slot->label;
+    slot->job = NULL;
+    slot->label = NULL;
+    slot->ready = FALSE;
+    loader->next_take++;
+    WakeAllConditionVariable(&loader->slot_free);
+
+    LeaveCriticalSection(&loader->lock);
+
+    return TRUE;
+}
+
+BOOL loader_next_job(struct loader *loader, struct print_job **job)
+{
+    stop_workers(loader);
+
+    /* Jobs that were already claimed come first, to keep them in order.
+     * With the workers gone, every claimed slot is ready. */
+    while (loader->next_take < loader->next_claim)
+    {
+        struct loader_slot *slot = &loader->slots[loader->next_take++ % loader->depth];
+
+        if (!slot->ready)
+            continue;
+
+        *job = slot->job;
+        close_label(slot->label);
+        slot->job = NULL;
+        slot->label = NULL;
+        slot->ready = FALSE;
+
+        return TRUE;
+    }
+
+    /* Once the source has run out, it isn't read again. */
+    if (loader->exhausted)
+        return FALSE;
+
+    return next_job(loader->source, job);
+}
+
+void loader_stop(struct loader *loader)
+{
+    if (loader == NULL)
+        return;
+
+    stop_workers(loader);
+
+    /* Anything still sitting in a slot was never taken. */
+    for (int i = 0; i < loader->depth; i++)
+    {
+        if (!loader->slots[i].ready)
+            continue;
+
+        free_print_job(loader->slots[i].job);
+        close_label(loader->slots[i].label);
+    }
+
+    DeleteCriticalSection(&loader->lock);
+
+    free(loader->threads);
+    free(loader->slots);
+    free(loader);
+}
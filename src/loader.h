@@ -0,0 +1,61 @@
+#ifndef LOADER_H
+#define LOADER_H
+
+#include "job.h"
+#include "label.h"
+#include "print.h"
+
+/* Opens labels on worker threads ahead of the printer, so the printer context
+ * isn't left idle while we wait on the disk. Labels always come out in the
+ * order they were given. */
+struct loader;
+
+/**
+ * @brief Start loading the labels for a batch of jobs.
+ *
+ * @param source Where the jobs come from, in print order. Must outlive the
+ * loader, and isn't touched by anyone else until the loader's stopped.
+ * @param thread_count The number of worker threads. With no threads, each
+ * label is opened on the calling thread when it's asked for.
+ * @param prepare How to prepare each label once it's open, with
+ * `prepare_label()`. Must outlive the loader.
+ * @return The loader, or `NULL` on failure. Release it with `loader_stop()`.
+ */
+struct loader *loader_start(
+    struct job_source *source,
+    int thread_count,
+    const struct prepare_options *prepare);
+
+/**
+ * @brief Take the next label, waiting for it to load if it isn't ready yet.
+ *
+ * @param loader The loader to take the label from.
+ * @param job Set to the job the label is for. The caller owns the job and
+ * must release it with `free_print_job()`.
+ * @param label Set to the label, or `NULL` if it failed to load. The caller
+ * owns the label and must close it with `close_label()`.
+ * @return `FALSE` once every job has been taken.
+ */
+BOOL loader_next(struct loader *loader, struct print_job **job, struct label **label);
+
+/**
+ * @brief Take the next job without its label, for once the batch has
+ * stopped. The workers are stopped first, so nothing more is loaded, and
+ * `loader_next()` mustn't be called again.
+ *
+ * @param loader The loader to take the job from.
+ * @param job Set to the job. The caller owns the job and must release it
+ * with `free_print_job()`.
+ * @return `FALSE` once every job has been taken.
+ */
+BOOL loader_next_job(struct loader *loader, struct print_job **job);
+
+/**
+ * @brief Stop the loader, waiting for the workers to finish and releasing any
+ * jobs and labels that were never taken.
+ *
+ * @param loader The loader to stop. May be `NULL`.
+ */
+void loader_stop(struct loader *loader);
+
+#endif /* LOADER_H */
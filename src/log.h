@@ -0,0 +1,33 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdio.h>
+
+#include <windows.h>
+
+#define RESET "\x1b[0m"
+#define DIM "\x1b[2m"
+#define RED "\x1b[31m"
+
+#define DBG(...)                          \
+    {                                     \
+        if (verbose)                      \
+        {                                 \
+            fputs(DIM "    ", stdout);    \
+            fprintf(stdout, __VA_ARGS__); \
+            fputs(RESET, stdout);         \
+        }                                 \
+    }
+
+#define ERR(...)                      \
+    {                                 \
+        fputs(RED " 🚨 ", stderr);    \
+        fprintf(stderr, __VA_ARGS__); \
+        fputs(RESET, stderr);         \
+    }
+
+/* Set from the command line in main.c. */
+extern BOOL verbose;
+extern BOOL dry_run;
+
+#endif /* LOG_H */
@@ -8,744 +8,683 @@
 #include <wingdi.h>
 #include <winspool.h>
 
-#define PAPER_NAME_SIZE (64)
-
-#define RESET "\x1b[0m"
-#define DIM "\x1b[2m"
-#define RED "\x1b[31m"
-
-#define DBG(...)                          \
-    {                                     \
-        if (verbose)                      \
-        {                                 \
-            fputs(DIM "    ", stdout);    \
-            fprintf(stdout, __VA_ARGS__); \
-            fputs(RESET, stdout);         \
-        }                                 \
-    }
-
-#define ERR(...)                      \
-    {                                 \
-        fputs(RED " 🚨 ", stderr);    \
-        fprintf(stderr, __VA_ARGS__); \
-        fputs(RESET, stderr);         \
-    }
-
-struct paper_size
-{
-    char name[PAPER_NAME_SIZE];
-    short size;
-    float width_mm;
-    float height_mm;
-};
-
-struct label
+#include "convert.h"
+#include "dispatch.h"
+#include "failure_list.h"
+#include "job.h"
+#include "label.h"
+#include "label_cache.h"
+#include "loader.h"
+#include "log.h"
+#include "metrics.h"
+#include "print.h"
+#include "printer.h"
+#include "printer_list.h"
+#include "raw.h"
+#include "server.h"
+#include "stream.h"
+#include "timing.h"
+#include "watch.h"
+
+#define DEFAULT_LOADER_THREADS (2)
+#define MAX_LOADER_THREADS (16)
+#define DEFAULT_MAX_IN_FLIGHT (8)
+#define MAX_IN_FLIGHT (1000)
+#define MAX_RETRIES (10)
+#define DEFAULT_METRICS_INTERVAL (10)
+#define MAX_METRICS_INTERVAL (3600)
+
+/* The batch got to the end, but only by skipping labels with --keep-going. */
+#define EXIT_SKIPPED (2)
+
+/* Long-only options are given values outside the range of `char`, so they
+ * can't collide with the short options. */
+enum
 {
-    BITMAPFILEHEADER *header;
-    BITMAPINFOHEADER *info_header;
-    void *bits;
-    int width, height;
-    int xres, yres;
+    OPT_SINGLE_JOB = 0x100,
+    OPT_JOB_PER_LABEL,
+    OPT_LOADER_THREADS,
+    OPT_REFRESH_PRINTER_CACHE,
+    OPT_SERVE,
+    OPT_LENGTH_PREFIXED,
+    OPT_TIMINGS,
+    OPT_TIMINGS_OUTPUT,
+    OPT_PRESCALE,
+    OPT_RAW,
+    OPT_AUTO_PAPER,
+    OPT_GROUP_BY_PAPER,
+    OPT_MANIFEST,
+    OPT_COPIES,
+    OPT_CACHE_LABELS,
+    OPT_ASYNC,
+    OPT_MAX_IN_FLIGHT,
+    OPT_KEEP_GOING,
+    OPT_RETRIES,
+    OPT_FAILED_LIST,
+    OPT_DITHER,
+    OPT_BAND_ROWS,
+    OPT_CROP,
+    OPT_TEMPLATE,
+    OPT_DATA,
+    OPT_LIST_PRINTERS,
+    OPT_PROFILE,
+    OPT_SAVE_PROFILE,
+    OPT_WATCH,
+    OPT_METRICS,
+    OPT_METRICS_INTERVAL,
 };
 
 static struct option long_options[] = {
     {"printer", required_argument, NULL, 'p'},
     {"paper-size", required_argument, NULL, 's'},
     {"orientation", required_argument, NULL, 'o'},
+    {"profile", required_argument, NULL, OPT_PROFILE},
+    {"save-profile", required_argument, NULL, OPT_SAVE_PROFILE},
+    {"single-job", 0, NULL, OPT_SINGLE_JOB},
+    {"job-per-label", 0, NULL, OPT_JOB_PER_LABEL},
+    {"loader-threads", required_argument, NULL, OPT_LOADER_THREADS},
+    {"refresh-printer-cache", 0, NULL, OPT_REFRESH_PRINTER_CACHE},
+    {"list-printers", 0, NULL, OPT_LIST_PRINTERS},
+    {"serve", optional_argument, NULL, OPT_SERVE},
+    {"watch", required_argument, NULL, OPT_WATCH},
+    {"length-prefixed", 0, NULL, OPT_LENGTH_PREFIXED},
+    {"timings", 0, NULL, OPT_TIMINGS},
+    {"timings-output", required_argument, NULL, OPT_TIMINGS_OUTPUT},
+    {"metrics", required_argument, NULL, OPT_METRICS},
+    {"metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL},
+    {"prescale", 0, NULL, OPT_PRESCALE},
+    {"raw", 0, NULL, OPT_RAW},
+    {"auto-paper", 0, NULL, OPT_AUTO_PAPER},
+    {"group-by-paper", 0, NULL, OPT_GROUP_BY_PAPER},
+    {"manifest", required_argument, NULL, OPT_MANIFEST},
+    {"template", required_argument, NULL, OPT_TEMPLATE},
+    {"data", required_argument, NULL, OPT_DATA},
+    {"copies", required_argument, NULL, OPT_COPIES},
+    {"cache-labels", 0, NULL, OPT_CACHE_LABELS},
+    {"async", 0, NULL, OPT_ASYNC},
+    {"max-in-flight", required_argument, NULL, OPT_MAX_IN_FLIGHT},
+    {"keep-going", 0, NULL, OPT_KEEP_GOING},
+    {"retries", required_argument, NULL, OPT_RETRIES},
+    {"failed-list", required_argument, NULL, OPT_FAILED_LIST},
+    {"dither", 0, NULL, OPT_DITHER},
+    {"band-rows", required_argument, NULL, OPT_BAND_ROWS},
+    {"crop", 0, NULL, OPT_CROP},
     {"help", 0, NULL, 'h'},
     {NULL, 0, NULL, 0}};
 
-static BOOL verbose = FALSE;
-static BOOL dry_run = FALSE;
-
-static void print_usage(void)
-{
-    fprintf(stderr, "Usage: labelprinter [options] [filename...]\n");
-    fprintf(stderr, "Options:\n");
-    fprintf(stderr, "  -p, --printer NAME                      Specify the printer name (default: system default)\n");
-    fprintf(stderr, "  -s, --paper-size SIZE                   Specify the paper size (default: printer default)\n");
-    fprintf(stderr, "  -o, --orientation [landscape|portrait]  Specify the orientation (default: printer default)\n");
-    fprintf(stderr, "  -d, --dry-run                           Do not print, just simulate the operation\n");
-    fprintf(stderr, "  -v, --verbose                           Enable verbose output\n");
-    fprintf(stderr, "  -h, --help                              Display this help message and exit\n");
-    fprintf(stderr, "Arguments:\n");
-    fprintf(stderr, "  filename                                File(s) to process\n");
-}
+BOOL verbose = FALSE;
+BOOL dry_run = FALSE;
 
 /**
- * @brief Get the default printer name.
+ * @brief Get a job from the batch ready to print, now its label is loaded.
  *
- * @return The default printer name, or `NULL` on failure.
+ * @return `NULL` if the job is ready, otherwise why it isn't.
  */
-static char *get_default_printer(void)
+static const char *prepare_batch_job(
+    struct print_target *target,
+    const struct print_job *job,
+    struct label *label,
+    const struct prepare_options *prepare,
+    BOOL paper_may_change)
 {
-    char *printer_name = NULL;
-    DWORD size = 0;
-
-    GetDefaultPrinter(NULL, &size);
-    if (size == 0)
+    if (label == NULL)
     {
-        ERR("Failed to get default printer name.\n");
-        goto exit;
+        ERR("Failed to open %s.\n", job->filename);
+        return "it couldn't be opened";
     }
 
-    printer_name = (char *)malloc(size);
-    if (printer_name == NULL)
+    if (job->printer_name != NULL && _stricmp(job->printer_name, target->printer_name) != 0)
     {
-        ERR("Failed to allocate memory for default printer name.\n");
-        goto exit;
+        ERR("%s is for printer %s, which isn't printing.\n", job->filename, job->printer_name);
+        return "its printer isn't printing";
     }
 
-    if (!GetDefaultPrinter(printer_name, &size))
+    if (paper_may_change)
     {
-        ERR("Failed to get default printer name.\n");
-        goto exit;
-    }
-
-    DBG("Default printer: %s\n", printer_name);
-
-    return printer_name;
+        if (!set_job_paper(target, job, label))
+        {
+            return "its paper couldn't be set up";
+        }
 
-exit:
-    if (printer_name != NULL)
-        free(printer_name);
+        if (!prepare_label(label, prepare))
+        {
+            ERR("Failed to open %s.\n", job->filename);
+            return "it couldn't be prepared";
+        }
+    }
 
     return NULL;
 }
 
-/**
- * @brief Get the default paper size for the specified printer.
- *
- * @param printer The printer to request the default page size name from.
- * @return The default paper size, or `NULL` on failure.
- */
-static char *get_default_paper_size_name(char *printer_name)
+static void print_usage(void)
 {
-    HANDLE printer = INVALID_HANDLE_VALUE;
-    char *paper_size = NULL;
-    DWORD size = 0;
+    fprintf(stderr, "Usage: labelprinter [options] [filename...]\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -p, --printer NAME                      Specify the printer name (default: system default). Repeat to share the labels between printers\n");
+    fprintf(stderr, "  -s, --paper-size SIZE                   Specify the paper size (default: printer default)\n");
+    fprintf(stderr, "  -o, --orientation [landscape|portrait]  Specify the orientation (default: printer default)\n");
+    fprintf(stderr, "      --save-profile NAME                 Save the printer's settings for this paper and orientation as NAME\n");
+    fprintf(stderr, "      --profile NAME                      Print with the settings saved as NAME, instead of asking the driver\n");
+    fprintf(stderr, "      --copies N                          Print N copies of each label (default: 1)\n");
+    fprintf(stderr, "      --manifest FILE                     Read the jobs to print from FILE instead of the command line\n");
+    fprintf(stderr, "      --template FILE                     Compose each label from the template in FILE, instead of a bitmap file\n");
+    fprintf(stderr, "      --data FILE                         With --template, the CSV file with a row for each label\n");
+    fprintf(stderr, "      --auto-paper                        Pick the paper size and orientation that best fits each label\n");
+    fprintf(stderr, "      --group-by-paper                    With --auto-paper, print the labels for each paper size together\n");
+    fprintf(stderr, "      --keep-going                        Skip labels that fail and carry on with the rest of the batch\n");
+    fprintf(stderr, "      --retries N                         Try a label the spooler turns away up to N more times (default: 0)\n");
+    fprintf(stderr, "      --failed-list FILE                  With --keep-going, write the labels that failed to FILE, as a manifest\n");
+    fprintf(stderr, "      --single-job                        Print all labels as pages of one document (default for multiple files)\n");
+    fprintf(stderr, "      --job-per-label                     Print each label as its own document (default for a single file)\n");
+    fprintf(stderr, "      --loader-threads N                  Number of threads loading labels ahead of the printer (default: %d)\n", DEFAULT_LOADER_THREADS);
+    fprintf(stderr, "      --refresh-printer-cache             Ask the driver for its paper sizes again, rather than using the cache\n");
+    fprintf(stderr, "      --list-printers                     List every printer, with its paper sizes and resolution, and exit\n");
+    fprintf(stderr, "      --cache-labels                      Keep recently printed labels in memory, for batches that repeat them (default with --serve)\n");
+    fprintf(stderr, "      --async                             Follow each job through to the printer in the background and report how it went\n");
+    fprintf(stderr, "      --max-in-flight N                   With --async, the most jobs to have in the spooler at once (default: %d)\n", DEFAULT_MAX_IN_FLIGHT);
+    fprintf(stderr, "      --serve[=PIPE]                      Keep running, printing labels sent over a named pipe (default: %s)\n", DEFAULT_PIPE_NAME);
+    fprintf(stderr, "      --watch DIR                         Keep running, printing bitmaps as they're dropped into DIR\n");
+    fprintf(stderr, "      --length-prefixed                   Bitmaps on stdin are each preceded by a 32-bit little-endian length\n");
+    fprintf(stderr, "      --prescale                          Scale monochrome labels to the printer's resolution before sending them\n");
+    fprintf(stderr, "      --dither                            Dither colour and greyscale labels when converting them to black and white\n");
+    fprintf(stderr, "      --band-rows N                       Send labels taller than N rows a band of N rows at a time, to keep memory flat\n");
+    fprintf(stderr, "      --crop                              Send only the inked part of each label, leaving out the white around it\n");
+    fprintf(stderr, "      --raw                               Send files to the printer as-is; they must already be in its own language\n");
+    fprintf(stderr, "      --timings                           Report how long each part of the run took\n");
+    fprintf(stderr, "      --timings-output FILE               Also write the timings to FILE, as JSON if it ends in .json, otherwise CSV\n");
+    fprintf(stderr, "      --metrics FILE                      Keep writing running totals to FILE, in Prometheus' format if it ends in .prom, otherwise as JSON lines\n");
+    fprintf(stderr, "      --metrics-interval N                With --metrics, write them every N seconds (default: %d)\n", DEFAULT_METRICS_INTERVAL);
+    fprintf(stderr, "  -d, --dry-run                           Do not print, just simulate the operation\n");
+    fprintf(stderr, "  -v, --verbose                           Enable verbose output\n");
+    fprintf(stderr, "  -h, --help                              Display this help message and exit\n");
+    fprintf(stderr, "Arguments:\n");
+    fprintf(stderr, "  filename                                File(s) to process, or - to read bitmaps from stdin\n");
+}
 
-    if (!OpenPrinter(printer_name, &printer, NULL))
-    {
-        ERR("Failed to open printer %s.\n", printer_name);
-        goto exit;
-    }
+int main(int argc, char **argv)
+{
+    char *printer_name = NULL, *default_printer_name = NULL;
+    char *printer_names[MAX_DISPATCH_PRINTERS];
+    int printer_count = 0;
+    char *paper_size_name = NULL;
+    char *orientation = NULL;
+    char *profile_name = NULL, *save_profile_name = NULL;
+    BOOL is_landscape = FALSE;
+    BOOL single_job = FALSE, job_mode_set = FALSE;
+    BOOL document_started = FALSE;
+    char doc_name[64];
+    int file_count = 0;
+    int loader_threads = DEFAULT_LOADER_THREADS;
+    char *pipe_name = NULL;
+    char *watch_folder_name = NULL;
+    BOOL use_stdin = FALSE, length_prefixed = FALSE;
+    BOOL timings = FALSE;
+    BOOL raw = FALSE;
+    BOOL cache_labels = FALSE;
+    BOOL async = FALSE;
+    int max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    BOOL keep_going = FALSE;
+    int retries = 0;
+    int band_rows = 0;
+    char *failed_list = NULL;
+    BOOL auto_paper = FALSE, group_by_paper = FALSE;
+    char *manifest_path = NULL;
+    char *template_path = NULL, *data_path = NULL;
+    BOOL job_list;
+    int copies = 1, native_copies;
+    struct job_source source = {0};
+    struct print_job *job = NULL;
+    struct print_job **pages = NULL;
+    int page_count = 0, page_capacity = 0;
+    char *timings_output = NULL;
+    char *metrics_path = NULL;
+    int metrics_interval = DEFAULT_METRICS_INTERVAL;
+    LONGLONG start;
+    int opt;
+    int ret = EXIT_FAILURE;
 
-    /* Get PRINTER_INFO_2, which has the DEVMODE structure we need. */
-    GetPrinter(printer, 2, NULL, 0, &size);
-    if (size == 0)
-    {
-        ERR("Failed to get printer info.\n");
-        goto exit;
-    }
+    SetConsoleOutputCP(CP_UTF8);
 
-    PRINTER_INFO_2 *printer_info = (PRINTER_INFO_2 *)malloc(size);
-    if (printer_info == NULL)
-    {
-        ERR("Failed to allocate memory for printer info.\n");
-        goto exit;
-    }
+    struct print_target target = {0};
+    struct prepare_options prepare = {0}, loader_prepare;
+    BOOL refresh_printer_cache = FALSE;
+    BOOL list_printers_only = FALSE;
+    struct loader *loader = NULL;
+    struct label_stream *stream = NULL;
+    struct label *label = NULL;
+    char *filename = NULL;
 
-    if (!GetPrinter(printer, 2, (void *)printer_info, size, &size))
+    while ((opt = getopt_long(
+                argc,
+                argv,
+                "p:s:o:dvh",
+                long_options,
+                NULL)) != -1)
     {
-        ERR("Failed to get printer info.\n");
-        goto exit;
-    }
+        switch (opt)
+        {
+        case 'p':
+            if (printer_count >= MAX_DISPATCH_PRINTERS)
+            {
+                ERR("Can't print to more than %d printers at once.\n", MAX_DISPATCH_PRINTERS);
+                exit(EXIT_FAILURE);
+            }
+
+            printer_names[printer_count++] = optarg;
+            printer_name = printer_names[0];
+            break;
 
-    if (printer_info->pDevMode == NULL)
-    {
-        ERR("DEVMODE not found in printer info.\n");
-        goto exit;
-    }
+        case 's':
+            paper_size_name = optarg;
+            break;
 
-    paper_size = strdup(printer_info->pDevMode->dmFormName);
-    if (paper_size == NULL)
-    {
-        ERR("Failed to allocate memory for paper size name.\n");
-        goto exit;
-    }
+        case 'o':
+            orientation = optarg;
+            break;
 
-    if (!ClosePrinter(printer))
-    {
-        ERR("Failed to close printer.\n");
-        goto exit;
-    }
+        case 'd':
+            dry_run = TRUE;
+            break;
 
-    DBG("Default paper size: %s\n", paper_size);
+        case OPT_PROFILE:
+            profile_name = optarg;
+            break;
 
-    return paper_size;
+        case OPT_SAVE_PROFILE:
+            save_profile_name = optarg;
+            break;
 
-exit:
-    if (printer != INVALID_HANDLE_VALUE)
-        ClosePrinter(printer);
+        case OPT_SINGLE_JOB:
+            single_job = TRUE;
+            job_mode_set = TRUE;
+            break;
 
-    if (printer_info != NULL)
-        free(printer_info);
+        case OPT_JOB_PER_LABEL:
+            single_job = FALSE;
+            job_mode_set = TRUE;
+            break;
 
-    return NULL;
-}
+        case OPT_REFRESH_PRINTER_CACHE:
+            refresh_printer_cache = TRUE;
+            break;
 
-/**
- * @brief Get the paper size for the named paper size.
- *
- * @param printer_name The name of the printer to request the details from.
- * @param paper_size_name The name of the paper size to get.
- * @return The paper size, or `NULL` on failure.
- */
-static struct paper_size *get_paper_size(
-    char *printer_name, char *paper_size_name)
-{
-    struct paper_size *paper_size = NULL;
+        case OPT_LIST_PRINTERS:
+            list_printers_only = TRUE;
+            break;
 
-    int paper_count = 0;
-    short *sizes = NULL;
-    POINT *dimensions = NULL;
-    char *names = NULL;
+        case OPT_SERVE:
+            pipe_name = optarg != NULL ? optarg : DEFAULT_PIPE_NAME;
+            break;
 
-    /* We need to get DM_PAPERS and DM_PAPERSIZE from the driver - and we
-     * do a bit of a dance to get there. First we get the size of the
-     * structure, and then we get the structure itself! Any failures, we
-     * need to clean up before returning. */
+        case OPT_WATCH:
+            watch_folder_name = optarg;
+            break;
 
-    paper_count = DeviceCapabilities(
-        printer_name, NULL, DC_PAPERS, NULL, NULL);
-    if (paper_count <= 0)
-    {
-        ERR("Failed to get paper sizes.\n");
-        goto exit;
-    }
+        case OPT_LENGTH_PREFIXED:
+            length_prefixed = TRUE;
+            break;
 
-    DBG("Paper count: %d\n", paper_count);
+        case OPT_PRESCALE:
+            prepare.prescale = TRUE;
+            break;
 
-    sizes = (short *)malloc(paper_count * sizeof(short));
-    if (sizes == NULL)
-    {
-        ERR("Failed to allocate memory for paper sizes.\n");
-        goto exit;
-    }
+        case OPT_CROP:
+            prepare.crop = TRUE;
+            break;
 
-    if (DeviceCapabilities(
-            printer_name, NULL, DC_PAPERS, (char *)sizes, NULL) <= 0)
-    {
-        ERR("Failed to get paper sizes.\n");
-        goto exit;
-    }
+        case OPT_RAW:
+            raw = TRUE;
+            break;
 
-    dimensions = (POINT *)malloc(paper_count * sizeof(POINT));
-    if (dimensions == NULL)
-    {
-        ERR("Failed to allocate memory for paper sizes.\n");
-        goto exit;
-    }
+        case OPT_DITHER:
+            convert_dither_enable();
+            break;
 
-    if (DeviceCapabilities(
-            printer_name, NULL, DC_PAPERSIZE, (char *)dimensions, NULL) <= 0)
-    {
-        ERR("Failed to get paper dimensions.\n");
-        goto exit;
-    }
+        case OPT_BAND_ROWS:
+            band_rows = atoi(optarg);
+            if (band_rows < 1)
+            {
+                ERR("Band rows must be at least 1.\n");
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-    names = (char *)malloc(paper_count * PAPER_NAME_SIZE);
-    if (names == NULL)
-    {
-        ERR("Failed to allocate memory for paper names.\n");
-        goto exit;
-    }
+        case OPT_CACHE_LABELS:
+            cache_labels = TRUE;
+            break;
 
-    if (DeviceCapabilities(
-            printer_name, NULL, DC_PAPERNAMES, (char *)names, NULL) <= 0)
-    {
-        ERR("Failed to get paper names.\n");
-        goto exit;
-    }
+        case OPT_ASYNC:
+            async = TRUE;
+            break;
 
-    /* The arrays all share the same indicies - so we will search by name
-     * and then copy the details across. */
-    for (int i = 0; i < paper_count; i++)
-    {
-        const char *name = names + (i * PAPER_NAME_SIZE);
-        DBG("Checking paper size: %s\n", name);
-        if (strncmp(name, paper_size_name, PAPER_NAME_SIZE) != 0)
-            continue;
+        case OPT_MAX_IN_FLIGHT:
+            max_in_flight = atoi(optarg);
+            if (max_in_flight < 1 || max_in_flight > MAX_IN_FLIGHT)
+            {
+                ERR("Jobs in flight must be between 1 and %d.\n", MAX_IN_FLIGHT);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
 
-        /* We found it! */
-        paper_size = (struct paper_size *)malloc(sizeof(struct paper_size));
-        if (paper_size == NULL)
-        {
-            ERR("Failed to allocate memory for paper size structure.\n");
-            goto exit;
-        }
+            async = TRUE;
+            break;
 
-        snprintf(paper_size->name, PAPER_NAME_SIZE, "%s", name);
-        paper_size->size = sizes[i];
-        paper_size->width_mm = dimensions[i].x / 10.0f;
-        paper_size->height_mm = dimensions[i].y / 10.0f;
-        break;
-    }
+        case OPT_KEEP_GOING:
+            keep_going = TRUE;
+            break;
 
-    if (paper_size == NULL)
-    {
-        ERR("Failed to find matching paper size.\n");
-        goto exit;
-    }
+        case OPT_RETRIES:
+            retries = atoi(optarg);
+            if (retries < 0 || retries > MAX_RETRIES)
+            {
+                ERR("Retries must be between 0 and %d.\n", MAX_RETRIES);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-    DBG("Found paper size: name=%s, size=%d, width=%.1f mm, height=%.1f mm\n",
-        paper_size->name,
-        paper_size->size,
-        paper_size->width_mm,
-        paper_size->height_mm);
+        case OPT_FAILED_LIST:
+            failed_list = optarg;
+            break;
 
-exit:
-    if (sizes != NULL)
-        free(sizes);
+        case OPT_COPIES:
+            copies = atoi(optarg);
+            if (copies < 1 || copies > MAX_JOB_COPIES)
+            {
+                ERR("Copies must be between 1 and %d.\n", MAX_JOB_COPIES);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-    if (dimensions != NULL)
-        free(dimensions);
+        case OPT_MANIFEST:
+            manifest_path = optarg;
+            break;
 
-    if (names != NULL)
-        free(names);
+        case OPT_TEMPLATE:
+            template_path = optarg;
+            break;
 
-    return paper_size;
-}
+        case OPT_DATA:
+            data_path = optarg;
+            break;
 
-static DEVMODE *set_paper_size(
-    char *printer_name,
-    struct paper_size *paper_size,
-    BOOL landscape)
-{
-    DEVMODE *devmode = NULL;
-    HANDLE printer = INVALID_HANDLE_VALUE;
-    int devmode_size = 0;
+        case OPT_AUTO_PAPER:
+            auto_paper = TRUE;
+            break;
 
-    DBG("Setting paper size to %s\n", paper_size->name, paper_size->size);
+        case OPT_GROUP_BY_PAPER:
+            group_by_paper = TRUE;
+            break;
 
-    if (!OpenPrinter(printer_name, &printer, NULL))
-    {
-        ERR("Failed to open printer %s.\n", printer_name);
-        goto exit;
-    }
+        case OPT_TIMINGS:
+            timings = TRUE;
+            break;
 
-    devmode_size = DocumentProperties(
-        NULL, printer, (char *)printer_name, NULL, NULL, 0);
+        case OPT_TIMINGS_OUTPUT:
+            timings = TRUE;
+            timings_output = optarg;
+            break;
 
-    if (devmode_size <= 0)
-    {
-        ERR("Failed to get printer properties size.\n");
-        goto exit;
-    }
+        case OPT_METRICS:
+            metrics_path = optarg;
+            break;
 
-    devmode = (DEVMODE *)malloc(devmode_size);
-    if (devmode == NULL)
-    {
-        ERR("Failed to allocate memory for printer properties.\n");
-        goto exit;
-    }
+        case OPT_METRICS_INTERVAL:
+            metrics_interval = atoi(optarg);
+            if (metrics_interval < 1 || metrics_interval > MAX_METRICS_INTERVAL)
+            {
+                ERR("Metrics interval must be between 1 and %d seconds.\n", MAX_METRICS_INTERVAL);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-    if (DocumentProperties(
-            NULL,
-            printer,
-            printer_name,
-            devmode,
-            NULL,
-            DM_OUT_BUFFER) != IDOK)
-    {
-        ERR("Failed to get printer properties.\n");
-        goto exit;
-    }
+        case OPT_LOADER_THREADS:
+            loader_threads = atoi(optarg);
+            if (loader_threads < 0 || loader_threads > MAX_LOADER_THREADS)
+            {
+                ERR("Loader threads must be between 0 and %d.\n", MAX_LOADER_THREADS);
+                print_usage();
+                exit(EXIT_FAILURE);
+            }
+            break;
 
-    /* Configure our page settings. */
-    devmode->dmFields |= DM_PAPERSIZE | DM_ORIENTATION;
-    devmode->dmPaperSize = paper_size->size;
-    devmode->dmOrientation = landscape ? DMORIENT_LANDSCAPE : DMORIENT_PORTRAIT;
+        case 'v':
+            verbose = TRUE;
+            break;
 
-    if (!dry_run)
-    {
-        if (DocumentProperties(
-                NULL,
-                printer,
-                printer_name,
-                devmode,
-                devmode,
-                (DM_IN_BUFFER | DM_OUT_BUFFER)) != IDOK ||
-            devmode == NULL)
-        {
-            ERR("Failed to set paper size or devmode is invalid.\n");
-            goto exit;
+        case 'h':
+            print_usage();
+            exit(EXIT_SUCCESS);
+            break;
+
+        case '?':
+            print_usage();
+            exit(EXIT_FAILURE);
+            break;
         }
     }
 
-    DBG("Printer properties: paper size=%d, orientation=%s\n",
-        devmode->dmPaperSize,
-        (devmode->dmOrientation == DMORIENT_LANDSCAPE) ? "landscape" : "portrait");
-
-    return devmode;
-
-exit:
-    if (printer != INVALID_HANDLE_VALUE)
-        ClosePrinter(printer);
-
-    if (devmode != NULL)
+    /* Listing the printers is all we'll do, so there's nothing else to
+     * check. */
+    if (list_printers_only)
     {
-        free(devmode);
-    }
-
-    return NULL;
-}
+        if (argc - optind > 0)
+        {
+            ERR("--list-printers can't be used with files.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
 
-static struct label *open_label(char *filename)
-{
-    HANDLE f;
-    DWORD sizel, sizeh, bytes_read;
-    void *file_data = NULL;
-    BOOL success = FALSE;
-    BITMAPFILEHEADER *header = NULL;
-    struct label *label = NULL;
+        exit(list_printers(refresh_printer_cache) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
 
-    if (filename == NULL)
+    if (profile_name != NULL || save_profile_name != NULL)
     {
-        ERR("Filename is NULL.\n");
-        return NULL;
-    }
+        if (profile_name != NULL && save_profile_name != NULL)
+        {
+            ERR("--profile can't be used with --save-profile.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
 
-    DBG("Opening label file: %s\n", filename);
+        if (raw || printer_count > 1)
+        {
+            ERR("Profiles can't be used with --raw or more than one printer.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
 
-    f = CreateFile(
-        filename,
-        GENERIC_READ,
-        FILE_SHARE_READ,
-        NULL,
-        OPEN_EXISTING,
-        FILE_FLAG_SEQUENTIAL_SCAN,
-        NULL);
+        /* The profile has these already. */
+        if (profile_name != NULL && (paper_size_name != NULL || orientation != NULL))
+        {
+            ERR("--profile can't be used with --paper-size or --orientation.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
 
-    if (f == INVALID_HANDLE_VALUE)
-    {
-        goto exit;
+        /* A dry run never has the driver fill in its own settings, so
+         * there'd be nothing worth saving. */
+        if (save_profile_name != NULL && dry_run)
+        {
+            ERR("--save-profile can't be used with --dry-run.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
     }
 
-    sizel = GetFileSize(f, &sizeh);
-    if (sizeh > 0)
+    /* Like a server, a watched folder brings its own labels one at a time. */
+    if (watch_folder_name != NULL &&
+        (argc - optind > 0 || pipe_name != NULL || raw || printer_count > 1 ||
+         manifest_path != NULL || template_path != NULL || copies > 1 || keep_going))
     {
-        ERR("%s is too large to process.\n", filename);
-        goto exit;
+        ERR("--watch can't be used with files, --serve, --raw, --manifest, --template, --copies, --keep-going or more than one printer.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    file_data = malloc(sizel);
-    if (file_data == NULL)
+    if (raw && pipe_name != NULL)
     {
-        ERR("Failed to allocate memory for file data.\n");
-        goto exit;
+        ERR("--raw can't be used with --serve.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    success = ReadFile(f, file_data, sizel, &bytes_read, NULL);
-    if (!success || bytes_read != sizel)
+    if (printer_count > 1 && (raw || pipe_name != NULL))
     {
-        goto exit;
+        ERR("Only one printer can be used with --raw or --serve.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    DBG("Read %d bytes\n", bytes_read);
-
-    header = (BITMAPFILEHEADER *)file_data;
-    DBG("Bitmap type: %x\n", header->bfType);
-    DBG("Bitmap size: %d\n", header->bfSize);
-
-    /* Ensure we're dealing with a bitmap file. */
-    if ((header->bfType != 0x4D42) ||
-        (header->bfSize != sizel))
+    if (copies > 1 && (raw || pipe_name != NULL))
     {
-        ERR("%s is not a valid bitmap file.\n", filename);
-        goto exit;
+        ERR("--copies can't be used with --raw or --serve.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    /* Ensure the file is well-formed. */
-    if (header->bfOffBits < (sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) ||
-        header->bfOffBits > sizel)
+    if (async && raw)
     {
-        ERR("%s is not a valid bitmap file.\n", filename);
-        goto exit;
+        ERR("--async can't be used with --raw.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    /* Create our label structure. */
-    label = (struct label *)malloc(sizeof(struct label));
-    if (label == NULL)
+    if (keep_going && (raw || pipe_name != NULL))
     {
-        ERR("Failed to allocate memory for label structure.\n");
-        goto exit;
+        ERR("--keep-going can't be used with --raw or --serve.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    label->header = header;
-    label->info_header = (BITMAPINFOHEADER *)(header + 1);
-    label->bits = (char *)header + header->bfOffBits;
-    label->width = label->info_header->biWidth;
-    label->height = label->info_header->biHeight;
-    label->xres = label->info_header->biXPelsPerMeter;
-    label->yres = label->info_header->biYPelsPerMeter;
-
-    DBG("Bitmap width: %d px\n", label->width);
-    DBG("Bitmap height: %d px\n", label->height);
-    DBG("Bitmap xres: %d px/m\n", label->xres);
-    DBG("Bitmap yres: %d px/m\n", label->yres);
-
-    CloseHandle(f);
-    f = INVALID_HANDLE_VALUE;
-
-    return label;
-
-exit:
-    if (f != INVALID_HANDLE_VALUE)
-        CloseHandle(f);
-
-    if (file_data != NULL)
-        free(file_data);
-
-    if (label != NULL)
-        free(label);
-
-    return NULL;
-}
-
-static void close_label(struct label *label)
-{
-    if (label == NULL)
-        return;
-
-    if (label->header != NULL)
-        free(label->header);
-
-    free(label);
-}
-
-static BOOL print_label(
-    HDC printer_context,
-    char *printer_name,
-    char *filename)
-{
-    BOOL success = FALSE;
-    struct label *label = NULL;
-
-    int page_w, page_h;
-    int print_w, print_h;
-    int print_resx, print_resy;
-    int print_offx, print_offy;
-
-    int bitmap_print_w, bitmap_print_h;
-    int bitmap_print_offx, bitmap_print_offy;
-
-    int saved_state = 0;
-    DOCINFOA doc_info = {0};
-
-    label = open_label(filename);
-    if (label == NULL)
+    if (failed_list != NULL && !keep_going)
     {
-        ERR("Failed to open %s.\n", filename);
-        goto exit;
+        ERR("--failed-list needs --keep-going.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    /* Figure out the printable area in pixels, and the resolution in
-     * pixels per meter. */
-    page_w = GetDeviceCaps(printer_context, PHYSICALWIDTH);
-    page_h = GetDeviceCaps(printer_context, PHYSICALHEIGHT);
-    print_w = GetDeviceCaps(printer_context, HORZRES);
-    print_h = GetDeviceCaps(printer_context, VERTRES);
-
-    print_resx = GetDeviceCaps(printer_context, LOGPIXELSX) * 10000 / 254;
-    print_resy = GetDeviceCaps(printer_context, LOGPIXELSY) * 10000 / 254;
-
-    print_offx = GetDeviceCaps(printer_context, PHYSICALOFFSETX);
-    print_offy = GetDeviceCaps(printer_context, PHYSICALOFFSETY);
-
-    DBG("Page size: %d x %d px\n", page_w, page_h);
-    DBG("Printable area: %d x %d px\n", print_w, print_h);
-    DBG("Printer resolution: %d x %d px/m\n", print_resx, print_resy);
-    DBG("Printer offset: %d x %d px\n", print_offx, print_offy);
-
-    /* Convert bitmap into printer units and calculate offset
-     * to center on printable area. */
-    bitmap_print_w = (label->width * print_resx) / label->xres;
-    bitmap_print_h = (label->height * print_resy) / label->yres;
-    bitmap_print_offx = (print_w - bitmap_print_w) / 2;
-    bitmap_print_offy = (print_h - bitmap_print_h) / 2;
-
-    DBG("Bitmap print size: %d x %d px\n", bitmap_print_w, bitmap_print_h);
-    DBG("Bitmap print offset: %d x %d px\n", bitmap_print_offx, bitmap_print_offy);
-
-    /* Before we mess with the printer, we'll store its state. */
-    saved_state = SaveDC(printer_context);
-    if (saved_state <= 0)
+    if (group_by_paper && !auto_paper)
     {
-        ERR("Failed to save printer context.\n");
-        goto exit;
+        ERR("--group-by-paper needs --auto-paper.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    /* Set up the coordinate space to handle the scaling. */
-    if (SetMapMode(printer_context, MM_ANISOTROPIC) == 0)
+    if (auto_paper && raw)
     {
-        ERR("Failed to set map mode.\n");
-        goto exit;
+        ERR("--auto-paper can't be used with --raw.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    if (SetWindowExtEx(
-            printer_context,
-            label->width,
-            label->height,
-            NULL) == 0)
+    if ((template_path != NULL) != (data_path != NULL))
     {
-        ERR("Failed to set window extents.\n");
-        goto exit;
+        ERR("--template and --data go together.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    if (SetViewportExtEx(
-            printer_context,
-            bitmap_print_w,
-            bitmap_print_h,
-            NULL) == 0)
+    file_count = argc - optind;
+    if (template_path != NULL)
     {
-        ERR("Failed to set viewport extents.\n");
-        goto exit;
-    }
+        if (file_count > 0 || manifest_path != NULL || pipe_name != NULL || raw || group_by_paper)
+        {
+            ERR("--template can't be used with files, --manifest, --serve, --raw or --group-by-paper.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
 
-    if (SetViewportOrgEx(
-            printer_context,
-            bitmap_print_offx,
-            bitmap_print_offy,
-            NULL) == 0)
-    {
-        ERR("Failed to set viewport origin.\n");
-        goto exit;
+        /* There are no files to list, just rows. */
+        if (failed_list != NULL)
+        {
+            ERR("--failed-list can't be used with --template.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
     }
-
-    /* Our print job will be a document with just one page in it. */
-    doc_info.cbSize = sizeof(DOCINFOA);
-    doc_info.lpszDocName = filename;
-    doc_info.lpszOutput = NULL;
-    doc_info.lpszDatatype = NULL;
-    doc_info.fwType = 0;
-
-    if (dry_run)
+    else if (manifest_path != NULL)
     {
-        /* Skip the actual print. */
-        success = TRUE;
-        goto exit;
+        if (file_count > 0 || pipe_name != NULL || raw || group_by_paper)
+        {
+            ERR("--manifest can't be used with files, --serve, --raw or --group-by-paper.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
     }
-
-    if (StartDocA(
-            printer_context,
-            &doc_info) <= 0)
+    else if (file_count <= 0 && pipe_name == NULL && watch_folder_name == NULL && save_profile_name == NULL)
     {
-        ERR("Failed to start document.\n");
-        goto exit;
+        ERR("No files to process!\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    if (StartPage(printer_context) <= 0)
+    for (int i = 0; i < file_count; i++)
     {
-        ERR("Failed to start page.\n");
-        goto exit;
-    }
+        if (strcmp(argv[optind + i], "-") != 0)
+            continue;
 
-    if (StretchDIBits(
-            printer_context,
-            0, 0, label->width, label->height,
-            0, 0, label->width, label->height,
-            label->bits,
-            (BITMAPINFO *)label->info_header,
-            DIB_RGB_COLORS,
-            SRCCOPY) <= 0)
-    {
-        ERR("Failed to print label.\n");
-        goto exit;
+        if (file_count > 1)
+        {
+            ERR("- can't be combined with other files.\n");
+            print_usage();
+            exit(EXIT_FAILURE);
+        }
+
+        use_stdin = TRUE;
     }
 
-    if (EndPage(printer_context) <= 0)
+    if (use_stdin && printer_count > 1)
     {
-        ERR("Failed to end page.\n");
-        goto exit;
+        ERR("Only one printer can be used when reading from stdin.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    if (EndDoc(printer_context) <= 0)
+    /* Labels from stdin can't be read again, so there's nothing a list of
+     * them would be good for. */
+    if (use_stdin && keep_going)
     {
-        ERR("Failed to end document.\n");
-        goto exit;
+        ERR("--keep-going can't be used when reading from stdin.\n");
+        print_usage();
+        exit(EXIT_FAILURE);
     }
 
-    success = TRUE;
+    /* Manifests and templates both carry their own jobs, which can each ask
+     * for their own copies and paper. */
+    job_list = manifest_path != NULL || template_path != NULL;
 
-exit:
-    if (label != NULL)
+    if (failed_list != NULL && !failure_list_open(failed_list))
     {
-        close_label(label);
+        exit(EXIT_FAILURE);
     }
 
-    if (saved_state > 0 && !RestoreDC(printer_context, saved_state))
+    if (timings)
     {
-        ERR("Failed to restore printer context.\n");
-        success = FALSE;
+        timing_enable();
     }
 
-    return success;
-}
-
-int main(int argc, char **argv)
-{
-    char *printer_name = NULL, *default_printer_name = NULL;
-    char *paper_size_name = NULL, *default_paper_size_name = NULL;
-    char *orientation = NULL;
-    BOOL is_landscape = FALSE;
-    int file_count = 0;
-    int opt;
-
-    SetConsoleOutputCP(CP_UTF8);
-
-    HDC context = NULL;
-    DEVMODE *devmode = NULL;
-    struct paper_size *paper_size = NULL;
-
-    while ((opt = getopt_long(
-                argc,
-                argv,
-                "p:s:o:dvh",
-                long_options,
-                NULL)) != -1)
+    /* Before any printer is opened, so each one gets its counters. */
+    if (metrics_path != NULL && !metrics_enable(metrics_path, metrics_interval))
     {
-        switch (opt)
-        {
-        case 'p':
-            printer_name = optarg;
-            break;
-
-        case 's':
-            paper_size_name = optarg;
-            break;
-
-        case 'o':
-            orientation = optarg;
-            break;
-
-        case 'd':
-            dry_run = TRUE;
-            break;
-
-        case 'v':
-            verbose = TRUE;
-            break;
-
-        case 'h':
-            print_usage();
-            exit(EXIT_SUCCESS);
-            break;
+        exit(EXIT_FAILURE);
+    }
 
-        case '?':
-            print_usage();
-            exit(EXIT_FAILURE);
-            break;
-        }
+    /* A server sees the same labels over and over, so it's worth holding on
+     * to them. */
+    if (cache_labels || pipe_name != NULL)
+    {
+        label_cache_enable();
     }
 
-    file_count = argc - optind;
-    if (file_count <= 0)
+    /* Every spool job makes the driver redo its job setup, so batches go
+     * out as one document unless we're told otherwise. */
+    if (!job_mode_set)
     {
-        ERR("No files to process!\n");
-        print_usage();
-        exit(EXIT_FAILURE);
+        single_job = file_count > 1 || job_list;
     }
 
     if (orientation != NULL)
@@ -778,7 +717,9 @@ int main(int argc, char **argv)
     /* Grab the printer */
     if (printer_name == NULL)
     {
+        start = timing_start();
         default_printer_name = get_default_printer();
+        timing_end(PHASE_PRINTER_DISCOVERY, start);
 
         if (default_printer_name == NULL)
         {
@@ -788,79 +729,401 @@ int main(int argc, char **argv)
         printer_name = default_printer_name;
     }
 
-    /* Grab the paper size. */
-    if (paper_size_name == NULL)
+    /* Raw files are already everything the printer needs, so there's
+     * nothing to set up. */
+    if (raw)
     {
-        default_paper_size_name = get_default_paper_size_name(printer_name);
+        printf(" 🖨️ %s (raw)\n", printer_name);
+        if (print_raw(printer_name, &argv[optind], file_count, single_job))
+            ret = EXIT_SUCCESS;
 
-        if (default_paper_size_name == NULL)
+        goto exit;
+    }
+
+    if (dry_run)
+    {
+        printf(" ⚠️ Dry run only.\n");
+    }
+
+    if (template_path != NULL)
+    {
+        if (!open_template_job_source(&source, template_path, data_path, copies))
+        {
+            goto exit;
+        }
+    }
+    else if (manifest_path != NULL)
+    {
+        if (!open_manifest_job_source(&source, manifest_path, copies))
         {
             goto exit;
         }
+    }
+    else
+    {
+        open_file_job_source(&source, &argv[optind], file_count, copies);
+    }
+
+    /* When every label wants the same number of copies, the driver can print
+     * them for the whole document. Manifests and data can ask for different
+     * numbers for each label, which one document can't do. */
+    native_copies = job_list && single_job ? 1 : copies;
+
+    /* With several printers, each one sets itself up on its own thread. */
+    if (printer_count > 1)
+    {
+        struct dispatch_options options = {
+            .paper_size_name = paper_size_name,
+            .landscape = is_landscape,
+            .refresh_printer_cache = refresh_printer_cache,
+            .auto_paper = auto_paper,
+            .single_job = single_job,
+            .copies = native_copies,
+            .prescale = prepare.prescale,
+            .crop = prepare.crop,
+            .max_in_flight = async ? max_in_flight : 0,
+            .retries = retries,
+            .band_rows = band_rows,
+            .keep_going = keep_going,
+        };
+
+        /* The printers are meant to be identical, so the first one's paper
+         * sizes are as good as any for grouping the labels. */
+        if (group_by_paper)
+        {
+            struct printer_session session;
+            struct paper_table *table = NULL;
+            BOOL grouped;
+
+            if (open_printer_session(&session, printer_names[0]))
+                table = get_paper_table(&session, refresh_printer_cache);
+
+            close_printer_session(&session);
 
-        paper_size_name = default_paper_size_name;
+            grouped = table != NULL &&
+                      group_labels_by_paper(table, &argv[optind], file_count);
+
+            if (table != NULL)
+                free_paper_table(table);
+
+            if (!grouped)
+                goto exit;
+        }
+
+        if (dispatch_labels(printer_names, printer_count, &source, &options))
+            ret = EXIT_SUCCESS;
+
+        goto exit;
     }
 
-    paper_size = get_paper_size(printer_name, paper_size_name);
-    if (paper_size == NULL)
+    if (!open_print_target(
+            &target,
+            printer_name,
+            paper_size_name,
+            is_landscape,
+            native_copies,
+            profile_name,
+            refresh_printer_cache))
     {
         goto exit;
     }
 
-    printf(" 🖨️ %s\n", printer_name);
-    printf(
-        " 📄 %s (%s) %.1f x %.1f mm\n",
-        paper_size_name,
-        orientation,
-        paper_size->width_mm,
-        paper_size->height_mm);
+    if (save_profile_name != NULL)
+    {
+        if (!save_print_profile(&target, save_profile_name))
+        {
+            goto exit;
+        }
 
-    if (dry_run)
+        /* Saving a profile needs nothing to print. */
+        if (file_count <= 0 && pipe_name == NULL && watch_folder_name == NULL && !job_list)
+        {
+            ret = EXIT_SUCCESS;
+            goto exit;
+        }
+    }
+
+    target.auto_paper = auto_paper;
+    target.retries = retries;
+    target.band_rows = band_rows;
+    prepare.geometry = &target.geometry;
+
+    /* Once a job's in the spooler, we move on to the next one and leave the
+     * tracker to find out whether it printed. */
+    if (async && !dry_run)
     {
-        printf(" ⚠️ Dry run only.\n");
+        target.tracker = start_job_tracker(&target.session, max_in_flight);
+        if (target.tracker == NULL)
+        {
+            goto exit;
+        }
     }
 
-    /* Set up the printer context for printing the labels. */
-    devmode = set_paper_size(printer_name, paper_size, is_landscape);
-    if (devmode == NULL)
+    /* In server mode, labels come from the pipe instead of the command line,
+     * and we keep everything we've set up so far for as long as we run. */
+    if (pipe_name != NULL)
     {
+        serve(pipe_name, &target, &prepare);
         goto exit;
     }
 
-    context = CreateDC("WINSPOOL", printer_name, NULL, devmode);
-    if (context == NULL)
+    if (watch_folder_name != NULL)
     {
-        ERR("Failed to create printer context.\n");
+        watch_folder(watch_folder_name, &target, &prepare);
         goto exit;
     }
 
-    for (int i = 0; i < file_count; i++)
+    if (group_by_paper && !use_stdin &&
+        !group_labels_by_paper(target.paper_table, &argv[optind], file_count))
     {
-        char *filename = argv[optind + i];
-        if (!print_label(context, printer_name, filename))
+        goto exit;
+    }
+
+    if (single_job && !dry_run)
+    {
+        if (job_list)
+            snprintf(doc_name, sizeof(doc_name), "labelprinter (%s)", template_path != NULL ? data_path : manifest_path);
+        else
+            snprintf(doc_name, sizeof(doc_name), "labelprinter (%d labels)", file_count);
+
+        if (!start_document(&target, doc_name))
+        {
+            goto exit;
+        }
+
+        document_started = TRUE;
+    }
+
+    /* Labels piped in are printed as they arrive. There's no way of telling
+     * how many there will be, so each one is its own document unless we're
+     * told otherwise. */
+    if (use_stdin)
+    {
+        stream = open_label_stream(GetStdHandle(STD_INPUT_HANDLE), length_prefixed);
+        if (stream == NULL)
+        {
+            goto exit;
+        }
+
+        for (;;)
+        {
+            if (!read_label_stream(stream, &label, &filename))
+            {
+                ERR("Failed to open %s.\n", filename);
+                goto exit;
+            }
+
+            if (label == NULL)
+                break;
+
+            if (!fit_print_target(&target, label))
+            {
+                goto exit;
+            }
+
+            if (!prepare_label(label, &prepare))
+            {
+                ERR("Failed to open %s.\n", filename);
+                goto exit;
+            }
+
+            if (!print_label_copies(&target, label, filename, copies, !single_job))
+            {
+                ERR("Failed to print %s.\n", filename);
+                goto exit;
+            }
+
+            close_label(label);
+            label = NULL;
+
+            printf(" 🏷️ %s\n", filename);
+        }
+    }
+    else
+    {
+        /* Labels are loaded ahead of time on the loader's threads, while
+         * this thread keeps the printer context busy. When the paper can
+         * change from label to label, we can't prescale until we know what
+         * it's going to be. */
+        BOOL paper_may_change = auto_paper || job_list;
+
+        loader_prepare = prepare;
+        loader_prepare.prescale = prepare.prescale && !paper_may_change;
+
+        loader = loader_start(&source, loader_threads, &loader_prepare);
+        if (loader == NULL)
         {
-            ERR("Failed to print %s.\n", filename);
             goto exit;
         }
 
-        printf(" 🏷️ %s\n", filename);
+        while (loader_next(loader, &job, &label))
+        {
+            const char *failure;
+
+            /* After a failed page, the labels that follow go in a new
+             * document. */
+            if (single_job && !dry_run && !document_started)
+            {
+                if (!start_document(&target, doc_name))
+                {
+                    goto exit;
+                }
+
+                document_started = TRUE;
+            }
+
+            failure = prepare_batch_job(&target, job, label, &prepare, paper_may_change);
+            if (failure == NULL &&
+                !print_label_copies(&target, label, job->filename, job->copies, !single_job))
+            {
+                ERR("Failed to print %s.\n", job->filename);
+                failure = "it failed to print";
+
+                /* The page might be half done, and it takes the rest of the
+                 * document down with it. */
+                if (document_started)
+                {
+                    document_started = FALSE;
+                    abort_document(&target);
+
+                    for (int i = 0; i < page_count; i++)
+                    {
+                        record_failed_job(pages[i], "its document was abandoned");
+                        free_print_job(pages[i]);
+                    }
+
+                    page_count = 0;
+                }
+            }
+
+            if (label != NULL)
+            {
+                close_label(label);
+                label = NULL;
+            }
+
+            if (failure != NULL)
+            {
+                if (!keep_going)
+                    goto exit;
+
+                record_failed_job(job, failure);
+            }
+            else
+            {
+                printf(" 🏷️ %s\n", job->filename);
+
+                /* Until the document's ended, its labels haven't really
+                 * printed, so we hang on to them in case it isn't. */
+                if (document_started && keep_going)
+                {
+                    if (!append_print_job(&pages, &page_count, &page_capacity, job))
+                        goto exit;
+
+                    job = NULL;
+                }
+            }
+
+            free_print_job(job);
+            job = NULL;
+        }
+
+        /* A bad line in the manifest or data stops the batch where it is. */
+        if (source.failed)
+        {
+            goto exit;
+        }
     }
 
+    if (document_started)
+    {
+        document_started = FALSE;
+        if (!end_document(&target))
+        {
+            for (int i = 0; i < page_count; i++)
+                record_failed_job(pages[i], "its document failed");
+
+            goto exit;
+        }
+    }
+
+    ret = EXIT_SUCCESS;
+
 exit:
+    if (label != NULL)
+        close_label(label);
+
+    /* If we stopped part way through, a re-run needs to know about
+     * everything we didn't get to. */
+    if (keep_going)
+    {
+        if (document_started)
+        {
+            for (int i = 0; i < page_count; i++)
+                record_failed_job(pages[i], "the batch stopped before its document was finished");
+        }
+
+        if (job != NULL)
+            record_failed_job(job, "the batch stopped");
+
+        /* Only the jobs are needed, so nothing more is loaded. */
+        while (loader != NULL ? loader_next_job(loader, &job) : next_job(&source, &job))
+        {
+            record_failed_job(job, "the batch stopped before it");
+            free_print_job(job);
+        }
+
+        label = NULL;
+        job = NULL;
+    }
+
+    for (int i = 0; i < page_count; i++)
+        free_print_job(pages[i]);
+
+    free(pages);
+
+    if (job != NULL)
+        free_print_job(job);
+
+    if (loader != NULL)
+        loader_stop(loader);
+
+    close_job_source(&source);
+
+    if (stream != NULL)
+        close_label_stream(stream);
+
+    if (document_started)
+        abort_document(&target);
+
+    /* Wait for whatever we've spooled, so we can say whether it printed. */
+    if (!stop_job_tracker(target.tracker))
+        ret = EXIT_FAILURE;
+
     if (default_printer_name != NULL)
         free(default_printer_name);
 
-    if (default_paper_size_name != NULL)
-        free(default_paper_size_name);
+    close_print_target(&target);
+
+    drain_label_cache();
+    drain_label_pool();
+
+    /* Whoever ran us needs to know there's a failure list to deal with. */
+    if (ret == EXIT_SUCCESS && failed_job_count() > 0)
+        ret = EXIT_SKIPPED;
 
-    if (devmode != NULL)
-        free(devmode);
+    failure_list_close();
 
-    if (paper_size != NULL)
-        free(paper_size);
+    metrics_stop();
 
-    if (context != NULL)
-        DeleteDC(context);
+    /* Whatever happened, the timings up to that point are still useful. */
+    if (timings)
+    {
+        timing_report(stdout);
+
+        if (timings_output != NULL)
+            timing_write(timings_output);
+    }
 
-    return 0;
+    return ret;
 }
@@ -0,0 +1,585 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "job.h"
+#include "line_reader.h"
+#include "log.h"
+#include "manifest.h"
+
+struct manifest
+{
+    struct line_reader reader;
+};
+
+/* The options on one line, pointing into the line itself. */
+struct manifest_fields
+{
+    char *path;
+    char *copies;
+    char *paper;
+    char *orientation;
+    char *printer;
+};
+
+struct manifest *open_manifest(const char *path)
+{
+    struct manifest *manifest = NULL;
+
+    manifest = (struct manifest *)calloc(1, sizeof(struct manifest));
+    if (manifest == NULL)
+    {
+        ERR("Failed to allocate memory for manifest.\n");
+        return NULL;
+    }
+
+    if (!open_line_reader(&manifest->reader, path))
+    {
+        ERR("Failed to open manifest %s.\n", path);
+        goto exit;
+    }
+
+    return manifest;
+
+exit:
+    close_manifest(manifest);
+
+    return NULL;
+}
+
+/**
+ * @brief Store one option from a line.
+ *
+ * @return `FALSE` if the key isn't one we know.
+ */
+static BOOL set_field(
+    struct manifest *manifest,
+    struct manifest_fields *fields,
+    const char *key,
+    char *value)
+{
+    if (strcmp(key, "path") == 0)
+        fields->path = value;
+    else if (strcmp(key, "copies") == 0)
+        fields->copies = value;
+    else if (strcmp(key, "paper") == 0)
+        fields->paper = value;
+    else if (strcmp(key, "orientation") == 0)
+        fields->orientation = value;
+    else if (strcmp(key, "printer") == 0)
+        fields->printer = value;
+    else
+    {
+        ERR("Unknown manifest key on line %ld: %s\n", manifest->reader.line_number, key);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Parse a line of tab-separated options, starting with the path.
+ */
+static BOOL parse_plain_line(
+    struct manifest *manifest,
+    char *line,
+    struct manifest_fields *fields)
+{
+    char *field = line;
+
+    fields->path = field;
+
+    while ((field = strchr(field, '\t')) != NULL)
+    {
+        char *value;
+
+        *field++ = '\0';
+
+        /* Tabs in a row leave empty fields, which are skipped. */
+        if (*field == '\0' || *field == '\t')
+            continue;
+
+        value = field + strcspn(field, "=\t");
+        if (*value != '=')
+        {
+            ERR("Expected key=value on line %ld: %.*s\n", manifest->reader.line_number, (int)(value - field), field);
+            return FALSE;
+        }
+
+        *value++ = '\0';
+
+        /* Later fields are found from where this one ends. */
+        if (!set_field(manifest, fields, field, value))
+            return FALSE;
+
+        field = value;
+    }
+
+    return TRUE;
+}
+
+static char *skip_space(char *p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+
+    return p;
+}
+
+/**
+ * @brief Append a code point to a string as UTF-8.
+ *
+ * @return Where the next character goes.
+ */
+static char *put_utf8(char *out, unsigned int code)
+{
+    if (code < 0x80)
+    {
+        *out++ = (char)code;
+    }
+    else if (code < 0x800)
+    {
+        *out++ = (char)(0xC0 | (code >> 6));
+        *out++ = (char)(0x80 | (code & 0x3F));
+    }
+    else if (code < 0x10000)
+    {
+        *out++ = (char)(0xE0 | (code >> 12));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+    }
+    else
+    {
+        *out++ = (char)(0xF0 | (code >> 18));
+        *out++ = (char)(0x80 | ((code >> 12) & 0x3F));
+        *out++ = (char)(0x80 | ((code >> 6) & 0x3F));
+        *out++ = (char)(0x80 | (code & 0x3F));
+    }
+
+    return out;
+}
+
+/**
+ * @brief Parse the four hex digits of a `\u` escape.
+ *
+ * @param p The first digit.
+ * @param code Set to the UTF-16 code unit.
+ * @return `FALSE` if they aren't four hex digits.
+ */
+static BOOL parse_json_hex(const char *p, unsigned int *code)
+{
+    *code = 0;
+
+    for (int i = 0; i < 4; i++)
+    {
+        char c = p[i];
+
+        *code <<= 4;
+
+        if (c >= '0' && c <= '9')
+            *code |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            *code |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            *code |= c - 'A' + 10;
+        else
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Check whether a bare value is a JSON number.
+ */
+static BOOL is_json_number(const char *p)
+{
+    if (*p == '-')
+        p++;
+
+    if (*p == '0')
+    {
+        p++;
+    }
+    else if (*p >= '1' && *p <= '9')
+    {
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+    else
+    {
+        return FALSE;
+    }
+
+    if (*p == '.')
+    {
+        if (*++p < '0' || *p > '9')
+            return FALSE;
+
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    if (*p == 'e' || *p == 'E')
+    {
+        if (*++p == '+' || *p == '-')
+            p++;
+
+        if (*p < '0' || *p > '9')
+            return FALSE;
+
+        while (*p >= '0' && *p <= '9')
+            p++;
+    }
+
+    return *p == '\0';
+}
+
+/**
+ * @brief Parse a JSON string in place. Unescaping never makes it longer, so
+ * the result is written over the string itself.
+ *
+ * @param p The opening quote.
+ * @param end Set to just past the closing quote.
+ * @return The string, or `NULL` if it's invalid.
+ */
+static char *parse_json_string(char *p, char **end)
+{
+    char *value = p + 1;
+    char *out = value;
+
+    for (p++; *p != '"'; p++)
+    {
+        if (*p == '\0')
+            return NULL;
+
+        if (*p != '\\')
+        {
+            *out++ = *p;
+            continue;
+        }
+
+        switch (*++p)
+        {
+        case '"':
+        case '\\':
+        case '/':
+            *out++ = *p;
+            break;
+
+        case 'b':
+            *out++ = '\b';
+            break;
+
+        case 'f':
+            *out++ = '\f';
+            break;
+
+        case 'n':
+            *out++ = '\n';
+            break;
+
+        case 'r':
+            *out++ = '\r';
+            break;
+
+        case 't':
+            *out++ = '\t';
+            break;
+
+        case 'u':
+        {
+            unsigned int code, low;
+
+            if (!parse_json_hex(p + 1, &code))
+                return NULL;
+
+            p += 4;
+
+            /* Characters outside the BMP come as a surrogate pair, which is
+             * one code point. Half a pair has no UTF-8 of its own. */
+            if (code >= 0xD800 && code <= 0xDBFF)
+            {
+                if (p[1] != '\\' || p[2] != 'u' ||
+                    !parse_json_hex(p + 3, &low) ||
+                    low < 0xDC00 || low > 0xDFFF)
+                    return NULL;
+
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                p += 6;
+            }
+            else if (code >= 0xDC00 && code <= 0xDFFF)
+            {
+                return NULL;
+            }
+
+            /* Nothing after a NUL would make it out of the string. */
+            if (code == 0)
+                return NULL;
+
+            out = put_utf8(out, code);
+            break;
+        }
+
+        default:
+            return NULL;
+        }
+    }
+
+    *out = '\0';
+    *end = p + 1;
+
+    return value;
+}
+
+/**
+ * @brief Parse a line holding a flat JSON object, with string values, a
+ * number for the copies, and `null` for anything left out.
+ */
+static BOOL parse_json_line(
+    struct manifest *manifest,
+    char *line,
+    struct manifest_fields *fields)
+{
+    char *p = skip_space(line + 1);
+
+    if (*p == '}')
+        return TRUE;
+
+    for (;;)
+    {
+        char *key, *value, *value_end = NULL;
+        char separator;
+
+        if (*p != '"' || (key = parse_json_string(p, &p)) == NULL)
+            goto invalid;
+
+        p = skip_space(p);
+        if (*p++ != ':')
+            goto invalid;
+
+        p = skip_space(p);
+        if (*p == '"')
+        {
+            if ((value = parse_json_string(p, &p)) == NULL)
+                goto invalid;
+        }
+        else
+        {
+            value = p;
+            while (*p != '\0' && *p != ',' && *p != '}' && *p != ' ' && *p != '\t')
+                p++;
+
+            if (p == value)
+                goto invalid;
+
+            value_end = p;
+        }
+
+        p = skip_space(p);
+        if (*p != ',' && *p != '}')
+            goto invalid;
+
+        separator = *p;
+        *p++ = '\0';
+
+        if (value_end != NULL)
+        {
+            *value_end = '\0';
+
+            /* Numbers are kept as text, the same as in plain lines, and
+             * only the copies are a number. */
+            if (strcmp(value, "null") == 0)
+            {
+                value = NULL;
+            }
+            else if (strcmp(key, "copies") != 0)
+            {
+                ERR("Expected a string for %s on line %ld: %s\n", key, manifest->reader.line_number, value);
+                return FALSE;
+            }
+            else if (!is_json_number(value))
+            {
+                ERR("Expected a number for copies on line %ld: %s\n", manifest->reader.line_number, value);
+                return FALSE;
+            }
+        }
+
+        if (!set_field(manifest, fields, key, value))
+            return FALSE;
+
+        if (separator == '}')
+            break;
+
+        p = skip_space(p);
+    }
+
+    if (*skip_space(p) != '\0')
+        goto invalid;
+
+    return TRUE;
+
+invalid:
+    ERR("Invalid JSON on line %ld.\n", manifest->reader.line_number);
+    return FALSE;
+}
+
+BOOL read_manifest(struct manifest *manifest, struct print_job **job)
+{
+    struct manifest_fields fields;
+    char *line;
+    int copies = 0;
+    enum job_orientation orientation = JOB_ORIENTATION_DEFAULT;
+
+    *job = NULL;
+
+    for (;;)
+    {
+        if (!read_line(&manifest->reader))
+        {
+            if (line_reader_failed(&manifest->reader))
+            {
+                ERR("Failed to read manifest.\n");
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+
+        line = skip_space(manifest->reader.line);
+        if (*line != '\0' && *line != '#')
+            break;
+    }
+
+    memset(&fields, 0, sizeof(fields));
+
+    if (*line == '{')
+    {
+        if (!parse_json_line(manifest, line, &fields))
+            return FALSE;
+    }
+    else if (!parse_plain_line(manifest, line, &fields))
+    {
+        return FALSE;
+    }
+
+    if (fields.path == NULL || *fields.path == '\0')
+    {
+        ERR("No path on line %ld.\n", manifest->reader.line_number);
+        return FALSE;
+    }
+
+    if (fields.copies != NULL && !parse_job_copies(fields.copies, &copies))
+    {
+        ERR("Copies must be between 1 and %d on line %ld.\n", MAX_JOB_COPIES, manifest->reader.line_number);
+        return FALSE;
+    }
+
+    if (fields.orientation != NULL && !parse_job_orientation(fields.orientation, &orientation))
+    {
+        ERR("Invalid orientation on line %ld: %s\n", manifest->reader.line_number, fields.orientation);
+        return FALSE;
+    }
+
+    *job = new_print_job(fields.path, fields.paper, fields.printer);
+    if (*job == NULL)
+        return FALSE;
+
+    (*job)->copies = copies;
+    (*job)->orientation = orientation;
+
+    return TRUE;
+}
+
+/**
+ * @brief Check whether a value can go in a plain line as it is.
+ */
+static BOOL is_plain_value(const char *value)
+{
+    return value == NULL ||
+           (strpbrk(value, "\t\r\n") == NULL && *value != '{' && *value != '#' &&
+            *value != ' ' && strncmp(value, "\xEF\xBB\xBF", 3) != 0);
+}
+
+static void write_json_string(FILE *file, const char *key, const char *value)
+{
+    fprintf(file, "\"%s\": \"", key);
+
+    for (const char *p = value; *p != '\0'; p++)
+    {
+        if (*p == '"' || *p == '\\')
+            fprintf(file, "\\%c", *p);
+        else if ((unsigned char)*p < 0x20)
+            fprintf(file, "\\u%04x", (unsigned char)*p);
+        else
+            fputc(*p, file);
+    }
+
+    fputc('"', file);
+}
+
+BOOL write_manifest(FILE *file, const struct print_job *job)
+{
+    const char *orientation = job->orientation == JOB_ORIENTATION_LANDSCAPE  ? "landscape"
+                              : job->orientation == JOB_ORIENTATION_PORTRAIT ? "portrait"
+                                                                             : NULL;
+
+    /* Plain lines are easier on the eye, so JSON is only for values that
+     * wouldn't survive being read back from one. */
+    if (is_plain_value(job->filename) && is_plain_value(job->paper_size_name) && is_plain_value(job->printer_name))
+    {
+        fputs(job->filename, file);
+
+        if (job->copies != 1)
+            fprintf(file, "\tcopies=%d", job->copies);
+
+        if (job->paper_size_name != NULL)
+            fprintf(file, "\tpaper=%s", job->paper_size_name);
+
+        if (orientation != NULL)
+            fprintf(file, "\torientation=%s", orientation);
+
+        if (job->printer_name != NULL)
+            fprintf(file, "\tprinter=%s", job->printer_name);
+    }
+    else
+    {
+        fputc('{', file);
+        write_json_string(file, "path", job->filename);
+
+        if (job->copies != 1)
+            fprintf(file, ", \"copies\": %d", job->copies);
+
+        if (job->paper_size_name != NULL)
+        {
+            fputs(", ", file);
+            write_json_string(file, "paper", job->paper_size_name);
+        }
+
+        if (orientation != NULL)
+            fprintf(file, ", \"orientation\": \"%s\"", orientation);
+
+        if (job->printer_name != NULL)
+        {
+            fputs(", ", file);
+            write_json_string(file, "printer", job->printer_name);
+        }
+
+        fputc('}', file);
+    }
+
+    fputc('\n', file);
+
+    return !ferror(file);
+}
+
+void close_manifest(struct manifest *manifest)
+{
+    if (manifest == NULL)
+        return;
+
+    close_line_reader(&manifest->reader);
+    free(manifest);
+}
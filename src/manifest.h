@@ -0,0 +1,54 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <stdio.h>
+
+#include "job.h"
+
+/* Reads print jobs from a manifest, one line at a time.
+ *
+ * Each line is one job. A line starting with `{` is a JSON object; anything
+ * else is a path, optionally followed by tab-separated `key=value` options.
+ * Either way, the keys are `path`, `copies`, `paper`, `orientation` and
+ * `printer`. In JSON the values are strings, except that `copies` can be a
+ * number, and `null` leaves a key out. Blank lines and lines starting with
+ * `#` are skipped. */
+struct manifest;
+
+/**
+ * @brief Open a manifest.
+ *
+ * @param path The manifest file.
+ * @return The manifest, or `NULL` on failure. Release it with
+ * `close_manifest()`.
+ */
+struct manifest *open_manifest(const char *path);
+
+/**
+ * @brief Read the next job from a manifest.
+ *
+ * @param manifest The manifest to read from.
+ * @param job Set to the job, or `NULL` at the end of the manifest. Jobs that
+ * don't say how many copies they want have `copies` set to 0. Release it
+ * with `free_print_job()`.
+ * @return `FALSE` if the manifest couldn't be read, or the line was invalid.
+ */
+BOOL read_manifest(struct manifest *manifest, struct print_job **job);
+
+/**
+ * @brief Write a job as a manifest line, which reads back as the same job.
+ *
+ * @param file The file to write to.
+ * @param job The job to write.
+ * @return `TRUE` if the line was written.
+ */
+BOOL write_manifest(FILE *file, const struct print_job *job);
+
+/**
+ * @brief Close a manifest.
+ *
+ * @param manifest The manifest to close. May be `NULL`.
+ */
+void close_manifest(struct manifest *manifest);
+
+#endif /* MANIFEST_H */
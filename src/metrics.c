@@ -0,0 +1,425 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "timing.h"
+
+#define MAX_METRICS_PRINTERS (64)
+
+/* Upper bounds of the histogram buckets, in milliseconds. Spans longer than
+ * the last go in one more bucket of their own. */
+static const double bucket_bounds_ms[] = {1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000};
+
+#define BUCKET_COUNT ((int)(sizeof(bucket_bounds_ms) / sizeof(bucket_bounds_ms[0])))
+
+struct printer_metrics
+{
+    const char *printer_name;
+
+    volatile LONGLONG labels_printed;
+    volatile LONGLONG print_errors;
+    volatile LONGLONG bytes_spooled;
+    volatile LONGLONG jobs_failed;
+    volatile LONG queue_depth;
+};
+
+struct phase_histogram
+{
+    volatile LONGLONG buckets[BUCKET_COUNT + 1];
+    volatile LONGLONG count;
+    volatile LONGLONG sum_ticks;
+};
+
+static BOOL enabled = FALSE;
+static const char *metrics_path;
+static BOOL prometheus;
+static DWORD interval_ms;
+static LARGE_INTEGER frequency;
+static LONGLONG bucket_bounds[BUCKET_COUNT];
+
+/* Slots are only ever added, so once a printer's counted in `printer_count`
+ * it can be read without the lock. The lock is only there to keep two
+ * threads from taking the same slot. */
+static SRWLOCK printers_lock = SRWLOCK_INIT;
+static struct printer_metrics printers[MAX_METRICS_PRINTERS];
+static volatile LONG printer_count;
+
+static struct phase_histogram phases[PHASE_COUNT];
+
+static HANDLE stop_event;
+static HANDLE thread;
+
+/**
+ * @brief Read a counter that other threads may be adding to.
+ */
+static LONGLONG read_counter(volatile LONGLONG *counter)
+{
+    return InterlockedCompareExchange64(counter, 0, 0);
+}
+
+/**
+ * @brief Write a string for a JSON string or a Prometheus label value, which
+ * escape the same way.
+ */
+static void write_escaped(FILE *out, const char *text)
+{
+    for (; *text != '\0'; text++)
+    {
+        if (*text == '\\' || *text == '"')
+        {
+            fputc('\\', out);
+            fputc(*text, out);
+        }
+        else if (*text == '\n')
+        {
+            fputs("\\n", out);
+        }
+        else if ((unsigned char)*text >= ' ')
+        {
+            fputc(*text, out);
+        }
+    }
+}
+
+static void write_json(FILE *out)
+{
+    FILETIME now;
+    ULONGLONG now_ms;
+    LONG count = printer_count;
+    BOOL first;
+
+    /* FILETIMEs count 100 ns from 1601, rather than milliseconds from 1970. */
+    GetSystemTimeAsFileTime(&now);
+    now_ms = ((((ULONGLONG)now.dwHighDateTime << 32) | now.dwLowDateTime) - 116444736000000000ULL) / 10000;
+
+    fprintf(out, "{\"time_ms\": %llu, \"printers\": {", now_ms);
+    for (LONG i = 0; i < count; i++)
+    {
+        struct printer_metrics *printer = &printers[i];
+
+        fprintf(out, "%s\"", i > 0 ? ", " : "");
+        write_escaped(out, printer->printer_name);
+        fprintf(out,
+                "\": {\"labels_printed\": %lld, \"print_errors\": %lld, \"bytes_spooled\": %lld, "
+                "\"jobs_failed\": %lld, \"queue_depth\": %ld}",
+                read_counter(&printer->labels_printed),
+                read_counter(&printer->print_errors),
+                read_counter(&printer->bytes_spooled),
+                read_counter(&printer->jobs_failed),
+                printer->queue_depth);
+    }
+
+    /* The bounds go in every line, so each one can be read on its own. */
+    fprintf(out, "}, \"bucket_bounds_ms\": [");
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        fprintf(out, "%s%g", i > 0 ? ", " : "", bucket_bounds_ms[i]);
+
+    fprintf(out, "], \"phases\": {");
+    first = TRUE;
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        struct phase_histogram *histogram = &phases[i];
+        LONGLONG phase_count = read_counter(&histogram->count);
+
+        if (phase_count == 0)
+            continue;
+
+        fprintf(out,
+                "%s\"%s\": {\"count\": %lld, \"sum_ms\": %.3f, \"buckets\": [",
+                first ? "" : ", ",
+                timing_phase_name(i),
+                phase_count,
+                (double)read_counter(&histogram->sum_ticks) * 1000.0 / frequency.QuadPart);
+
+        for (int j = 0; j <= BUCKET_COUNT; j++)
+            fprintf(out, "%s%lld", j > 0 ? ", " : "", read_counter(&histogram->buckets[j]));
+
+        fprintf(out, "]}");
+        first = FALSE;
+    }
+
+    fprintf(out, "}}\n");
+}
+
+/**
+ * @brief Write one counter for every printer, in Prometheus' text format.
+ *
+ * @param name The metric's name, without our prefix.
+ * @param offset Where the counter is in `struct printer_metrics`.
+ */
+static void write_prometheus_counter(FILE *out, const char *name, const char *help, size_t offset)
+{
+    LONG count = printer_count;
+
+    fprintf(out, "# HELP labelprinter_%s %s\n", name, help);
+    fprintf(out, "# TYPE labelprinter_%s counter\n", name);
+
+    for (LONG i = 0; i < count; i++)
+    {
+        fprintf(out, "labelprinter_%s{printer=\"", name);
+        write_escaped(out, printers[i].printer_name);
+        fprintf(out, "\"} %lld\n", read_counter((volatile LONGLONG *)((char *)&printers[i] + offset)));
+    }
+}
+
+static void write_prometheus(FILE *out)
+{
+    LONG count = printer_count;
+
+    write_prometheus_counter(
+        out, "labels_printed_total", "Labels printed.",
+        offsetof(struct printer_metrics, labels_printed));
+    write_prometheus_counter(
+        out, "print_errors_total", "Labels that failed to print, counting each try.",
+        offsetof(struct printer_metrics, print_errors));
+    write_prometheus_counter(
+        out, "bytes_spooled_total", "Bytes of bitmap sent to the spooler.",
+        offsetof(struct printer_metrics, bytes_spooled));
+    write_prometheus_counter(
+        out, "jobs_failed_total", "Jobs deleted from the spooler before they printed.",
+        offsetof(struct printer_metrics, jobs_failed));
+
+    fprintf(out, "# HELP labelprinter_queue_depth Jobs in the spooler that haven't printed yet.\n");
+    fprintf(out, "# TYPE labelprinter_queue_depth gauge\n");
+    for (LONG i = 0; i < count; i++)
+    {
+        fprintf(out, "labelprinter_queue_depth{printer=\"");
+        write_escaped(out, printers[i].printer_name);
+        fprintf(out, "\"} %ld\n", printers[i].queue_depth);
+    }
+
+    fprintf(out, "# HELP labelprinter_phase_seconds Time spent in each part of printing.\n");
+    fprintf(out, "# TYPE labelprinter_phase_seconds histogram\n");
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        struct phase_histogram *histogram = &phases[i];
+        const char *name = timing_phase_name(i);
+        LONGLONG phase_count = read_counter(&histogram->count);
+        LONGLONG cumulative = 0;
+
+        if (phase_count == 0)
+            continue;
+
+        /* Prometheus' buckets count everything up to their bound, not just
+         * what's in them. */
+        for (int j = 0; j < BUCKET_COUNT; j++)
+        {
+            cumulative += read_counter(&histogram->buckets[j]);
+            fprintf(out, "labelprinter_phase_seconds_bucket{phase=\"%s\",le=\"%g\"} %lld\n",
+                    name, bucket_bounds_ms[j] / 1000.0, cumulative);
+        }
+
+        /* Spans can land while we're reading, so the count comes from the
+         * buckets, to keep it in step with them. */
+        cumulative += read_counter(&histogram->buckets[BUCKET_COUNT]);
+        fprintf(out, "labelprinter_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lld\n", name, cumulative);
+        fprintf(out, "labelprinter_phase_seconds_sum{phase=\"%s\"} %.6f\n",
+                name, (double)read_counter(&histogram->sum_ticks) / frequency.QuadPart);
+        fprintf(out, "labelprinter_phase_seconds_count{phase=\"%s\"} %lld\n", name, cumulative);
+    }
+}
+
+static BOOL write_metrics(void)
+{
+    char temp_path[MAX_PATH + 4];
+    FILE *out;
+
+    /* A textfile collector could read the file at any moment, so it
+     * should never find half of one. */
+    if (prometheus)
+    {
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", metrics_path);
+        out = fopen(temp_path, "w");
+    }
+    else
+    {
+        out = fopen(metrics_path, "a");
+    }
+
+    if (out == NULL)
+    {
+        DBG("Failed to open %s\n", prometheus ? temp_path : metrics_path);
+        return FALSE;
+    }
+
+    if (prometheus)
+        write_prometheus(out);
+    else
+        write_json(out);
+
+    if (fclose(out) != 0)
+    {
+        DBG("Failed to write %s\n", prometheus ? temp_path : metrics_path);
+        return FALSE;
+    }
+
+    if (prometheus && !MoveFileEx(temp_path, metrics_path, MOVEFILE_REPLACE_EXISTING))
+    {
+        DBG("Failed to replace %s\n", metrics_path);
+        DeleteFile(temp_path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static DWORD WINAPI metrics_worker(LPVOID param)
+{
+    (void)param;
+
+    while (WaitForSingleObject(stop_event, interval_ms) == WAIT_TIMEOUT)
+    {
+        /* Not worth stopping the print over. We'll try again next time. */
+        write_metrics();
+    }
+
+    return 0;
+}
+
+BOOL metrics_enable(const char *path, int interval_seconds)
+{
+    size_t length = strlen(path);
+
+    metrics_path = path;
+    prometheus = length >= 5 && _stricmp(path + length - 5, ".prom") == 0;
+    interval_ms = (DWORD)interval_seconds * 1000;
+
+    QueryPerformanceFrequency(&frequency);
+    for (int i = 0; i < BUCKET_COUNT; i++)
+        bucket_bounds[i] = (LONGLONG)(bucket_bounds_ms[i] * frequency.QuadPart / 1000.0);
+
+    /* Better to find out now if the file can't be written. */
+    if (!write_metrics())
+    {
+        ERR("Failed to write metrics to %s.\n", path);
+        return FALSE;
+    }
+
+    stop_event = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (stop_event == NULL)
+    {
+        ERR("Failed to create metrics event.\n");
+        return FALSE;
+    }
+
+    thread = CreateThread(NULL, 0, metrics_worker, NULL, 0, NULL);
+    if (thread == NULL)
+    {
+        ERR("Failed to start metrics thread.\n");
+        CloseHandle(stop_event);
+        stop_event = NULL;
+        return FALSE;
+    }
+
+    enabled = TRUE;
+    timing_enable_metrics();
+
+    return TRUE;
+}
+
+void metrics_stop(void)
+{
+    if (!enabled)
+        return;
+
+    SetEvent(stop_event);
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    CloseHandle(stop_event);
+
+    if (!write_metrics())
+    {
+        ERR("Failed to write metrics to %s.\n", metrics_path);
+    }
+
+    enabled = FALSE;
+}
+
+struct printer_metrics *metrics_printer(const char *printer_name)
+{
+    struct printer_metrics *printer = NULL;
+
+    if (!enabled)
+        return NULL;
+
+    AcquireSRWLockExclusive(&printers_lock);
+
+    for (LONG i = 0; i < printer_count; i++)
+    {
+        if (_stricmp(printers[i].printer_name, printer_name) == 0)
+        {
+            printer = &printers[i];
+            break;
+        }
+    }
+
+    if (printer == NULL && printer_count < MAX_METRICS_PRINTERS)
+    {
+        printer = &printers[printer_count];
+        printer->printer_name = printer_name;
+
+        /* Only now is the slot ready for the writer to look at. */
+        InterlockedIncrement(&printer_count);
+    }
+
+    ReleaseSRWLockExclusive(&printers_lock);
+
+    if (printer == NULL)
+        DBG("Too many printers to keep metrics for %s\n", printer_name);
+
+    return printer;
+}
+
+void metrics_label(struct printer_metrics *printer, BOOL printed, ULONGLONG bytes)
+{
+    if (printer == NULL)
+        return;
+
+    if (printed)
+        InterlockedIncrement64(&printer->labels_printed);
+    else
+        InterlockedIncrement64(&printer->print_errors);
+
+    if (bytes > 0)
+        InterlockedExchangeAdd64(&printer->bytes_spooled, (LONGLONG)bytes);
+}
+
+void metrics_job_queued(struct printer_metrics *printer)
+{
+    if (printer == NULL)
+        return;
+
+    InterlockedIncrement(&printer->queue_depth);
+}
+
+void metrics_job_finished(struct printer_metrics *printer, BOOL printed)
+{
+    if (printer == NULL)
+        return;
+
+    InterlockedDecrement(&printer->queue_depth);
+
+    if (!printed)
+        InterlockedIncrement64(&printer->jobs_failed);
+}
+
+void metrics_phase(enum timing_phase phase, LONGLONG ticks)
+{
+    struct phase_histogram *histogram = &phases[phase];
+    int bucket = 0;
+
+    if (!enabled)
+        return;
+
+    while (bucket < BUCKET_COUNT && ticks > bucket_bounds[bucket])
+        bucket++;
+
+    InterlockedIncrement64(&histogram->buckets[bucket]);
+    InterlockedIncrement64(&histogram->count);
+    InterlockedExchangeAdd64(&histogram->sum_ticks, ticks);
+}
@@ -0,0 +1,77 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <windows.h>
+
+#include "timing.h"
+
+/* Running totals for long-lived runs, written out every so often for
+ * monitoring to pick up. Counting is a handful of interlocked adds, with no
+ * locks or system calls, so it's safe to do on every label. */
+
+/* The counters for one printer. */
+struct printer_metrics;
+
+/**
+ * @brief Start collecting metrics, and writing them out on a background
+ * thread. Until this is called, metrics are a no-op.
+ *
+ * Paths ending in `.prom` are rewritten each time in Prometheus' text format,
+ * for a node exporter's textfile collector to serve. Anything else has a JSON
+ * line appended each time.
+ *
+ * @param path The file to write the metrics to.
+ * @param interval_seconds How often to write them.
+ * @return `TRUE` if the metrics are being collected.
+ */
+BOOL metrics_enable(const char *path, int interval_seconds);
+
+/**
+ * @brief Write the metrics out one last time, and stop the background thread.
+ */
+void metrics_stop(void);
+
+/**
+ * @brief Get the counters for a printer, setting them up the first time.
+ *
+ * Safe to call from any thread.
+ *
+ * @param printer_name The printer. Must outlive the metrics.
+ * @return The printer's counters, or `NULL` if metrics aren't enabled. Every
+ * other call takes `NULL` and does nothing with it.
+ */
+struct printer_metrics *metrics_printer(const char *printer_name);
+
+/**
+ * @brief Count a label handed to a printer.
+ *
+ * @param printer The printer's counters.
+ * @param printed `TRUE` if the label was printed, `FALSE` if it failed.
+ * @param bytes The bytes of bitmap spooled for it.
+ */
+void metrics_label(struct printer_metrics *printer, BOOL printed, ULONGLONG bytes);
+
+/**
+ * @brief Count a job going into the spooler's queue.
+ *
+ * @param printer The printer's counters.
+ */
+void metrics_job_queued(struct printer_metrics *printer);
+
+/**
+ * @brief Count a job leaving the spooler's queue.
+ *
+ * @param printer The printer's counters.
+ * @param printed `TRUE` if the job printed, `FALSE` if it was lost.
+ */
+void metrics_job_finished(struct printer_metrics *printer, BOOL printed);
+
+/**
+ * @brief Add a span to its phase's histogram. Called by `timing_end()`.
+ *
+ * @param phase The phase the span was spent in.
+ * @param ticks How long it took, in performance counter ticks.
+ */
+void metrics_phase(enum timing_phase phase, LONGLONG ticks);
+
+#endif /* METRICS_H */
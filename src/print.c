@@ -0,0 +1,1201 @@
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "barcode.h"
+#include "crop.h"
+#include "job_tracker.h"
+#include "label.h"
+#include "log.h"
+#include "metrics.h"
+#include "print.h"
+#include "printer.h"
+#include "profile.h"
+#include "render.h"
+#include "scale.h"
+#include "timing.h"
+
+/* Spooler errors tend to clear up in a second or two, once whatever's
+ * holding it up lets go. Each retry waits this much longer than the last. */
+#define RETRY_DELAY_MS (1000)
+
+/**
+ * @brief Get a DEVMODE for printing on a paper size and orientation, with the
+ * driver printing some number of copies of each page, building it if we
+ * haven't already.
+ *
+ * @return The DEVMODE, or `NULL` on failure. It belongs to the target.
+ */
+static DEVMODE *get_print_mode(
+    struct print_target *target,
+    const struct paper_size *paper_size,
+    BOOL landscape,
+    int copies)
+{
+    struct print_mode *modes;
+    DEVMODE *devmode;
+    LONGLONG start;
+
+    for (int i = 0; i < target->mode_count; i++)
+    {
+        if (target->modes[i].paper == paper_size->size &&
+            target->modes[i].landscape == landscape &&
+            target->modes[i].copies == copies)
+        {
+            return target->modes[i].devmode;
+        }
+    }
+
+    modes = (struct print_mode *)realloc(
+        target->modes, (target->mode_count + 1) * sizeof(struct print_mode));
+    if (modes == NULL)
+    {
+        ERR("Failed to allocate memory for printer settings.\n");
+        return NULL;
+    }
+
+    target->modes = modes;
+
+    start = timing_start();
+    devmode = set_paper_size(&target->session, paper_size, landscape, copies);
+    timing_end(PHASE_SET_PAPER_SIZE, start);
+    if (devmode == NULL)
+    {
+        return NULL;
+    }
+
+    modes[target->mode_count].paper = paper_size->size;
+    modes[target->mode_count].landscape = landscape;
+    modes[target->mode_count].copies = copies;
+    modes[target->mode_count].devmode = devmode;
+    target->mode_count++;
+
+    return devmode;
+}
+
+/**
+ * @brief Work out how many copies of each page the driver should print, to
+ * get `copies` of them.
+ *
+ * @return `copies` if the driver can print that many, otherwise 1, leaving us
+ * to print them ourselves.
+ */
+static int get_native_copies(struct print_target *target, int copies)
+{
+    if (copies <= 1)
+        return 1;
+
+    /* Most runs never need to know, so we only ask the first time. */
+    if (target->max_copies == 0)
+        target->max_copies = get_max_copies(&target->session);
+
+    return copies <= target->max_copies ? copies : 1;
+}
+
+/**
+ * @brief Set a print target up from a saved profile, in place of asking the
+ * driver for a DEVMODE.
+ *
+ * @return The paper size the profile is for, or `NULL` on failure. The
+ * profile's DEVMODE goes in with the target's others, for `get_print_mode()`
+ * to find.
+ */
+static const struct paper_size *load_print_profile(
+    struct print_target *target,
+    const char *profile_name,
+    BOOL *landscape)
+{
+    struct printer_driver_id driver_id;
+    const struct paper_size *paper_size;
+    struct print_mode mode, *modes;
+    LONGLONG start;
+
+    if (!get_printer_driver_id(&target->session, &driver_id))
+    {
+        return NULL;
+    }
+
+    start = timing_start();
+    if (!load_profile(profile_name, target->printer_name, &driver_id, &mode))
+    {
+        return NULL;
+    }
+
+    timing_end(PHASE_SET_PAPER_SIZE, start);
+
+    paper_size = find_paper_size_by_id(target->paper_table, mode.paper);
+    if (paper_size == NULL)
+    {
+        ERR("Profile %s is for paper the printer no longer has.\n", profile_name);
+        free(mode.devmode);
+        return NULL;
+    }
+
+    modes = (struct print_mode *)realloc(
+        target->modes, (target->mode_count + 1) * sizeof(struct print_mode));
+    if (modes == NULL)
+    {
+        ERR("Failed to allocate memory for printer settings.\n");
+        free(mode.devmode);
+        return NULL;
+    }
+
+    target->modes = modes;
+    modes[target->mode_count++] = mode;
+
+    *landscape = mode.landscape;
+
+    return paper_size;
+}
+
+BOOL save_print_profile(const struct print_target *target, const char *profile_name)
+{
+    struct printer_driver_id driver_id;
+
+    if (!get_printer_driver_id(&target->session, &driver_id))
+    {
+        return FALSE;
+    }
+
+    for (int i = 0; i < target->mode_count; i++)
+    {
+        if (target->modes[i].devmode == target->devmode)
+        {
+            if (!save_profile(profile_name, target->printer_name, &driver_id, &target->modes[i]))
+            {
+                return FALSE;
+            }
+
+            printf(" 💾 Saved profile %s\n", profile_name);
+            return TRUE;
+        }
+    }
+
+    ERR("The printer's settings can't be saved, as it has none of its own.\n");
+    return FALSE;
+}
+
+static void print_paper_size(const struct paper_size *paper_size, BOOL landscape)
+{
+    printf(
+        " 📄 %s (%s) %.1f x %.1f mm\n",
+        paper_size->name,
+        landscape ? "landscape" : "portrait",
+        paper_size->width_mm,
+        paper_size->height_mm);
+}
+
+BOOL open_print_target(
+    struct print_target *target,
+    char *printer_name,
+    const char *paper_size_name,
+    BOOL landscape,
+    int copies,
+    const char *profile_name,
+    BOOL refresh_printer_cache)
+{
+    LONGLONG start;
+
+    memset(target, 0, sizeof(*target));
+    target->printer_name = printer_name;
+    target->landscape = landscape;
+    target->metrics = metrics_printer(printer_name);
+
+    if (!open_printer_session(&target->session, printer_name))
+    {
+        return FALSE;
+    }
+
+    /* Grab the paper size. */
+    start = timing_start();
+    target->paper_table = get_paper_table(&target->session, refresh_printer_cache);
+    timing_end(PHASE_PAPER_TABLE, start);
+    if (target->paper_table == NULL)
+    {
+        return FALSE;
+    }
+
+    /* A profile already knows its paper, and has the DEVMODE to print on
+     * it. Unless the copies differ, there's nothing to ask the driver. */
+    if (profile_name != NULL)
+    {
+        target->paper_size = load_print_profile(target, profile_name, &landscape);
+        target->landscape = landscape;
+    }
+    else
+    {
+        if (paper_size_name == NULL)
+        {
+            paper_size_name = target->paper_table->default_name;
+        }
+
+        target->paper_size = find_paper_size(target->paper_table, paper_size_name);
+    }
+
+    if (target->paper_size == NULL)
+    {
+        return FALSE;
+    }
+
+    target->default_paper_size = target->paper_size;
+    target->default_landscape = landscape;
+
+    printf(" 🖨️ %s\n", printer_name);
+    print_paper_size(target->paper_size, landscape);
+
+    /* Set up the printer context for printing the labels. */
+    target->copies = get_native_copies(target, copies);
+    target->devmode = get_print_mode(target, target->paper_size, landscape, target->copies);
+    if (target->devmode == NULL)
+    {
+        return FALSE;
+    }
+
+    start = timing_start();
+    target->context = CreateDC("WINSPOOL", printer_name, NULL, target->devmode);
+    if (target->context == NULL)
+    {
+        ERR("Failed to create printer context.\n");
+        return FALSE;
+    }
+
+    timing_end(PHASE_CREATE_DC, start);
+
+    get_printer_geometry(target->context, &target->geometry);
+
+    return TRUE;
+}
+
+void close_print_target(struct print_target *target)
+{
+    if (target->render != NULL)
+        close_render(target->render, target->context);
+
+    if (target->context != NULL)
+        DeleteDC(target->context);
+
+    for (int i = 0; i < target->mode_count; i++)
+        free(target->modes[i].devmode);
+
+    free(target->modes);
+
+    if (target->paper_table != NULL)
+        free_paper_table(target->paper_table);
+
+    close_printer_session(&target->session);
+
+    memset(target, 0, sizeof(*target));
+}
+
+/**
+ * @brief Switch a print target to another DEVMODE, keeping its printer
+ * context.
+ *
+ * @return `TRUE` if the target is ready to print with the new settings.
+ */
+static BOOL set_print_mode(
+    struct print_target *target,
+    const struct paper_size *paper_size,
+    BOOL landscape,
+    int copies)
+{
+    DEVMODE *devmode;
+    LONGLONG start;
+
+    if (paper_size == target->paper_size &&
+        landscape == target->landscape &&
+        copies == target->copies)
+    {
+        return TRUE;
+    }
+
+    devmode = get_print_mode(target, paper_size, landscape, copies);
+    if (devmode == NULL)
+    {
+        return FALSE;
+    }
+
+    if (paper_size != target->paper_size || landscape != target->landscape)
+    {
+        print_paper_size(paper_size, landscape);
+    }
+
+    /* The context keeps its document, it just lays out the pages that follow
+     * with the new settings. */
+    start = timing_start();
+    if (ResetDC(target->context, devmode) == NULL)
+    {
+        ERR("Failed to change printer settings for %s.\n", paper_size->name);
+        return FALSE;
+    }
+
+    timing_end(PHASE_SET_PAPER_SIZE, start);
+
+    target->paper_size = paper_size;
+    target->landscape = landscape;
+    target->copies = copies;
+    target->devmode = devmode;
+
+    get_printer_geometry(target->context, &target->geometry);
+
+    return TRUE;
+}
+
+BOOL set_print_target_paper(
+    struct print_target *target,
+    const struct paper_size *paper_size,
+    BOOL landscape)
+{
+    return set_print_mode(target, paper_size, landscape, target->copies);
+}
+
+/**
+ * @brief Find the paper size and orientation closest to a label's size in
+ * millimetres.
+ */
+static const struct paper_size *find_paper_size_mm(
+    const struct paper_table *table,
+    float width_mm,
+    float height_mm,
+    BOOL *landscape)
+{
+    const struct paper_size *portrait, *rotated;
+    float portrait_distance, rotated_distance;
+
+    /* Paper sizes are always given portrait, so a label can also go on paper
+     * that's its own size turned on its side. */
+    portrait = find_closest_paper_size(table, width_mm, height_mm);
+    rotated = find_closest_paper_size(table, height_mm, width_mm);
+    if (portrait == NULL)
+        return NULL;
+
+    portrait_distance =
+        (portrait->width_mm - width_mm) * (portrait->width_mm - width_mm) +
+        (portrait->height_mm - height_mm) * (portrait->height_mm - height_mm);
+    rotated_distance =
+        (rotated->width_mm - height_mm) * (rotated->width_mm - height_mm) +
+        (rotated->height_mm - width_mm) * (rotated->height_mm - width_mm);
+
+    *landscape = rotated_distance < portrait_distance;
+
+    return *landscape ? rotated : portrait;
+}
+
+const struct paper_size *find_label_paper_size(
+    const struct paper_table *table,
+    const struct label *label,
+    BOOL *landscape)
+{
+    return find_paper_size_mm(
+        table,
+        label->width * 1000.0f / label->xres,
+        label->height * 1000.0f / label->yres,
+        landscape);
+}
+
+BOOL fit_print_target(struct print_target *target, const struct label *label)
+{
+    const struct paper_size *paper_size;
+    BOOL landscape;
+
+    if (!target->auto_paper)
+        return TRUE;
+
+    paper_size = find_label_paper_size(target->paper_table, label, &landscape);
+    if (paper_size == NULL)
+    {
+        ERR("No paper size fits the label.\n");
+        return FALSE;
+    }
+
+    return set_print_target_paper(target, paper_size, landscape);
+}
+
+/* A label's place in the batch, and the paper it goes on. */
+struct label_group_entry
+{
+    int index;
+    int group;
+};
+
+static int compare_label_group_entries(const void *a, const void *b)
+{
+    const struct label_group_entry *entry_a = (const struct label_group_entry *)a;
+    const struct label_group_entry *entry_b = (const struct label_group_entry *)b;
+
+    if (entry_a->group != entry_b->group)
+        return entry_a->group < entry_b->group ? -1 : 1;
+
+    return entry_a->index < entry_b->index ? -1 : entry_a->index > entry_b->index;
+}
+
+BOOL group_labels_by_paper(
+    const struct paper_table *table,
+    char **filenames,
+    int count)
+{
+    struct label_group_entry *entries = NULL;
+    char **sorted = NULL;
+    int *first_seen = NULL;
+    BOOL ret = FALSE;
+
+    entries = (struct label_group_entry *)calloc(count, sizeof(struct label_group_entry));
+    sorted = (char **)calloc(count, sizeof(char *));
+    first_seen = (int *)malloc(table->count * 2 * sizeof(int));
+    if (entries == NULL || sorted == NULL || first_seen == NULL)
+    {
+        ERR("Failed to allocate memory for grouping labels.\n");
+        goto exit;
+    }
+
+    for (int i = 0; i < table->count * 2; i++)
+        first_seen[i] = INT_MAX;
+
+    /* Each paper's group goes where its first label was, so the batch stays
+     * as close to the order it was given in as it can. */
+    for (int i = 0; i < count; i++)
+    {
+        struct label_size size;
+        const struct paper_size *paper_size = NULL;
+        BOOL landscape = FALSE;
+        int paper;
+
+        entries[i].index = i;
+
+        /* Only the size matters here, so the bitmap itself is left until
+         * it's printed, rather than being loaded twice. */
+        if (read_label_size(filenames[i], &size))
+        {
+            paper_size = find_paper_size_mm(
+                table,
+                size.width * 1000.0f / size.xres,
+                size.height * 1000.0f / size.yres,
+                &landscape);
+        }
+
+        /* Anything we can't place goes first, so the batch fails before
+         * anything is printed. */
+        if (paper_size == NULL)
+        {
+            entries[i].group = -1;
+            continue;
+        }
+
+        paper = (int)(paper_size - table->papers) * 2 + (landscape ? 1 : 0);
+        if (first_seen[paper] == INT_MAX)
+            first_seen[paper] = i;
+
+        entries[i].group = first_seen[paper];
+    }
+
+    qsort(entries, count, sizeof(struct label_group_entry), compare_label_group_entries);
+
+    for (int i = 0; i < count; i++)
+        sorted[i] = filenames[entries[i].index];
+
+    memcpy(filenames, sorted, count * sizeof(char *));
+
+    ret = TRUE;
+
+exit:
+    free(first_seen);
+    free(sorted);
+    free(entries);
+
+    return ret;
+}
+
+void get_printer_geometry(
+    HDC printer_context,
+    struct printer_geometry *geometry)
+{
+    memset(geometry, 0, sizeof(*geometry));
+
+    /* Figure out the printable area in pixels, and the resolution in
+     * pixels per meter. */
+    geometry->page_w = GetDeviceCaps(printer_context, PHYSICALWIDTH);
+    geometry->page_h = GetDeviceCaps(printer_context, PHYSICALHEIGHT);
+    geometry->print_w = GetDeviceCaps(printer_context, HORZRES);
+    geometry->print_h = GetDeviceCaps(printer_context, VERTRES);
+
+    geometry->print_resx = GetDeviceCaps(printer_context, LOGPIXELSX) * 10000 / 254;
+    geometry->print_resy = GetDeviceCaps(printer_context, LOGPIXELSY) * 10000 / 254;
+
+    geometry->print_offx = GetDeviceCaps(printer_context, PHYSICALOFFSETX);
+    geometry->print_offy = GetDeviceCaps(printer_context, PHYSICALOFFSETY);
+
+    DBG("Page size: %d x %d px\n", geometry->page_w, geometry->page_h);
+    DBG("Printable area: %d x %d px\n", geometry->print_w, geometry->print_h);
+    DBG("Printer resolution: %d x %d px/m\n", geometry->print_resx, geometry->print_resy);
+    DBG("Printer offset: %d x %d px\n", geometry->print_offx, geometry->print_offy);
+}
+
+void compute_label_placement(
+    const struct printer_geometry *geometry,
+    const struct label *label,
+    struct label_placement *placement)
+{
+    placement->width = label->width;
+    placement->height = label->height;
+    placement->xres = label->xres;
+    placement->yres = label->yres;
+
+    /* Convert bitmap into printer units and calculate offset
+     * to center on printable area. */
+    placement->print_w = (label->width * geometry->print_resx) / label->xres;
+    placement->print_h = (label->height * geometry->print_resy) / label->yres;
+    placement->print_offx = (geometry->print_w - placement->print_w) / 2;
+    placement->print_offy = (geometry->print_h - placement->print_h) / 2;
+}
+
+const struct label_placement *get_label_placement(
+    struct printer_geometry *geometry,
+    const struct label *label)
+{
+    struct label_placement *placement = &geometry->last_placement;
+
+    if (geometry->has_placement &&
+        placement->width == label->width &&
+        placement->height == label->height &&
+        placement->xres == label->xres &&
+        placement->yres == label->yres)
+    {
+        return placement;
+    }
+
+    compute_label_placement(geometry, label, placement);
+    geometry->has_placement = TRUE;
+
+    DBG("Bitmap print size: %d x %d px\n", placement->print_w, placement->print_h);
+    DBG("Bitmap print offset: %d x %d px\n", placement->print_offx, placement->print_offy);
+
+    return placement;
+}
+
+BOOL prepare_label(struct label *label, const struct prepare_options *options)
+{
+    struct label_placement placement;
+    BOOL success = TRUE;
+    LONGLONG start;
+
+    /* A cached label might be shared with another thread, and might already
+     * have been prescaled, for this printer or for another. Once it has, it
+     * stays that way, and printers it doesn't suit leave it to GDI. */
+    if (options->prescale)
+    {
+        if (can_prescale_label(label))
+        {
+            compute_label_placement(options->geometry, label, &placement);
+
+            start = timing_start();
+            AcquireSRWLockExclusive(&label->lock);
+            if (!label->prescaled)
+                success = prescale_label(label, placement.print_w, placement.print_h);
+            ReleaseSRWLockExclusive(&label->lock);
+            timing_end(PHASE_PRESCALE, start);
+        }
+        else
+        {
+            /* Anything we can't scale ourselves is left to GDI. */
+            DBG("Label can't be prescaled, leaving it to the driver\n");
+        }
+    }
+
+    /* Cropped after prescaling, so the prescaled copy is cropped too. */
+    if (success && options->crop)
+    {
+        start = timing_start();
+        AcquireSRWLockExclusive(&label->lock);
+        crop_label(label);
+        ReleaseSRWLockExclusive(&label->lock);
+        timing_end(PHASE_CROP, start);
+    }
+
+    return success;
+}
+
+BOOL start_document(struct print_target *target, char *doc_name)
+{
+    DOCINFOA doc_info = {0};
+    int job_id;
+
+    doc_info.cbSize = sizeof(DOCINFOA);
+    doc_info.lpszDocName = doc_name;
+    doc_info.lpszOutput = NULL;
+    doc_info.lpszDatatype = NULL;
+    doc_info.fwType = 0;
+
+    /* Rendered pages don't belong to any document. */
+    if (target->render != NULL)
+        return TRUE;
+
+    /* Keep the spooler from filling up with jobs the printer hasn't got to
+     * yet. This blocks until it's worked through some of them. */
+    if (target->tracker != NULL)
+        target->document_start = reserve_job_slot(target->tracker);
+
+    for (int attempt = 1;; attempt++)
+    {
+        job_id = StartDocA(
+            target->context,
+            &doc_info);
+        if (job_id > 0)
+            break;
+
+        if (attempt > target->retries)
+        {
+            ERR("Failed to start document.\n");
+
+            if (target->tracker != NULL)
+                release_job_slot(target->tracker);
+
+            return FALSE;
+        }
+
+        printf(" ⚠️ Failed to start %s, trying again\n", doc_name);
+        Sleep(RETRY_DELAY_MS * attempt);
+    }
+
+    target->job_id = (DWORD)job_id;
+    target->document_name = doc_name;
+
+    return TRUE;
+}
+
+BOOL end_document(struct print_target *target)
+{
+    LONGLONG start = timing_start();
+
+    if (target->render != NULL)
+    {
+        timing_end(PHASE_END_DOC, start);
+        return TRUE;
+    }
+
+    if (EndDoc(target->context) <= 0)
+    {
+        ERR("Failed to end document.\n");
+
+        if (target->tracker != NULL)
+            release_job_slot(target->tracker);
+
+        return FALSE;
+    }
+
+    timing_end(PHASE_END_DOC, start);
+
+    /* The job's only in the spooler so far. The tracker follows it the rest
+     * of the way while we get on with the next one. */
+    if (target->tracker != NULL)
+        track_job(target->tracker, target->job_id, target->document_name, target->document_start);
+
+    return TRUE;
+}
+
+void abort_document(struct print_target *target)
+{
+    if (target->render != NULL)
+        return;
+
+    AbortDoc(target->context);
+
+    if (target->tracker != NULL)
+        release_job_slot(target->tracker);
+}
+
+/**
+ * @brief Work out how many bytes of bitmap a label hands to GDI.
+ */
+static size_t label_bits_size(const struct label *label)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+
+    if (info_header->biSizeImage > 0)
+        return info_header->biSizeImage;
+
+    return (((size_t)label->width * info_header->biBitCount + 31) / 32) * 4 * label->height;
+}
+
+/**
+ * @brief Set up the printer context's coordinate space, so a label drawn in
+ * its own pixels comes out at its placement.
+ *
+ * @return `TRUE` if the mapping was set up.
+ */
+static BOOL set_label_mapping(
+    HDC printer_context,
+    const struct label *label,
+    const struct label_placement *placement)
+{
+    if (SetMapMode(printer_context, MM_ANISOTROPIC) == 0)
+    {
+        ERR("Failed to set map mode.\n");
+        return FALSE;
+    }
+
+    if (SetWindowExtEx(
+            printer_context,
+            label->width,
+            label->height,
+            NULL) == 0)
+    {
+        ERR("Failed to set window extents.\n");
+        return FALSE;
+    }
+
+    if (SetViewportExtEx(
+            printer_context,
+            placement->print_w,
+            placement->print_h,
+            NULL) == 0)
+    {
+        ERR("Failed to set viewport extents.\n");
+        return FALSE;
+    }
+
+    if (SetViewportOrgEx(
+            printer_context,
+            placement->print_offx,
+            placement->print_offy,
+            NULL) == 0)
+    {
+        ERR("Failed to set viewport origin.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Work out how much of a bitmap's headers GDI reads: the header
+ * itself, any colour masks after it, and the palette.
+ *
+ * @return The size in bytes.
+ */
+static size_t bitmap_info_size(const BITMAPINFOHEADER *info_header)
+{
+    size_t size = info_header->biSize;
+    DWORD colors = info_header->biClrUsed;
+
+    if (info_header->biCompression == BI_BITFIELDS && info_header->biSize == sizeof(BITMAPINFOHEADER))
+        size += 3 * sizeof(DWORD);
+
+    if (colors == 0 && info_header->biBitCount <= 8)
+        colors = 1u << info_header->biBitCount;
+
+    return size + (size_t)colors * sizeof(RGBQUAD);
+}
+
+/**
+ * @brief Draw a label onto the page, cropped to its ink and in bands, if the
+ * label and target ask for either.
+ *
+ * Each band goes to GDI as a bitmap of its own, pointing at its rows in
+ * place, so neither GDI nor the driver ever holds more than a band of the
+ * label, and rows above and below the ink aren't sent at all. Once a band
+ * of a mapped file is sent, its pages are dropped from our working set;
+ * they're file-backed, so this costs nothing unless the label is printed
+ * again.
+ *
+ * @return `TRUE` if every band was drawn.
+ */
+static BOOL draw_label(
+    struct print_target *target,
+    const struct label *label,
+    const struct label_placement *placement,
+    BOOL prescaled)
+{
+    const BITMAPINFOHEADER *info_header = prescaled ? &label->device_info.header : label->info_header;
+    const BYTE *bits = prescaled ? label->device_bits : label->bits;
+    int width = info_header->biWidth;
+    int height = abs(info_header->biHeight);
+    BOOL top_down = info_header->biHeight < 0;
+    BOOL cropped = prescaled ? label->device_cropped : label->cropped;
+    RECT area = {0, 0, width, height};
+    int area_width, band_rows;
+    size_t stride = (((size_t)width * info_header->biBitCount + 31) / 32) * 4;
+    size_t info_size = bitmap_info_size(info_header);
+    BOOL mapped = !prescaled && !label->converted && label->view != NULL;
+
+    union
+    {
+        BITMAPINFOHEADER header;
+        BYTE bytes[sizeof(BITMAPV5HEADER) + 256 * sizeof(RGBQUAD)];
+    } band_info;
+
+    if (cropped)
+        area = prescaled ? label->device_ink : label->ink;
+
+    /* A blank label is just a blank page. */
+    if (IsRectEmpty(&area))
+    {
+        DBG("Label is blank, nothing to send.\n");
+        return TRUE;
+    }
+
+    area_width = area.right - area.left;
+    band_rows = area.bottom - area.top;
+    if (target->band_rows > 0 && target->band_rows < band_rows)
+        band_rows = target->band_rows;
+
+    /* Compressed rows can't be found without decoding everything before
+     * them, so those go out whole, as do labels that are neither cropped
+     * nor banded. */
+    if ((!cropped && band_rows == height) ||
+        (info_header->biCompression != BI_RGB && info_header->biCompression != BI_BITFIELDS) ||
+        info_size > sizeof(band_info))
+    {
+        target->bytes_sent += prescaled ? info_header->biSizeImage : label_bits_size(label);
+
+        if (prescaled)
+        {
+            return SetDIBitsToDevice(
+                       target->context,
+                       placement->print_offx, placement->print_offy,
+                       width, height,
+                       0, 0,
+                       0, height,
+                       bits,
+                       (BITMAPINFO *)info_header,
+                       DIB_RGB_COLORS) > 0;
+        }
+
+        return StretchDIBits(
+                   target->context,
+                   0, 0, width, height,
+                   0, 0, width, height,
+                   bits,
+                   (BITMAPINFO *)info_header,
+                   DIB_RGB_COLORS,
+                   SRCCOPY) > 0;
+    }
+
+    memcpy(band_info.bytes, info_header, info_size);
+
+    for (int row = area.top; row < area.bottom; row += band_rows)
+    {
+        int rows = min(band_rows, area.bottom - row);
+
+        /* Rows are counted from the top of the label, but a bottom-up
+         * bitmap keeps its top rows last. */
+        const BYTE *band_bits = bits + stride * (top_down ? row : height - row - rows);
+
+        band_info.header.biHeight = top_down ? -rows : rows;
+        band_info.header.biSizeImage = (DWORD)(stride * rows);
+
+        /* The band keeps the label's full width, cropped by the source
+         * rectangle, and lands where its pixels would have. */
+        if (prescaled)
+        {
+            if (SetDIBitsToDevice(
+                    target->context,
+                    placement->print_offx + area.left, placement->print_offy + row,
+                    area_width, rows,
+                    area.left, 0,
+                    0, rows,
+                    band_bits,
+                    (BITMAPINFO *)&band_info,
+                    DIB_RGB_COLORS) <= 0)
+                return FALSE;
+        }
+        else if (StretchDIBits(
+                     target->context,
+                     area.left, row, area_width, rows,
+                     area.left, 0, area_width, rows,
+                     band_bits,
+                     (BITMAPINFO *)&band_info,
+                     DIB_RGB_COLORS,
+                     SRCCOPY) <= 0)
+        {
+            return FALSE;
+        }
+
+        target->bytes_sent += stride * rows;
+
+        /* Unlocking pages that were never locked takes them out of the
+         * working set, which is all we want, so it "fails" every time. */
+        if (mapped)
+            VirtualUnlock((void *)band_bits, stride * rows);
+    }
+
+    DBG("Printed %d x %d px of the label in bands of %d rows.\n", area_width, area.bottom - area.top, band_rows);
+
+    return TRUE;
+}
+
+/**
+ * @brief Draw a label's layers over it, in the printer's own pixels.
+ *
+ * Modules are rounded to whole dots before anything is placed, so every bar
+ * of a barcode comes out the same width, which scaling the label's bitmap
+ * can't promise.
+ *
+ * @return `TRUE` if every layer was drawn.
+ */
+static BOOL draw_label_layers(
+    struct print_target *target,
+    const struct label *label,
+    const struct label_placement *placement)
+{
+    double scale_x = (double)placement->print_w / label->width;
+    double scale_y = (double)placement->print_h / label->height;
+
+    if (label->layer_count == 0)
+        return TRUE;
+
+    /* Whatever the bitmap was drawn with, layers go out 1:1. */
+    if (SetMapMode(target->context, MM_TEXT) == 0 ||
+        SetViewportOrgEx(target->context, 0, 0, NULL) == 0)
+    {
+        ERR("Failed to set map mode.\n");
+        return FALSE;
+    }
+
+    for (int i = 0; i < label->layer_count; i++)
+    {
+        const struct label_layer *layer = &label->layers[i];
+        struct barcode_bitmap bitmap;
+        int module_width = max(1, (int)(layer->module * scale_x + 0.5));
+        int module_height = layer->barcode->linear
+                                ? max(1, (int)(layer->bar_height * scale_y + 0.5))
+                                : max(1, (int)(layer->module * scale_y + 0.5));
+        int height;
+        BOOL drawn;
+
+        if (!rasterize_barcode(layer->barcode, module_width, module_height, &bitmap))
+            return FALSE;
+
+        height = bitmap.info.header.biHeight;
+        drawn = SetDIBitsToDevice(
+                    target->context,
+                    placement->print_offx + (int)(layer->x * scale_x + 0.5),
+                    placement->print_offy + (int)(layer->y * scale_y + 0.5),
+                    bitmap.info.header.biWidth, height,
+                    0, 0,
+                    0, height,
+                    bitmap.bits,
+                    (BITMAPINFO *)&bitmap.info,
+                    DIB_RGB_COLORS) > 0;
+
+        target->bytes_sent += bitmap.info.header.biSizeImage;
+        free_barcode_bitmap(&bitmap);
+
+        if (!drawn)
+            return FALSE;
+
+        DBG("Drew a barcode at %d x %d dots a module.\n", module_width, module_height);
+    }
+
+    return TRUE;
+}
+
+BOOL print_label(
+    struct print_target *target,
+    struct label *label,
+    char *filename,
+    BOOL own_document)
+{
+    BOOL success = FALSE;
+    HDC printer_context = target->context;
+    const struct label_placement *placement;
+
+    int saved_state = 0;
+    BOOL document_started = FALSE;
+    BOOL prescaled;
+    ULONGLONG bytes_sent = target->bytes_sent;
+    LONGLONG start;
+
+    start = timing_start();
+    placement = get_label_placement(&target->geometry, label);
+
+    /* Before we mess with the printer, we'll store its state. */
+    saved_state = SaveDC(printer_context);
+    if (saved_state <= 0)
+    {
+        ERR("Failed to save printer context.\n");
+        goto exit;
+    }
+
+    /* A prescaled label is already in printer pixels, so goes out 1:1, as
+     * long as it was prescaled for this printer. Otherwise, we set up the
+     * coordinate space to handle the scaling. */
+    prescaled = label->prescaled &&
+                label->device_info.header.biWidth == placement->print_w &&
+                label->device_info.header.biHeight == placement->print_h;
+    if (prescaled)
+    {
+        if (SetMapMode(printer_context, MM_TEXT) == 0)
+        {
+            ERR("Failed to set map mode.\n");
+            goto exit;
+        }
+    }
+    else if (!set_label_mapping(printer_context, label, placement))
+    {
+        goto exit;
+    }
+
+    timing_end(PHASE_MAPPING, start);
+
+    if (dry_run)
+    {
+        /* Skip the actual print. */
+        success = TRUE;
+        goto exit;
+    }
+
+    /* Unless we're part of a larger job, our print job will be a document
+     * with just one page in it. */
+    start = timing_start();
+    if (own_document)
+    {
+        if (!start_document(target, filename))
+            goto exit;
+
+        document_started = TRUE;
+    }
+
+    if (target->render != NULL ? !render_start_page(target->render) : StartPage(printer_context) <= 0)
+    {
+        ERR("Failed to start page.\n");
+        goto exit;
+    }
+
+    timing_end(PHASE_START_PAGE, start);
+
+    start = timing_start();
+    if (!draw_label(target, label, placement, prescaled) ||
+        !draw_label_layers(target, label, placement))
+    {
+        ERR("Failed to print label.\n");
+        goto exit;
+    }
+
+    timing_end(PHASE_STRETCH, start);
+
+    start = timing_start();
+    if (target->render != NULL ? !render_end_page(target->render) : EndPage(printer_context) <= 0)
+    {
+        ERR("Failed to end page.\n");
+        goto exit;
+    }
+
+    timing_end(PHASE_END_PAGE, start);
+
+    if (own_document)
+    {
+        /* A failed EndDoc has already let go of the document. */
+        document_started = FALSE;
+        if (!end_document(target))
+            goto exit;
+    }
+
+    success = TRUE;
+
+exit:
+    if (!success && document_started)
+    {
+        abort_document(target);
+    }
+
+    if (saved_state > 0 && !RestoreDC(printer_context, saved_state))
+    {
+        ERR("Failed to restore printer context.\n");
+        success = FALSE;
+    }
+
+    metrics_label(target->metrics, success, target->bytes_sent - bytes_sent);
+
+    return success;
+}
+
+/**
+ * @brief Print several copies of a label, once.
+ */
+static BOOL print_copies(
+    struct print_target *target,
+    struct label *label,
+    char *filename,
+    int copies,
+    BOOL own_document)
+{
+    BOOL document_started = FALSE;
+    int native_copies;
+
+    if (copies == target->copies)
+    {
+        return print_label(target, label, filename, own_document);
+    }
+
+    /* Drivers only take a new number of copies between documents. When the
+     * label is its own document, we can ask for as many as we like, and the
+     * bitmap only goes to the spooler once. */
+    if (own_document)
+    {
+        native_copies = get_native_copies(target, copies);
+        if (!set_print_mode(target, target->paper_size, target->landscape, native_copies))
+        {
+            return FALSE;
+        }
+
+        if (native_copies == copies)
+        {
+            return print_label(target, label, filename, TRUE);
+        }
+    }
+    else if (target->copies != 1)
+    {
+        ERR("Can't print %d copies of %s in a document of %d copies.\n", copies, filename, target->copies);
+        return FALSE;
+    }
+
+    /* Otherwise, we print the copies as pages of their own. */
+    if (own_document && !dry_run)
+    {
+        if (!start_document(target, filename))
+            return FALSE;
+
+        document_started = TRUE;
+    }
+
+    for (int i = 0; i < copies; i++)
+    {
+        if (!print_label(target, label, filename, own_document && !document_started))
+        {
+            if (document_started)
+                abort_document(target);
+
+            return FALSE;
+        }
+    }
+
+    return !document_started || end_document(target);
+}
+
+BOOL print_label_copies(
+    struct print_target *target,
+    struct label *label,
+    char *filename,
+    int copies,
+    BOOL own_document)
+{
+    for (int attempt = 1;; attempt++)
+    {
+        target->job_id = 0;
+        if (print_copies(target, label, filename, copies, own_document))
+            return TRUE;
+
+        /* Pages of the caller's document go down with it, so there's
+         * nothing for us to try again. If the document never started,
+         * `start_document()` has already had its tries. */
+        if (!own_document || target->job_id == 0 || attempt > target->retries)
+            return FALSE;
+
+        printf(" ⚠️ Failed to print %s, trying again\n", filename);
+        Sleep(RETRY_DELAY_MS * attempt);
+    }
+}
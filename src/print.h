@@ -0,0 +1,339 @@
+#ifndef PRINT_H
+#define PRINT_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "job_tracker.h"
+#include "label.h"
+#include "metrics.h"
+#include "printer.h"
+
+struct render;
+
+/* Where a label of a given size and resolution lands on the page, in
+ * printer pixels. */
+struct label_placement
+{
+    int width, height;
+    int xres, yres;
+
+    int print_w, print_h;
+    int print_offx, print_offy;
+};
+
+/* The printable area and resolution of a printer context, in printer
+ * pixels and pixels per meter. */
+struct printer_geometry
+{
+    int page_w, page_h;
+    int print_w, print_h;
+    int print_resx, print_resy;
+    int print_offx, print_offy;
+
+    struct label_placement last_placement;
+    BOOL has_placement;
+};
+
+/* A DEVMODE for one paper size and orientation. They're kept for as long as
+ * the printer is, so switching back to a paper doesn't go through the driver
+ * again. */
+struct print_mode
+{
+    short paper;
+    BOOL landscape;
+    int copies;
+    DEVMODE *devmode;
+};
+
+/* Everything needed to print labels to one printer, set up and ready. */
+struct print_target
+{
+    char *printer_name;
+
+    /* The one handle on the printer that its settings are asked through,
+     * held for as long as the target is open. */
+    struct printer_session session;
+    struct paper_table *paper_table;
+    const struct paper_size *paper_size;
+    BOOL landscape;
+    DEVMODE *devmode;
+    HDC context;
+    struct printer_geometry geometry;
+
+    /* How many copies of each page the driver prints, and the most it can
+     * print, or 0 until we've asked. */
+    int copies;
+    int max_copies;
+
+    /* The paper the target was opened with, for labels that don't ask for
+     * anything else. */
+    const struct paper_size *default_paper_size;
+    BOOL default_landscape;
+
+    /* Switch paper to suit each label, with `fit_print_target()`. */
+    BOOL auto_paper;
+
+    struct print_mode *modes;
+    int mode_count;
+
+    /* How many more times to try a document the spooler turns away, before
+     * giving up on it. */
+    int retries;
+
+    /* Send labels taller than this many rows in bands of it, or 0 to send
+     * them whole. */
+    int band_rows;
+
+    /* Follows each document through to the printer, if set. The caller
+     * starts and stops it. */
+    struct job_tracker *tracker;
+
+    /* The document that's open, for the tracker. */
+    DWORD job_id;
+    char *document_name;
+    LONGLONG document_start;
+
+    /* Set when the target renders into memory, from `open_render_target()`,
+     * rather than printing. */
+    struct render *render;
+
+    /* How many bytes of bitmap we've handed to GDI for printing. */
+    ULONGLONG bytes_sent;
+
+    /* The printer's counters, or `NULL` without metrics. */
+    struct printer_metrics *metrics;
+};
+
+/* How labels are prepared before they reach the printer. */
+struct prepare_options
+{
+    const struct printer_geometry *geometry;
+
+    /* Scale monochrome labels to the printer's resolution ourselves, rather
+     * than leaving it to GDI and the driver. */
+    BOOL prescale;
+
+    /* Send only the inked part of each label, leaving the white around it
+     * out. */
+    BOOL crop;
+};
+
+/**
+ * @brief Set up a printer for printing labels: find its paper size, build a
+ * DEVMODE for it, and create the printer context.
+ *
+ * @param target The target to set up. Release it with `close_print_target()`,
+ * even if this fails.
+ * @param printer_name The printer to print to. Must outlive the target.
+ * @param paper_size_name The paper size to print on, or `NULL` for the
+ * printer's default.
+ * @param landscape `TRUE` to print in landscape, otherwise portrait.
+ * @param copies How many copies of each label to have the driver print, if it
+ * can. If it can't, the target prints one and leaves the rest to the caller.
+ * @param profile_name The profile to take the printer's settings from, in
+ * place of `paper_size_name` and `landscape`, or `NULL` to ask the driver.
+ * @param refresh_printer_cache Ask the driver for its paper sizes, rather
+ * than trusting the printer cache.
+ * @return `TRUE` if the printer is ready.
+ */
+BOOL open_print_target(
+    struct print_target *target,
+    char *printer_name,
+    const char *paper_size_name,
+    BOOL landscape,
+    int copies,
+    const char *profile_name,
+    BOOL refresh_printer_cache);
+
+/**
+ * @brief Save the settings a print target was opened with as a profile, so
+ * later runs can open it from `profile_name` without asking the driver.
+ *
+ * @param target The target to save the settings of.
+ * @param profile_name The name to save the profile under.
+ * @return `TRUE` if the profile was saved.
+ */
+BOOL save_print_profile(const struct print_target *target, const char *profile_name);
+
+/**
+ * @brief Release everything held by a print target.
+ *
+ * @param target The target to release.
+ */
+void close_print_target(struct print_target *target);
+
+/**
+ * @brief Switch a print target to another paper size or orientation, without
+ * creating a new printer context. Only call this between pages.
+ *
+ * @param target The target to switch.
+ * @param paper_size The paper size to print on. Must belong to the target's
+ * paper table.
+ * @param landscape `TRUE` to print in landscape, otherwise portrait.
+ * @return `TRUE` if the target is ready to print on the new paper.
+ */
+BOOL set_print_target_paper(
+    struct print_target *target,
+    const struct paper_size *paper_size,
+    BOOL landscape);
+
+/**
+ * @brief Find the paper size and orientation closest to a label's own size.
+ *
+ * @param table The paper sizes to choose from.
+ * @param label The label to find paper for.
+ * @param landscape Set to `TRUE` if the label fits better in landscape.
+ * @return The paper size, or `NULL` if the table is empty. The paper size
+ * belongs to the table.
+ */
+const struct paper_size *find_label_paper_size(
+    const struct paper_table *table,
+    const struct label *label,
+    BOOL *landscape);
+
+/**
+ * @brief If the target picks paper for each label, switch it to the paper
+ * that best fits this one. Only call this between pages.
+ *
+ * @param target The target to switch.
+ * @param label The label about to be printed.
+ * @return `TRUE` if the target is ready to print the label.
+ */
+BOOL fit_print_target(struct print_target *target, const struct label *label);
+
+/**
+ * @brief Reorder a batch of labels so those on the same paper are next to
+ * each other, keeping their order within each paper.
+ *
+ * @param table The paper sizes that labels are matched against.
+ * @param filenames The files to reorder, in place.
+ * @param count The number of files.
+ * @return `TRUE` if the files were reordered.
+ */
+BOOL group_labels_by_paper(
+    const struct paper_table *table,
+    char **filenames,
+    int count);
+
+/**
+ * @brief Query the printable area and resolution of a printer context.
+ *
+ * These don't change for the life of the context, so we ask once up front
+ * rather than for every label.
+ *
+ * @param printer_context The printer context to query.
+ * @param geometry The geometry to fill in.
+ */
+void get_printer_geometry(
+    HDC printer_context,
+    struct printer_geometry *geometry);
+
+/**
+ * @brief Work out where a label lands on the page, without using or updating
+ * the geometry's last placement. Safe to call from any thread.
+ *
+ * @param geometry The geometry of the printer context being printed to.
+ * @param label The label to place.
+ * @param placement Filled in with the label's placement.
+ */
+void compute_label_placement(
+    const struct printer_geometry *geometry,
+    const struct label *label,
+    struct label_placement *placement);
+
+/**
+ * @brief Work out where a label lands on the page.
+ *
+ * Batches are usually all the same size of label, so the last placement is
+ * kept and handed straight back when the next label matches it.
+ *
+ * @param geometry The geometry of the printer context being printed to.
+ * @param label The label to place.
+ * @return The label's placement. Only valid until the next call.
+ */
+const struct label_placement *get_label_placement(
+    struct printer_geometry *geometry,
+    const struct label *label);
+
+/**
+ * @brief Do any work on a label that can be done before it's printed.
+ *
+ * This doesn't touch the printer context, so it can be done on the loader's
+ * threads while the printer is busy with something else.
+ *
+ * @param label The label to prepare.
+ * @param options How to prepare it.
+ * @return `TRUE` if the label is ready to print.
+ */
+BOOL prepare_label(struct label *label, const struct prepare_options *options);
+
+/**
+ * @brief Start a new print document on the target, trying again as many
+ * times as the target allows. If the target has a job tracker, this waits
+ * until the tracker has room for another job.
+ *
+ * @param target The target to start the document on.
+ * @param doc_name The name the document will have in the spooler queue. Must
+ * outlive the document.
+ * @return `TRUE` if the document was started.
+ */
+BOOL start_document(struct print_target *target, char *doc_name);
+
+/**
+ * @brief End the current print document, sending it to the spooler. If the
+ * target has a job tracker, the job is handed to it to follow to the printer.
+ *
+ * @param target The target with the open document.
+ * @return `TRUE` if the document was ended.
+ */
+BOOL end_document(struct print_target *target);
+
+/**
+ * @brief Abandon the current print document.
+ *
+ * @param target The target with the open document.
+ */
+void abort_document(struct print_target *target);
+
+/**
+ * @brief Print a single label.
+ *
+ * @param target The printer to print the label on.
+ * @param label The label to print. The caller still owns it.
+ * @param filename The file the label came from, used to name the document.
+ * @param own_document If `TRUE`, the label is printed as its own document.
+ * Otherwise the caller has already started a document with `start_document()`
+ * and the label is added to it as a new page.
+ * @return `TRUE` if the label was printed.
+ */
+BOOL print_label(
+    struct print_target *target,
+    struct label *label,
+    char *filename,
+    BOOL own_document);
+
+/**
+ * @brief Print several copies of a label. When the label is its own document
+ * and the driver can print the copies itself, the label is only sent once.
+ * Otherwise the copies are printed as pages. When the copies are their own
+ * document and it fails, it's tried again as many times as the target allows.
+ *
+ * @param target The printer to print the label on.
+ * @param label The label to print. The caller still owns it.
+ * @param filename The file the label came from, used to name the document.
+ * @param copies The number of copies to print.
+ * @param own_document If `TRUE`, the copies are printed as their own
+ * document. Otherwise they're added to the caller's document, which must not
+ * already have the driver printing more than one copy of each page, unless
+ * it's the number we want.
+ * @return `TRUE` if every copy was printed.
+ */
+BOOL print_label_copies(
+    struct print_target *target,
+    struct label *label,
+    char *filename,
+    int copies,
+    BOOL own_document);
+
+#endif /* PRINT_H */
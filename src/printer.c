@@ -0,0 +1,696 @@
+#include <float.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+#include <winspool.h>
+
+#include "log.h"
+#include "printer.h"
+#include "printer_cache.h"
+
+char *get_default_printer(void)
+{
+    char *printer_name = NULL;
+    DWORD size = 0;
+
+    GetDefaultPrinter(NULL, &size);
+    if (size == 0)
+    {
+        ERR("Failed to get default printer name.\n");
+        goto exit;
+    }
+
+    printer_name = (char *)malloc(size);
+    if (printer_name == NULL)
+    {
+        ERR("Failed to allocate memory for default printer name.\n");
+        goto exit;
+    }
+
+    if (!GetDefaultPrinter(printer_name, &size))
+    {
+        ERR("Failed to get default printer name.\n");
+        goto exit;
+    }
+
+    DBG("Default printer: %s\n", printer_name);
+
+    return printer_name;
+
+exit:
+    if (printer_name != NULL)
+        free(printer_name);
+
+    return NULL;
+}
+
+BOOL open_printer_session(struct printer_session *session, char *printer_name)
+{
+    session->printer_name = printer_name;
+    session->handle = NULL;
+
+    if (!OpenPrinter(printer_name, &session->handle, NULL))
+    {
+        ERR("Failed to open printer %s.\n", printer_name);
+        session->handle = NULL;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void close_printer_session(struct printer_session *session)
+{
+    if (session->handle != NULL)
+        ClosePrinter(session->handle);
+
+    session->handle = NULL;
+}
+
+BOOL get_printer_driver_id(const struct printer_session *session, struct printer_driver_id *driver_id)
+{
+    BYTE *driver_info = NULL;
+    DWORD level = 6;
+    DWORD size = 0;
+    BOOL success = FALSE;
+
+    memset(driver_id, 0, sizeof(*driver_id));
+
+    /* DRIVER_INFO_6 has the driver's version and date, but older drivers
+     * only give us DRIVER_INFO_2. */
+    GetPrinterDriver(session->handle, NULL, level, NULL, 0, &size);
+    if (size == 0)
+    {
+        level = 2;
+        GetPrinterDriver(session->handle, NULL, level, NULL, 0, &size);
+    }
+
+    if (size == 0)
+    {
+        ERR("Failed to get printer driver info.\n");
+        goto exit;
+    }
+
+    driver_info = (BYTE *)malloc(size);
+    if (driver_info == NULL)
+    {
+        ERR("Failed to allocate memory for printer driver info.\n");
+        goto exit;
+    }
+
+    if (!GetPrinterDriver(session->handle, NULL, level, driver_info, size, &size))
+    {
+        ERR("Failed to get printer driver info.\n");
+        goto exit;
+    }
+
+    if (level == 6)
+    {
+        DRIVER_INFO_6 *info = (DRIVER_INFO_6 *)driver_info;
+        snprintf(driver_id->name, sizeof(driver_id->name), "%s", info->pName);
+        driver_id->version = info->dwlDriverVersion;
+        driver_id->date = info->ftDriverDate;
+    }
+    else
+    {
+        DRIVER_INFO_2 *info = (DRIVER_INFO_2 *)driver_info;
+        snprintf(driver_id->name, sizeof(driver_id->name), "%s", info->pName);
+        driver_id->version = info->cVersion;
+    }
+
+    DBG("Printer driver: %s (version %llx)\n", driver_id->name, driver_id->version);
+
+    success = TRUE;
+
+exit:
+    if (driver_info != NULL)
+        free(driver_info);
+
+    return success;
+}
+
+BOOL same_printer_driver(const struct printer_driver_id *a, const struct printer_driver_id *b)
+{
+    return strncmp(a->name, b->name, sizeof(a->name)) == 0 &&
+           a->version == b->version &&
+           a->date.dwLowDateTime == b->date.dwLowDateTime &&
+           a->date.dwHighDateTime == b->date.dwHighDateTime;
+}
+
+/**
+ * @brief Get the default paper size for the specified printer.
+ *
+ * @param session The printer to request the default page size name from.
+ * @param paper_size_name Filled in with the default paper size name.
+ * @return `TRUE` if the default paper size was found.
+ */
+static BOOL get_default_paper_size_name(
+    const struct printer_session *session,
+    char paper_size_name[PAPER_NAME_SIZE])
+{
+    PRINTER_INFO_2 *printer_info = NULL;
+    DWORD size = 0;
+    BOOL success = FALSE;
+
+    /* Get PRINTER_INFO_2, which has the DEVMODE structure we need. */
+    GetPrinter(session->handle, 2, NULL, 0, &size);
+    if (size == 0)
+    {
+        ERR("Failed to get printer info.\n");
+        goto exit;
+    }
+
+    printer_info = (PRINTER_INFO_2 *)malloc(size);
+    if (printer_info == NULL)
+    {
+        ERR("Failed to allocate memory for printer info.\n");
+        goto exit;
+    }
+
+    if (!GetPrinter(session->handle, 2, (void *)printer_info, size, &size))
+    {
+        ERR("Failed to get printer info.\n");
+        goto exit;
+    }
+
+    if (printer_info->pDevMode == NULL)
+    {
+        ERR("DEVMODE not found in printer info.\n");
+        goto exit;
+    }
+
+    snprintf(paper_size_name, PAPER_NAME_SIZE, "%s", printer_info->pDevMode->dmFormName);
+
+    DBG("Default paper size: %s\n", paper_size_name);
+
+    success = TRUE;
+
+exit:
+    if (printer_info != NULL)
+        free(printer_info);
+
+    return success;
+}
+
+struct paper_table *query_paper_table(const struct printer_session *session)
+{
+    char *printer_name = session->printer_name;
+    struct paper_table *table = NULL;
+    BOOL success = FALSE;
+
+    int paper_count = 0;
+    short *sizes = NULL;
+    POINT *dimensions = NULL;
+    char *names = NULL;
+
+    table = (struct paper_table *)calloc(1, sizeof(struct paper_table));
+    if (table == NULL)
+    {
+        ERR("Failed to allocate memory for paper table.\n");
+        goto exit;
+    }
+
+    if (!get_default_paper_size_name(session, table->default_name))
+    {
+        goto exit;
+    }
+
+    /* We need to get DM_PAPERS and DM_PAPERSIZE from the driver - and we
+     * do a bit of a dance to get there. First we get the size of the
+     * structure, and then we get the structure itself! Any failures, we
+     * need to clean up before returning. */
+
+    paper_count = DeviceCapabilities(
+        printer_name, NULL, DC_PAPERS, NULL, NULL);
+    if (paper_count <= 0)
+    {
+        ERR("Failed to get paper sizes.\n");
+        goto exit;
+    }
+
+    DBG("Paper count: %d\n", paper_count);
+
+    sizes = (short *)malloc(paper_count * sizeof(short));
+    if (sizes == NULL)
+    {
+        ERR("Failed to allocate memory for paper sizes.\n");
+        goto exit;
+    }
+
+    if (DeviceCapabilities(
+            printer_name, NULL, DC_PAPERS, (char *)sizes, NULL) <= 0)
+    {
+        ERR("Failed to get paper sizes.\n");
+        goto exit;
+    }
+
+    dimensions = (POINT *)malloc(paper_count * sizeof(POINT));
+    if (dimensions == NULL)
+    {
+        ERR("Failed to allocate memory for paper sizes.\n");
+        goto exit;
+    }
+
+    if (DeviceCapabilities(
+            printer_name, NULL, DC_PAPERSIZE, (char *)dimensions, NULL) <= 0)
+    {
+        ERR("Failed to get paper dimensions.\n");
+        goto exit;
+    }
+
+    names = (char *)malloc(paper_count * PAPER_NAME_SIZE);
+    if (names == NULL)
+    {
+        ERR("Failed to allocate memory for paper names.\n");
+        goto exit;
+    }
+
+    if (DeviceCapabilities(
+            printer_name, NULL, DC_PAPERNAMES, (char *)names, NULL) <= 0)
+    {
+        ERR("Failed to get paper names.\n");
+        goto exit;
+    }
+
+    table->papers = (struct paper_size *)calloc(paper_count, sizeof(struct paper_size));
+    if (table->papers == NULL)
+    {
+        ERR("Failed to allocate memory for paper table.\n");
+        goto exit;
+    }
+
+    /* The arrays all share the same indicies - so we can copy the details
+     * across in one go. Names only have a terminator if they're shorter
+     * than the field. */
+    for (int i = 0; i < paper_count; i++)
+    {
+        struct paper_size *paper_size = &table->papers[i];
+        const char *name = names + (i * PAPER_NAME_SIZE);
+
+        snprintf(paper_size->name, PAPER_NAME_SIZE, "%.*s", PAPER_NAME_SIZE - 1, name);
+        paper_size->size = sizes[i];
+        paper_size->width_mm = dimensions[i].x / 10.0f;
+        paper_size->height_mm = dimensions[i].y / 10.0f;
+    }
+
+    table->count = paper_count;
+
+    if (!index_paper_table(table))
+    {
+        goto exit;
+    }
+
+    success = TRUE;
+
+exit:
+    if (sizes != NULL)
+        free(sizes);
+
+    if (dimensions != NULL)
+        free(dimensions);
+
+    if (names != NULL)
+        free(names);
+
+    if (!success)
+    {
+        free_paper_table(table);
+        table = NULL;
+    }
+
+    return table;
+}
+
+struct paper_table *get_paper_table(const struct printer_session *session, BOOL refresh)
+{
+    char *printer_name = session->printer_name;
+    struct printer_driver_id driver_id;
+    struct paper_table *table = NULL;
+    BOOL have_driver_id;
+
+    /* Without knowing the driver we can't tell if the cache is stale, so
+     * we'd have to go to the driver anyway. */
+    have_driver_id = get_printer_driver_id(session, &driver_id);
+
+    if (have_driver_id && !refresh)
+    {
+        table = printer_cache_load(printer_name, &driver_id);
+        if (table != NULL)
+            return table;
+    }
+
+    table = query_paper_table(session);
+    if (table == NULL)
+        return NULL;
+
+    if (have_driver_id && !printer_cache_save(printer_name, &driver_id, table))
+    {
+        /* Not fatal, we'll just have to ask the driver again next time. */
+        DBG("Failed to update printer cache\n");
+    }
+
+    return table;
+}
+
+void free_paper_table(struct paper_table *table)
+{
+    if (table == NULL)
+        return;
+
+    if (table->papers != NULL)
+        free(table->papers);
+
+    if (table->by_name != NULL)
+        free(table->by_name);
+
+    if (table->by_id != NULL)
+        free(table->by_id);
+
+    if (table->by_width != NULL)
+        free(table->by_width);
+
+    free(table);
+}
+
+/**
+ * @brief Hash a paper size name, FNV-1a style.
+ */
+static unsigned int hash_paper_name(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    for (int i = 0; i < PAPER_NAME_SIZE && name[i] != '\0'; i++)
+    {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Spread a paper size id across the hash table.
+ */
+static unsigned int hash_paper_id(short id)
+{
+    return (unsigned short)id * 2654435761u;
+}
+
+/* A paper's width alongside its index, so sorting by width needs nothing
+ * but the records themselves. */
+struct paper_width
+{
+    float width_mm;
+    int index;
+};
+
+static int compare_paper_width(const void *a, const void *b)
+{
+    const struct paper_width *pa = (const struct paper_width *)a;
+    const struct paper_width *pb = (const struct paper_width *)b;
+
+    if (pa->width_mm != pb->width_mm)
+        return pa->width_mm < pb->width_mm ? -1 : 1;
+
+    /* Keep the driver's order for papers of the same width. */
+    return pa->index - pb->index;
+}
+
+BOOL index_paper_table(struct paper_table *table)
+{
+    struct paper_width *widths;
+    unsigned int mask;
+
+    /* Keep the tables at most half full, so probes stay short. */
+    table->index_size = 16;
+    while (table->index_size < table->count * 2)
+        table->index_size *= 2;
+
+    mask = table->index_size - 1;
+
+    table->by_name = (int *)malloc(table->index_size * sizeof(int));
+    table->by_id = (int *)malloc(table->index_size * sizeof(int));
+    table->by_width = (int *)malloc(table->count * sizeof(int));
+    widths = (struct paper_width *)malloc((table->count > 0 ? table->count : 1) * sizeof(struct paper_width));
+    if (table->by_name == NULL || table->by_id == NULL || table->by_width == NULL || widths == NULL)
+    {
+        ERR("Failed to allocate memory for paper table index.\n");
+        free(widths);
+        return FALSE;
+    }
+
+    memset(table->by_name, 0xff, table->index_size * sizeof(int));
+    memset(table->by_id, 0xff, table->index_size * sizeof(int));
+
+    for (int i = 0; i < table->count; i++)
+    {
+        const struct paper_size *paper_size = &table->papers[i];
+        unsigned int slot;
+
+        /* If a name or id turns up twice, the driver's first one wins. */
+        slot = hash_paper_name(paper_size->name) & mask;
+        while (table->by_name[slot] >= 0 &&
+               strncmp(table->papers[table->by_name[slot]].name, paper_size->name, PAPER_NAME_SIZE) != 0)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        if (table->by_name[slot] < 0)
+            table->by_name[slot] = i;
+
+        slot = hash_paper_id(paper_size->size) & mask;
+        while (table->by_id[slot] >= 0 &&
+               table->papers[table->by_id[slot]].size != paper_size->size)
+        {
+            slot = (slot + 1) & mask;
+        }
+
+        if (table->by_id[slot] < 0)
+            table->by_id[slot] = i;
+
+        widths[i].width_mm = paper_size->width_mm;
+        widths[i].index = i;
+    }
+
+    qsort(widths, table->count, sizeof(struct paper_width), compare_paper_width);
+
+    for (int i = 0; i < table->count; i++)
+        table->by_width[i] = widths[i].index;
+
+    free(widths);
+
+    DBG("Indexed %d paper sizes\n", table->count);
+
+    return TRUE;
+}
+
+const struct paper_size *find_paper_size(
+    const struct paper_table *table,
+    const char *paper_size_name)
+{
+    const struct paper_size *paper_size = NULL;
+    unsigned int mask = table->index_size - 1;
+    unsigned int slot;
+
+    slot = hash_paper_name(paper_size_name) & mask;
+    while (table->by_name[slot] >= 0)
+    {
+        const struct paper_size *candidate = &table->papers[table->by_name[slot]];
+        if (strncmp(candidate->name, paper_size_name, PAPER_NAME_SIZE) == 0)
+        {
+            /* We found it! */
+            paper_size = candidate;
+            break;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+
+    if (paper_size == NULL)
+    {
+        ERR("Failed to find matching paper size.\n");
+        return NULL;
+    }
+
+    DBG("Found paper size: name=%s, size=%d, width=%.1f mm, height=%.1f mm\n",
+        paper_size->name,
+        paper_size->size,
+        paper_size->width_mm,
+        paper_size->height_mm);
+
+    return paper_size;
+}
+
+const struct paper_size *find_paper_size_by_id(
+    const struct paper_table *table,
+    short id)
+{
+    unsigned int mask = table->index_size - 1;
+    unsigned int slot;
+
+    slot = hash_paper_id(id) & mask;
+    while (table->by_id[slot] >= 0)
+    {
+        const struct paper_size *candidate = &table->papers[table->by_id[slot]];
+        if (candidate->size == id)
+            return candidate;
+
+        slot = (slot + 1) & mask;
+    }
+
+    return NULL;
+}
+
+const struct paper_size *find_closest_paper_size(
+    const struct paper_table *table,
+    float width_mm,
+    float height_mm)
+{
+    const struct paper_size *best = NULL;
+    float best_distance = 0;
+    int low = 0, high = table->count;
+
+    if (table->count == 0)
+        return NULL;
+
+    /* Find the first paper at least as wide as we want. */
+    while (low < high)
+    {
+        int mid = (low + high) / 2;
+        if (table->papers[table->by_width[mid]].width_mm < width_mm)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    /* Then work outwards from there, always taking whichever side is
+     * closer in width. Once the difference in width alone is bigger than
+     * the best match, nothing further out can beat it. */
+    for (int below = low - 1, above = low; below >= 0 || above < table->count;)
+    {
+        const struct paper_size *candidate;
+        float dw_below = below >= 0 ? width_mm - table->papers[table->by_width[below]].width_mm : FLT_MAX;
+        float dw_above = above < table->count ? table->papers[table->by_width[above]].width_mm - width_mm : FLT_MAX;
+        float dw, dh, distance;
+
+        if (dw_above <= dw_below)
+        {
+            candidate = &table->papers[table->by_width[above++]];
+            dw = dw_above;
+        }
+        else
+        {
+            candidate = &table->papers[table->by_width[below--]];
+            dw = dw_below;
+        }
+
+        if (best != NULL && dw * dw > best_distance)
+            break;
+
+        dh = candidate->height_mm - height_mm;
+        distance = dw * dw + dh * dh;
+        if (best == NULL || distance < best_distance)
+        {
+            best = candidate;
+            best_distance = distance;
+        }
+    }
+
+    return best;
+}
+
+int get_max_copies(const struct printer_session *session)
+{
+    int copies = DeviceCapabilities(session->printer_name, NULL, DC_COPIES, NULL, NULL);
+
+    DBG("Driver can print %d copies\n", copies);
+
+    return copies > 1 ? copies : 1;
+}
+
+DEVMODE *set_paper_size(
+    const struct printer_session *session,
+    const struct paper_size *paper_size,
+    BOOL landscape,
+    int copies)
+{
+    DEVMODE *devmode = NULL;
+    HANDLE printer = session->handle;
+    char *printer_name = session->printer_name;
+    int devmode_size = 0;
+
+    DBG("Setting paper size to %s\n", paper_size->name);
+
+    devmode_size = DocumentProperties(
+        NULL, printer, (char *)printer_name, NULL, NULL, 0);
+
+    if (devmode_size <= 0)
+    {
+        ERR("Failed to get printer properties size.\n");
+        goto exit;
+    }
+
+    devmode = (DEVMODE *)malloc(devmode_size);
+    if (devmode == NULL)
+    {
+        ERR("Failed to allocate memory for printer properties.\n");
+        goto exit;
+    }
+
+    if (DocumentProperties(
+            NULL,
+            printer,
+            printer_name,
+            devmode,
+            NULL,
+            DM_OUT_BUFFER) != IDOK)
+    {
+        ERR("Failed to get printer properties.\n");
+        goto exit;
+    }
+
+    /* Configure our page settings. */
+    devmode->dmFields |= DM_PAPERSIZE | DM_ORIENTATION;
+    devmode->dmPaperSize = paper_size->size;
+    devmode->dmOrientation = landscape ? DMORIENT_LANDSCAPE : DMORIENT_PORTRAIT;
+
+    /* Each page's copies should come out together, not the whole document
+     * over again. */
+    devmode->dmFields |= DM_COPIES | DM_COLLATE;
+    devmode->dmCopies = (short)copies;
+    devmode->dmCollate = DMCOLLATE_FALSE;
+
+    if (!dry_run)
+    {
+        if (DocumentProperties(
+                NULL,
+                printer,
+                printer_name,
+                devmode,
+                devmode,
+                (DM_IN_BUFFER | DM_OUT_BUFFER)) != IDOK ||
+            devmode == NULL)
+        {
+            ERR("Failed to set paper size or devmode is invalid.\n");
+            goto exit;
+        }
+    }
+
+    DBG("Printer properties: paper size=%d, orientation=%s, copies=%d\n",
+        devmode->dmPaperSize,
+        (devmode->dmOrientation == DMORIENT_LANDSCAPE) ? "landscape" : "portrait",
+        devmode->dmCopies);
+
+    return devmode;
+
+exit:
+    if (devmode != NULL)
+    {
+        free(devmode);
+    }
+
+    return NULL;
+}
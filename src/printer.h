@@ -0,0 +1,193 @@
+#ifndef PRINTER_H
+#define PRINTER_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+#define PAPER_NAME_SIZE (64)
+
+struct paper_size
+{
+    char name[PAPER_NAME_SIZE];
+    short size;
+    float width_mm;
+    float height_mm;
+};
+
+/* Every paper size a printer's driver knows about, along with the one the
+ * printer is set to use by default. */
+struct paper_table
+{
+    char default_name[PAPER_NAME_SIZE];
+    int count;
+    struct paper_size *papers;
+
+    /* Indexes into `papers`, filled in by `index_paper_table()`. The name and
+     * id indexes are open-addressed hash tables with `index_size` slots, and
+     * empty slots are -1. `by_width` is every paper, narrowest first. */
+    int index_size;
+    int *by_name;
+    int *by_id;
+    int *by_width;
+};
+
+/* Identifies the driver a printer is using, so we can tell when anything we
+ * learned from it has gone stale. */
+struct printer_driver_id
+{
+    char name[128];
+    DWORDLONG version;
+    FILETIME date;
+};
+
+/* A printer opened once and shared by everything that asks its driver or
+ * spooler about it, since each open is a round trip to a print server. */
+struct printer_session
+{
+    char *printer_name;
+    HANDLE handle;
+};
+
+/**
+ * @brief Get the default printer name.
+ *
+ * @return The default printer name, or `NULL` on failure.
+ */
+char *get_default_printer(void);
+
+/**
+ * @brief Open a printer, to share between everything that needs it.
+ *
+ * @param session Filled in with the open printer. Release it with
+ * `close_printer_session()`, even if this fails.
+ * @param printer_name The printer to open. Must outlive the session.
+ * @return `TRUE` if the printer was opened.
+ */
+BOOL open_printer_session(struct printer_session *session, char *printer_name);
+
+/**
+ * @brief Close a printer session.
+ *
+ * @param session The session to close. Anything still using its handle must
+ * be finished with it.
+ */
+void close_printer_session(struct printer_session *session);
+
+/**
+ * @brief Identify the driver used by a printer.
+ *
+ * @param session The printer to identify the driver of.
+ * @param driver_id Filled in with the driver's details.
+ * @return `TRUE` if the driver was identified.
+ */
+BOOL get_printer_driver_id(const struct printer_session *session, struct printer_driver_id *driver_id);
+
+/**
+ * @brief Check whether two driver ids are for the same driver.
+ *
+ * @return `TRUE` if the name, version and date all match.
+ */
+BOOL same_printer_driver(const struct printer_driver_id *a, const struct printer_driver_id *b);
+
+/**
+ * @brief Get the paper table for a printer.
+ *
+ * Asking the driver for its paper sizes is slow, particularly for network
+ * printers, so the table is kept in the printer cache and only fetched from
+ * the driver when the cache is missing, stale, or `refresh` is set.
+ *
+ * @param session The printer to get the paper sizes of.
+ * @param refresh Ignore anything in the cache, and update it from the driver.
+ * @return The paper table, or `NULL` on failure. Release it with
+ * `free_paper_table()`.
+ */
+struct paper_table *get_paper_table(const struct printer_session *session, BOOL refresh);
+
+/**
+ * @brief Ask the driver for a printer's paper table, bypassing the cache.
+ *
+ * @param session The printer to get the paper sizes of.
+ * @return The paper table, or `NULL` on failure. Release it with
+ * `free_paper_table()`.
+ */
+struct paper_table *query_paper_table(const struct printer_session *session);
+
+/**
+ * @brief Release a paper table.
+ *
+ * @param table The table to release. May be `NULL`.
+ */
+void free_paper_table(struct paper_table *table);
+
+/**
+ * @brief Build the lookup indexes for a paper table.
+ *
+ * @param table The table to index.
+ * @return `TRUE` if the table was indexed.
+ */
+BOOL index_paper_table(struct paper_table *table);
+
+/**
+ * @brief Find a paper size by name.
+ *
+ * @param table The paper table to search.
+ * @param paper_size_name The name of the paper size to get.
+ * @return The paper size, or `NULL` if there isn't one by that name. The
+ * paper size belongs to the table.
+ */
+const struct paper_size *find_paper_size(
+    const struct paper_table *table,
+    const char *paper_size_name);
+
+/**
+ * @brief Find a paper size by its DEVMODE `dmPaperSize` id.
+ *
+ * @param table The paper table to search.
+ * @param id The paper size id.
+ * @return The paper size, or `NULL` if there isn't one with that id. The
+ * paper size belongs to the table.
+ */
+const struct paper_size *find_paper_size_by_id(
+    const struct paper_table *table,
+    short id);
+
+/**
+ * @brief Find the paper size closest to the given dimensions.
+ *
+ * @param table The paper table to search.
+ * @param width_mm The width to match.
+ * @param height_mm The height to match.
+ * @return The closest paper size, or `NULL` if the table is empty. The paper
+ * size belongs to the table.
+ */
+const struct paper_size *find_closest_paper_size(
+    const struct paper_table *table,
+    float width_mm,
+    float height_mm);
+
+/**
+ * @brief Find out how many copies of each page the printer's driver can print
+ * by itself.
+ *
+ * @param session The printer to ask.
+ * @return The most copies the driver can print, which is 1 if it can't.
+ */
+int get_max_copies(const struct printer_session *session);
+
+/**
+ * @brief Build a DEVMODE for printing on a paper size and orientation.
+ *
+ * @param session The printer to build the DEVMODE for.
+ * @param paper_size The paper size to print on.
+ * @param landscape `TRUE` to print in landscape, otherwise portrait.
+ * @param copies How many copies of each page the driver should print. More
+ * than one needs the driver to support it, see `get_max_copies()`.
+ * @return The DEVMODE, or `NULL` on failure. Release it with `free()`.
+ */
+DEVMODE *set_paper_size(
+    const struct printer_session *session,
+    const struct paper_size *paper_size,
+    BOOL landscape,
+    int copies);
+
+#endif /* PRINTER_H */
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "log.h"
+#include "printer.h"
+#include "printer_cache.h"
+
+#define CACHE_MAGIC (0x3143504C) /* "LPC1" */
+#define CACHE_FOLDER "printers"
+#define CACHE_EXTENSION ".papers"
+
+/* The start of every cache file. The paper sizes follow straight after. */
+struct printer_cache_header
+{
+    DWORD magic;
+    DWORD header_size;
+    char printer_name[MAX_PATH];
+    struct printer_driver_id driver_id;
+    char default_name[PAPER_NAME_SIZE];
+    DWORD count;
+};
+
+BOOL get_cache_path(
+    const char *folder,
+    const char *name,
+    const char *extension,
+    char *path,
+    size_t path_size)
+{
+    char base[MAX_PATH];
+    DWORD length;
+    int written;
+
+    length = GetEnvironmentVariable("LOCALAPPDATA", base, sizeof(base));
+    if (length == 0 || length >= sizeof(base))
+    {
+        DBG("LOCALAPPDATA is not set\n");
+        return FALSE;
+    }
+
+    /* The folders may already exist, which is fine. Anything else will show
+     * up when the file is opened. */
+    written = snprintf(path, path_size, "%s\\labelprinter", base);
+    if (written < 0 || (size_t)written >= path_size)
+        return FALSE;
+
+    CreateDirectory(path, NULL);
+
+    written = snprintf(path, path_size, "%s\\labelprinter\\%s", base, folder);
+    if (written < 0 || (size_t)written >= path_size)
+        return FALSE;
+
+    CreateDirectory(path, NULL);
+
+    written = snprintf(path, path_size, "%s\\labelprinter\\%s\\%s%s", base, folder, name, extension);
+    if (written < 0 || (size_t)written >= path_size)
+        return FALSE;
+
+    /* Only touch the name itself, not the folders we put it in. */
+    char *file_name = path + strlen(path) - strlen(name) - strlen(extension);
+    for (size_t i = 0; i < strlen(name); i++)
+    {
+        if (strchr("\\/:*?\"<>|", file_name[i]) != NULL)
+            file_name[i] = '_';
+    }
+
+    return TRUE;
+}
+
+struct paper_table *printer_cache_load(
+    const char *printer_name,
+    const struct printer_driver_id *driver_id)
+{
+    char path[MAX_PATH];
+    HANDLE f = INVALID_HANDLE_VALUE;
+    struct printer_cache_header header;
+    struct paper_table *table = NULL;
+    DWORD papers_size, bytes_read;
+    BOOL success = FALSE;
+
+    if (!get_cache_path(CACHE_FOLDER, printer_name, CACHE_EXTENSION, path, sizeof(path)))
+        return NULL;
+
+    f = CreateFile(
+        path,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        DBG("No printer cache at %s\n", path);
+        goto exit;
+    }
+
+    if (!ReadFile(f, &header, sizeof(header), &bytes_read, NULL) ||
+        bytes_read != sizeof(header))
+    {
+        DBG("Printer cache is truncated\n");
+        goto exit;
+    }
+
+    /* Different printers can end up with the same file name, so we check
+     * the full name too. */
+    if (header.magic != CACHE_MAGIC ||
+        header.header_size != sizeof(header) ||
+        strncmp(header.printer_name, printer_name, sizeof(header.printer_name)) != 0)
+    {
+        DBG("Printer cache is not for this printer\n");
+        goto exit;
+    }
+
+    if (!same_printer_driver(&header.driver_id, driver_id))
+    {
+        DBG("Printer cache is for a different driver\n");
+        goto exit;
+    }
+
+    if (header.count == 0 || header.count > MAXDWORD / sizeof(struct paper_size))
+    {
+        DBG("Printer cache is corrupt\n");
+        goto exit;
+    }
+
+    table = (struct paper_table *)calloc(1, sizeof(struct paper_table));
+    if (table == NULL)
+    {
+        ERR("Failed to allocate memory for paper table.\n");
+        goto exit;
+    }
+
+    papers_size = header.count * sizeof(struct paper_size);
+    table->papers = (struct paper_size *)malloc(papers_size);
+    if (table->papers == NULL)
+    {
+        ERR("Failed to allocate memory for paper table.\n");
+        goto exit;
+    }
+
+    if (!ReadFile(f, table->papers, papers_size, &bytes_read, NULL) ||
+        bytes_read != papers_size)
+    {
+        DBG("Printer cache is truncated\n");
+        goto exit;
+    }
+
+    /* Make sure nothing we hand out can run off the end of its string. */
+    header.default_name[PAPER_NAME_SIZE - 1] = '\0';
+    for (DWORD i = 0; i < header.count; i++)
+        table->papers[i].name[PAPER_NAME_SIZE - 1] = '\0';
+
+    memcpy(table->default_name, header.default_name, PAPER_NAME_SIZE);
+    table->count = header.count;
+
+    if (!index_paper_table(table))
+    {
+        goto exit;
+    }
+
+    DBG("Loaded %d paper sizes from %s\n", table->count, path);
+
+    success = TRUE;
+
+exit:
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    if (!success)
+    {
+        free_paper_table(table);
+        table = NULL;
+    }
+
+    return table;
+}
+
+BOOL printer_cache_save(
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    const struct paper_table *table)
+{
+    char path[MAX_PATH], temp_path[MAX_PATH + 4];
+    HANDLE f = INVALID_HANDLE_VALUE;
+    struct printer_cache_header header;
+    DWORD papers_size, bytes_written;
+    BOOL success = FALSE;
+
+    if (!get_cache_path(CACHE_FOLDER, printer_name, CACHE_EXTENSION, path, sizeof(path)))
+        return FALSE;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.header_size = sizeof(header);
+    snprintf(header.printer_name, sizeof(header.printer_name), "%s", printer_name);
+    header.driver_id = *driver_id;
+    memcpy(header.default_name, table->default_name, PAPER_NAME_SIZE);
+    header.count = table->count;
+
+    /* Write the new cache alongside the old one and swap it in at the end,
+     * so another run never sees half a file. */
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    f = CreateFile(
+        temp_path,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        DBG("Failed to create %s\n", temp_path);
+        goto exit;
+    }
+
+    papers_size = table->count * sizeof(struct paper_size);
+    if (!WriteFile(f, &header, sizeof(header), &bytes_written, NULL) ||
+        bytes_written != sizeof(header) ||
+        !WriteFile(f, table->papers, papers_size, &bytes_written, NULL) ||
+        bytes_written != papers_size)
+    {
+        DBG("Failed to write %s\n", temp_path);
+        goto exit;
+    }
+
+    CloseHandle(f);
+    f = INVALID_HANDLE_VALUE;
+
+    if (!MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+    {
+        DBG("Failed to replace %s\n", path);
+        goto exit;
+    }
+
+    DBG("Saved %d paper sizes to %s\n", table->count, path);
+
+    success = TRUE;
+
+exit:
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    if (!success)
+        DeleteFile(temp_path);
+
+    return success;
+}
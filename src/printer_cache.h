@@ -0,0 +1,54 @@
+#ifndef PRINTER_CACHE_H
+#define PRINTER_CACHE_H
+
+#include "printer.h"
+
+/* Keeps what we learn about each printer under %LOCALAPPDATA%, so later runs
+ * don't have to ask the driver again. Entries are tied to the driver they
+ * came from, and are ignored once the driver changes. */
+
+/**
+ * @brief Build the path to a file in our part of %LOCALAPPDATA%, creating
+ * the folders it lives in along the way.
+ *
+ * @param folder The folder under our own to put the file in.
+ * @param name The name of the file. Characters that aren't allowed in file
+ * names, such as the slashes in network printer names, are replaced.
+ * @param extension The extension to give the file, including the dot.
+ * @param path Filled in with the path.
+ * @param path_size The size of `path`.
+ * @return `TRUE` if the path was built.
+ */
+BOOL get_cache_path(
+    const char *folder,
+    const char *name,
+    const char *extension,
+    char *path,
+    size_t path_size);
+
+/**
+ * @brief Load a printer's paper table from the cache.
+ *
+ * @param printer_name The printer to load the paper table of.
+ * @param driver_id The printer's current driver.
+ * @return The paper table, or `NULL` if it isn't cached for this driver.
+ * Release it with `free_paper_table()`.
+ */
+struct paper_table *printer_cache_load(
+    const char *printer_name,
+    const struct printer_driver_id *driver_id);
+
+/**
+ * @brief Save a printer's paper table to the cache.
+ *
+ * @param printer_name The printer the paper table belongs to.
+ * @param driver_id The driver the paper table came from.
+ * @param table The paper table to save.
+ * @return `TRUE` if the paper table was saved.
+ */
+BOOL printer_cache_save(
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    const struct paper_table *table);
+
+#endif /* PRINTER_CACHE_H */
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+#include <winspool.h>
+
+#include "log.h"
+#include "printer.h"
+#include "printer_list.h"
+
+/* Probes spend nearly all their time waiting on the network, so there can be
+ * more of them than there are cores. */
+#define MAX_PROBE_THREADS (16)
+
+/* What we found out about one printer. */
+struct printer_probe
+{
+    char *name;
+    BOOL is_default;
+
+    struct paper_table *table;
+    LONG xres, yres;
+    int max_copies;
+};
+
+struct printer_list
+{
+    struct printer_probe *probes;
+    int count;
+    BOOL refresh;
+
+    /* The next printer for a thread to take. */
+    volatile LONG next;
+};
+
+/**
+ * @brief Find the finest resolution a printer offers.
+ *
+ * @return `TRUE` if the driver listed any.
+ */
+static BOOL get_best_resolution(char *printer_name, LONG *xres, LONG *yres)
+{
+    LONG *resolutions;
+    int count;
+
+    count = DeviceCapabilities(printer_name, NULL, DC_ENUMRESOLUTIONS, NULL, NULL);
+    if (count <= 0)
+        return FALSE;
+
+    /* Each one is a pair of dots per inch, across and down. */
+    resolutions = (LONG *)malloc(count * 2 * sizeof(LONG));
+    if (resolutions == NULL)
+    {
+        ERR("Failed to allocate memory for printer resolutions.\n");
+        return FALSE;
+    }
+
+    count = DeviceCapabilities(printer_name, NULL, DC_ENUMRESOLUTIONS, (char *)resolutions, NULL);
+    for (int i = 0; i < count; i++)
+    {
+        LONG x = resolutions[i * 2], y = resolutions[i * 2 + 1];
+
+        if ((LONGLONG)x * y > (LONGLONG)*xres * *yres)
+        {
+            *xres = x;
+            *yres = y;
+        }
+    }
+
+    free(resolutions);
+
+    return *xres > 0;
+}
+
+static DWORD WINAPI probe_worker(LPVOID param)
+{
+    struct printer_list *list = (struct printer_list *)param;
+    LONG i;
+
+    while ((i = InterlockedIncrement(&list->next) - 1) < list->count)
+    {
+        struct printer_probe *probe = &list->probes[i];
+        struct printer_session session;
+
+        DBG("Probing %s\n", probe->name);
+
+        /* The same as printing would ask for, so whatever we learn is
+         * cached for it. */
+        if (open_printer_session(&session, probe->name))
+            probe->table = get_paper_table(&session, list->refresh);
+
+        if (probe->table != NULL)
+        {
+            get_best_resolution(probe->name, &probe->xres, &probe->yres);
+            probe->max_copies = get_max_copies(&session);
+        }
+
+        close_printer_session(&session);
+    }
+
+    return 0;
+}
+
+static void print_probe(const struct printer_probe *probe)
+{
+    printf(" 🖨️ %s%s\n", probe->name, probe->is_default ? " (default)" : "");
+
+    if (probe->table == NULL)
+    {
+        printf("    ⚠️ Couldn't be probed.\n");
+        return;
+    }
+
+    printf("    📄 %d paper sizes, default %s\n", probe->table->count, probe->table->default_name);
+
+    if (probe->xres > 0)
+        printf("    🔍 %ld x %ld dpi, up to %d copies\n", probe->xres, probe->yres, probe->max_copies);
+    else
+        printf("    🔍 Unknown resolution, up to %d copies\n", probe->max_copies);
+}
+
+BOOL list_printers(BOOL refresh)
+{
+    struct printer_list list = {0};
+    PRINTER_INFO_4 *printers = NULL;
+    HANDLE threads[MAX_PROBE_THREADS];
+    int thread_count = 0;
+    DWORD size = 0, count = 0;
+    char *default_printer_name = NULL;
+    LARGE_INTEGER frequency, start, end;
+    BOOL success = FALSE;
+
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&start);
+
+    /* Level 4 comes out of the registry, without asking any printer, so it's
+     * quick even when they're all on the network. */
+    EnumPrinters(PRINTER_ENUM_LOCAL | PRINTER_ENUM_CONNECTIONS, NULL, 4, NULL, 0, &size, &count);
+    if (size == 0)
+    {
+        printf(" ⚠️ No printers found.\n");
+        return TRUE;
+    }
+
+    printers = (PRINTER_INFO_4 *)malloc(size);
+    if (printers == NULL)
+    {
+        ERR("Failed to allocate memory for printer list.\n");
+        goto exit;
+    }
+
+    if (!EnumPrinters(PRINTER_ENUM_LOCAL | PRINTER_ENUM_CONNECTIONS, NULL, 4, (BYTE *)printers, size, &size, &count))
+    {
+        ERR("Failed to list printers.\n");
+        goto exit;
+    }
+
+    list.probes = (struct printer_probe *)calloc(count > 0 ? count : 1, sizeof(struct printer_probe));
+    if (list.probes == NULL)
+    {
+        ERR("Failed to allocate memory for printer list.\n");
+        goto exit;
+    }
+
+    /* Not having a default printer is fine; it's just one less to mark. */
+    default_printer_name = get_default_printer();
+
+    list.count = (int)count;
+    list.refresh = refresh;
+    for (int i = 0; i < list.count; i++)
+    {
+        list.probes[i].name = printers[i].pPrinterName;
+        list.probes[i].is_default = default_printer_name != NULL &&
+                                    strcmp(default_printer_name, printers[i].pPrinterName) == 0;
+    }
+
+    for (int i = 0; i < min(list.count, MAX_PROBE_THREADS); i++)
+    {
+        threads[thread_count] = CreateThread(NULL, 0, probe_worker, &list, 0, NULL);
+        if (threads[thread_count] == NULL)
+        {
+            ERR("Failed to start printer probe thread.\n");
+            break;
+        }
+
+        thread_count++;
+    }
+
+    DBG("Probing %d printers on %d threads\n", list.count, thread_count);
+
+    /* If no threads started, there's still this one. */
+    if (thread_count > 0)
+        WaitForMultipleObjects(thread_count, threads, TRUE, INFINITE);
+    else
+        probe_worker(&list);
+
+    QueryPerformanceCounter(&end);
+
+    for (int i = 0; i < list.count; i++)
+        print_probe(&list.probes[i]);
+
+    printf(
+        " ⏱️ %d printers probed in %.3f s\n",
+        list.count,
+        (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart);
+
+    success = TRUE;
+
+exit:
+    for (int i = 0; i < thread_count; i++)
+        CloseHandle(threads[i]);
+
+    if (list.probes != NULL)
+    {
+        for (int i = 0; i < list.count; i++)
+            free_paper_table(list.probes[i].table);
+
+        free(list.probes);
+    }
+
+    if (default_printer_name != NULL)
+        free(default_printer_name);
+
+    if (printers != NULL)
+        free(printers);
+
+    return success;
+}
@@ -0,0 +1,23 @@
+#ifndef PRINTER_LIST_H
+#define PRINTER_LIST_H
+
+#include <windows.h>
+
+/**
+ * @brief List every printer we can see, local or connected, along with its
+ * paper sizes, best resolution and how many copies it can print.
+ *
+ * Asking a network printer's driver can take seconds, so the printers are
+ * probed at the same time on a pool of threads, and the list is printed once
+ * they've all answered. Paper tables come from and go to the printer cache,
+ * just as they do when printing, so listing the printers also warms the
+ * cache for them.
+ *
+ * @param refresh Ask every driver for its paper sizes, rather than using
+ * the cache.
+ * @return `TRUE` if the printers could be listed, even if some of them
+ * couldn't be probed.
+ */
+BOOL list_printers(BOOL refresh);
+
+#endif /* PRINTER_LIST_H */
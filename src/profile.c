@@ -0,0 +1,229 @@
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "log.h"
+#include "print.h"
+#include "printer.h"
+#include "printer_cache.h"
+#include "profile.h"
+
+#define PROFILE_MAGIC (0x3150504C) /* "LPP1" */
+#define PROFILE_FOLDER "profiles"
+#define PROFILE_EXTENSION ".devmode"
+
+/* Drivers can have an older, shorter DEVMODE than ours, but it always runs
+ * at least up to the fields saying which of the rest it has. */
+#define MIN_DEVMODE_SIZE (offsetof(DEVMODE, dmFields) + sizeof(DWORD))
+
+/* The start of every profile. The DEVMODE follows straight after. */
+struct profile_header
+{
+    DWORD magic;
+    DWORD header_size;
+    char printer_name[MAX_PATH];
+    struct printer_driver_id driver_id;
+
+    /* What the DEVMODE was asked for, which the driver may have put
+     * differently in the DEVMODE itself. */
+    short paper;
+    BOOL landscape;
+    int copies;
+
+    DWORD devmode_size;
+};
+
+BOOL save_profile(
+    const char *name,
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    const struct print_mode *mode)
+{
+    char path[MAX_PATH], temp_path[MAX_PATH + 4];
+    HANDLE f = INVALID_HANDLE_VALUE;
+    struct profile_header header;
+    DWORD bytes_written;
+    BOOL success = FALSE;
+
+    if (!get_cache_path(PROFILE_FOLDER, name, PROFILE_EXTENSION, path, sizeof(path)))
+    {
+        ERR("Failed to find somewhere to save profile %s.\n", name);
+        return FALSE;
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.magic = PROFILE_MAGIC;
+    header.header_size = sizeof(header);
+    snprintf(header.printer_name, sizeof(header.printer_name), "%s", printer_name);
+    header.driver_id = *driver_id;
+    header.paper = mode->paper;
+    header.landscape = mode->landscape;
+    header.copies = mode->copies;
+
+    /* The driver's private settings come straight after the public part,
+     * and are most of what it took the driver so long to work out. */
+    header.devmode_size = mode->devmode->dmSize + mode->devmode->dmDriverExtra;
+    if (mode->devmode->dmSize < MIN_DEVMODE_SIZE)
+    {
+        ERR("The driver's printer properties are too short to save.\n");
+        return FALSE;
+    }
+
+    /* As with the printer cache, nobody should see half a profile. */
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+    f = CreateFile(
+        temp_path,
+        GENERIC_WRITE,
+        0,
+        NULL,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        ERR("Failed to create %s.\n", temp_path);
+        goto exit;
+    }
+
+    if (!WriteFile(f, &header, sizeof(header), &bytes_written, NULL) ||
+        bytes_written != sizeof(header) ||
+        !WriteFile(f, mode->devmode, header.devmode_size, &bytes_written, NULL) ||
+        bytes_written != header.devmode_size)
+    {
+        ERR("Failed to write %s.\n", temp_path);
+        goto exit;
+    }
+
+    CloseHandle(f);
+    f = INVALID_HANDLE_VALUE;
+
+    if (!MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING))
+    {
+        ERR("Failed to replace %s.\n", path);
+        goto exit;
+    }
+
+    DBG("Saved %lu byte DEVMODE to %s\n", header.devmode_size, path);
+
+    success = TRUE;
+
+exit:
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    if (!success)
+        DeleteFile(temp_path);
+
+    return success;
+}
+
+BOOL load_profile(
+    const char *name,
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    struct print_mode *mode)
+{
+    char path[MAX_PATH];
+    HANDLE f = INVALID_HANDLE_VALUE;
+    struct profile_header header;
+    DEVMODE *devmode = NULL;
+    DWORD bytes_read;
+    BOOL success = FALSE;
+
+    memset(mode, 0, sizeof(*mode));
+
+    if (!get_cache_path(PROFILE_FOLDER, name, PROFILE_EXTENSION, path, sizeof(path)))
+    {
+        ERR("Failed to find profile %s.\n", name);
+        return FALSE;
+    }
+
+    f = CreateFile(
+        path,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        ERR("There's no profile called %s.\n", name);
+        goto exit;
+    }
+
+    if (!ReadFile(f, &header, sizeof(header), &bytes_read, NULL) ||
+        bytes_read != sizeof(header) ||
+        header.magic != PROFILE_MAGIC ||
+        header.header_size != sizeof(header))
+    {
+        ERR("Profile %s is corrupt.\n", name);
+        goto exit;
+    }
+
+    /* Different printers can end up with the same file name, so we check
+     * the full name too. */
+    header.printer_name[MAX_PATH - 1] = '\0';
+    if (strcmp(header.printer_name, printer_name) != 0)
+    {
+        ERR("Profile %s is for printer %s.\n", name, header.printer_name);
+        goto exit;
+    }
+
+    /* Another driver wouldn't make sense of the private settings, and could
+     * do anything with them. */
+    if (!same_printer_driver(&header.driver_id, driver_id))
+    {
+        ERR("Profile %s was saved for another driver. Save it again with --save-profile.\n", name);
+        goto exit;
+    }
+
+    /* Both parts of a DEVMODE give their size in a WORD. */
+    if (header.devmode_size < MIN_DEVMODE_SIZE || header.devmode_size > 2 * MAXWORD)
+    {
+        ERR("Profile %s is corrupt.\n", name);
+        goto exit;
+    }
+
+    devmode = (DEVMODE *)malloc(header.devmode_size);
+    if (devmode == NULL)
+    {
+        ERR("Failed to allocate memory for printer properties.\n");
+        goto exit;
+    }
+
+    if (!ReadFile(f, devmode, header.devmode_size, &bytes_read, NULL) ||
+        bytes_read != header.devmode_size ||
+        devmode->dmSize < MIN_DEVMODE_SIZE ||
+        devmode->dmSize + devmode->dmDriverExtra != header.devmode_size)
+    {
+        ERR("Profile %s is corrupt.\n", name);
+        goto exit;
+    }
+
+    mode->paper = header.paper;
+    mode->landscape = header.landscape;
+    mode->copies = header.copies;
+    mode->devmode = devmode;
+    devmode = NULL;
+
+    DBG("Loaded %lu byte DEVMODE from %s\n", header.devmode_size, path);
+
+    success = TRUE;
+
+exit:
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    if (devmode != NULL)
+        free(devmode);
+
+    return success;
+}
@@ -0,0 +1,49 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "print.h"
+#include "printer.h"
+
+/* Profiles are DEVMODEs the driver has already merged, saved by name under
+ * %LOCALAPPDATA% along with the paper, orientation and copies they were made
+ * for, so a later run can hand one straight to the printer context without
+ * asking the driver. Like the printer cache, a profile is tied to the
+ * printer and driver it came from. */
+
+/**
+ * @brief Save a print mode as a profile, replacing any profile of that name.
+ *
+ * @param name The name to save the profile under.
+ * @param printer_name The printer the mode was built for.
+ * @param driver_id The driver that built it.
+ * @param mode The mode to save. Its DEVMODE is saved whole, driver-private
+ * part and all.
+ * @return `TRUE` if the profile was saved.
+ */
+BOOL save_profile(
+    const char *name,
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    const struct print_mode *mode);
+
+/**
+ * @brief Load a profile.
+ *
+ * @param name The name the profile was saved under.
+ * @param printer_name The printer it's going to be used with.
+ * @param driver_id The printer's current driver.
+ * @param mode Filled in with the saved mode. Release its DEVMODE with
+ * `free()`.
+ * @return `TRUE` if the profile was loaded. It isn't if it was saved for
+ * another printer or driver.
+ */
+BOOL load_profile(
+    const char *name,
+    const char *printer_name,
+    const struct printer_driver_id *driver_id,
+    struct print_mode *mode);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <winspool.h>
+
+#include "log.h"
+#include "printer.h"
+#include "raw.h"
+#include "timing.h"
+
+/* WritePrinter() takes a DWORD, and the spooler is happier with reasonably
+ * sized writes than one enormous one anyway. */
+#define RAW_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * @brief Write a block of data to the open job, a chunk at a time.
+ */
+static BOOL write_raw(HANDLE printer, const char *data, ULONGLONG size)
+{
+    while (size > 0)
+    {
+        DWORD chunk = size > RAW_CHUNK_SIZE ? RAW_CHUNK_SIZE : (DWORD)size;
+        DWORD written = 0;
+
+        if (!WritePrinter(printer, (LPVOID)data, chunk, &written) || written == 0)
+        {
+            ERR("Failed to write to printer.\n");
+            return FALSE;
+        }
+
+        data += written;
+        size -= written;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Write the whole of a file to the open job. The file is mapped, so
+ * it goes from the page cache straight to the spooler.
+ */
+static BOOL write_raw_file(HANDLE printer, char *filename)
+{
+    HANDLE f = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+    LARGE_INTEGER file_size;
+    void *view = NULL;
+    BOOL success = FALSE;
+
+    f = CreateFile(
+        filename,
+        GENERIC_READ,
+        FILE_SHARE_READ,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_SEQUENTIAL_SCAN,
+        NULL);
+
+    if (f == INVALID_HANDLE_VALUE)
+    {
+        ERR("Failed to open %s.\n", filename);
+        goto exit;
+    }
+
+    if (!GetFileSizeEx(f, &file_size))
+    {
+        ERR("Failed to get the size of %s.\n", filename);
+        goto exit;
+    }
+
+    /* Empty files can't be mapped, but there's nothing to send anyway. */
+    if (file_size.QuadPart == 0)
+    {
+        success = TRUE;
+        goto exit;
+    }
+
+    if ((ULONGLONG)file_size.QuadPart > SIZE_MAX)
+    {
+        ERR("%s is too large to process.\n", filename);
+        goto exit;
+    }
+
+    mapping = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL)
+    {
+        ERR("Failed to map %s.\n", filename);
+        goto exit;
+    }
+
+    view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL)
+    {
+        ERR("Failed to map a view of %s.\n", filename);
+        goto exit;
+    }
+
+    DBG("Sending %lld bytes from %s\n", file_size.QuadPart, filename);
+
+    success = write_raw(printer, (const char *)view, file_size.QuadPart);
+
+exit:
+    if (view != NULL)
+        UnmapViewOfFile(view);
+
+    if (mapping != NULL)
+        CloseHandle(mapping);
+
+    if (f != INVALID_HANDLE_VALUE)
+        CloseHandle(f);
+
+    return success;
+}
+
+/**
+ * @brief Copy everything on stdin to the open job.
+ */
+static BOOL write_raw_stdin(HANDLE printer)
+{
+    HANDLE input = GetStdHandle(STD_INPUT_HANDLE);
+    char *buffer = NULL;
+    BOOL success = FALSE;
+
+    buffer = (char *)malloc(RAW_CHUNK_SIZE);
+    if (buffer == NULL)
+    {
+        ERR("Failed to allocate memory for stdin.\n");
+        return FALSE;
+    }
+
+    for (;;)
+    {
+        DWORD bytes_read = 0;
+
+        if (!ReadFile(input, buffer, RAW_CHUNK_SIZE, &bytes_read, NULL))
+        {
+            /* The other end of a pipe closing is just the end of the data. */
+            if (GetLastError() != ERROR_BROKEN_PIPE)
+            {
+                ERR("Failed to read from stdin.\n");
+                goto exit;
+            }
+
+            bytes_read = 0;
+        }
+
+        if (bytes_read == 0)
+            break;
+
+        if (!write_raw(printer, buffer, bytes_read))
+            goto exit;
+    }
+
+    success = TRUE;
+
+exit:
+    free(buffer);
+
+    return success;
+}
+
+/**
+ * @brief Start a RAW spool job.
+ */
+static BOOL start_raw_job(HANDLE printer, char *doc_name)
+{
+    DOC_INFO_1 doc_info = {0};
+
+    doc_info.pDocName = doc_name;
+    doc_info.pOutputFile = NULL;
+    doc_info.pDatatype = "RAW";
+
+    if (StartDocPrinter(printer, 1, (BYTE *)&doc_info) == 0)
+    {
+        ERR("Failed to start document.\n");
+        return FALSE;
+    }
+
+    if (!StartPagePrinter(printer))
+    {
+        ERR("Failed to start page.\n");
+        EndDocPrinter(printer);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Finish a RAW spool job, handing it to the printer.
+ */
+static BOOL end_raw_job(HANDLE printer)
+{
+    LONGLONG start = timing_start();
+    BOOL success = TRUE;
+
+    if (!EndPagePrinter(printer))
+    {
+        ERR("Failed to end page.\n");
+        success = FALSE;
+    }
+
+    if (!EndDocPrinter(printer))
+    {
+        ERR("Failed to end document.\n");
+        success = FALSE;
+    }
+
+    timing_end(PHASE_END_DOC, start);
+
+    return success;
+}
+
+BOOL print_raw(
+    char *printer_name,
+    char **filenames,
+    int count,
+    BOOL single_job)
+{
+    struct printer_session session = {0};
+    HANDLE printer;
+    BOOL job_started = FALSE;
+    BOOL success = FALSE;
+    char doc_name[64];
+
+    if (dry_run)
+        return TRUE;
+
+    if (!open_printer_session(&session, printer_name))
+        goto exit;
+
+    printer = session.handle;
+
+    if (single_job)
+    {
+        snprintf(doc_name, sizeof(doc_name), "labelprinter (%d raw files)", count);
+        if (!start_raw_job(printer, doc_name))
+            goto exit;
+
+        job_started = TRUE;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        char *filename = filenames[i];
+        BOOL use_stdin = strcmp(filename, "-") == 0;
+        LONGLONG start;
+
+        if (!single_job)
+        {
+            if (!start_raw_job(printer, use_stdin ? "labelprinter (stdin)" : filename))
+                goto exit;
+
+            job_started = TRUE;
+        }
+
+        start = timing_start();
+        if (!(use_stdin ? write_raw_stdin(printer) : write_raw_file(printer, filename)))
+        {
+            ERR("Failed to print %s.\n", filename);
+            goto exit;
+        }
+
+        timing_end(PHASE_WRITE_PRINTER, start);
+
+        if (!single_job)
+        {
+            job_started = FALSE;
+            if (!end_raw_job(printer))
+                goto exit;
+        }
+
+        printf(" 🏷️ %s\n", filename);
+    }
+
+    if (job_started)
+    {
+        job_started = FALSE;
+        if (!end_raw_job(printer))
+            goto exit;
+    }
+
+    success = TRUE;
+
+exit:
+    /* Don't leave half a job in the queue. */
+    if (job_started)
+        AbortPrinter(session.handle);
+
+    close_printer_session(&session);
+
+    return success;
+}
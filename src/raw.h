@@ -0,0 +1,27 @@
+#ifndef RAW_H
+#define RAW_H
+
+#include <windows.h>
+
+/**
+ * @brief Send files straight to a printer with the RAW datatype, bypassing
+ * GDI and the driver's rendering altogether.
+ *
+ * The files must already be in the printer's own language, such as the
+ * output of printing to a file with the printer's driver. Nothing is checked
+ * or converted on the way through.
+ *
+ * @param printer_name The printer to send the files to.
+ * @param filenames The files to send, or just "-" to send stdin.
+ * @param count The number of files.
+ * @param single_job If `TRUE`, all of the files go out back to back in one
+ * spool job. Otherwise each one is its own job.
+ * @return `TRUE` if every file was sent.
+ */
+BOOL print_raw(
+    char *printer_name,
+    char **filenames,
+    int count,
+    BOOL single_job);
+
+#endif /* RAW_H */
@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "log.h"
+#include "print.h"
+#include "render.h"
+
+/* Close enough for the bitmaps we render, which only need to be the right
+ * size once printed. */
+#define MM_PER_INCH (25.4f)
+
+static char render_name[] = "render";
+
+struct render
+{
+    HBITMAP bitmap;
+    HGDIOBJ old_bitmap;
+    void *bits;
+    size_t bits_size;
+
+    struct
+    {
+        BITMAPINFOHEADER header;
+        RGBQUAD colors[2];
+    } info;
+
+    const char *output_dir;
+    int page_count;
+    ULONGLONG bytes_written;
+};
+
+BOOL open_render_target(
+    struct print_target *target,
+    float width_mm,
+    float height_mm,
+    int dpi,
+    const char *output_dir)
+{
+    struct render *render;
+    int width = (int)(width_mm * dpi / MM_PER_INCH + 0.5f);
+    int height = (int)(height_mm * dpi / MM_PER_INCH + 0.5f);
+
+    memset(target, 0, sizeof(*target));
+    target->printer_name = render_name;
+
+    if (width <= 0 || height <= 0)
+    {
+        ERR("Can't render a page of %.1f x %.1f mm.\n", width_mm, height_mm);
+        return FALSE;
+    }
+
+    render = (struct render *)calloc(1, sizeof(struct render));
+    if (render == NULL)
+    {
+        ERR("Failed to allocate memory for renderer.\n");
+        return FALSE;
+    }
+
+    target->render = render;
+    render->output_dir = output_dir;
+
+    /* Pages are 1bpp, the same as a label printer's. */
+    render->info.header.biSize = sizeof(BITMAPINFOHEADER);
+    render->info.header.biWidth = width;
+    render->info.header.biHeight = height;
+    render->info.header.biPlanes = 1;
+    render->info.header.biBitCount = 1;
+    render->info.header.biCompression = BI_RGB;
+    render->info.header.biXPelsPerMeter = dpi * 10000 / 254;
+    render->info.header.biYPelsPerMeter = dpi * 10000 / 254;
+    render->info.header.biClrUsed = 2;
+    render->info.colors[1].rgbRed = 255;
+    render->info.colors[1].rgbGreen = 255;
+    render->info.colors[1].rgbBlue = 255;
+
+    render->bits_size = (((size_t)width + 31) / 32) * 4 * height;
+    render->info.header.biSizeImage = (DWORD)render->bits_size;
+
+    target->context = CreateCompatibleDC(NULL);
+    if (target->context == NULL)
+    {
+        ERR("Failed to create render context.\n");
+        return FALSE;
+    }
+
+    render->bitmap = CreateDIBSection(
+        target->context,
+        (BITMAPINFO *)&render->info,
+        DIB_RGB_COLORS,
+        &render->bits,
+        NULL,
+        0);
+    if (render->bitmap == NULL)
+    {
+        ERR("Failed to create a %d x %d px page to render to.\n", width, height);
+        return FALSE;
+    }
+
+    render->old_bitmap = SelectObject(target->context, render->bitmap);
+
+    /* The whole page is printable, and the driver doesn't print copies. */
+    target->geometry.page_w = width;
+    target->geometry.page_h = height;
+    target->geometry.print_w = width;
+    target->geometry.print_h = height;
+    target->geometry.print_resx = render->info.header.biXPelsPerMeter;
+    target->geometry.print_resy = render->info.header.biYPelsPerMeter;
+    target->copies = 1;
+    target->max_copies = 1;
+
+    printf(" 🖨️ Rendering %.1f x %.1f mm pages at %d dpi\n", width_mm, height_mm, dpi);
+
+    return TRUE;
+}
+
+BOOL render_start_page(struct render *render)
+{
+    /* The context may already be mapped for the label, so the page is
+     * cleared directly rather than through GDI. */
+    GdiFlush();
+    memset(render->bits, 0xFF, render->bits_size);
+
+    return TRUE;
+}
+
+/**
+ * @brief Write the page out as a bitmap file.
+ */
+static BOOL write_page(struct render *render)
+{
+    BITMAPFILEHEADER header = {0};
+    char path[MAX_PATH];
+    FILE *file;
+    BOOL written;
+
+    if (snprintf(path, sizeof(path), "%s\\page%05d.bmp", render->output_dir, render->page_count) >= (int)sizeof(path))
+    {
+        ERR("Path for page %d is too long.\n", render->page_count);
+        return FALSE;
+    }
+
+    header.bfType = 0x4D42;
+    header.bfOffBits = sizeof(BITMAPFILEHEADER) + sizeof(render->info);
+    header.bfSize = header.bfOffBits + (DWORD)render->bits_size;
+
+    file = fopen(path, "wb");
+    if (file == NULL)
+    {
+        ERR("Failed to open %s.\n", path);
+        return FALSE;
+    }
+
+    written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+              fwrite(&render->info, sizeof(render->info), 1, file) == 1 &&
+              fwrite(render->bits, render->bits_size, 1, file) == 1;
+
+    if (fclose(file) != 0 || !written)
+    {
+        ERR("Failed to write %s.\n", path);
+        return FALSE;
+    }
+
+    render->bytes_written += header.bfSize;
+
+    return TRUE;
+}
+
+BOOL render_end_page(struct render *render)
+{
+    GdiFlush();
+    render->page_count++;
+
+    if (render->output_dir != NULL)
+        return write_page(render);
+
+    return TRUE;
+}
+
+ULONGLONG get_render_bytes_written(const struct render *render)
+{
+    return render->bytes_written;
+}
+
+void close_render(struct render *render, HDC context)
+{
+    if (render->old_bitmap != NULL)
+        SelectObject(context, render->old_bitmap);
+
+    if (render->bitmap != NULL)
+        DeleteObject(render->bitmap);
+
+    free(render);
+}
@@ -0,0 +1,66 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include <windows.h>
+
+#include "print.h"
+
+/* Prints to a bitmap in memory instead of a printer. Labels go through the
+ * same placement, scaling and GDI calls they would on paper, but nothing
+ * leaves the machine, so the print path can be timed and checked without
+ * using up labels. Pages can be written out as bitmap files. */
+struct render;
+
+/**
+ * @brief Set up a print target that renders pages into memory.
+ *
+ * @param target The target to set up. Release it with `close_print_target()`,
+ * even if this fails.
+ * @param width_mm The width of the page.
+ * @param height_mm The height of the page.
+ * @param dpi The resolution to render at.
+ * @param output_dir Where to write each page, as a bitmap, or `NULL` to keep
+ * them in memory. Must outlive the target.
+ * @return `TRUE` if the target is ready.
+ */
+BOOL open_render_target(
+    struct print_target *target,
+    float width_mm,
+    float height_mm,
+    int dpi,
+    const char *output_dir);
+
+/**
+ * @brief Clear the page, ready for the next one.
+ *
+ * @param render The target's renderer.
+ * @return `TRUE` if the page was started.
+ */
+BOOL render_start_page(struct render *render);
+
+/**
+ * @brief Finish the page, writing it out if the renderer has somewhere to
+ * write it.
+ *
+ * @param render The target's renderer.
+ * @return `TRUE` if the page was finished.
+ */
+BOOL render_end_page(struct render *render);
+
+/**
+ * @brief Count the bytes written out so far.
+ *
+ * @param render The target's renderer.
+ * @return The total size of the page files written.
+ */
+ULONGLONG get_render_bytes_written(const struct render *render);
+
+/**
+ * @brief Release a renderer. Called by `close_print_target()`.
+ *
+ * @param render The renderer to release.
+ * @param context The memory context it renders with.
+ */
+void close_render(struct render *render, HDC context);
+
+#endif /* RENDER_H */
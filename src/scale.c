@@ -0,0 +1,216 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "label.h"
+#include "log.h"
+#include "scale.h"
+
+/* Integer upscales up to this factor expand whole bytes at a time. */
+#define MAX_TABLE_FACTOR (8)
+
+/* expand_table[k][b] is byte `b` with every bit repeated `k` times, as the
+ * `k` bytes it becomes, most significant first. Built on first use. */
+static uint8_t expand_table[MAX_TABLE_FACTOR + 1][256][MAX_TABLE_FACTOR];
+static INIT_ONCE expand_table_once = INIT_ONCE_STATIC_INIT;
+
+static BOOL CALLBACK build_expand_table(INIT_ONCE *once, void *param, void **context)
+{
+    for (int k = 1; k <= MAX_TABLE_FACTOR; k++)
+    {
+        for (int b = 0; b < 256; b++)
+        {
+            for (int bit = 0; bit < 8 * k; bit++)
+            {
+                /* Output bit `bit` comes from source bit `bit / k`. */
+                if (b & (0x80 >> (bit / k)))
+                    expand_table[k][b][bit / 8] |= 0x80 >> (bit % 8);
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+static size_t stride_1bpp(int width)
+{
+    return (((size_t)width + 31) / 32) * 4;
+}
+
+/**
+ * @brief Scale one row by a whole number, up to `MAX_TABLE_FACTOR`, a byte
+ * at a time using the expansion table.
+ */
+static void scale_row_table(
+    const uint8_t *src,
+    uint8_t *dst,
+    int dst_width,
+    int factor)
+{
+    int dst_bytes = (dst_width + 7) / 8;
+
+    /* Every source byte becomes `factor` output bytes. The last one may
+     * become fewer, as we mustn't write past the end of the row. */
+    for (int i = 0; dst_bytes > 0; i++)
+    {
+        int n = dst_bytes < factor ? dst_bytes : factor;
+
+        memcpy(dst, expand_table[factor][src[i]], n);
+        dst += n;
+        dst_bytes -= n;
+    }
+}
+
+/**
+ * @brief Scale one row by any ratio, picking the nearest source pixel for
+ * each output pixel.
+ *
+ * @param columns The source column for every output column.
+ */
+static void scale_row_nearest(
+    const uint8_t *src,
+    uint8_t *dst,
+    const int *columns,
+    int dst_width)
+{
+    int x = 0;
+
+    /* Build whole output bytes, rather than setting bits in place. */
+    for (; x + 8 <= dst_width; x += 8)
+    {
+        uint8_t out = 0;
+
+        for (int bit = 0; bit < 8; bit++)
+        {
+            int c = columns[x + bit];
+            out |= ((src[c >> 3] >> (7 - (c & 7))) & 1) << (7 - bit);
+        }
+
+        *dst++ = out;
+    }
+
+    if (x < dst_width)
+    {
+        uint8_t out = 0;
+
+        for (int bit = 0; x + bit < dst_width; bit++)
+        {
+            int c = columns[x + bit];
+            out |= ((src[c >> 3] >> (7 - (c & 7))) & 1) << (7 - bit);
+        }
+
+        *dst = out;
+    }
+}
+
+BOOL can_prescale_label(const struct label *label)
+{
+    return label->info_header->biBitCount == 1 &&
+           label->info_header->biCompression == BI_RGB &&
+           label->info_header->biPlanes == 1;
+}
+
+BOOL prescale_label(struct label *label, int width, int height)
+{
+    const BITMAPINFOHEADER *info_header = label->info_header;
+    const RGBQUAD *colors;
+    int src_width = info_header->biWidth;
+    int src_height = info_header->biHeight < 0 ? -info_header->biHeight : info_header->biHeight;
+    BOOL top_down = info_header->biHeight < 0;
+    size_t src_stride = stride_1bpp(src_width);
+    size_t dst_stride = stride_1bpp(width);
+    int factor = 0;
+    int *columns = NULL;
+    uint8_t *dst;
+    int last_src_row = -1;
+
+    if (!can_prescale_label(label) || width <= 0 || height <= 0 || src_width <= 0 || src_height <= 0)
+    {
+        ERR("Label can't be prescaled.\n");
+        return FALSE;
+    }
+
+    dst = (uint8_t *)reserve_label_device_buffer(label, dst_stride * height);
+    if (dst == NULL)
+        return FALSE;
+
+    /* Work out which row scaler to use. Whole-number upscales, which is the
+     * usual case when a label's drawn at a fraction of the printer's
+     * resolution, get the table. */
+    if (width % src_width == 0 && width / src_width <= MAX_TABLE_FACTOR)
+    {
+        factor = width / src_width;
+        InitOnceExecuteOnce(&expand_table_once, build_expand_table, NULL, NULL);
+    }
+    else
+    {
+        columns = (int *)malloc(width * sizeof(int));
+        if (columns == NULL)
+        {
+            ERR("Failed to allocate memory for label scaling.\n");
+            return FALSE;
+        }
+
+        for (int x = 0; x < width; x++)
+            columns[x] = (int)(((LONGLONG)x * src_width + src_width / 2) / width);
+    }
+
+    DBG("Prescaling label to %d x %d px (%s)\n",
+        width, height, factor > 0 ? "table" : "nearest");
+
+    /* Output rows are bottom-up, whichever way up the source is, which is
+     * what SetDIBitsToDevice() sees most often. */
+    for (int y = 0; y < height; y++)
+    {
+        int src_row = (int)(((LONGLONG)y * src_height + src_height / 2) / height);
+        uint8_t *dst_row = dst + (size_t)y * dst_stride;
+        const uint8_t *src_row_bits;
+
+        if (src_row >= src_height)
+            src_row = src_height - 1;
+
+        /* Upscaled rows come in runs, which are copies of the first. */
+        if (src_row == last_src_row)
+        {
+            memcpy(dst_row, dst_row - dst_stride, dst_stride);
+            continue;
+        }
+
+        last_src_row = src_row;
+        if (top_down)
+            src_row = src_height - 1 - src_row;
+
+        src_row_bits = (const uint8_t *)label->bits + (size_t)src_row * src_stride;
+
+        if (factor > 0)
+            scale_row_table(src_row_bits, dst_row, width, factor);
+        else
+            scale_row_nearest(src_row_bits, dst_row, columns, width);
+    }
+
+    if (columns != NULL)
+        free(columns);
+
+    /* Same colours as the source, so black stays black. */
+    memset(&label->device_info, 0, sizeof(label->device_info));
+    label->device_info.header.biSize = sizeof(BITMAPINFOHEADER);
+    label->device_info.header.biWidth = width;
+    label->device_info.header.biHeight = height;
+    label->device_info.header.biPlanes = 1;
+    label->device_info.header.biBitCount = 1;
+    label->device_info.header.biCompression = BI_RGB;
+    label->device_info.header.biSizeImage = dst_stride * height;
+    label->device_info.header.biClrUsed = 2;
+
+    colors = (const RGBQUAD *)((const char *)info_header + info_header->biSize);
+    label->device_info.colors[0] = colors[0];
+    label->device_info.colors[1] = info_header->biClrUsed == 1 ? colors[0] : colors[1];
+
+    label->device_bits = dst;
+    label->prescaled = TRUE;
+
+    return TRUE;
+}
@@ -0,0 +1,32 @@
+#ifndef SCALE_H
+#define SCALE_H
+
+#include <windows.h>
+
+#include "label.h"
+
+/**
+ * @brief Check whether a label can be prescaled.
+ *
+ * Only uncompressed monochrome bitmaps can be, which is what labels should
+ * be anyway.
+ *
+ * @param label The label to check.
+ * @return `TRUE` if `prescale_label()` can scale the label.
+ */
+BOOL can_prescale_label(const struct label *label);
+
+/**
+ * @brief Scale a monochrome label to an exact size in printer pixels.
+ *
+ * The result is kept in the label, as `device_info` and `device_bits`, ready
+ * to go to the printer without any scaling by GDI or the driver.
+ *
+ * @param label The label to scale.
+ * @param width The width to scale to, in printer pixels.
+ * @param height The height to scale to, in printer pixels.
+ * @return `TRUE` if the label was scaled.
+ */
+BOOL prescale_label(struct label *label, int width, int height);
+
+#endif /* SCALE_H */
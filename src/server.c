@@ -0,0 +1,232 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "label.h"
+#include "label_cache.h"
+#include "log.h"
+#include "print.h"
+#include "server.h"
+
+#define PIPE_PREFIX "\\\\.\\pipe\\"
+#define PIPE_BUFFER_SIZE (64 * 1024)
+#define MAX_MESSAGE_SIZE (256 * 1024 * 1024)
+
+#define RESPONSE_OK "OK\n"
+#define RESPONSE_FAILED "FAILED\n"
+
+/**
+ * @brief Read a whole message from the pipe, growing the buffer as needed.
+ *
+ * @param pipe The pipe to read from.
+ * @param buffer The buffer to read into. May be reallocated.
+ * @param capacity The size of the buffer. Updated if it's reallocated.
+ * @param length Set to the length of the message, which is also terminated
+ * so it can be used as a string.
+ * @return `FALSE` if the client has gone, or the message is too large.
+ */
+static BOOL read_message(
+    HANDLE pipe,
+    char **buffer,
+    DWORD *capacity,
+    DWORD *length)
+{
+    *length = 0;
+
+    for (;;)
+    {
+        DWORD bytes_read = 0;
+        BOOL success;
+
+        if (*capacity - *length < PIPE_BUFFER_SIZE)
+        {
+            DWORD new_capacity = *capacity == 0 ? PIPE_BUFFER_SIZE * 2 : *capacity * 2;
+            char *new_buffer;
+
+            if (new_capacity > MAX_MESSAGE_SIZE)
+            {
+                ERR("Message is too large to process.\n");
+                return FALSE;
+            }
+
+            new_buffer = (char *)realloc(*buffer, new_capacity);
+            if (new_buffer == NULL)
+            {
+                ERR("Failed to allocate memory for message.\n");
+                return FALSE;
+            }
+
+            *buffer = new_buffer;
+            *capacity = new_capacity;
+        }
+
+        /* Leave room for the terminator. */
+        success = ReadFile(pipe, *buffer + *length, *capacity - *length - 1, &bytes_read, NULL);
+        *length += bytes_read;
+
+        if (success)
+        {
+            (*buffer)[*length] = '\0';
+            return TRUE;
+        }
+
+        if (GetLastError() != ERROR_MORE_DATA)
+            return FALSE;
+    }
+}
+
+/**
+ * @brief Check whether a message is the contents of a bitmap file, rather
+ * than a path. A path can start with "BM" too, so we go by the file header's
+ * own idea of how long the file is.
+ *
+ * @param message The message.
+ * @param length The length of the message.
+ * @return `TRUE` if the message is a bitmap file.
+ */
+static BOOL is_bitmap_message(const char *message, DWORD length)
+{
+    BITMAPFILEHEADER header;
+
+    if (length < sizeof(header))
+        return FALSE;
+
+    /* The message buffer makes no promises about alignment. */
+    memcpy(&header, message, sizeof(header));
+
+    return header.bfType == 0x4D42 && header.bfSize == length;
+}
+
+/**
+ * @brief Print the label in a message.
+ *
+ * @param message The message, which is either a bitmap or a path to one.
+ * @param length The length of the message.
+ * @param target The printer to print to.
+ * @param prepare How to prepare the label before it's printed.
+ * @return `TRUE` if the label was printed.
+ */
+static BOOL handle_message(
+    char *message,
+    DWORD length,
+    struct print_target *target,
+    const struct prepare_options *prepare)
+{
+    struct label *label = NULL;
+    char *name;
+    BOOL success;
+
+    if (is_bitmap_message(message, length))
+    {
+        name = "labelprinter (pipe)";
+        label = open_label_memory(message, length, name);
+    }
+    else
+    {
+        while (length > 0 && (message[length - 1] == '\n' || message[length - 1] == '\r'))
+            message[--length] = '\0';
+
+        name = message;
+        label = open_cached_label(name);
+    }
+
+    if (label == NULL)
+    {
+        ERR("Failed to open %s.\n", name);
+        return FALSE;
+    }
+
+    success = fit_print_target(target, label) &&
+              prepare_label(label, prepare) &&
+              print_label(target, label, name, TRUE);
+    close_label(label);
+
+    if (!success)
+    {
+        ERR("Failed to print %s.\n", name);
+        return FALSE;
+    }
+
+    printf(" 🏷️ %s\n", name);
+
+    return TRUE;
+}
+
+BOOL serve(
+    const char *pipe_name,
+    struct print_target *target,
+    const struct prepare_options *prepare)
+{
+    char path[MAX_PATH];
+    HANDLE pipe = INVALID_HANDLE_VALUE;
+    char *message = NULL;
+    DWORD capacity = 0, length = 0;
+
+    if (strchr(pipe_name, '\\') == NULL)
+        snprintf(path, sizeof(path), PIPE_PREFIX "%s", pipe_name);
+    else
+        snprintf(path, sizeof(path), "%s", pipe_name);
+
+    /* One client at a time keeps the labels in the order they were sent. We
+     * only take local clients, as there's nothing stopping anyone who can
+     * reach the pipe from printing. */
+    pipe = CreateNamedPipe(
+        path,
+        PIPE_ACCESS_DUPLEX,
+        PIPE_TYPE_MESSAGE | PIPE_READMODE_MESSAGE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+        1,
+        PIPE_BUFFER_SIZE,
+        PIPE_BUFFER_SIZE,
+        0,
+        NULL);
+
+    if (pipe == INVALID_HANDLE_VALUE)
+    {
+        ERR("Failed to create pipe %s.\n", path);
+        return FALSE;
+    }
+
+    printf(" 📡 Listening on %s\n", path);
+
+    for (;;)
+    {
+        if (!ConnectNamedPipe(pipe, NULL) && GetLastError() != ERROR_PIPE_CONNECTED)
+        {
+            ERR("Failed to wait for a client.\n");
+            break;
+        }
+
+        DBG("Client connected\n");
+
+        while (read_message(pipe, &message, &capacity, &length))
+        {
+            const char *response;
+            DWORD bytes_written;
+
+            if (length == 0)
+                continue;
+
+            if (handle_message(message, length, target, prepare))
+                response = RESPONSE_OK;
+            else
+                response = RESPONSE_FAILED;
+
+            if (!WriteFile(pipe, response, strlen(response), &bytes_written, NULL))
+                break;
+        }
+
+        DBG("Client disconnected\n");
+
+        DisconnectNamedPipe(pipe);
+    }
+
+    if (message != NULL)
+        free(message);
+
+    CloseHandle(pipe);
+
+    return FALSE;
+}
@@ -0,0 +1,30 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <windows.h>
+
+#include "print.h"
+
+#define DEFAULT_PIPE_NAME "labelprinter"
+
+/**
+ * @brief Print labels sent to us over a named pipe, until something goes
+ * wrong.
+ *
+ * The pipe is message based, and each message is one label: either the
+ * contents of a bitmap file, or the path to one. A message is only taken as
+ * a bitmap if its file header gives the message's exact length. Every label
+ * is printed as its own document, and the client gets back "OK" or "FAILED".
+ *
+ * @param pipe_name The name of the pipe to listen on. Plain names are put in
+ * the local pipe namespace, e.g. `labelprinter` is `\\.\pipe\labelprinter`.
+ * @param target The printer to print to.
+ * @param prepare How to prepare each label before it's printed.
+ * @return `FALSE` if the server couldn't keep running.
+ */
+BOOL serve(
+    const char *pipe_name,
+    struct print_target *target,
+    const struct prepare_options *prepare);
+
+#endif /* SERVER_H */
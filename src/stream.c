@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "label.h"
+#include "log.h"
+#include "stream.h"
+
+/* Nothing we'd print is anywhere near this big, so a length past it means
+ * the stream has got out of step. */
+#define MAX_STREAM_LABEL_SIZE (1024u * 1024u * 1024u)
+
+struct label_stream
+{
+    HANDLE input;
+    BOOL length_prefixed;
+    int count;
+    char name[32];
+};
+
+/**
+ * @brief Read exactly `size` bytes from the stream.
+ *
+ * @param stream The stream to read from.
+ * @param data Where to put the data.
+ * @param size The number of bytes to read.
+ * @param bytes_read Set to the number of bytes actually read, which is only
+ * less than `size` at the end of the stream.
+ * @return `FALSE` if the read failed.
+ */
+static BOOL read_exactly(
+    struct label_stream *stream,
+    void *data,
+    size_t size,
+    size_t *bytes_read)
+{
+    *bytes_read = 0;
+
+    while (*bytes_read < size)
+    {
+        DWORD chunk = size - *bytes_read > MAXDWORD ? MAXDWORD : (DWORD)(size - *bytes_read);
+        DWORD chunk_read = 0;
+
+        if (!ReadFile(stream->input, (char *)data + *bytes_read, chunk, &chunk_read, NULL))
+        {
+            /* The other end of a pipe closing is just the end of the stream. */
+            if (GetLastError() == ERROR_BROKEN_PIPE)
+                return TRUE;
+
+            return FALSE;
+        }
+
+        if (chunk_read == 0)
+            return TRUE;
+
+        *bytes_read += chunk_read;
+    }
+
+    return TRUE;
+}
+
+struct label_stream *open_label_stream(HANDLE input, BOOL length_prefixed)
+{
+    struct label_stream *stream;
+
+    if (input == NULL || input == INVALID_HANDLE_VALUE)
+    {
+        ERR("Invalid stream input.\n");
+        return NULL;
+    }
+
+    stream = (struct label_stream *)calloc(1, sizeof(struct label_stream));
+    if (stream == NULL)
+    {
+        ERR("Failed to allocate memory for label stream.\n");
+        return NULL;
+    }
+
+    stream->input = input;
+    stream->length_prefixed = length_prefixed;
+
+    return stream;
+}
+
+BOOL read_label_stream(
+    struct label_stream *stream,
+    struct label **label,
+    char **name)
+{
+    struct label *next = NULL;
+    char *buffer;
+    size_t size, bytes_read;
+
+    *label = NULL;
+    *name = stream->name;
+
+    /* The bitmap is read into a pooled label's buffer, so once a batch is
+     * under way we aren't allocating for every label. */
+    next = new_label();
+    if (next == NULL)
+        return FALSE;
+
+    if (stream->length_prefixed)
+    {
+        BYTE prefix[4];
+
+        if (!read_exactly(stream, prefix, sizeof(prefix), &bytes_read))
+        {
+            ERR("Failed to read from stream.\n");
+            goto exit;
+        }
+
+        if (bytes_read == 0)
+        {
+            close_label(next);
+            return TRUE;
+        }
+
+        if (bytes_read != sizeof(prefix))
+        {
+            ERR("Stream ended part-way through a length.\n");
+            goto exit;
+        }
+
+        size = prefix[0] | (prefix[1] << 8) | (prefix[2] << 16) | ((DWORD)prefix[3] << 24);
+        if (size < sizeof(BITMAPFILEHEADER) || size > MAX_STREAM_LABEL_SIZE)
+        {
+            ERR("Stream has an invalid label length (%zu bytes).\n", size);
+            goto exit;
+        }
+
+        buffer = (char *)reserve_label_buffer(next, size);
+        if (buffer == NULL)
+            goto exit;
+
+        if (!read_exactly(stream, buffer, size, &bytes_read))
+        {
+            ERR("Failed to read from stream.\n");
+            goto exit;
+        }
+    }
+    else
+    {
+        BITMAPFILEHEADER header;
+
+        /* Without a prefix, we read the file header first to find out how
+         * much more there is. */
+        if (!read_exactly(stream, &header, sizeof(header), &bytes_read))
+        {
+            ERR("Failed to read from stream.\n");
+            goto exit;
+        }
+
+        if (bytes_read == 0)
+        {
+            close_label(next);
+            return TRUE;
+        }
+
+        if (bytes_read != sizeof(header) ||
+            header.bfType != 0x4D42 ||
+            header.bfSize < sizeof(header) ||
+            header.bfSize > MAX_STREAM_LABEL_SIZE)
+        {
+            ERR("Stream does not contain a valid bitmap.\n");
+            goto exit;
+        }
+
+        size = header.bfSize;
+        buffer = (char *)reserve_label_buffer(next, size);
+        if (buffer == NULL)
+            goto exit;
+
+        memcpy(buffer, &header, sizeof(header));
+        if (!read_exactly(
+                stream,
+                buffer + sizeof(header),
+                size - sizeof(header),
+                &bytes_read))
+        {
+            ERR("Failed to read from stream.\n");
+            goto exit;
+        }
+
+        bytes_read += sizeof(header);
+    }
+
+    if (bytes_read != size)
+    {
+        ERR("Stream ended part-way through a label.\n");
+        goto exit;
+    }
+
+    stream->count++;
+    snprintf(stream->name, sizeof(stream->name), "stdin #%d", stream->count);
+
+    DBG("Read %zu bytes from stream\n", size);
+
+    if (!parse_label_buffer(next, size, stream->name))
+        goto exit;
+
+    *label = next;
+
+    return TRUE;
+
+exit:
+    close_label(next);
+
+    return FALSE;
+}
+
+void close_label_stream(struct label_stream *stream)
+{
+    if (stream == NULL)
+        return;
+
+    free(stream);
+}
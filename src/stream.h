@@ -0,0 +1,46 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <windows.h>
+
+#include "label.h"
+
+/* Reads labels one after another from a pipe or file handle, such as stdin,
+ * into pooled label buffers. */
+struct label_stream;
+
+/**
+ * @brief Start reading labels from a handle.
+ *
+ * @param input The handle to read from. The stream doesn't take ownership.
+ * @param length_prefixed If `TRUE`, each bitmap is preceded by its length as
+ * a 32-bit little-endian number. Otherwise the bitmaps are back to back, and
+ * each one's header says how long it is.
+ * @return The stream, or `NULL` on failure. Release it with
+ * `close_label_stream()`.
+ */
+struct label_stream *open_label_stream(HANDLE input, BOOL length_prefixed);
+
+/**
+ * @brief Read the next label from the stream.
+ *
+ * @param stream The stream to read from.
+ * @param label Set to the label, or `NULL` at the end of the stream. Release
+ * it with `close_label()`.
+ * @param name Set to a name for the label, for messages and the document
+ * name. Only valid until the next read.
+ * @return `FALSE` if the stream couldn't be read, or held an invalid label.
+ */
+BOOL read_label_stream(
+    struct label_stream *stream,
+    struct label **label,
+    char **name);
+
+/**
+ * @brief Release a label stream.
+ *
+ * @param stream The stream to release. May be `NULL`.
+ */
+void close_label_stream(struct label_stream *stream);
+
+#endif /* STREAM_H */
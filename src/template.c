@@ -0,0 +1,1211 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+#include <wingdi.h>
+
+#include "barcode.h"
+#include "canvas.h"
+#include "glyphs.h"
+#include "job.h"
+#include "label.h"
+#include "line_reader.h"
+#include "log.h"
+#include "template.h"
+#include "timing.h"
+
+#define DEFAULT_FONT "Arial"
+
+/* Nothing on a label needs more than a few options, or text, bars or
+ * modules bigger than this. */
+#define MAX_TEMPLATE_OPTIONS (16)
+#define MAX_TEXT_HEIGHT (4096)
+#define MAX_MODULE_SIZE (1000.0)
+
+/* The longest a field's text can be, once it's filled in. */
+#define MAX_FIELD_TEXT (1024)
+
+enum piece_kind
+{
+    PIECE_TEXT,
+    PIECE_COLUMN,
+    PIECE_SERIAL,
+};
+
+/* Part of a field's value: either text to copy, or something to fill in. */
+struct template_piece
+{
+    enum piece_kind kind;
+
+    /* The text, or the name of what to fill in, pointing into the field's
+     * value. */
+    const char *text;
+    size_t length;
+
+    /* For columns, which column of the open data it is. */
+    int column;
+};
+
+enum field_kind
+{
+    FIELD_TEXT,
+    FIELD_BARCODE,
+};
+
+struct template_field
+{
+    enum field_kind kind;
+    int x, y;
+
+    /* For text. The atlas belongs to the template, and might be shared with
+     * other fields. */
+    enum text_align align;
+    struct glyph_atlas *atlas;
+
+    /* For barcodes, which are encoded afresh for each label, and drawn over
+     * it at the printer's resolution. */
+    enum barcode_type barcode_type;
+    float module;
+    int bar_height;
+
+    char *value;
+    struct template_piece *pieces;
+    int piece_count;
+};
+
+struct template
+{
+    /* The base bitmap, as a 1bpp bitmap file. Each label starts out as a
+     * copy of it. */
+    BYTE *image;
+    size_t image_size;
+
+    struct template_field *fields;
+    int field_count;
+    int field_capacity;
+
+    /* One for each font the fields use. */
+    struct glyph_atlas **atlases;
+    int atlas_count;
+    int atlas_capacity;
+
+    long serial_start;
+    long serial_step;
+    int serial_digits;
+};
+
+struct template_data
+{
+    struct template *template;
+    struct line_reader reader;
+    char *path;
+
+    /* The header row, and the column names pointing into it. */
+    char *header;
+    char **columns;
+    int column_count;
+
+    /* The values of the row just read, pointing into the reader's line.
+     * There's room for one more than there are columns, so we can tell when
+     * a row has too many. */
+    char **cells;
+
+    /* Columns for the job's own settings, or -1 if there isn't one. */
+    int copies_column;
+    int paper_column;
+    int orientation_column;
+    int printer_column;
+
+    /* How many rows we've read, for their serial numbers. */
+    long rows;
+};
+
+/* The options on one line of a template, pointing into the line itself. */
+struct template_options
+{
+    char *directive;
+    char *keys[MAX_TEMPLATE_OPTIONS];
+    char *values[MAX_TEMPLATE_OPTIONS];
+    int count;
+};
+
+/**
+ * @brief Make room for one more item in a growable array.
+ *
+ * @return `FALSE` if there wasn't room and we couldn't make any.
+ */
+static BOOL grow_array(void **items, int count, int *capacity, size_t item_size)
+{
+    int new_capacity;
+    void *new_items;
+
+    if (count < *capacity)
+        return TRUE;
+
+    new_capacity = *capacity > 0 ? *capacity * 2 : 16;
+    new_items = realloc(*items, new_capacity * item_size);
+    if (new_items == NULL)
+    {
+        ERR("Failed to allocate memory for template.\n");
+        return FALSE;
+    }
+
+    *items = new_items;
+    *capacity = new_capacity;
+
+    return TRUE;
+}
+
+/**
+ * @brief Split a line of a template into its directive and options.
+ */
+static BOOL parse_template_line(
+    const struct line_reader *reader,
+    char *line,
+    struct template_options *options)
+{
+    char *field = line;
+
+    memset(options, 0, sizeof(*options));
+    options->directive = field;
+
+    while ((field = strchr(field, '\t')) != NULL)
+    {
+        char *value;
+
+        *field++ = '\0';
+
+        /* Tabs in a row leave empty fields, which are skipped. */
+        if (*field == '\0' || *field == '\t')
+            continue;
+
+        value = field + strcspn(field, "=\t");
+        if (*value != '=')
+        {
+            ERR("Expected key=value on line %ld: %.*s\n", reader->line_number, (int)(value - field), field);
+            return FALSE;
+        }
+
+        if (options->count == MAX_TEMPLATE_OPTIONS)
+        {
+            ERR("Too many options on line %ld.\n", reader->line_number);
+            return FALSE;
+        }
+
+        *value++ = '\0';
+        options->keys[options->count] = field;
+        options->values[options->count] = value;
+        options->count++;
+
+        /* Later fields are found from where this one ends. */
+        field = value;
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Make sure a line only has options its directive knows about.
+ *
+ * @param known The keys the directive takes, ending with `NULL`.
+ */
+static BOOL check_options(
+    const struct line_reader *reader,
+    const struct template_options *options,
+    const char *const *known)
+{
+    for (int i = 0; i < options->count; i++)
+    {
+        int k = 0;
+
+        while (known[k] != NULL && strcmp(known[k], options->keys[i]) != 0)
+            k++;
+
+        if (known[k] == NULL)
+        {
+            ERR("Unknown template key on line %ld: %s\n", reader->line_number, options->keys[i]);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static const char *get_option(const struct template_options *options, const char *key)
+{
+    for (int i = 0; i < options->count; i++)
+    {
+        if (strcmp(options->keys[i], key) == 0)
+            return options->values[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Get a whole number option.
+ *
+ * @param value Set to the number. Left alone if the option isn't there and
+ * isn't `required`.
+ */
+static BOOL get_number_option(
+    const struct line_reader *reader,
+    const struct template_options *options,
+    const char *key,
+    BOOL required,
+    long *value)
+{
+    const char *text = get_option(options, key);
+    char *end;
+    long number;
+
+    if (text == NULL)
+    {
+        if (required)
+        {
+            ERR("%s needs %s= on line %ld.\n", options->directive, key, reader->line_number);
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    number = strtol(text, &end, 10);
+    if (end == text || *end != '\0')
+    {
+        ERR("Invalid %s on line %ld: %s\n", key, reader->line_number, text);
+        return FALSE;
+    }
+
+    *value = number;
+
+    return TRUE;
+}
+
+/**
+ * @brief Get a number option that can have a fraction.
+ *
+ * @param value Set to the number. Left alone if the option isn't there and
+ * isn't `required`.
+ */
+static BOOL get_decimal_option(
+    const struct line_reader *reader,
+    const struct template_options *options,
+    const char *key,
+    BOOL required,
+    double *value)
+{
+    const char *text = get_option(options, key);
+    char *end;
+    double number;
+
+    if (text == NULL)
+    {
+        if (required)
+        {
+            ERR("%s needs %s= on line %ld.\n", options->directive, key, reader->line_number);
+            return FALSE;
+        }
+
+        return TRUE;
+    }
+
+    number = strtod(text, &end);
+    if (end == text || *end != '\0')
+    {
+        ERR("Invalid %s on line %ld: %s\n", key, reader->line_number, text);
+        return FALSE;
+    }
+
+    *value = number;
+
+    return TRUE;
+}
+
+/**
+ * @brief Load the base bitmap, and keep it as a 1bpp bitmap file that labels
+ * can be copied from without converting them again.
+ */
+static BOOL load_template_base(struct template *template, char *path)
+{
+    struct label *label;
+    const BITMAPINFOHEADER *info;
+    const RGBQUAD *colors;
+    BITMAPFILEHEADER *file_header;
+    BITMAPINFOHEADER *info_header;
+    RGBQUAD *palette;
+    size_t bits_size;
+    BOOL success = FALSE;
+
+    if (template->image != NULL)
+    {
+        ERR("A template can only have one base.\n");
+        return FALSE;
+    }
+
+    label = open_label(path);
+    if (label == NULL)
+    {
+        ERR("Failed to open %s.\n", path);
+        return FALSE;
+    }
+
+    /* Anything that isn't 1bpp by now is a JPEG or PNG, which GDI draws
+     * and we can't. */
+    info = label->info_header;
+    if (info->biBitCount != 1 || info->biCompression != BI_RGB)
+    {
+        ERR("%s can't be used as a template; it needs to be a bitmap.\n", path);
+        goto exit;
+    }
+
+    colors = (const RGBQUAD *)((const char *)info + info->biSize);
+    bits_size = (((size_t)label->width + 31) / 32) * 4 * label->height;
+
+    template->image_size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + 2 * sizeof(RGBQUAD) + bits_size;
+    template->image = (BYTE *)malloc(template->image_size);
+    if (template->image == NULL)
+    {
+        ERR("Failed to allocate memory for template.\n");
+        goto exit;
+    }
+
+    file_header = (BITMAPFILEHEADER *)template->image;
+    info_header = (BITMAPINFOHEADER *)(file_header + 1);
+    palette = (RGBQUAD *)(info_header + 1);
+
+    memset(file_header, 0, sizeof(*file_header));
+    file_header->bfType = 0x4D42;
+    file_header->bfSize = (DWORD)template->image_size;
+    file_header->bfOffBits = (DWORD)(template->image_size - bits_size);
+
+    memset(info_header, 0, sizeof(*info_header));
+    info_header->biSize = sizeof(BITMAPINFOHEADER);
+    info_header->biWidth = info->biWidth;
+    info_header->biHeight = info->biHeight;
+    info_header->biPlanes = 1;
+    info_header->biBitCount = 1;
+    info_header->biCompression = BI_RGB;
+    info_header->biSizeImage = (DWORD)bits_size;
+    info_header->biXPelsPerMeter = info->biXPelsPerMeter;
+    info_header->biYPelsPerMeter = info->biYPelsPerMeter;
+    info_header->biClrUsed = 2;
+
+    palette[0] = colors[0];
+    palette[1] = info->biClrUsed == 1 ? colors[0] : colors[1];
+
+    memcpy(palette + 2, label->bits, bits_size);
+
+    DBG("Template base %s: %d x %d px\n", path, label->width, label->height);
+
+    success = TRUE;
+
+exit:
+    close_label(label);
+
+    return success;
+}
+
+/**
+ * @brief Get the atlas for a font, sharing one if another field already
+ * uses it.
+ *
+ * @return The atlas, or `NULL` on failure. It belongs to the template.
+ */
+static struct glyph_atlas *get_template_atlas(struct template *template, const char *face, int height, BOOL bold)
+{
+    struct glyph_atlas *atlas;
+
+    for (int i = 0; i < template->atlas_count; i++)
+    {
+        if (glyph_atlas_matches(template->atlases[i], face, height, bold))
+            return template->atlases[i];
+    }
+
+    if (!grow_array((void **)&template->atlases, template->atlas_count, &template->atlas_capacity, sizeof(struct glyph_atlas *)))
+        return NULL;
+
+    atlas = open_glyph_atlas(face, height, bold);
+    if (atlas == NULL)
+        return NULL;
+
+    template->atlases[template->atlas_count++] = atlas;
+
+    return atlas;
+}
+
+/**
+ * @brief Split a field's value into text and the things to fill in.
+ */
+static BOOL parse_field_value(const struct line_reader *reader, struct template_field *field)
+{
+    const char *p = field->value;
+    int capacity = 1;
+
+    /* Every brace starts at most one piece, and ends at most one more. */
+    for (const char *q = p; *q != '\0'; q++)
+    {
+        if (*q == '{' || *q == '}')
+            capacity += 2;
+    }
+
+    field->pieces = (struct template_piece *)calloc(capacity, sizeof(struct template_piece));
+    if (field->pieces == NULL)
+    {
+        ERR("Failed to allocate memory for template.\n");
+        return FALSE;
+    }
+
+    while (*p != '\0')
+    {
+        struct template_piece *piece = &field->pieces[field->piece_count++];
+
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}'))
+        {
+            piece->kind = PIECE_TEXT;
+            piece->text = p;
+            piece->length = 1;
+            p += 2;
+        }
+        else if (*p == '{')
+        {
+            const char *end = strchr(p, '}');
+            if (end == NULL || end == p + 1)
+            {
+                ERR("Expected {name} on line %ld: %s\n", reader->line_number, p);
+                return FALSE;
+            }
+
+            /* Which column it is isn't known until there's data. */
+            piece->kind = PIECE_COLUMN;
+            piece->text = p + 1;
+            piece->length = end - p - 1;
+            p = end + 1;
+        }
+        else
+        {
+            const char *end = p + 1;
+
+            while (*end != '\0' && *end != '{' && !(end[0] == '}' && end[1] == '}'))
+                end++;
+
+            piece->kind = PIECE_TEXT;
+            piece->text = p;
+            piece->length = end - p;
+            p = end;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * @brief Take a copy of a field's value, split it up, and add the field to
+ * the template.
+ */
+static BOOL add_field(
+    struct template *template,
+    const struct line_reader *reader,
+    struct template_field *field,
+    const char *value)
+{
+    if (value == NULL)
+    {
+        ERR("%s needs value= on line %ld.\n", field->kind == FIELD_BARCODE ? "barcode" : "text", reader->line_number);
+        return FALSE;
+    }
+
+    field->value = _strdup(value);
+    if (field->value == NULL)
+    {
+        ERR("Failed to allocate memory for template.\n");
+        return FALSE;
+    }
+
+    if (!parse_field_value(reader, field) ||
+        !grow_array((void **)&template->fields, template->field_count, &template->field_capacity, sizeof(struct template_field)))
+    {
+        free(field->pieces);
+        free(field->value);
+        return FALSE;
+    }
+
+    template->fields[template->field_count++] = *field;
+
+    return TRUE;
+}
+
+static BOOL add_text_field(
+    struct template *template,
+    const struct line_reader *reader,
+    const struct template_options *options)
+{
+    static const char *const known[] = {"x", "y", "height", "value", "font", "bold", "align", NULL};
+    struct template_field field = {0};
+    const char *value = get_option(options, "value");
+    const char *face = get_option(options, "font");
+    const char *bold = get_option(options, "bold");
+    const char *align = get_option(options, "align");
+    BOOL is_bold = FALSE;
+    long x, y, height;
+
+    if (!check_options(reader, options, known) ||
+        !get_number_option(reader, options, "x", TRUE, &x) ||
+        !get_number_option(reader, options, "y", TRUE, &y) ||
+        !get_number_option(reader, options, "height", TRUE, &height))
+    {
+        return FALSE;
+    }
+
+    if (height < 1 || height > MAX_TEXT_HEIGHT)
+    {
+        ERR("Height must be between 1 and %d on line %ld.\n", MAX_TEXT_HEIGHT, reader->line_number);
+        return FALSE;
+    }
+
+    if (bold != NULL)
+    {
+        if (_stricmp(bold, "yes") == 0 || _stricmp(bold, "true") == 0 || strcmp(bold, "1") == 0)
+            is_bold = TRUE;
+        else if (_stricmp(bold, "no") != 0 && _stricmp(bold, "false") != 0 && strcmp(bold, "0") != 0)
+        {
+            ERR("Invalid bold on line %ld: %s\n", reader->line_number, bold);
+            return FALSE;
+        }
+    }
+
+    field.align = TEXT_ALIGN_LEFT;
+    if (align != NULL)
+    {
+        if (_stricmp(align, "center") == 0 || _stricmp(align, "centre") == 0)
+            field.align = TEXT_ALIGN_CENTER;
+        else if (_stricmp(align, "right") == 0)
+            field.align = TEXT_ALIGN_RIGHT;
+        else if (_stricmp(align, "left") != 0)
+        {
+            ERR("Invalid align on line %ld: %s\n", reader->line_number, align);
+            return FALSE;
+        }
+    }
+
+    field.kind = FIELD_TEXT;
+    field.x = (int)x;
+    field.y = (int)y;
+
+    field.atlas = get_template_atlas(template, face != NULL ? face : DEFAULT_FONT, (int)height, is_bold);
+    if (field.atlas == NULL)
+        return FALSE;
+
+    return add_field(template, reader, &field, value);
+}
+
+static BOOL add_barcode_field(
+    struct template *template,
+    const struct line_reader *reader,
+    const struct template_options *options)
+{
+    static const char *const known[] = {"type", "x", "y", "module", "height", "value", NULL};
+    struct template_field field = {0};
+    const char *type = get_option(options, "type");
+    double module;
+    long x, y, height = 0;
+
+    if (!check_options(reader, options, known) ||
+        !get_number_option(reader, options, "x", TRUE, &x) ||
+        !get_number_option(reader, options, "y", TRUE, &y) ||
+        !get_decimal_option(reader, options, "module", TRUE, &module) ||
+        !get_number_option(reader, options, "height", FALSE, &height))
+    {
+        return FALSE;
+    }
+
+    if (type == NULL || !parse_barcode_type(type, &field.barcode_type))
+    {
+        ERR("barcode needs type=code128, qr or datamatrix on line %ld.\n", reader->line_number);
+        return FALSE;
+    }
+
+    if (!(module > 0 && module <= MAX_MODULE_SIZE))
+    {
+        ERR("Module must be more than 0 and at most %.0f on line %ld.\n", MAX_MODULE_SIZE, reader->line_number);
+        return FALSE;
+    }
+
+    /* 2D codes are as tall as their modules make them. */
+    if (field.barcode_type == BARCODE_CODE128 && (height < 1 || height > MAX_TEXT_HEIGHT))
+    {
+        ERR("Height must be between 1 and %d on line %ld.\n", MAX_TEXT_HEIGHT, reader->line_number);
+        return FALSE;
+    }
+
+    field.kind = FIELD_BARCODE;
+    field.x = (int)x;
+    field.y = (int)y;
+    field.module = (float)module;
+    field.bar_height = (int)height;
+
+    return add_field(template, reader, &field, get_option(options, "value"));
+}
+
+static BOOL set_template_serial(
+    struct template *template,
+    const struct line_reader *reader,
+    const struct template_options *options)
+{
+    static const char *const known[] = {"start", "step", "digits", NULL};
+    long digits = template->serial_digits;
+
+    if (!check_options(reader, options, known) ||
+        !get_number_option(reader, options, "start", FALSE, &template->serial_start) ||
+        !get_number_option(reader, options, "step", FALSE, &template->serial_step) ||
+        !get_number_option(reader, options, "digits", FALSE, &digits))
+    {
+        return FALSE;
+    }
+
+    if (digits < 0 || digits > 20)
+    {
+        ERR("Digits must be between 0 and 20 on line %ld.\n", reader->line_number);
+        return FALSE;
+    }
+
+    template->serial_digits = (int)digits;
+
+    return TRUE;
+}
+
+struct template *open_template(const char *path)
+{
+    static const char *const base_keys[] = {"path", NULL};
+    struct template *template = NULL;
+    struct line_reader reader = {0};
+    struct template_options options;
+    BOOL success = FALSE;
+
+    template = (struct template *)calloc(1, sizeof(struct template));
+    if (template == NULL)
+    {
+        ERR("Failed to allocate memory for template.\n");
+        return NULL;
+    }
+
+    template->serial_start = 1;
+    template->serial_step = 1;
+
+    if (!open_line_reader(&reader, path))
+    {
+        ERR("Failed to open template %s.\n", path);
+        goto exit;
+    }
+
+    while (read_line(&reader))
+    {
+        char *line = reader.line;
+
+        while (*line == ' ' || *line == '\t')
+            line++;
+
+        if (*line == '\0' || *line == '#')
+            continue;
+
+        if (!parse_template_line(&reader, line, &options))
+            goto exit;
+
+        if (strcmp(options.directive, "base") == 0)
+        {
+            char *base = (char *)get_option(&options, "path");
+
+            if (!check_options(&reader, &options, base_keys))
+                goto exit;
+
+            if (base == NULL)
+            {
+                ERR("base needs path= on line %ld.\n", reader.line_number);
+                goto exit;
+            }
+
+            if (!load_template_base(template, base))
+                goto exit;
+        }
+        else if (strcmp(options.directive, "serial") == 0)
+        {
+            if (!set_template_serial(template, &reader, &options))
+                goto exit;
+        }
+        else if (strcmp(options.directive, "text") == 0)
+        {
+            if (!add_text_field(template, &reader, &options))
+                goto exit;
+        }
+        else if (strcmp(options.directive, "barcode") == 0)
+        {
+            if (!add_barcode_field(template, &reader, &options))
+                goto exit;
+        }
+        else
+        {
+            ERR("Unknown template directive on line %ld: %s\n", reader.line_number, options.directive);
+            goto exit;
+        }
+    }
+
+    if (line_reader_failed(&reader))
+    {
+        ERR("Failed to read template %s.\n", path);
+        goto exit;
+    }
+
+    if (template->image == NULL)
+    {
+        ERR("Template %s has no base.\n", path);
+        goto exit;
+    }
+
+    DBG("Template %s: %d fields in %d fonts\n", path, template->field_count, template->atlas_count);
+
+    success = TRUE;
+
+exit:
+    close_line_reader(&reader);
+
+    if (!success)
+    {
+        close_template(template);
+        return NULL;
+    }
+
+    return template;
+}
+
+void close_template(struct template *template)
+{
+    if (template == NULL)
+        return;
+
+    for (int i = 0; i < template->field_count; i++)
+    {
+        free(template->fields[i].pieces);
+        free(template->fields[i].value);
+    }
+
+    for (int i = 0; i < template->atlas_count; i++)
+        close_glyph_atlas(template->atlases[i]);
+
+    free(template->fields);
+    free(template->atlases);
+    free(template->image);
+    free(template);
+}
+
+/**
+ * @brief Split a line of CSV into its values, in place. Quoted values can
+ * hold commas, and `""` for a quote.
+ *
+ * @param cells Set to the values, up to `capacity` of them.
+ * @return The number of values on the line, which might be more than
+ * `capacity`, or -1 if a quote isn't closed properly.
+ */
+static int split_csv_line(char *line, char **cells, int capacity)
+{
+    char *in = line, *out = line;
+    int count = 0;
+
+    for (;;)
+    {
+        char *cell = out;
+        BOOL more;
+
+        if (*in == '"')
+        {
+            for (in++;; in++)
+            {
+                if (*in == '\0')
+                    return -1;
+
+                if (*in == '"')
+                {
+                    if (in[1] != '"')
+                        break;
+
+                    in++;
+                }
+
+                *out++ = *in;
+            }
+
+            in++;
+            if (*in != ',' && *in != '\0')
+                return -1;
+        }
+        else
+        {
+            while (*in != ',' && *in != '\0')
+                *out++ = *in++;
+        }
+
+        /* The value's been shuffled down over any quotes, so its end might
+         * land on the comma. */
+        more = *in == ',';
+        *out++ = '\0';
+        in++;
+
+        if (count < capacity)
+            cells[count] = cell;
+        count++;
+
+        if (!more)
+            return count;
+    }
+}
+
+/**
+ * @brief Find a column by name.
+ *
+ * @return The column, or -1 if there isn't one.
+ */
+static int find_column(const struct template_data *data, const char *name, size_t length)
+{
+    for (int i = 0; i < data->column_count; i++)
+    {
+        if (strlen(data->columns[i]) == length && _strnicmp(data->columns[i], name, length) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+struct template_data *open_template_data(struct template *template, const char *path)
+{
+    struct template_data *data = NULL;
+    int capacity = 1;
+
+    data = (struct template_data *)calloc(1, sizeof(struct template_data));
+    if (data == NULL)
+    {
+        ERR("Failed to allocate memory for data.\n");
+        return NULL;
+    }
+
+    data->template = template;
+
+    if (!open_line_reader(&data->reader, path))
+    {
+        ERR("Failed to open data %s.\n", path);
+        goto exit;
+    }
+
+    if (!read_line(&data->reader))
+    {
+        if (line_reader_failed(&data->reader))
+        {
+            ERR("Failed to read %s.\n", path);
+        }
+        else
+        {
+            ERR("%s has no header row.\n", path);
+        }
+
+        goto exit;
+    }
+
+    data->path = _strdup(path);
+    data->header = _strdup(data->reader.line);
+    if (data->path == NULL || data->header == NULL)
+    {
+        ERR("Failed to allocate memory for data.\n");
+        goto exit;
+    }
+
+    /* Some commas might be quoted, so this is as many columns as there
+     * could be. */
+    for (const char *p = data->header; *p != '\0'; p++)
+    {
+        if (*p == ',')
+            capacity++;
+    }
+
+    data->columns = (char **)calloc(capacity, sizeof(char *));
+    if (data->columns == NULL)
+    {
+        ERR("Failed to allocate memory for data.\n");
+        goto exit;
+    }
+
+    data->column_count = split_csv_line(data->header, data->columns, capacity);
+    if (data->column_count < 0)
+    {
+        ERR("Invalid header row in %s.\n", path);
+        goto exit;
+    }
+
+    data->cells = (char **)calloc(data->column_count + 1, sizeof(char *));
+    if (data->cells == NULL)
+    {
+        ERR("Failed to allocate memory for data.\n");
+        goto exit;
+    }
+
+    data->copies_column = find_column(data, "copies", strlen("copies"));
+    data->paper_column = find_column(data, "paper", strlen("paper"));
+    data->orientation_column = find_column(data, "orientation", strlen("orientation"));
+    data->printer_column = find_column(data, "printer", strlen("printer"));
+
+    /* Now we know the columns, work out what each field fills in. A column
+     * called `serial` wins over the counter. */
+    for (int i = 0; i < template->field_count; i++)
+    {
+        struct template_field *field = &template->fields[i];
+
+        for (int j = 0; j < field->piece_count; j++)
+        {
+            struct template_piece *piece = &field->pieces[j];
+
+            if (piece->kind == PIECE_TEXT)
+                continue;
+
+            piece->kind = PIECE_COLUMN;
+            piece->column = find_column(data, piece->text, piece->length);
+            if (piece->column >= 0)
+                continue;
+
+            if (piece->length == strlen("serial") && strncmp(piece->text, "serial", piece->length) == 0)
+            {
+                piece->kind = PIECE_SERIAL;
+                continue;
+            }
+
+            ERR("%s has no column called %.*s.\n", path, (int)piece->length, piece->text);
+            goto exit;
+        }
+    }
+
+    DBG("Data %s: %d columns\n", path, data->column_count);
+
+    return data;
+
+exit:
+    close_template_data(data);
+
+    return NULL;
+}
+
+BOOL read_template_job(struct template_data *data, struct print_job **job)
+{
+    struct line_reader *reader = &data->reader;
+    char name[MAX_PATH + 32];
+    const char *paper = NULL, *printer = NULL;
+    int copies = 0;
+    enum job_orientation orientation = JOB_ORIENTATION_DEFAULT;
+    size_t strings_size = 0;
+    char *strings;
+    int count;
+
+    *job = NULL;
+
+    do
+    {
+        if (!read_line(reader))
+        {
+            if (line_reader_failed(reader))
+            {
+                ERR("Failed to read %s.\n", data->path);
+                return FALSE;
+            }
+
+            return TRUE;
+        }
+    } while (reader->line[0] == '\0');
+
+    count = split_csv_line(reader->line, data->cells, data->column_count + 1);
+    if (count < 0)
+    {
+        ERR("Unclosed quote on line %ld of %s.\n", reader->line_number, data->path);
+        return FALSE;
+    }
+
+    if (count != data->column_count)
+    {
+        ERR("Line %ld of %s has %d values, but there are %d columns.\n",
+            reader->line_number, data->path, count, data->column_count);
+        return FALSE;
+    }
+
+    /* Empty values leave the batch's settings alone. */
+    if (data->copies_column >= 0 && *data->cells[data->copies_column] != '\0' &&
+        !parse_job_copies(data->cells[data->copies_column], &copies))
+    {
+        ERR("Copies must be between 1 and %d on line %ld of %s.\n", MAX_JOB_COPIES, reader->line_number, data->path);
+        return FALSE;
+    }
+
+    if (data->orientation_column >= 0 && *data->cells[data->orientation_column] != '\0' &&
+        !parse_job_orientation(data->cells[data->orientation_column], &orientation))
+    {
+        ERR("Invalid orientation on line %ld of %s: %s\n",
+            reader->line_number, data->path, data->cells[data->orientation_column]);
+        return FALSE;
+    }
+
+    if (data->paper_column >= 0 && *data->cells[data->paper_column] != '\0')
+        paper = data->cells[data->paper_column];
+
+    if (data->printer_column >= 0 && *data->cells[data->printer_column] != '\0')
+        printer = data->cells[data->printer_column];
+
+    snprintf(name, sizeof(name), "%s:%ld", data->path, reader->line_number);
+
+    *job = new_print_job(name, paper, printer);
+    if (*job == NULL)
+        return FALSE;
+
+    /* The values live straight after their pointers, so it's one
+     * allocation. */
+    for (int i = 0; i < count; i++)
+        strings_size += strlen(data->cells[i]) + 1;
+
+    (*job)->values = (char **)malloc(count * sizeof(char *) + strings_size);
+    if ((*job)->values == NULL)
+    {
+        ERR("Failed to allocate memory for job.\n");
+        free_print_job(*job);
+        *job = NULL;
+        return FALSE;
+    }
+
+    strings = (char *)((*job)->values + count);
+    for (int i = 0; i < count; i++)
+    {
+        size_t size = strlen(data->cells[i]) + 1;
+
+        (*job)->values[i] = strings;
+        memcpy(strings, data->cells[i], size);
+        strings += size;
+    }
+
+    (*job)->copies = copies;
+    (*job)->orientation = orientation;
+    (*job)->serial = data->template->serial_start + data->template->serial_step * data->rows;
+    data->rows++;
+
+    return TRUE;
+}
+
+void close_template_data(struct template_data *data)
+{
+    if (data == NULL)
+        return;
+
+    close_line_reader(&data->reader);
+
+    free(data->cells);
+    free(data->columns);
+    free(data->header);
+    free(data->path);
+    free(data);
+}
+
+/**
+ * @brief Fill in a field's value for a job.
+ *
+ * @return `FALSE` if it doesn't fit in `size` bytes.
+ */
+static BOOL fill_field(
+    const struct template *template,
+    const struct template_field *field,
+    const struct print_job *job,
+    char *text,
+    size_t size)
+{
+    char serial[32];
+    size_t length = 0;
+
+    for (int i = 0; i < field->piece_count; i++)
+    {
+        const struct template_piece *piece = &field->pieces[i];
+        const char *value = piece->text;
+        size_t value_length = piece->length;
+
+        if (piece->kind == PIECE_COLUMN)
+        {
+            value = job->values[piece->column];
+            value_length = strlen(value);
+        }
+        else if (piece->kind == PIECE_SERIAL)
+        {
+            snprintf(serial, sizeof(serial), "%0*ld", template->serial_digits, job->serial);
+            value = serial;
+            value_length = strlen(serial);
+        }
+
+        if (length + value_length >= size)
+            return FALSE;
+
+        memcpy(text + length, value, value_length);
+        length += value_length;
+    }
+
+    text[length] = '\0';
+
+    return TRUE;
+}
+
+struct label *compose_label(const struct template *template, const struct print_job *job)
+{
+    struct label *label;
+    struct canvas canvas;
+    char text[MAX_FIELD_TEXT];
+    void *buffer;
+    LONGLONG start = timing_start();
+
+    label = new_label();
+    if (label == NULL)
+        return NULL;
+
+    /* The template's already 1bpp, so this is just a copy and a check. */
+    buffer = reserve_label_buffer(label, template->image_size);
+    if (buffer == NULL)
+        goto exit;
+
+    memcpy(buffer, template->image, template->image_size);
+    if (!parse_label_buffer(label, template->image_size, job->filename))
+        goto exit;
+
+    init_canvas(&canvas, label->info_header, label->bits);
+
+    for (int i = 0; i < template->field_count; i++)
+    {
+        const struct template_field *field = &template->fields[i];
+
+        if (!fill_field(template, field, job, text, sizeof(text)))
+        {
+            ERR("Text for %s is longer than %d bytes.\n", job->filename, MAX_FIELD_TEXT - 1);
+            goto exit;
+        }
+
+        if (field->kind == FIELD_BARCODE)
+        {
+            struct label_layer layer = {field->x, field->y, field->module, field->bar_height, NULL};
+
+            layer.barcode = encode_barcode(field->barcode_type, text);
+            if (layer.barcode == NULL || !add_label_layer(label, &layer))
+            {
+                ERR("Failed to make a barcode for %s.\n", job->filename);
+                goto exit;
+            }
+        }
+        else if (!draw_text(&canvas, field->atlas, field->x, field->y, field->align, text))
+        {
+            goto exit;
+        }
+    }
+
+    timing_end(PHASE_COMPOSE, start);
+
+    return label;
+
+exit:
+    close_label(label);
+
+    return NULL;
+}
@@ -0,0 +1,92 @@
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <windows.h>
+
+#include "job.h"
+#include "label.h"
+
+/* Composes labels from a base bitmap and a row of data, so a serialized run
+ * doesn't need a bitmap file for every label.
+ *
+ * A template file is read a line at a time, like a manifest. Each line is a
+ * directive followed by tab-separated `key=value` options:
+ *
+ *   base    path=FILE                 The bitmap every label starts from.
+ *   serial  start=N step=N digits=N   How `{serial}` counts; default 1, 1, 0.
+ *   text    x=N y=N height=N value=TEXT [font=NAME] [bold=yes] [align=left|center|right]
+ *   barcode type=code128|qr|datamatrix x=N y=N module=N [height=N] value=TEXT
+ *
+ * Positions and sizes are in the base bitmap's pixels, from its top left.
+ * A barcode's `module` is the size of its narrowest bar or square, and can
+ * have a fraction, as it's rounded to whole printer dots; Code128s also need
+ * the `height` of their bars. Barcodes are drawn over the label at the
+ * printer's resolution, not scaled with the base.
+ *
+ * In a value, `{column}` is replaced by that column of the row, `{serial}`
+ * by the row's serial number, and `{{` and `}}` by `{` and `}`. Blank lines
+ * and lines starting with `#` are skipped.
+ *
+ * The data file is CSV, with a header row naming the columns. Columns named
+ * `copies`, `paper`, `orientation` and `printer` set those for the row, as
+ * in a manifest. Quoted values can't span lines. */
+struct template;
+struct template_data;
+
+/**
+ * @brief Open a template and its base bitmap.
+ *
+ * @param path The template file.
+ * @return The template, or `NULL` on failure. Release it with
+ * `close_template()`.
+ */
+struct template *open_template(const char *path);
+
+/**
+ * @brief Release a template.
+ *
+ * @param template The template to release. May be `NULL`.
+ */
+void close_template(struct template *template);
+
+/**
+ * @brief Open a data file to fill a template in from, checking that it has
+ * every column the template uses.
+ *
+ * @param template The template the data is for. Only one data file can be
+ * open for it at a time. Must outlive the data.
+ * @param path The data file.
+ * @return The data, or `NULL` on failure. Release it with
+ * `close_template_data()`.
+ */
+struct template_data *open_template_data(struct template *template, const char *path);
+
+/**
+ * @brief Read the next row of data as a job.
+ *
+ * @param data The data to read from.
+ * @param job Set to the job, or `NULL` at the end of the data. The job's
+ * filename names the row, for messages. Jobs that don't say how many copies
+ * they want have `copies` set to 0. Release it with `free_print_job()`.
+ * @return `FALSE` if the data couldn't be read, or the row was invalid.
+ */
+BOOL read_template_job(struct template_data *data, struct print_job **job);
+
+/**
+ * @brief Release a data file.
+ *
+ * @param data The data to release. May be `NULL`.
+ */
+void close_template_data(struct template_data *data);
+
+/**
+ * @brief Compose a job's label onto a copy of the template. Safe to call from
+ * several threads at once.
+ *
+ * @param template The template to compose onto.
+ * @param job A job from `read_template_job()`.
+ * @return The label, or `NULL` on failure. Release it with `close_label()`.
+ */
+struct label *compose_label(const struct template *template, const struct print_job *job);
+
+#endif /* TEMPLATE_H */
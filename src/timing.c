@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "log.h"
+#include "metrics.h"
+#include "timing.h"
+
+struct timing_samples
+{
+    LONGLONG *spans;
+    int count;
+    int capacity;
+};
+
+struct timing_summary
+{
+    int count;
+    double total_ms;
+    double mean_ms;
+    double p50_ms, p90_ms, p99_ms;
+    double max_ms;
+};
+
+static const char *phase_names[PHASE_COUNT] = {
+    [PHASE_PRINTER_DISCOVERY] = "printer_discovery",
+    [PHASE_PAPER_TABLE] = "paper_table",
+    [PHASE_SET_PAPER_SIZE] = "set_paper_size",
+    [PHASE_CREATE_DC] = "create_dc",
+    [PHASE_OPEN_LABEL] = "open_label",
+    [PHASE_COMPOSE] = "compose",
+    [PHASE_PRESCALE] = "prescale",
+    [PHASE_CROP] = "crop",
+    [PHASE_MAPPING] = "mapping",
+    [PHASE_START_PAGE] = "start_page",
+    [PHASE_STRETCH] = "stretch_dib",
+    [PHASE_END_PAGE] = "end_page",
+    [PHASE_END_DOC] = "end_doc",
+    [PHASE_WRITE_PRINTER] = "write_printer",
+};
+
+/* Whether to keep every span for the report, and whether to time them at all,
+ * which the metrics need even when there's no report. */
+static BOOL enabled = FALSE;
+static BOOL measuring = FALSE;
+static LARGE_INTEGER frequency;
+static SRWLOCK lock = SRWLOCK_INIT;
+static struct timing_samples samples[PHASE_COUNT];
+
+void timing_enable(void)
+{
+    QueryPerformanceFrequency(&frequency);
+    enabled = TRUE;
+    measuring = TRUE;
+}
+
+void timing_enable_metrics(void)
+{
+    QueryPerformanceFrequency(&frequency);
+    measuring = TRUE;
+}
+
+const char *timing_phase_name(enum timing_phase phase)
+{
+    return phase_names[phase];
+}
+
+LONGLONG timing_start(void)
+{
+    LARGE_INTEGER now;
+
+    if (!measuring)
+        return 0;
+
+    QueryPerformanceCounter(&now);
+
+    return now.QuadPart;
+}
+
+void timing_end(enum timing_phase phase, LONGLONG start)
+{
+    struct timing_samples *phase_samples = &samples[phase];
+    LARGE_INTEGER now;
+
+    if (!measuring)
+        return;
+
+    QueryPerformanceCounter(&now);
+
+    metrics_phase(phase, now.QuadPart - start);
+
+    if (!enabled)
+        return;
+
+    AcquireSRWLockExclusive(&lock);
+
+    if (phase_samples->count == phase_samples->capacity)
+    {
+        int capacity = phase_samples->capacity == 0 ? 64 : phase_samples->capacity * 2;
+        LONGLONG *spans = (LONGLONG *)realloc(phase_samples->spans, capacity * sizeof(LONGLONG));
+
+        /* Losing a sample isn't worth failing the print over. */
+        if (spans == NULL)
+        {
+            ReleaseSRWLockExclusive(&lock);
+            return;
+        }
+
+        phase_samples->spans = spans;
+        phase_samples->capacity = capacity;
+    }
+
+    phase_samples->spans[phase_samples->count++] = now.QuadPart - start;
+
+    ReleaseSRWLockExclusive(&lock);
+}
+
+static double ticks_to_ms(LONGLONG ticks)
+{
+    return (double)ticks * 1000.0 / (double)frequency.QuadPart;
+}
+
+static int compare_spans(const void *a, const void *b)
+{
+    LONGLONG sa = *(const LONGLONG *)a, sb = *(const LONGLONG *)b;
+
+    return sa < sb ? -1 : sa > sb;
+}
+
+/**
+ * @brief Work out the summary for a phase.
+ *
+ * Only called once everything has finished, so the samples are read without
+ * taking the lock. They're sorted in a copy, so the CSV output keeps them in
+ * the order they were recorded.
+ */
+static void summarise(
+    const struct timing_samples *phase_samples,
+    struct timing_summary *summary)
+{
+    LONGLONG total = 0;
+    LONGLONG *sorted;
+    int n = phase_samples->count;
+
+    memset(summary, 0, sizeof(*summary));
+    if (n == 0)
+        return;
+
+    for (int i = 0; i < n; i++)
+        total += phase_samples->spans[i];
+
+    summary->count = n;
+    summary->total_ms = ticks_to_ms(total);
+    summary->mean_ms = summary->total_ms / n;
+
+    sorted = (LONGLONG *)malloc(n * sizeof(LONGLONG));
+    if (sorted == NULL)
+        return;
+
+    memcpy(sorted, phase_samples->spans, n * sizeof(LONGLONG));
+    qsort(sorted, n, sizeof(LONGLONG), compare_spans);
+
+    /* Nearest-rank percentiles. */
+    summary->p50_ms = ticks_to_ms(sorted[(n * 50 + 99) / 100 - 1]);
+    summary->p90_ms = ticks_to_ms(sorted[(n * 90 + 99) / 100 - 1]);
+    summary->p99_ms = ticks_to_ms(sorted[(n * 99 + 99) / 100 - 1]);
+    summary->max_ms = ticks_to_ms(sorted[n - 1]);
+
+    free(sorted);
+}
+
+void timing_report(FILE *out)
+{
+    if (!enabled)
+        return;
+
+    fprintf(out, " ⏱️ %-18s %6s %10s %9s %9s %9s %9s %9s\n",
+            "phase", "count", "total ms", "mean", "p50", "p90", "p99", "max");
+
+    for (int i = 0; i < PHASE_COUNT; i++)
+    {
+        struct timing_summary summary;
+
+        summarise(&samples[i], &summary);
+        if (summary.count == 0)
+            continue;
+
+        fprintf(out, "    %-18s %6d %10.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                phase_names[i],
+                summary.count,
+                summary.total_ms,
+                summary.mean_ms,
+                summary.p50_ms,
+                summary.p90_ms,
+                summary.p99_ms,
+                summary.max_ms);
+    }
+}
+
+BOOL timing_write(const char *path)
+{
+    size_t length = strlen(path);
+    BOOL json = length >= 5 && _stricmp(path + length - 5, ".json") == 0;
+    FILE *out;
+
+    if (!enabled)
+        return FALSE;
+
+    out = fopen(path, "w");
+    if (out == NULL)
+    {
+        ERR("Failed to open %s.\n", path);
+        return FALSE;
+    }
+
+    if (json)
+    {
+        BOOL first = TRUE;
+
+        fprintf(out, "{\n  \"phases\": {");
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            struct timing_summary summary;
+
+            summarise(&samples[i], &summary);
+            if (summary.count == 0)
+                continue;
+
+            fprintf(out,
+                    "%s\n    \"%s\": {\"count\": %d, \"total_ms\": %.3f, \"mean_ms\": %.3f, "
+                    "\"p50_ms\": %.3f, \"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+                    first ? "" : ",",
+                    phase_names[i],
+                    summary.count,
+                    summary.total_ms,
+                    summary.mean_ms,
+                    summary.p50_ms,
+                    summary.p90_ms,
+                    summary.p99_ms,
+                    summary.max_ms);
+            first = FALSE;
+        }
+        fprintf(out, "\n  }\n}\n");
+    }
+    else
+    {
+        fprintf(out, "phase,sample,ms\n");
+        for (int i = 0; i < PHASE_COUNT; i++)
+        {
+            for (int j = 0; j < samples[i].count; j++)
+                fprintf(out, "%s,%d,%.3f\n", phase_names[i], j, ticks_to_ms(samples[i].spans[j]));
+        }
+    }
+
+    if (fclose(out) != 0)
+    {
+        ERR("Failed to write %s.\n", path);
+        return FALSE;
+    }
+
+    return TRUE;
+}
@@ -0,0 +1,84 @@
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdio.h>
+
+#include <windows.h>
+
+/* The parts of a run we keep track of the time spent in. */
+enum timing_phase
+{
+    PHASE_PRINTER_DISCOVERY,
+    PHASE_PAPER_TABLE,
+    PHASE_SET_PAPER_SIZE,
+    PHASE_CREATE_DC,
+    PHASE_OPEN_LABEL,
+    PHASE_COMPOSE,
+    PHASE_PRESCALE,
+    PHASE_CROP,
+    PHASE_MAPPING,
+    PHASE_START_PAGE,
+    PHASE_STRETCH,
+    PHASE_END_PAGE,
+    PHASE_END_DOC,
+    PHASE_WRITE_PRINTER,
+
+    PHASE_COUNT,
+};
+
+/**
+ * @brief Start recording timings. Until this is called, timing is a no-op.
+ */
+void timing_enable(void);
+
+/**
+ * @brief Time every span for the metrics, without keeping them for a report.
+ * `timing_enable()` does this too.
+ */
+void timing_enable_metrics(void);
+
+/**
+ * @brief Get the name of a phase, as it appears in reports.
+ *
+ * @param phase The phase.
+ * @return The name.
+ */
+const char *timing_phase_name(enum timing_phase phase);
+
+/**
+ * @brief Mark the start of a span.
+ *
+ * @return The time now, to pass to `timing_end()`.
+ */
+LONGLONG timing_start(void);
+
+/**
+ * @brief Record a span that started at `start` and ends now, and add it to
+ * the metrics.
+ *
+ * Safe to call from any thread.
+ *
+ * @param phase The phase the span was spent in.
+ * @param start The start of the span, from `timing_start()`.
+ */
+void timing_end(enum timing_phase phase, LONGLONG start);
+
+/**
+ * @brief Print a summary of every phase, with totals and percentiles.
+ *
+ * @param out Where to print the summary.
+ */
+void timing_report(FILE *out);
+
+/**
+ * @brief Write the timings out for other programs to read.
+ *
+ * Paths ending in `.json` get the summary as JSON. Anything else gets every
+ * span as CSV.
+ *
+ * @param path The file to write to.
+ * @return `TRUE` if the file was written.
+ */
+BOOL timing_write(const char *path);
+
+#endif /* TIMING_H */
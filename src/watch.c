@@ -0,0 +1,492 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <windows.h>
+
+#include "label.h"
+#include "log.h"
+#include "print.h"
+#include "watch.h"
+
+/* Shares won't hand back more than 64 KB of changes at a time. */
+#define WATCH_BUFFER_SIZE (64 * 1024)
+
+/* How long a file has to sit untouched before we take it to be finished.
+ * Writers that hold the file open are caught anyway, as we can't open it
+ * for ourselves until they're done; this is for those that close it and
+ * come back for more. */
+#define WATCH_SETTLE_MS (100)
+
+#define DONE_FOLDER "done"
+#define FAILED_FOLDER "failed"
+
+/* A file we've seen change, waiting to settle before it's printed. */
+struct watched_file
+{
+    char name[MAX_PATH];
+    ULONGLONG changed;
+};
+
+struct watch
+{
+    const char *folder;
+
+    /* In the order they first turned up, which is the order they print. */
+    struct watched_file *files;
+    int count;
+    int capacity;
+};
+
+static BOOL is_label_name(const char *name)
+{
+    size_t length = strlen(name);
+
+    return length > 4 && _stricmp(name + length - 4, ".bmp") == 0;
+}
+
+/**
+ * @brief Build the path to a file in the watched folder, or one of its
+ * subfolders.
+ *
+ * @param subfolder The subfolder, or `NULL` for the folder itself.
+ * @return `TRUE` if the path fits.
+ */
+static BOOL get_watch_path(
+    const struct watch *watch,
+    const char *subfolder,
+    const char *name,
+    char *path,
+    size_t path_size)
+{
+    int written;
+
+    if (subfolder != NULL)
+        written = snprintf(path, path_size, "%s\\%s\\%s", watch->folder, subfolder, name);
+    else
+        written = snprintf(path, path_size, "%s\\%s", watch->folder, name);
+
+    return written >= 0 && (size_t)written < path_size;
+}
+
+/**
+ * @brief Start or restart the wait for a file to settle.
+ */
+static void note_change(struct watch *watch, const char *name, ULONGLONG now)
+{
+    struct watched_file *files;
+
+    if (!is_label_name(name))
+        return;
+
+    for (int i = 0; i < watch->count; i++)
+    {
+        if (_stricmp(watch->files[i].name, name) == 0)
+        {
+            watch->files[i].changed = now;
+            return;
+        }
+    }
+
+    if (watch->count == watch->capacity)
+    {
+        int capacity = watch->capacity == 0 ? 16 : watch->capacity * 2;
+
+        files = (struct watched_file *)realloc(watch->files, capacity * sizeof(struct watched_file));
+        if (files == NULL)
+        {
+            ERR("Failed to allocate memory for %s.\n", name);
+            return;
+        }
+
+        watch->files = files;
+        watch->capacity = capacity;
+    }
+
+    snprintf(watch->files[watch->count].name, MAX_PATH, "%s", name);
+    watch->files[watch->count].changed = now;
+    watch->count++;
+}
+
+static void forget_file(struct watch *watch, int index)
+{
+    memmove(
+        &watch->files[index],
+        &watch->files[index + 1],
+        (watch->count - index - 1) * sizeof(struct watched_file));
+    watch->count--;
+}
+
+static void forget_file_name(struct watch *watch, const char *name)
+{
+    for (int i = 0; i < watch->count; i++)
+    {
+        if (_stricmp(watch->files[i].name, name) == 0)
+        {
+            forget_file(watch, i);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Pick up every bitmap in the folder, for when we don't know what's
+ * changed: when we start, and when more changed than the system could tell
+ * us about.
+ */
+static void scan_folder(struct watch *watch, ULONGLONG now)
+{
+    char pattern[MAX_PATH];
+    WIN32_FIND_DATA found;
+    HANDLE find;
+
+    if (!get_watch_path(watch, NULL, "*.bmp", pattern, sizeof(pattern)))
+        return;
+
+    find = FindFirstFile(pattern, &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+
+    do
+    {
+        if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+            note_change(watch, found.cFileName, now);
+    } while (FindNextFile(find, &found));
+
+    FindClose(find);
+}
+
+/**
+ * @brief Go through a batch of changes from `ReadDirectoryChangesW()`.
+ */
+static void read_changes(struct watch *watch, const BYTE *changes, ULONGLONG now)
+{
+    const FILE_NOTIFY_INFORMATION *info;
+    char name[MAX_PATH];
+    BOOL lossy;
+    int length;
+
+    for (;;)
+    {
+        info = (const FILE_NOTIFY_INFORMATION *)changes;
+
+        /* Labels are opened with the ANSI calls, so a name that doesn't
+         * survive the trip couldn't be opened anyway. */
+        lossy = FALSE;
+        length = WideCharToMultiByte(
+            CP_ACP,
+            0,
+            info->FileName,
+            info->FileNameLength / sizeof(WCHAR),
+            name,
+            sizeof(name) - 1,
+            NULL,
+            &lossy);
+
+        if (length > 0 && !lossy)
+        {
+            name[length] = '\0';
+
+            switch (info->Action)
+            {
+            case FILE_ACTION_ADDED:
+            case FILE_ACTION_MODIFIED:
+            case FILE_ACTION_RENAMED_NEW_NAME:
+                note_change(watch, name, now);
+                break;
+
+            case FILE_ACTION_REMOVED:
+            case FILE_ACTION_RENAMED_OLD_NAME:
+                forget_file_name(watch, name);
+                break;
+            }
+        }
+        else
+        {
+            ERR("Skipping a file whose name can't be opened.\n");
+        }
+
+        if (info->NextEntryOffset == 0)
+            break;
+
+        changes += info->NextEntryOffset;
+    }
+}
+
+/**
+ * @brief Work out how long until the next file settles.
+ *
+ * @return The time to wait in milliseconds, or `INFINITE` if there's nothing
+ * waiting.
+ */
+static DWORD get_wait_time(const struct watch *watch, ULONGLONG now)
+{
+    DWORD wait = INFINITE;
+
+    for (int i = 0; i < watch->count; i++)
+    {
+        ULONGLONG settled = watch->files[i].changed + WATCH_SETTLE_MS;
+        DWORD remaining = settled > now ? (DWORD)(settled - now) : 0;
+
+        if (remaining < wait)
+            wait = remaining;
+    }
+
+    return wait;
+}
+
+/**
+ * @brief Print a file from the folder, and move it out of the way.
+ */
+static void print_watched_file(
+    const struct watch *watch,
+    char *name,
+    struct print_target *target,
+    const struct prepare_options *prepare)
+{
+    char path[MAX_PATH], moved_path[MAX_PATH];
+    struct label *label;
+    BOOL success;
+
+    if (!get_watch_path(watch, NULL, name, path, sizeof(path)))
+    {
+        ERR("The path to %s is too long.\n", name);
+        return;
+    }
+
+    label = open_label(path);
+    if (label == NULL)
+    {
+        ERR("Failed to open %s.\n", name);
+        success = FALSE;
+    }
+    else
+    {
+        success = fit_print_target(target, label) &&
+                  prepare_label(label, prepare) &&
+                  print_label(target, label, name, TRUE);
+
+        /* The label maps the file, which has to go before it can be moved. */
+        close_label(label);
+
+        if (success)
+        {
+            printf(" 🏷️ %s\n", name);
+        }
+        else
+        {
+            ERR("Failed to print %s.\n", name);
+        }
+    }
+
+    if (dry_run)
+        return;
+
+    if (!get_watch_path(watch, success ? DONE_FOLDER : FAILED_FOLDER, name, moved_path, sizeof(moved_path)) ||
+        !MoveFileEx(path, moved_path, MOVEFILE_REPLACE_EXISTING))
+    {
+        ERR("Failed to move %s out of %s.\n", name, watch->folder);
+    }
+}
+
+/**
+ * @brief Print every file that's been left alone long enough.
+ */
+static void print_settled_files(
+    struct watch *watch,
+    struct print_target *target,
+    const struct prepare_options *prepare)
+{
+    char path[MAX_PATH], name[MAX_PATH];
+    ULONGLONG now = GetTickCount64();
+    HANDLE f;
+
+    for (int i = 0; i < watch->count;)
+    {
+        struct watched_file *file = &watch->files[i];
+
+        if (now - file->changed < WATCH_SETTLE_MS)
+        {
+            i++;
+            continue;
+        }
+
+        if (!get_watch_path(watch, NULL, file->name, path, sizeof(path)))
+        {
+            ERR("The path to %s is too long.\n", file->name);
+            forget_file(watch, i);
+            continue;
+        }
+
+        /* If someone still has it open, it's not finished. */
+        f = CreateFile(path, GENERIC_READ, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (f == INVALID_HANDLE_VALUE)
+        {
+            if (GetLastError() == ERROR_SHARING_VIOLATION)
+            {
+                file->changed = now;
+                i++;
+            }
+            else
+            {
+                DBG("%s has gone\n", file->name);
+                forget_file(watch, i);
+            }
+
+            continue;
+        }
+
+        CloseHandle(f);
+
+        /* Printing can take long enough for more changes to come in, so the
+         * file comes off the list first. */
+        snprintf(name, sizeof(name), "%s", file->name);
+        forget_file(watch, i);
+
+        print_watched_file(watch, name, target, prepare);
+        now = GetTickCount64();
+    }
+}
+
+/**
+ * @brief Ask to hear about the next changes to the folder.
+ */
+static BOOL start_reading_changes(HANDLE folder, void *buffer, OVERLAPPED *overlapped)
+{
+    /* Not the subfolders, or we'd hear about every label we move. */
+    if (!ReadDirectoryChangesW(
+            folder,
+            buffer,
+            WATCH_BUFFER_SIZE,
+            FALSE,
+            FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE,
+            NULL,
+            overlapped,
+            NULL))
+    {
+        ERR("Failed to watch for changes.\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+BOOL watch_folder(
+    const char *folder,
+    struct print_target *target,
+    const struct prepare_options *prepare)
+{
+    struct watch watch = {0};
+    char path[MAX_PATH];
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED overlapped = {0};
+    BYTE *buffer = NULL;
+    BOOL reading = FALSE;
+    DWORD size;
+
+    watch.folder = folder;
+
+    /* The subfolders may already exist, which is fine. */
+    if (!get_watch_path(&watch, NULL, DONE_FOLDER, path, sizeof(path)) ||
+        (!CreateDirectory(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) ||
+        !get_watch_path(&watch, NULL, FAILED_FOLDER, path, sizeof(path)) ||
+        (!CreateDirectory(path, NULL) && GetLastError() != ERROR_ALREADY_EXISTS))
+    {
+        ERR("Failed to create the done and failed folders in %s.\n", folder);
+        goto exit;
+    }
+
+    handle = CreateFile(
+        folder,
+        FILE_LIST_DIRECTORY,
+        FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        NULL,
+        OPEN_EXISTING,
+        FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED,
+        NULL);
+
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        ERR("Failed to open folder %s.\n", folder);
+        goto exit;
+    }
+
+    /* The changes are written here, so it has to be DWORD aligned. */
+    buffer = (BYTE *)malloc(WATCH_BUFFER_SIZE);
+    overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (buffer == NULL || overlapped.hEvent == NULL)
+    {
+        ERR("Failed to set up watching %s.\n", folder);
+        goto exit;
+    }
+
+    /* Start listening before we look, so nothing slips in between. */
+    if (!start_reading_changes(handle, buffer, &overlapped))
+        goto exit;
+
+    reading = TRUE;
+    scan_folder(&watch, GetTickCount64());
+
+    printf(" 👀 Watching %s\n", folder);
+
+    for (;;)
+    {
+        DWORD wait = get_wait_time(&watch, GetTickCount64());
+        DWORD result = WaitForSingleObject(overlapped.hEvent, wait);
+
+        if (result == WAIT_OBJECT_0)
+        {
+            reading = FALSE;
+
+            if (!GetOverlappedResult(handle, &overlapped, &size, FALSE))
+            {
+                ERR("Lost track of changes to %s.\n", folder);
+                break;
+            }
+
+            /* Nothing at all means there were too many changes to keep. */
+            if (size == 0)
+            {
+                DBG("Too many changes to %s, looking again\n", folder);
+                scan_folder(&watch, GetTickCount64());
+            }
+            else
+            {
+                read_changes(&watch, buffer, GetTickCount64());
+            }
+
+            /* We're done with the buffer, so it can take the next changes
+             * while we print. */
+            ResetEvent(overlapped.hEvent);
+            if (!start_reading_changes(handle, buffer, &overlapped))
+                break;
+
+            reading = TRUE;
+        }
+        else if (result != WAIT_TIMEOUT)
+        {
+            ERR("Failed to wait for changes to %s.\n", folder);
+            break;
+        }
+
+        print_settled_files(&watch, target, prepare);
+    }
+
+exit:
+    if (reading)
+    {
+        CancelIo(handle);
+        GetOverlappedResult(handle, &overlapped, &size, TRUE);
+    }
+
+    if (overlapped.hEvent != NULL)
+        CloseHandle(overlapped.hEvent);
+
+    if (handle != INVALID_HANDLE_VALUE)
+        CloseHandle(handle);
+
+    free(buffer);
+    free(watch.files);
+
+    return FALSE;
+}
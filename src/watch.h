@@ -0,0 +1,28 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <windows.h>
+
+#include "print.h"
+
+/**
+ * @brief Print bitmaps as they're dropped into a folder, until something goes
+ * wrong.
+ *
+ * The folder is watched for changes rather than polled, so a label starts
+ * printing as soon as whoever's writing it lets go of the file. Each one is
+ * printed as its own document, then moved into `done` or `failed` under the
+ * folder. Bitmaps already in the folder when we start are printed first.
+ *
+ * @param folder The folder to watch. Only `.bmp` files in the folder itself
+ * are printed.
+ * @param target The printer to print to.
+ * @param prepare How to prepare each label before it's printed.
+ * @return `FALSE` if the folder couldn't be watched any longer.
+ */
+BOOL watch_folder(
+    const char *folder,
+    struct print_target *target,
+    const struct prepare_options *prepare);
+
+#endif /* WATCH_H */